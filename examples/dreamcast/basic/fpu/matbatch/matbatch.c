@@ -0,0 +1,316 @@
+/* KallistiOS ##version##
+
+   matbatch.c
+
+   This example checks the batch kernels in the matrix library against plain
+   C versions of the same thing, then times both over a few thousand vertices
+   to see what going through the matrix unit buys. The culling is done
+   against the six planes of a frustum, the lighting with six lights, and the
+   skinning with two bones a vertex.
+
+   The results are printed in the form
+
+   RESULT <test> <metric> <value> <unit>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <dc/matrix.h>
+#include <dc/matrix3d.h>
+#include <arch/timer.h>
+
+#define COUNT   4096
+#define RUNS    16
+#define PLANES  6
+#define LIGHTS  6
+#define BONES   16
+#define BPV     2
+
+static vector_t in[COUNT] __attribute__((aligned(32)));
+static vector_t out[COUNT] __attribute__((aligned(32)));
+static vector_t extents[COUNT] __attribute__((aligned(32)));
+static uint32_t argb[COUNT], ref_argb[COUNT];
+static uint8_t visible[COUNT], ref_visible[COUNT];
+static uint8_t bones[COUNT * BPV];
+static float weights[COUNT * BPV];
+static matrix_t palette[BONES] __attribute__((aligned(32)));
+static matrix_t mat __attribute__((aligned(32)));
+static vector_t planes[PLANES], dirs[LIGHTS], colors[LIGHTS];
+static vector_t ambient = { 0.1f, 0.1f, 0.15f, 1.0f };
+static uint32_t rand_state = 1;
+
+static float rnd(float lo, float hi) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return lo + (hi - lo) * (rand_state >> 16) / 65535.0f;
+}
+
+static void normalize(vector_t *v) {
+    float l = 1.0f / sqrtf(v->x * v->x + v->y * v->y + v->z * v->z);
+
+    v->x *= l;
+    v->y *= l;
+    v->z *= l;
+}
+
+static void setup(void) {
+    int i, j;
+
+    /* A frustum looking down -z, from 1 to 100 away. */
+    for(i = 0; i < 4; ++i) {
+        planes[i].x = (i == 0) - (i == 1);
+        planes[i].y = (i == 2) - (i == 3);
+        planes[i].z = -1.0f;
+        planes[i].w = 0.0f;
+        normalize(&planes[i]);
+    }
+
+    planes[4] = (vector_t){ 0.0f, 0.0f, -1.0f, -1.0f };
+    planes[5] = (vector_t){ 0.0f, 0.0f, 1.0f, 100.0f };
+
+    for(i = 0; i < LIGHTS; ++i) {
+        dirs[i] = (vector_t){ rnd(-1.0f, 1.0f), rnd(-1.0f, 1.0f),
+                              rnd(-1.0f, 1.0f), 0.0f };
+        normalize(&dirs[i]);
+        colors[i] = (vector_t){ rnd(0.0f, 0.4f), rnd(0.0f, 0.4f),
+                                rnd(0.0f, 0.4f), 0.0f };
+    }
+
+    for(i = 0; i < BONES; ++i) {
+        mat_identity();
+        mat_rotate(rnd(0.0f, 6.28f), rnd(0.0f, 6.28f), rnd(0.0f, 6.28f));
+        mat_translate(rnd(-2.0f, 2.0f), rnd(-2.0f, 2.0f), rnd(-2.0f, 2.0f));
+        mat_store(&palette[i]);
+    }
+
+    for(i = 0; i < COUNT; ++i) {
+        in[i] = (vector_t){ rnd(-60.0f, 60.0f), rnd(-60.0f, 60.0f),
+                            rnd(-120.0f, 10.0f), rnd(0.5f, 5.0f) };
+        extents[i] = (vector_t){ rnd(0.5f, 5.0f), rnd(0.5f, 5.0f),
+                                 rnd(0.5f, 5.0f), 0.0f };
+
+        /* Runs of vertices on the same bones, like a real mesh. */
+        for(j = 0; j < BPV; ++j) {
+            bones[i * BPV + j] = ((i / 64) + j * 5) % BONES;
+            weights[i * BPV + j] = j ? 0.25f : 0.75f;
+        }
+    }
+
+    /* Something to light the normals with, that doesn't scale them. */
+    mat_identity();
+    mat_rotate(0.3f, 0.7f, 0.1f);
+    mat_store(&mat);
+}
+
+static int ref_cull_spheres(void) {
+    int i, j, total = 0;
+
+    for(i = 0; i < COUNT; ++i) {
+        ref_visible[i] = 1;
+
+        for(j = 0; j < PLANES; ++j) {
+            if(planes[j].x * in[i].x + planes[j].y * in[i].y +
+               planes[j].z * in[i].z + planes[j].w < -in[i].w) {
+                ref_visible[i] = 0;
+                break;
+            }
+        }
+
+        total += ref_visible[i];
+    }
+
+    return total;
+}
+
+static int ref_cull_boxes(void) {
+    float d, r;
+    int i, j, total = 0;
+
+    for(i = 0; i < COUNT; ++i) {
+        ref_visible[i] = 1;
+
+        for(j = 0; j < PLANES; ++j) {
+            d = planes[j].x * in[i].x + planes[j].y * in[i].y +
+                planes[j].z * in[i].z + planes[j].w;
+            r = fabsf(planes[j].x) * extents[i].x +
+                fabsf(planes[j].y) * extents[i].y +
+                fabsf(planes[j].z) * extents[i].z;
+
+            if(d < -r) {
+                ref_visible[i] = 0;
+                break;
+            }
+        }
+
+        total += ref_visible[i];
+    }
+
+    return total;
+}
+
+static uint32_t ref_channel(float c) {
+    return c > 1.0f ? 255 : (uint32_t)(c * 255.0f);
+}
+
+static void ref_light(void) {
+    float n[3], c[3], d;
+    int i, j, k;
+
+    for(i = 0; i < COUNT; ++i) {
+        for(k = 0; k < 3; ++k)
+            n[k] = mat[0][k] * in[i].x + mat[1][k] * in[i].y +
+                   mat[2][k] * in[i].z;
+
+        c[0] = ambient.x;
+        c[1] = ambient.y;
+        c[2] = ambient.z;
+
+        for(j = 0; j < LIGHTS; ++j) {
+            d = n[0] * dirs[j].x + n[1] * dirs[j].y + n[2] * dirs[j].z;
+
+            if(d > 0.0f) {
+                c[0] += d * colors[j].x;
+                c[1] += d * colors[j].y;
+                c[2] += d * colors[j].z;
+            }
+        }
+
+        ref_argb[i] = (ref_channel(ambient.w) << 24) |
+                      (ref_channel(c[0]) << 16) | (ref_channel(c[1]) << 8) |
+                      ref_channel(c[2]);
+    }
+}
+
+static void ref_skin(vector_t *dst) {
+    const float (*m)[4];
+    float wt;
+    int i, j, k;
+
+    for(i = 0; i < COUNT; ++i) {
+        float v[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        for(j = 0; j < BPV; ++j) {
+            m = palette[bones[i * BPV + j]];
+            wt = weights[i * BPV + j];
+
+            for(k = 0; k < 4; ++k)
+                v[k] += wt * (m[0][k] * in[i].x + m[1][k] * in[i].y +
+                              m[2][k] * in[i].z + m[3][k] * in[i].w);
+        }
+
+        dst[i] = (vector_t){ v[0], v[1], v[2], v[3] };
+    }
+}
+
+static void result(const char *test, uint64_t batch_ns, uint64_t ref_ns,
+                   int bad) {
+    printf("RESULT %s batch %lu verts/s\n", test,
+           (unsigned long)((uint64_t)COUNT * RUNS * 1000000000 / batch_ns));
+    printf("RESULT %s reference %lu verts/s\n", test,
+           (unsigned long)((uint64_t)COUNT * RUNS * 1000000000 / ref_ns));
+    printf("RESULT %s mismatches %d verts\n", test, bad);
+}
+
+int main(int argc, char *argv[]) {
+    static vector_t ref_out[COUNT];
+    uint64_t start, batch, ref;
+    int i, run, bad, got, want;
+    int ch;
+
+    (void)argc;
+    (void)argv;
+
+    setup();
+
+    /* Spheres */
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        got = mat_cull_spheres(planes, PLANES, in, COUNT, visible);
+    batch = timer_ns_gettime64() - start;
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        want = ref_cull_spheres();
+    ref = timer_ns_gettime64() - start;
+
+    for(i = 0, bad = got != want; i < COUNT; ++i)
+        bad += visible[i] != ref_visible[i];
+
+    result("cull_spheres", batch, ref, bad);
+
+    /* Boxes */
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        got = mat_cull_boxes(planes, PLANES, in, extents, COUNT, visible);
+    batch = timer_ns_gettime64() - start;
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        want = ref_cull_boxes();
+    ref = timer_ns_gettime64() - start;
+
+    for(i = 0, bad = got != want; i < COUNT; ++i)
+        bad += visible[i] != ref_visible[i];
+
+    result("cull_boxes", batch, ref, bad);
+
+    /* Lighting, with the in vectors as normals. */
+    for(i = 0; i < COUNT; ++i)
+        normalize(&in[i]);
+
+    mat_load(&mat);
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        mat_light_diffuse(in, argb, COUNT, sizeof(uint32_t), dirs, colors,
+                          LIGHTS, &ambient);
+    batch = timer_ns_gettime64() - start;
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        ref_light();
+    ref = timer_ns_gettime64() - start;
+
+    /* fipr is a little less exact than doing it by hand, so allow the
+       channels to be off by one. */
+    for(i = 0, bad = 0; i < COUNT; ++i) {
+        for(ch = 0; ch < 32; ch += 8) {
+            if(abs((int)((argb[i] >> ch) & 0xff) -
+                   (int)((ref_argb[i] >> ch) & 0xff)) > 1) {
+                ++bad;
+                break;
+            }
+        }
+    }
+
+    result("light_diffuse", batch, ref, bad);
+
+    /* Skinning, as positions. */
+    for(i = 0; i < COUNT; ++i)
+        in[i].w = 1.0f;
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        mat_skin(in, out, COUNT, palette, bones, weights, BPV);
+    batch = timer_ns_gettime64() - start;
+
+    start = timer_ns_gettime64();
+    for(run = 0; run < RUNS; ++run)
+        ref_skin(ref_out);
+    ref = timer_ns_gettime64() - start;
+
+    for(i = 0, bad = 0; i < COUNT; ++i) {
+        if(fabsf(out[i].x - ref_out[i].x) > 1e-3f ||
+           fabsf(out[i].y - ref_out[i].y) > 1e-3f ||
+           fabsf(out[i].z - ref_out[i].z) > 1e-3f ||
+           fabsf(out[i].w - ref_out[i].w) > 1e-3f)
+            ++bad;
+    }
+
+    result("skin", batch, ref, bad);
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
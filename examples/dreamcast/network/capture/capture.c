@@ -0,0 +1,180 @@
+/* KallistiOS ##version##
+
+   capture.c
+
+   This example shows how to capture network traffic to a pcapng file that can
+   be opened in Wireshark or tcpdump. It sends a bunch of UDP datagrams to
+   itself over the loopback device, capturing only the ones going to one of the
+   two ports involved, and writes the capture to /ram/capture.pcapng. It then
+   reads the file back, checks that it holds what it should, and copies it to
+   /pc (if running under dcload) so it can be looked at on the host.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/fs.h>
+#include <kos/init.h>
+#include <kos/net.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define CAPTURE_FILE    "/ram/capture.pcapng"
+#define HOST_FILE       "/pc/capture.pcapng"
+#define PORT_A          4000
+#define PORT_B          4001
+#define COUNT           100
+#define PKT_SIZE        256
+#define SNAPLEN         64
+#define LOOPBACK        0x7F000001  /* 127.0.0.1 */
+
+static int open_sock(uint16_t port) {
+    struct sockaddr_in addr;
+    int sock;
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Send COUNT datagrams from a to b and the same number the other way. */
+static int send_traffic(int a, int b) {
+    struct sockaddr_in dst;
+    uint8_t buf[PKT_SIZE];
+    int i;
+
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = htonl(LOOPBACK);
+    memset(buf, 0xA5, sizeof(buf));
+
+    for(i = 0; i < COUNT; ++i) {
+        dst.sin_port = htons(PORT_B);
+
+        if(sendto(a, buf, sizeof(buf), 0, (struct sockaddr *)&dst,
+                  sizeof(dst)) < 0 || recv(b, buf, sizeof(buf), 0) < 0) {
+            perror("sendto/recv");
+            return -1;
+        }
+
+        dst.sin_port = htons(PORT_A);
+
+        if(sendto(b, buf, sizeof(buf), 0, (struct sockaddr *)&dst,
+                  sizeof(dst)) < 0 || recv(a, buf, sizeof(buf), 0) < 0) {
+            perror("sendto/recv");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Walk the blocks in the file, counting the packets and checking that they
+   were cut off at the snapshot length. */
+static int check_file(void) {
+    uint32_t hdr[7];
+    int rx = 0, tx = 0, bad = 0;
+    off_t pos = 0;
+    uint8_t flags[8];
+    file_t fd;
+
+    if((fd = fs_open(CAPTURE_FILE, O_RDONLY)) == FILEHND_INVALID) {
+        printf("Can't open %s\n", CAPTURE_FILE);
+        return -1;
+    }
+
+    while(fs_read(fd, hdr, 8) == 8) {
+        /* Enhanced packet blocks have the direction in their flags option,
+           right after the (padded) packet data. */
+        if(hdr[0] == 6) {
+            fs_read(fd, hdr + 2, 20);
+            bad += hdr[5] != SNAPLEN || hdr[6] < PKT_SIZE;
+            fs_seek(fd, pos + 28 + ((hdr[5] + 3) & ~3), SEEK_SET);
+            fs_read(fd, flags, 8);
+
+            if((flags[4] & 3) == 1)
+                ++rx;
+            else
+                ++tx;
+        }
+
+        pos += hdr[1];
+        fs_seek(fd, pos, SEEK_SET);
+    }
+
+    fs_close(fd);
+
+    /* Every datagram is seen going out of the loopback device and then
+       coming back in, in both directions. */
+    printf("File has %d received and %d sent packets (expected %d each), "
+           "%d truncated wrong\n", rx, tx, 2 * COUNT, bad);
+
+    return rx == 2 * COUNT && tx == 2 * COUNT && !bad ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    net_capture_opts_t opts;
+    net_capture_stats_t st;
+    int a, b, rv;
+
+    (void)argc;
+    (void)argv;
+
+    if((a = open_sock(PORT_A)) < 0 || (b = open_sock(PORT_B)) < 0)
+        return EXIT_FAILURE;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.format = NET_CAPTURE_PCAPNG;
+    opts.snaplen = SNAPLEN;
+    opts.ip_proto = IPPROTO_UDP;
+    opts.port = PORT_B;
+
+    if(net_capture_start(CAPTURE_FILE, &opts)) {
+        perror("net_capture_start");
+        return EXIT_FAILURE;
+    }
+
+    rv = send_traffic(a, b);
+    net_capture_stop();
+
+    close(a);
+    close(b);
+
+    net_capture_get_stats(&st);
+    printf("Captured %lu frames, %lu filtered out, %lu dropped, %llu bytes "
+           "written\n", (unsigned long)st.captured, (unsigned long)st.filtered,
+           (unsigned long)st.dropped, (unsigned long long)st.bytes);
+
+    if(rv || check_file()) {
+        printf("Capture FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    if(fs_copy(CAPTURE_FILE, HOST_FILE) >= 0)
+        printf("Copied the capture to %s\n", HOST_FILE);
+
+    printf("Capture OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/* KallistiOS ##version##
+
+   checksum.c
+
+   This example checks the Internet checksum and CRC routines from the network
+   stack against simple, obviously-correct versions of the same algorithms and
+   then measures how many bytes per CPU cycle each of them manages. It also
+   compares the fused copy-and-checksum routine against doing a memcpy() and a
+   separate checksum pass.
+
+   It doesn't need a network adapter to run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <dc/perfctr.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT);
+
+#define BUF_SIZE    8192
+#define ITERATIONS  64
+
+static uint8_t buf[BUF_SIZE + 8] __attribute__((aligned(32)));
+static uint8_t dst[BUF_SIZE + 8] __attribute__((aligned(32)));
+static uint8_t dst2[BUF_SIZE + 8] __attribute__((aligned(32)));
+
+/* The straightforward versions that the stack used to use. */
+static uint16_t ref_checksum(const uint8_t *data, size_t bytes,
+                             uint16_t start) {
+    uint32_t sum = start;
+    size_t i;
+
+    for(i = 0; i + 1 < bytes; i += 2)
+        sum += data[i] | (data[i + 1] << 8);
+
+    if(bytes & 1)
+        sum += data[bytes - 1];
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+static uint32_t ref_crc32le(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF;
+    int i, j;
+
+    for(i = 0; i < size; ++i) {
+        rv ^= data[i];
+
+        for(j = 0; j < 8; ++j)
+            rv = (0xEDB88320 & (-(rv & 1))) ^ (rv >> 1);
+    }
+
+    return ~rv;
+}
+
+static uint16_t ref_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
+    uint16_t rv = start, tmp;
+
+    while(size--) {
+        tmp = (rv >> 8) ^ *data++;
+        tmp ^= tmp >> 4;
+        rv = (rv << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
+    }
+
+    return rv;
+}
+
+static int validate(void) {
+    int off, doff, len, errs = 0;
+    uint16_t start;
+
+    for(off = 0; off < 8; ++off) {
+        for(len = 0; len < 1600; ++len) {
+            start = rand();
+
+            if(ref_checksum(buf + off, len, start) !=
+               net_ipv4_checksum(buf + off, len, start)) {
+                printf("checksum mismatch: offset %d, length %d\n", off, len);
+                ++errs;
+            }
+
+            if(ref_crc32le(buf + off, len) != net_crc32le(buf + off, len)) {
+                printf("crc32le mismatch: offset %d, length %d\n", off, len);
+                ++errs;
+            }
+
+            if(ref_crc16ccitt(buf + off, len, start) !=
+               net_crc16ccitt(buf + off, len, start)) {
+                printf("crc16 mismatch: offset %d, length %d\n", off, len);
+                ++errs;
+            }
+        }
+    }
+
+    /* The fused copy has to produce the same bytes and the same sum as doing
+       things separately, whatever the alignment of either side. */
+    for(off = 0; off < 4; ++off) {
+        for(doff = 0; doff < 4; ++doff) {
+            for(len = 0; len < 1600; ++len) {
+                start = rand();
+                memset(dst, 0, len + 8);
+                memset(dst2, 0, len + 8);
+                memcpy(dst2 + doff, buf + off, len);
+
+                if(net_ipv4_checksum_copy(dst + doff, buf + off, len, start) !=
+                   ref_checksum(dst2 + doff, len, start) ||
+                   memcmp(dst, dst2, len + 8)) {
+                    printf("checksum_copy mismatch: offsets %d/%d, length "
+                           "%d\n", off, doff, len);
+                    ++errs;
+                }
+            }
+        }
+    }
+
+    return errs;
+}
+
+static uint16_t copy_then_checksum(uint8_t *d, const uint8_t *s, size_t len) {
+    memcpy(d, s, len);
+    return net_ipv4_checksum(d, len, 0);
+}
+
+static void report(const char *name, uint64_t cycles, size_t bytes) {
+    printf("%-24s %10llu cycles, %.3f bytes/cycle\n", name,
+           (unsigned long long)cycles, (double)bytes / (double)cycles);
+}
+
+#define BENCH(name, len, expr) do { \
+        int __i; \
+        perf_cntr_clear(PRFC1); \
+        perf_cntr_start(PRFC1, PMCR_ELAPSED_TIME_MODE, \
+                        PMCR_COUNT_CPU_CYCLES); \
+        for(__i = 0; __i < ITERATIONS; ++__i) { \
+            sink += (expr); \
+        } \
+        perf_cntr_stop(PRFC1); \
+        report(name, perf_cntr_count(PRFC1), (size_t)(len) * ITERATIONS); \
+    } while(0)
+
+int main(int argc, char **argv) {
+    volatile uint32_t sink = 0;
+    int i;
+
+    for(i = 0; i < BUF_SIZE + 8; ++i)
+        buf[i] = rand();
+
+    printf("Validating against reference implementations...\n");
+
+    if(validate()) {
+        printf("Validation FAILED\n");
+        return 1;
+    }
+
+    printf("All results match.\n\n");
+    printf("Benchmarking over %d bytes, %d iterations:\n", BUF_SIZE,
+           ITERATIONS);
+
+    BENCH("reference checksum", BUF_SIZE, ref_checksum(buf, BUF_SIZE, 0));
+    BENCH("net_ipv4_checksum", BUF_SIZE, net_ipv4_checksum(buf, BUF_SIZE, 0));
+    BENCH("net_ipv4_checksum (1500)", 1500, net_ipv4_checksum(buf, 1500, 0));
+    BENCH("reference crc32le", BUF_SIZE, ref_crc32le(buf, BUF_SIZE));
+    BENCH("net_crc32le", BUF_SIZE, net_crc32le(buf, BUF_SIZE));
+    BENCH("reference crc16ccitt", BUF_SIZE, ref_crc16ccitt(buf, BUF_SIZE, 0));
+    BENCH("net_crc16ccitt", BUF_SIZE, net_crc16ccitt(buf, BUF_SIZE, 0));
+
+    /* An SD card sector, since that's the other big user of the CRC16. */
+    BENCH("net_crc16ccitt (512)", 512, net_crc16ccitt(buf, 512, 0));
+
+    /* A full TCP segment, copied to where the payload lands in a packet buffer
+       (two bytes off of a word boundary) and to an aligned destination. */
+    BENCH("memcpy + checksum (1460)", 1460,
+          copy_then_checksum(dst + 2, buf, 1460));
+    BENCH("checksum_copy (1460)", 1460,
+          net_ipv4_checksum_copy(dst + 2, buf, 1460, 0));
+    BENCH("memcpy + checksum (al.)", BUF_SIZE,
+          copy_then_checksum(dst, buf, BUF_SIZE));
+    BENCH("checksum_copy (al.)", BUF_SIZE,
+          net_ipv4_checksum_copy(dst, buf, BUF_SIZE, 0));
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+/* KallistiOS ##version##
+
+   dnscache.c
+
+   This example checks that the DNS cache behind getaddrinfo() works the way it
+   is supposed to. It runs a tiny DNS server of its own on 127.0.0.1, points the
+   resolver at it and counts how many queries actually make it to the server
+   while looking up names in different ways:
+
+   - looking up the same name twice should only ask the server once,
+   - so should looking up a name that doesn't exist twice,
+   - a name with a short TTL should be asked for again once it goes stale,
+   - several threads looking up the same name at once should share one query.
+
+   Everything goes over the loopback device, so no network adapter is needed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define LOOPBACK    0x7F000001  /* 127.0.0.1 */
+#define THREADS     4
+
+typedef struct {
+    const char *name;
+    uint32_t ttl;               /* Seconds */
+    int delay;                  /* Milliseconds to wait before answering */
+    uint8_t addr[4];
+} host_t;
+
+static const host_t hosts[] = {
+    { "cached.example", 300, 0, { 10, 0, 0, 1 } },
+    { "short.example", 1, 0, { 10, 0, 0, 2 } },
+    { "slow.example", 300, 250, { 10, 0, 0, 3 } }
+};
+
+#define HOST_COUNT  (sizeof(hosts) / sizeof(hosts[0]))
+
+static volatile int done = 0;
+static volatile int queries = 0;
+
+/* Pull the name out of the question in a query, as a dotted string. */
+static int get_qname(const uint8_t *pkt, ssize_t len, char *out, size_t outlen) {
+    ssize_t o = 12;
+    size_t n = 0;
+
+    while(o < len && pkt[o]) {
+        if(n + pkt[o] + 1 >= outlen || o + pkt[o] + 1 > len)
+            return -1;
+
+        if(n)
+            out[n++] = '.';
+
+        memcpy(out + n, pkt + o + 1, pkt[o]);
+        n += pkt[o];
+        o += pkt[o] + 1;
+    }
+
+    out[n] = 0;
+
+    /* Return the offset just past the question (name, type and class). */
+    return o + 5 <= len ? (int)(o + 5) : -1;
+}
+
+static void *server_thd(void *p) {
+    int sock = *(int *)p;
+    struct sockaddr_in from;
+    socklen_t alen;
+    struct pollfd pfd;
+    uint8_t buf[512];
+    char name[256];
+    const host_t *h;
+    ssize_t len;
+    int qend, i;
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while(!done) {
+        if(poll(&pfd, 1, 100) != 1)
+            continue;
+
+        alen = sizeof(from);
+
+        if((len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                           &alen)) < 12)
+            continue;
+
+        ++queries;
+
+        if((qend = get_qname(buf, len, name, sizeof(name))) < 0)
+            continue;
+
+        for(i = 0, h = NULL; i < (int)HOST_COUNT; ++i) {
+            if(!strcmp(name, hosts[i].name))
+                h = &hosts[i];
+        }
+
+        /* Build the response on top of the query: same id, one question. */
+        buf[2] = 0x81;
+        buf[3] = h ? 0x80 : 0x83;   /* No error or name error */
+        buf[6] = buf[8] = buf[9] = buf[10] = buf[11] = 0;
+        buf[7] = h ? 1 : 0;
+        len = qend;
+
+        if(h) {
+            uint8_t ans[16] = {
+                0xC0, 0x0C,                 /* Name: pointer to the question */
+                0x00, 0x01, 0x00, 0x01,     /* Type A, class IN */
+                h->ttl >> 24, h->ttl >> 16, h->ttl >> 8, h->ttl,
+                0x00, 0x04,                 /* Address length */
+                h->addr[0], h->addr[1], h->addr[2], h->addr[3]
+            };
+
+            memcpy(buf + len, ans, sizeof(ans));
+            len += sizeof(ans);
+
+            if(h->delay)
+                thd_sleep(h->delay);
+        }
+
+        sendto(sock, buf, len, 0, (struct sockaddr *)&from, alen);
+    }
+
+    return NULL;
+}
+
+static int lookup(const char *name) {
+    struct addrinfo hints, *res = NULL;
+    int rv;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if(!(rv = getaddrinfo(name, NULL, &hints, &res)))
+        freeaddrinfo(res);
+
+    return rv;
+}
+
+static void *lookup_thd(void *p) {
+    return (void *)(intptr_t)lookup((const char *)p);
+}
+
+static int check(const char *what, int expect) {
+    printf("%-40s %d quer%s (expected %d): %s\n", what, queries,
+           queries == 1 ? "y" : "ies", expect,
+           queries == expect ? "PASS" : "FAIL");
+    return queries == expect ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    kthread_t *srv, *thds[THREADS];
+    dns_cache_stats_t st;
+    netif_t *net = net_default_dev;
+    uint8_t old_dns[4];
+    void *rv;
+    int sock, i, fails = 0;
+
+    (void)argc;
+    (void)argv;
+
+    /* The resolver asks the default device's DNS server, or that of the first
+       device that has one if there's no default device. */
+    if(!net) {
+        LIST_FOREACH(net, net_get_if_list(), if_list) {
+            if(net->flags & NETIF_LOOPBACK)
+                break;
+        }
+
+        if(!net) {
+            printf("No loopback device, can't continue\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(LOOPBACK);
+    addr.sin_port = htons(53);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(old_dns, net->dns, 4);
+    net->dns[0] = 127;
+    net->dns[1] = net->dns[2] = 0;
+    net->dns[3] = 1;
+
+    dns_cache_flush();
+    srv = thd_create(false, server_thd, &sock);
+
+    /* The same name, twice. */
+    queries = 0;
+    fails |= lookup("cached.example") != 0;
+    fails |= lookup("CACHED.example.") != 0;
+    fails |= check("Repeated lookup:", 1);
+
+    /* A name that doesn't exist, twice. */
+    queries = 0;
+    fails |= lookup("missing.example") != EAI_NONAME;
+    fails |= lookup("missing.example") != EAI_NONAME;
+    fails |= check("Repeated lookup of a missing name:", 1);
+
+    /* A name with a one second TTL, before and after it expires. */
+    queries = 0;
+    fails |= lookup("short.example") != 0;
+    fails |= lookup("short.example") != 0;
+    thd_sleep(1100);
+    fails |= lookup("short.example") != 0;
+    fails |= check("Lookups around a TTL expiring:", 2);
+
+    /* A slow name, looked up from several threads at once. */
+    queries = 0;
+
+    for(i = 0; i < THREADS; ++i)
+        thds[i] = thd_create(false, lookup_thd, (void *)"slow.example");
+
+    for(i = 0; i < THREADS; ++i) {
+        thd_join(thds[i], &rv);
+        fails |= rv != NULL;
+    }
+
+    fails |= check("Concurrent lookups:", 1);
+
+    dns_cache_get_stats(&st);
+    printf("\nCache: %lu lookups, %lu hits, %lu negative hits, %lu misses, "
+           "%lu expired, %lu coalesced, %lu entries\n",
+           (unsigned long)st.lookups, (unsigned long)st.hits,
+           (unsigned long)st.neg_hits, (unsigned long)st.misses,
+           (unsigned long)st.expired, (unsigned long)st.coalesced,
+           (unsigned long)st.entries);
+
+    done = 1;
+    thd_join(srv, NULL);
+    close(sock);
+    memcpy(net->dns, old_dns, 4);
+    dns_cache_flush();
+
+    printf("%s\n", fails ? "Some checks FAILED" : "All checks passed");
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
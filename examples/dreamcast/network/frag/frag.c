@@ -0,0 +1,154 @@
+/* KallistiOS ##version##
+
+   frag.c
+
+   This example checks that UDP datagrams too big for a single packet make it
+   through the network stack intact, over both IPv4 and IPv6. Each datagram is
+   split into fragments on its way out and put back together on its way in.
+
+   It uses the loopback device, so no network adapter is needed. Datagrams go
+   up to twice the size of the loopback MTU, so even the largest need more than
+   one fragment.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define PORT_SRC    5000
+#define PORT_DST    5001
+#define MAX_SIZE    32768
+#define LOOPBACK    0x7F000001  /* 127.0.0.1 */
+
+static const size_t sizes[] = { 1000, 2000, 9000, 16385, 24000, MAX_SIZE };
+
+#define SIZE_COUNT  (sizeof(sizes) / sizeof(sizes[0]))
+
+static uint8_t out[MAX_SIZE], in[MAX_SIZE];
+
+static int open_sock(int domain, uint16_t port) {
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr;
+    int sock, rv;
+
+    if((sock = socket(domain, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if(domain == PF_INET6) {
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_loopback;
+        addr6.sin6_port = htons(port);
+        rv = bind(sock, (struct sockaddr *)&addr6, sizeof(addr6));
+    }
+    else {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(LOOPBACK);
+        addr.sin_port = htons(port);
+        rv = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    }
+
+    if(rv) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int run(int domain) {
+    struct sockaddr_in6 dst6;
+    struct sockaddr_in dst;
+    struct sockaddr *to;
+    socklen_t tolen;
+    ssize_t got;
+    int src, sink, i, fails = 0, rcvbuf = 2 * MAX_SIZE;
+    size_t j;
+
+    if((src = open_sock(domain, PORT_SRC)) < 0)
+        return 1;
+
+    if((sink = open_sock(domain, PORT_DST)) < 0) {
+        close(src);
+        return 1;
+    }
+
+    /* The default receive buffer is too small for the biggest datagrams. */
+    if(setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf))) {
+        perror("setsockopt");
+        close(src);
+        close(sink);
+        return 1;
+    }
+
+    if(domain == PF_INET6) {
+        memset(&dst6, 0, sizeof(dst6));
+        dst6.sin6_family = AF_INET6;
+        dst6.sin6_addr = in6addr_loopback;
+        dst6.sin6_port = htons(PORT_DST);
+        to = (struct sockaddr *)&dst6;
+        tolen = sizeof(dst6);
+    }
+    else {
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_addr.s_addr = htonl(LOOPBACK);
+        dst.sin_port = htons(PORT_DST);
+        to = (struct sockaddr *)&dst;
+        tolen = sizeof(dst);
+    }
+
+    for(i = 0; i < (int)SIZE_COUNT; ++i) {
+        for(j = 0; j < sizes[i]; ++j)
+            out[j] = (uint8_t)(j * 7 + i);
+
+        if(sendto(src, out, sizes[i], 0, to, tolen) < 0) {
+            perror("sendto");
+            ++fails;
+            continue;
+        }
+
+        got = recv(sink, in, sizeof(in), 0);
+
+        if(got != (ssize_t)sizes[i] || memcmp(in, out, sizes[i])) {
+            printf("%s %5u bytes: FAIL (got %d bytes)\n",
+                   domain == PF_INET6 ? "IPv6" : "IPv4",
+                   (unsigned)sizes[i], (int)got);
+            ++fails;
+        }
+        else {
+            printf("%s %5u bytes: OK\n", domain == PF_INET6 ? "IPv6" : "IPv4",
+                   (unsigned)sizes[i]);
+        }
+    }
+
+    close(src);
+    close(sink);
+    return fails;
+}
+
+int main(int argc, char *argv[]) {
+    int fails;
+
+    (void)argc;
+    (void)argv;
+
+    fails = run(PF_INET) + run(PF_INET6);
+
+    printf("%s\n", fails ? "Some checks FAILED" : "All checks passed");
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
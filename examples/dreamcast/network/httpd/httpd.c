@@ -14,6 +14,7 @@
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 
 #include <kos/fs.h>
@@ -245,7 +246,6 @@ void *client_thread(void *p) {
     char * buf, * ext;
     const char * ct;
     file_t f = -1;
-    int r, o, cnt;
 
     printf("httpd: client thread started, sock %d\n", hs->socket);
 
@@ -296,19 +296,10 @@ void *client_thread(void *p) {
 
         send_ok(hs, ct);
 
-        while((cnt = fs_read(f, buf, BUFSIZE)) != 0) {
-            o = 0;
-
-            while(cnt > 0) {
-                r = write(hs->socket, buf + o, cnt);
-
-                if(r <= 0)
-                    goto out;
-
-                cnt -= r;
-                o += r;
-            }
-        }
+        /* Hand the file to the socket directly, rather than reading it into
+           our own buffer and writing it out again. */
+        if(sendfile(hs->socket, f, NULL, fs_total(f)) < 0)
+            goto out;
     }
 
     fs_close(f);
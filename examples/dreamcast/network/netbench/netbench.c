@@ -0,0 +1,497 @@
+/* KallistiOS ##version##
+
+   netbench.c
+
+   This example is an automated benchmark of the network stack, along the same
+   lines as the speedtest example but without needing a browser (or any network
+   adapter at all). Both ends of every test run on the Dreamcast and talk over
+   the loopback device, so it can be run unattended under dcload or an emulator
+   and its output collected on the host to catch performance regressions.
+
+   The tests are:
+
+   - tcp_send:     bulk TCP transfer, measured on the sending side,
+   - tcp_recv:     bulk TCP transfer, measured on the receiving side,
+   - tcp_rr:       small TCP request/response round trips,
+   - tcp_connect:  TCP connection setup and teardown,
+   - udp_pps:      one way UDP datagram rate.
+
+   Every result is printed on a line of its own in the form
+
+   RESULT <test> <metric> <value> <unit>
+
+   so that a script can pick them out with a simple grep. The last line is
+   either "DONE" or "FAILED".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <arch/timer.h>
+#include <kos/init.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define BENCH_PORT      5201
+#define LOOPBACK        0x7F000001  /* 127.0.0.1 */
+
+#define BULK_SIZE       (4 * 1024 * 1024)
+#define BULK_CHUNK      8192
+#define RR_COUNT        2000
+#define RR_SIZE         64
+#define CONN_COUNT      200
+#define UDP_COUNT       20000
+#define UDP_SIZE        64
+#define UDP_RCVBUF      (128 * 1024)
+
+/* How long the servers wait for something to happen before giving up, in
+   milliseconds, so that a failing test can't hang the whole run. */
+#define IDLE_TIMEOUT    2000
+
+typedef struct {
+    int sock;                   /* Listening (or bound UDP) socket */
+    int fails;
+    size_t bytes;
+} server_args_t;
+
+static uint8_t buf_cli[BULK_CHUNK], buf_srv[BULK_CHUNK];
+
+/* Every test gets a port of its own, since the connections from the last one
+   may still be hanging around in TIME_WAIT. */
+static uint16_t bench_port = BENCH_PORT;
+
+static void result(const char *test, const char *metric, double value,
+                   const char *unit) {
+    printf("RESULT %s %s %.2f %s\n", test, metric, value, unit);
+}
+
+static void fill_addr(struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(LOOPBACK);
+    addr->sin_port = htons(bench_port);
+}
+
+static int open_server(int type) {
+    struct sockaddr_in addr;
+    int sock;
+
+    if((sock = socket(PF_INET, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    fill_addr(&addr);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    if(type == SOCK_STREAM && listen(sock, 8)) {
+        perror("listen");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int open_client(void) {
+    struct sockaddr_in addr;
+    int sock, one = 1;
+
+    if((sock = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    fill_addr(&addr);
+
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("connect");
+        close(sock);
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+static int send_all(int sock, const uint8_t *buf, size_t len) {
+    ssize_t r;
+
+    while(len) {
+        if((r = send(sock, buf, len, 0)) <= 0)
+            return -1;
+
+        buf += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static int recv_all(int sock, uint8_t *buf, size_t len) {
+    ssize_t r;
+
+    while(len) {
+        if((r = recv(sock, buf, len, 0)) <= 0)
+            return -1;
+
+        buf += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static int wait_readable(int sock) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+
+    return poll(&pfd, 1, IDLE_TIMEOUT) == 1 ? 0 : -1;
+}
+
+static int accept_one(server_args_t *args) {
+    int sock, one = 1;
+
+    if(wait_readable(args->sock) ||
+       (sock = accept(args->sock, NULL, NULL)) < 0) {
+        perror("accept");
+        ++args->fails;
+        return -1;
+    }
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+/* Receives everything the client sends until it closes the connection. */
+static void *sink_thd(void *p) {
+    server_args_t *args = (server_args_t *)p;
+    ssize_t r;
+    int sock;
+
+    if((sock = accept_one(args)) < 0)
+        return NULL;
+
+    while((r = recv(sock, buf_srv, sizeof(buf_srv), 0)) > 0)
+        args->bytes += r;
+
+    close(sock);
+    return NULL;
+}
+
+/* Sends BULK_SIZE bytes to the client. */
+static void *source_thd(void *p) {
+    server_args_t *args = (server_args_t *)p;
+    size_t left = BULK_SIZE;
+    int sock;
+
+    if((sock = accept_one(args)) < 0)
+        return NULL;
+
+    memset(buf_srv, 0x5A, sizeof(buf_srv));
+
+    while(left) {
+        if(send_all(sock, buf_srv, left < BULK_CHUNK ? left : BULK_CHUNK)) {
+            ++args->fails;
+            break;
+        }
+
+        left -= left < BULK_CHUNK ? left : BULK_CHUNK;
+    }
+
+    args->bytes = BULK_SIZE - left;
+    close(sock);
+    return NULL;
+}
+
+/* Answers every RR_SIZE byte request with an RR_SIZE byte response. */
+static void *echo_thd(void *p) {
+    server_args_t *args = (server_args_t *)p;
+    int sock, i;
+
+    if((sock = accept_one(args)) < 0)
+        return NULL;
+
+    for(i = 0; i < RR_COUNT; ++i) {
+        if(recv_all(sock, buf_srv, RR_SIZE) ||
+           send_all(sock, buf_srv, RR_SIZE)) {
+            ++args->fails;
+            break;
+        }
+    }
+
+    close(sock);
+    return NULL;
+}
+
+/* Accepts CONN_COUNT connections and closes each one right away. */
+static void *accept_thd(void *p) {
+    server_args_t *args = (server_args_t *)p;
+    int sock, i;
+
+    for(i = 0; i < CONN_COUNT; ++i) {
+        if((sock = accept_one(args)) < 0)
+            break;
+
+        close(sock);
+    }
+
+    return NULL;
+}
+
+/* Counts datagrams until UDP_COUNT have shown up or none show up for a bit. */
+static void *udp_sink_thd(void *p) {
+    server_args_t *args = (server_args_t *)p;
+
+    while(args->bytes < UDP_COUNT && !wait_readable(args->sock) &&
+          recv(args->sock, buf_srv, sizeof(buf_srv), 0) > 0)
+        ++args->bytes;
+
+    return NULL;
+}
+
+/* Run a server thread for a test and hand back its arguments when done. */
+static kthread_t *start_server(int type, void *(*fn)(void *),
+                               server_args_t *args) {
+    memset(args, 0, sizeof(server_args_t));
+    ++bench_port;
+
+    if((args->sock = open_server(type)) < 0)
+        return NULL;
+
+    return thd_create(false, fn, args);
+}
+
+static int finish_server(kthread_t *thd, server_args_t *args) {
+    thd_join(thd, NULL);
+    close(args->sock);
+    return args->fails;
+}
+
+static double mbits(size_t bytes, uint64_t us) {
+    return us ? (double)bytes * 8.0 / (double)us : 0.0;
+}
+
+static int bench_tcp_send(void) {
+    server_args_t args;
+    kthread_t *thd;
+    uint64_t start, end;
+    size_t left = BULK_SIZE;
+    int sock, fails = 0;
+
+    if(!(thd = start_server(SOCK_STREAM, sink_thd, &args)))
+        return 1;
+
+    if((sock = open_client()) < 0) {
+        close(args.sock);
+        return 1;
+    }
+
+    memset(buf_cli, 0xA5, sizeof(buf_cli));
+    start = timer_us_gettime64();
+
+    while(left) {
+        if(send_all(sock, buf_cli, left < BULK_CHUNK ? left : BULK_CHUNK)) {
+            ++fails;
+            break;
+        }
+
+        left -= left < BULK_CHUNK ? left : BULK_CHUNK;
+    }
+
+    /* It isn't done until the other end has seen all of it. */
+    close(sock);
+    fails += finish_server(thd, &args);
+    end = timer_us_gettime64();
+
+    if(args.bytes != BULK_SIZE)
+        ++fails;
+
+    result("tcp_send", "throughput", mbits(args.bytes, end - start), "Mbit/s");
+    return fails;
+}
+
+static int bench_tcp_recv(void) {
+    server_args_t args;
+    kthread_t *thd;
+    uint64_t start, end;
+    size_t got = 0;
+    ssize_t r;
+    int sock, fails = 0;
+
+    if(!(thd = start_server(SOCK_STREAM, source_thd, &args)))
+        return 1;
+
+    if((sock = open_client()) < 0) {
+        close(args.sock);
+        return 1;
+    }
+
+    start = timer_us_gettime64();
+
+    while((r = recv(sock, buf_cli, sizeof(buf_cli), 0)) > 0)
+        got += r;
+
+    end = timer_us_gettime64();
+    close(sock);
+    fails += finish_server(thd, &args);
+
+    if(got != BULK_SIZE)
+        ++fails;
+
+    result("tcp_recv", "throughput", mbits(got, end - start), "Mbit/s");
+    return fails;
+}
+
+static int bench_tcp_rr(void) {
+    server_args_t args;
+    kthread_t *thd;
+    uint64_t start, end;
+    int sock, i, fails = 0;
+
+    if(!(thd = start_server(SOCK_STREAM, echo_thd, &args)))
+        return 1;
+
+    if((sock = open_client()) < 0) {
+        close(args.sock);
+        return 1;
+    }
+
+    memset(buf_cli, 0x3C, RR_SIZE);
+    start = timer_us_gettime64();
+
+    for(i = 0; i < RR_COUNT; ++i) {
+        if(send_all(sock, buf_cli, RR_SIZE) || recv_all(sock, buf_cli, RR_SIZE)) {
+            ++fails;
+            break;
+        }
+    }
+
+    end = timer_us_gettime64();
+    close(sock);
+    fails += finish_server(thd, &args);
+
+    if(i) {
+        result("tcp_rr", "latency", (double)(end - start) / i, "us");
+        result("tcp_rr", "rate", i * 1000000.0 / (double)(end - start),
+               "trans/s");
+    }
+
+    return fails;
+}
+
+static int bench_tcp_connect(void) {
+    server_args_t args;
+    kthread_t *thd;
+    uint64_t start, end;
+    int sock, i, fails = 0;
+
+    if(!(thd = start_server(SOCK_STREAM, accept_thd, &args)))
+        return 1;
+
+    start = timer_us_gettime64();
+
+    for(i = 0; i < CONN_COUNT; ++i) {
+        if((sock = open_client()) < 0) {
+            ++fails;
+            break;
+        }
+
+        close(sock);
+    }
+
+    end = timer_us_gettime64();
+
+    /* If we bailed out early, the server gives up waiting on its own. */
+    if(fails)
+        finish_server(thd, &args);
+    else
+        fails += finish_server(thd, &args);
+
+    if(i)
+        result("tcp_connect", "rate", i * 1000000.0 / (double)(end - start),
+               "conn/s");
+
+    return fails;
+}
+
+static int bench_udp_pps(void) {
+    server_args_t args;
+    kthread_t *thd;
+    struct sockaddr_in dst;
+    uint64_t start, end;
+    int sock, i, fails = 0, rcvbuf = UDP_RCVBUF;
+
+    memset(&args, 0, sizeof(args));
+    ++bench_port;
+
+    if((args.sock = open_server(SOCK_DGRAM)) < 0)
+        return 1;
+
+    setsockopt(args.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket");
+        close(args.sock);
+        return 1;
+    }
+
+    fill_addr(&dst);
+    memset(buf_cli, 0x99, UDP_SIZE);
+    thd = thd_create(false, udp_sink_thd, &args);
+    start = timer_us_gettime64();
+
+    for(i = 0; i < UDP_COUNT; ++i) {
+        if(sendto(sock, buf_cli, UDP_SIZE, 0, (struct sockaddr *)&dst,
+                  sizeof(dst)) < 0) {
+            ++fails;
+            break;
+        }
+
+        /* Give the receiver a chance to keep up now and then. */
+        if(!(i & 63))
+            thd_pass();
+    }
+
+    thd_join(thd, NULL);
+    end = timer_us_gettime64();
+    close(sock);
+    close(args.sock);
+
+    result("udp_pps", "rate", args.bytes * 1000000.0 / (double)(end - start),
+           "pkt/s");
+    result("udp_pps", "lost", (double)(UDP_COUNT - args.bytes), "pkts");
+    return fails;
+}
+
+int main(int argc, char *argv[]) {
+    int fails = 0;
+
+    (void)argc;
+    (void)argv;
+
+    printf("netbench: starting\n");
+
+    fails += bench_tcp_send();
+    fails += bench_tcp_recv();
+    fails += bench_tcp_rr();
+    fails += bench_tcp_connect();
+    fails += bench_udp_pps();
+
+    printf("%s\n", fails ? "FAILED" : "DONE");
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,244 @@
+/* KallistiOS ##version##
+
+   udpbatch.c
+
+   This example measures how many UDP packets per second the network stack can
+   push through a simple echo server, once using recvfrom()/sendto() for every
+   datagram and once using recvmmsg()/sendmmsg() to handle whole batches of
+   datagrams at a time.
+
+   The client and the echo server both run on the Dreamcast and talk to each
+   other over 127.0.0.1 through the loopback device, so nothing goes out on the
+   wire and no network adapter is needed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <arch/timer.h>
+#include <kos/init.h>
+#include <kos/thread.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define ECHO_PORT   1337
+#define CLIENT_PORT 1338
+#define BATCH       16
+#define ROUNDS      500
+#define PKT_SIZE    64
+#define LOOPBACK    0x7F000001  /* 127.0.0.1 */
+
+#define ERR_EXIT() { thd_sleep(2000); exit(EXIT_FAILURE); }
+
+typedef struct {
+    int batched;
+    int sock;
+} echo_args_t;
+
+static void *echo_thd(void *p) {
+    echo_args_t *args = (echo_args_t *)p;
+    uint8_t data[BATCH][PKT_SIZE];
+    struct sockaddr_in addrs[BATCH];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+    socklen_t alen;
+    int i, n, left = BATCH * ROUNDS;
+    ssize_t sz;
+
+    while(left > 0) {
+        if(!args->batched) {
+            alen = sizeof(struct sockaddr_in);
+
+            if((sz = recvfrom(args->sock, data[0], PKT_SIZE, 0,
+                              (struct sockaddr *)&addrs[0], &alen)) < 0) {
+                perror("recvfrom");
+                ERR_EXIT();
+            }
+
+            if(sendto(args->sock, data[0], sz, 0,
+                      (struct sockaddr *)&addrs[0], alen) < 0) {
+                perror("sendto");
+                ERR_EXIT();
+            }
+
+            --left;
+            continue;
+        }
+
+        for(i = 0; i < BATCH; ++i) {
+            iov[i].iov_base = data[i];
+            iov[i].iov_len = PKT_SIZE;
+            memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        /* Grab whatever has shown up, waiting only if nothing has. */
+        if((n = recvmmsg(args->sock, msgs, BATCH, MSG_WAITFORONE, NULL)) < 0) {
+            perror("recvmmsg");
+            ERR_EXIT();
+        }
+
+        /* Send it all back where it came from. */
+        for(i = 0; i < n; ++i)
+            iov[i].iov_len = msgs[i].msg_len;
+
+        if(sendmmsg(args->sock, msgs, n, 0) != n) {
+            perror("sendmmsg");
+            ERR_EXIT();
+        }
+
+        left -= n;
+    }
+
+    return NULL;
+}
+
+static int open_sock(uint16_t port) {
+    struct sockaddr_in addr;
+    int sock;
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in))) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int run(int batched) {
+    echo_args_t args;
+    kthread_t *thd;
+    struct sockaddr_in dst;
+    uint8_t data[BATCH][PKT_SIZE];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+    uint64_t start, end;
+    uint32_t seq = 0, expect = 0, got;
+    int sock, i, n, r;
+
+    if((args.sock = open_sock(ECHO_PORT)) < 0)
+        return -1;
+
+    if((sock = open_sock(CLIENT_PORT)) < 0) {
+        close(args.sock);
+        return -1;
+    }
+
+    memset(&dst, 0, sizeof(struct sockaddr_in));
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = htonl(LOOPBACK);
+    dst.sin_port = htons(ECHO_PORT);
+
+    args.batched = batched;
+    thd = thd_create(false, echo_thd, &args);
+    start = timer_us_gettime64();
+
+    for(r = 0; r < ROUNDS; ++r) {
+        /* Send off a batch of numbered datagrams... */
+        for(i = 0; i < BATCH; ++i) {
+            memset(data[i], 0, PKT_SIZE);
+            memcpy(data[i], &seq, sizeof(seq));
+            ++seq;
+
+            iov[i].iov_base = data[i];
+            iov[i].iov_len = PKT_SIZE;
+            memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_name = &dst;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+
+            if(!batched && sendto(sock, data[i], PKT_SIZE, 0,
+                                  (struct sockaddr *)&dst,
+                                  sizeof(struct sockaddr_in)) < 0) {
+                perror("sendto");
+                ERR_EXIT();
+            }
+        }
+
+        if(batched && sendmmsg(sock, msgs, BATCH, 0) != BATCH) {
+            perror("sendmmsg");
+            ERR_EXIT();
+        }
+
+        /* ... and wait for all of them to come back. */
+        for(i = 0; i < BATCH; i += n) {
+            if(!batched) {
+                if(recvfrom(sock, data[i], PKT_SIZE, 0, NULL, NULL) < 0) {
+                    perror("recvfrom");
+                    ERR_EXIT();
+                }
+
+                n = 1;
+            }
+            else {
+                for(n = i; n < BATCH; ++n) {
+                    msgs[n].msg_hdr.msg_name = NULL;
+                    msgs[n].msg_hdr.msg_namelen = 0;
+                }
+
+                if((n = recvmmsg(sock, msgs + i, BATCH - i, 0, NULL)) < 0) {
+                    perror("recvmmsg");
+                    ERR_EXIT();
+                }
+            }
+        }
+
+        for(i = 0; i < BATCH; ++i) {
+            memcpy(&got, data[i], sizeof(got));
+
+            if(got != expect++) {
+                printf("Out of order echo: got %lu, expected %lu\n",
+                       (unsigned long)got, (unsigned long)expect - 1);
+                ERR_EXIT();
+            }
+        }
+    }
+
+    end = timer_us_gettime64();
+
+    /* Every datagram went through the stack twice: there and back again. */
+    printf("%-20s %8.0f packets/sec\n",
+           batched ? "recvmmsg/sendmmsg:" : "recvfrom/sendto:",
+           2.0 * BATCH * ROUNDS * 1000000.0 / (double)(end - start));
+
+    /* The echo thread is done once it has sent back everything. */
+    thd_join(thd, NULL);
+    close(args.sock);
+    close(sock);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    printf("Echoing %d batches of %d %d-byte datagrams over loopback:\n",
+           ROUNDS, BATCH, PKT_SIZE);
+
+    if(run(0) || run(1))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
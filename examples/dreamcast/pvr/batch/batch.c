@@ -0,0 +1,219 @@
+/* KallistiOS ##version##
+
+   batch.c
+
+   This example benchmarks batching quads by state with pvr_batch. It draws
+   a few thousand small translucent quads a frame, each with one of eight
+   textures and one of two blending modes, in no particular order (like a UI
+   or a particle system might), three different ways:
+
+   - direct: each quad is sent as it comes with pvr_prim(), with a header
+     every time the state changes from the quad before, which is almost
+     every time.
+   - batch_ordered: the quads go through a batch that keeps the order of
+     quads that overlap.
+   - batch_any: the quads go through a batch that draws them in any order,
+     so there's one header per state.
+
+   For each, it prints how many quads a second could be sent, going by the
+   time spent sending them, and how many headers were sent per frame, in the
+   form
+
+   RESULT <test> <metric> <value> <unit>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <dc/pvr.h>
+#include <arch/timer.h>
+
+#define QUADS       2000
+#define TXRS        8
+#define STATES      (TXRS * 2)
+#define TXR_SIZE    32
+#define FRAMES      180
+
+typedef struct {
+    float x, y, dx, dy, size;
+    int state;
+} quad_t;
+
+static quad_t quads[QUADS];
+static pvr_poly_hdr_t hdrs[STATES];
+static pvr_vertex_t verts[4] __attribute__((aligned(32)));
+static uint16_t pixels[TXR_SIZE * TXR_SIZE];
+static uint32_t rand_state = 1;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+/* Make up a round blob of a color, and headers to draw with it. */
+static void make_txr(int n) {
+    pvr_poly_cxt_t cxt;
+    pvr_ptr_t txr;
+    int x, y, dx, dy, a;
+
+    for(y = 0; y < TXR_SIZE; ++y) {
+        for(x = 0; x < TXR_SIZE; ++x) {
+            dx = x - TXR_SIZE / 2;
+            dy = y - TXR_SIZE / 2;
+            a = 15 - (dx * dx + dy * dy) * 15 / (TXR_SIZE * TXR_SIZE / 4);
+            a = a < 0 ? 0 : a;
+            pixels[y * TXR_SIZE + x] = (a << 12) | ((n & 1) ? 0xf00 : 0x400) |
+                                       ((n & 2) ? 0xf0 : 0x40) |
+                                       ((n & 4) ? 0xf : 0x4);
+        }
+    }
+
+    txr = pvr_mem_malloc(TXR_SIZE * TXR_SIZE * 2);
+    pvr_txr_load_ex(pixels, txr, TXR_SIZE, TXR_SIZE, PVR_TXRLOAD_16BPP);
+
+    pvr_poly_cxt_txr(&cxt, PVR_LIST_TR_POLY, PVR_TXRFMT_ARGB4444 |
+                     PVR_TXRFMT_TWIDDLED, TXR_SIZE, TXR_SIZE, txr,
+                     PVR_FILTER_BILINEAR);
+    pvr_poly_compile(&hdrs[n * 2], &cxt);
+
+    /* And a second one that adds its color on. */
+    cxt.blend.src = PVR_BLEND_SRCALPHA;
+    cxt.blend.dst = PVR_BLEND_ONE;
+    pvr_poly_compile(&hdrs[n * 2 + 1], &cxt);
+}
+
+static void make_quads(void) {
+    int i;
+
+    for(i = 0; i < QUADS; ++i) {
+        quads[i].x = rnd() % 640;
+        quads[i].y = rnd() % 480;
+        quads[i].dx = ((int)(rnd() % 9) - 4) * 0.5f;
+        quads[i].dy = ((int)(rnd() % 9) - 4) * 0.5f;
+        quads[i].size = 8 + rnd() % 16;
+        quads[i].state = rnd() % STATES;
+    }
+}
+
+static void move_quads(void) {
+    int i;
+
+    for(i = 0; i < QUADS; ++i) {
+        quads[i].x += quads[i].dx;
+        quads[i].y += quads[i].dy;
+
+        if(quads[i].x < 0.0f || quads[i].x > 640.0f)
+            quads[i].dx = -quads[i].dx;
+
+        if(quads[i].y < 0.0f || quads[i].y > 480.0f)
+            quads[i].dy = -quads[i].dy;
+    }
+}
+
+/* Fill in the four vertices of a quad, as a strip. */
+static void quad_verts(const quad_t *q, float z) {
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        verts[i].flags = i == 3 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+        verts[i].x = q->x + ((i & 2) ? q->size : 0.0f);
+        verts[i].y = q->y + ((i & 1) ? 0.0f : q->size);
+        verts[i].z = z;
+        verts[i].u = (i & 2) ? 1.0f : 0.0f;
+        verts[i].v = (i & 1) ? 0.0f : 1.0f;
+        verts[i].argb = 0xffffffff;
+        verts[i].oargb = 0;
+    }
+}
+
+static void run(const char *name, pvr_batch_t *batch) {
+    uint64_t start, total = 0;
+    int frame, i, last, rv, headers = 0;
+
+    rand_state = 1;
+    make_quads();
+
+    for(frame = 0; frame < FRAMES; ++frame) {
+        move_quads();
+
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_TR_POLY);
+
+        start = timer_us_gettime64();
+
+        if(!batch) {
+            for(i = 0, last = -1; i < QUADS; ++i) {
+                if(quads[i].state != last) {
+                    last = quads[i].state;
+                    pvr_prim(&hdrs[last], sizeof(pvr_poly_hdr_t));
+                    ++headers;
+                }
+
+                quad_verts(&quads[i], 1.0f + i * 0.001f);
+                pvr_prim(verts, sizeof(verts));
+            }
+        }
+        else {
+            for(i = 0; i < QUADS; ++i) {
+                quad_verts(&quads[i], 1.0f + i * 0.001f);
+                pvr_batch_add(batch, quads[i].state, verts);
+            }
+
+            if((rv = pvr_batch_submit(batch)) < 0)
+                printf("pvr_batch_submit() failed in frame %d\n", frame);
+            else
+                headers += rv;
+        }
+
+        total += timer_us_gettime64() - start;
+
+        pvr_list_finish();
+        pvr_scene_finish();
+    }
+
+    printf("RESULT %s quads_per_sec %lu quads/s\n", name,
+           (unsigned long)((uint64_t)QUADS * FRAMES * 1000000 / total));
+    printf("RESULT %s headers_per_frame %d headers\n", name,
+           headers / FRAMES);
+}
+
+int main(int argc, char *argv[]) {
+    pvr_batch_t *ordered, *any;
+    int i;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+
+    for(i = 0; i < TXRS; ++i)
+        make_txr(i);
+
+    ordered = pvr_batch_create(PVR_LIST_TR_POLY, QUADS, STATES, 0);
+    any = pvr_batch_create(PVR_LIST_TR_POLY, QUADS, STATES,
+                           PVR_BATCH_ANY_ORDER);
+
+    if(!ordered || !any) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The headers get the same state numbers in both, in this order. */
+    for(i = 0; i < STATES; ++i) {
+        pvr_batch_state(ordered, &hdrs[i]);
+        pvr_batch_state(any, &hdrs[i]);
+    }
+
+    run("direct", NULL);
+    run("batch_ordered", ordered);
+    run("batch_any", any);
+
+    pvr_batch_destroy(ordered);
+    pvr_batch_destroy(any);
+    pvr_shutdown();
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/* KallistiOS ##version##
+
+   clip.c
+
+   This example shows near plane clipping with pvr_clip. It flies the camera
+   along a checkered floor that it keeps dipping through, drawing the floor
+   with pvr_clip_strips_dr(). What pvr_clip puts out is checked against a
+   reference clipper by utils/cliptest, on a PC.
+
+   The results are printed in the form
+
+   RESULT <test> <metric> <value> <unit>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <dc/pvr.h>
+#include <dc/matrix.h>
+#include <dc/matrix3d.h>
+#include <arch/timer.h>
+
+#define GRID        32
+#define FRAMES      600
+
+static pvr_vertex_t floor_verts[GRID * (GRID + 1) * 2] __attribute__((aligned(32)));
+
+static void camera(float x, float y, float z, float yaw, float pitch) {
+    mat_identity();
+    mat_perspective(320.0f, 240.0f, 1.0f, 0.1f, 100.0f);
+    mat_rotate_x(pitch);
+    mat_rotate_y(yaw);
+    mat_translate(-x, -y, -z);
+}
+
+/* A checkered floor at y = 0, as one strip per row. */
+static void make_floor(void) {
+    pvr_vertex_t *v = floor_verts;
+    int x, z, i;
+
+    for(z = 0; z < GRID; ++z) {
+        for(x = 0; x <= GRID; ++x) {
+            for(i = 0; i < 2; ++i, ++v) {
+                v->flags = (x == GRID && i) ? PVR_CMD_VERTEX_EOL :
+                           PVR_CMD_VERTEX;
+                v->x = (x - GRID / 2) * 2.0f;
+                v->y = 0.0f;
+                v->z = (z + i - GRID / 2) * 2.0f;
+                v->u = x;
+                v->v = z + i;
+                v->argb = ((x ^ z) & 1) ? 0xff4060c0 : 0xffc0c0c0;
+                v->oargb = 0;
+            }
+        }
+    }
+}
+
+static void fly(void) {
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    pvr_dr_state_t dr;
+    uint64_t start, total = 0;
+    unsigned long sent = 0;
+    int frame;
+    float t;
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+    cxt.gen.culling = PVR_CULLING_NONE;
+    pvr_poly_compile(&hdr, &cxt);
+
+    for(frame = 0; frame < FRAMES; ++frame) {
+        t = frame * 0.02f;
+
+        /* Bob up and down through the floor while circling around. */
+        camera(sinf(t) * 20.0f, sinf(t * 3.0f) * 1.5f, cosf(t) * 20.0f,
+               t + 1.57f, 0.3f * sinf(t * 2.0f));
+
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_OP_POLY);
+
+        start = timer_us_gettime64();
+
+        pvr_prim(&hdr, sizeof(hdr));
+        pvr_dr_init(&dr);
+        sent += pvr_clip_strips_dr(&dr, floor_verts,
+                                   sizeof(floor_verts) / sizeof(floor_verts[0]));
+
+        total += timer_us_gettime64() - start;
+
+        pvr_list_finish();
+        pvr_scene_finish();
+    }
+
+    printf("RESULT fly verts_in_per_sec %lu verts/s\n",
+           (unsigned long)((uint64_t)(sizeof(floor_verts) /
+                                      sizeof(floor_verts[0])) * FRAMES *
+                           1000000 / total));
+    printf("RESULT fly verts_out_per_frame %lu verts\n", sent / FRAMES);
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+
+    make_floor();
+    fly();
+
+    pvr_shutdown();
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
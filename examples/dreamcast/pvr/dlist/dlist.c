@@ -0,0 +1,168 @@
+/* KallistiOS ##version##
+
+   dlist.c
+
+   This example shows how to use display lists for geometry that doesn't
+   change, and measures how much time it saves on the CPU. It draws a wavy,
+   colorful grid made of triangle strips three different ways, for five
+   seconds each:
+
+   - prim: every frame, the grid is put through the matrix with
+     mat_transform() and sent a vertex at a time with pvr_prim().
+   - dlist_mat: the grid was recorded once, untransformed, into a display list,
+     which is sent every frame with pvr_dlist_submit_mat().
+   - dlist: the grid was transformed once and recorded into a display list,
+     which is sent as it is every frame with pvr_dlist_submit(). It doesn't
+     spin like the other two.
+
+   For each, the average time spent sending the grid in a frame is printed in
+   the form
+
+   RESULT <test> submit_time <value> us
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <dc/pvr.h>
+#include <dc/matrix.h>
+#include <dc/matrix3d.h>
+#include <arch/timer.h>
+
+#define GRID        32
+#define ROW_VERTS   ((GRID + 1) * 2)
+#define VERTS       (ROW_VERTS * GRID)
+#define FRAMES      300
+
+static pvr_vertex_t model[VERTS] __attribute__((aligned(32)));
+static pvr_vertex_t xf[VERTS] __attribute__((aligned(32)));
+static pvr_poly_hdr_t hdr;
+
+static void make_grid(void) {
+    pvr_vertex_t *v = model;
+    int x, y, i;
+    float fx, fy;
+
+    for(y = 0; y < GRID; ++y) {
+        for(x = 0; x <= GRID; ++x) {
+            for(i = 0; i < 2; ++i, ++v) {
+                fx = (float)x / GRID * 4.0f - 2.0f;
+                fy = (float)(y + i) / GRID * 4.0f - 2.0f;
+
+                v->flags = (x == GRID && i) ? PVR_CMD_VERTEX_EOL :
+                           PVR_CMD_VERTEX;
+                v->x = fx;
+                v->y = 0.3f * sinf(fx * 3.0f) * cosf(fy * 2.0f);
+                v->z = fy;
+                v->u = v->v = 0.0f;
+                v->argb = 0xff000000 | ((x * 255 / GRID) << 16) |
+                          ((y * 255 / GRID) << 8) | 0x80;
+                v->oargb = 0;
+            }
+        }
+    }
+}
+
+static void setup_matrix(float angle) {
+    mat_identity();
+    mat_perspective(320.0f, 240.0f, 1.5f, 0.1f, 100.0f);
+    mat_translate(0.0f, 0.0f, -5.0f);
+    mat_rotate(0.6f, angle, 0.0f);
+}
+
+/* The way things are usually done: transform and send it all every frame. */
+static void send_prim(void) {
+    int i;
+
+    mat_transform((vector_t *)&model[0].x, (vector_t *)&xf[0].x, VERTS,
+                  sizeof(pvr_vertex_t));
+
+    pvr_prim(&hdr, sizeof(hdr));
+
+    for(i = 0; i < VERTS; ++i) {
+        xf[i].flags = model[i].flags;
+        xf[i].argb = model[i].argb;
+        xf[i].oargb = 0;
+        pvr_prim(&xf[i], sizeof(pvr_vertex_t));
+    }
+}
+
+static void run(const char *name, int mode, pvr_dlist_t *dl) {
+    uint64_t start, total = 0;
+    int frame;
+
+    for(frame = 0; frame < FRAMES; ++frame) {
+        if(mode != 2)
+            setup_matrix(frame * 0.02f);
+
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_OP_POLY);
+
+        start = timer_us_gettime64();
+
+        if(mode == 0)
+            send_prim();
+        else if(mode == 1)
+            pvr_dlist_submit_mat(dl);
+        else
+            pvr_dlist_submit(dl);
+
+        total += timer_us_gettime64() - start;
+
+        pvr_list_finish();
+        pvr_scene_finish();
+    }
+
+    printf("RESULT %s submit_time %.1f us\n", name, (double)total / FRAMES);
+}
+
+int main(int argc, char *argv[]) {
+    pvr_poly_cxt_t cxt;
+    pvr_dlist_t *model_dl, *screen_dl;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+    pvr_set_bg_color(0.0f, 0.0f, 0.2f);
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+    pvr_poly_compile(&hdr, &cxt);
+
+    make_grid();
+
+    /* Record the grid as it is, to be transformed when it's sent. */
+    if(!(model_dl = pvr_dlist_create(sizeof(hdr) + sizeof(model))) ||
+       !(screen_dl = pvr_dlist_create(0))) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    pvr_dlist_add(model_dl, &hdr, sizeof(hdr));
+    pvr_dlist_add(model_dl, model, sizeof(model));
+
+    /* Record it again already transformed, with pvr_prim(). */
+    setup_matrix(0.0f);
+    pvr_dlist_record(screen_dl);
+    send_prim();
+
+    if(pvr_dlist_stop()) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("Display lists are %u bytes\n", (unsigned)pvr_dlist_size(model_dl));
+
+    run("prim", 0, NULL);
+    run("dlist_mat", 1, model_dl);
+    run("dlist", 2, screen_dl);
+
+    pvr_dlist_destroy(model_dl);
+    pvr_dlist_destroy(screen_dl);
+    pvr_shutdown();
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
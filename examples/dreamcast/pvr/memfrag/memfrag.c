@@ -0,0 +1,159 @@
+/* KallistiOS ##version##
+
+   memfrag.c
+
+   This example compares the two allocators that can manage the PVR RAM pool,
+   by replaying the same series of allocations with each of them. The series
+   is made to look like a game going through a few levels: each level loads a
+   set of textures of all sorts of sizes (some of them with mipmaps), a few of
+   which are kept around for good (fonts, menus and the like, which end up
+   scattered all over VRAM), then churns through some small textures for a
+   while, and frees everything else before the next level loads.
+
+   After each level is loaded, it prints how much of VRAM is free, the
+   biggest block that could still be allocated, and how many allocations
+   didn't fit, in the form
+
+   RESULT <allocator>_level<n> <metric> <value> <unit>
+
+   along with the time taken by all of the allocations and frees, at the end.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <dc/pvr.h>
+#include <arch/timer.h>
+
+#define LEVELS      8
+#define LEVEL_TXRS  160
+#define KEEP_TXRS   600
+#define CHURN       2000
+
+static pvr_ptr_t level[LEVEL_TXRS];
+static pvr_ptr_t keep[KEEP_TXRS];
+static int kept;
+
+static uint32_t rand_state;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+/* Size of a random texture, as a game might have. */
+static size_t txr_size(void) {
+    size_t w = 8 << (rnd() % 6), h = w, bpp = 16, size = 0;
+
+    switch(rnd() % 8) {
+        case 0:
+            bpp = 4;
+            break;
+        case 1:
+            bpp = 8;
+            break;
+        case 2:
+            h = w >> (rnd() % 3);
+            break;
+        case 3:
+            /* A screen sized buffer, or a movie frame. */
+            return 320 * 240 * 2;
+        default:
+            break;
+    }
+
+    /* Mipmaps, with the padding pvr_txr_load_ex() puts in front. */
+    if(w == h && !(rnd() % 3)) {
+        for(size = 4; w > 1; w >>= 1)
+            size += w * w;
+
+        return size * bpp / 8;
+    }
+
+    return w * h * bpp / 8;
+}
+
+static int run(const char *name, int allocator) {
+    pvr_init_params_t params = {
+        { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_16, PVR_BINSIZE_0,
+          PVR_BINSIZE_0 },
+        512 * 1024, 0, 0, 0, 3, 0, allocator
+    };
+    pvr_mem_stats_t st;
+    uint64_t start, us = 0;
+    int l, i, j, fails;
+
+    if(pvr_init(&params)) {
+        printf("Can't start the PVR\n");
+        return -1;
+    }
+
+    rand_state = 1;
+    kept = 0;
+
+    for(l = 0; l < LEVELS; ++l) {
+        fails = 0;
+        start = timer_us_gettime64();
+
+        for(i = 0; i < LEVEL_TXRS; ++i) {
+            if(!(level[i] = pvr_mem_malloc(txr_size())))
+                ++fails;
+
+            /* Every so often, something comes along that sticks around. */
+            if(!(rnd() % 4) && kept < KEEP_TXRS) {
+                if(!(keep[kept++] = pvr_mem_malloc(32 << (rnd() % 8))))
+                    ++fails;
+            }
+        }
+
+        us += timer_us_gettime64() - start;
+
+        pvr_mem_get_stats(&st);
+        printf("RESULT %s_level%d free %lu KiB\n", name, l,
+               (unsigned long)(st.free / 1024));
+        printf("RESULT %s_level%d largest_free %lu KiB\n", name, l,
+               (unsigned long)(st.largest_free / 1024));
+        printf("RESULT %s_level%d free_blocks %lu blocks\n", name, l,
+               (unsigned long)st.free_blocks);
+        printf("RESULT %s_level%d failed %d allocs\n", name, l, fails);
+
+        start = timer_us_gettime64();
+
+        /* Textures that get swapped out while the level is played. */
+        for(i = 0; i < CHURN; ++i) {
+            j = rnd() % LEVEL_TXRS;
+
+            if(level[j])
+                pvr_mem_free(level[j]);
+
+            level[j] = pvr_mem_malloc(32 << (rnd() % 6));
+        }
+
+        for(i = 0; i < LEVEL_TXRS; ++i) {
+            if(level[i])
+                pvr_mem_free(level[i]);
+        }
+
+        us += timer_us_gettime64() - start;
+    }
+
+    printf("RESULT %s time %lu us\n", name, (unsigned long)us);
+
+    pvr_shutdown();
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    if(run("dlmalloc", PVR_MEM_ALLOC_DEFAULT) ||
+       run("buddy", PVR_MEM_ALLOC_BUDDY)) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+/* KallistiOS ##version##
+
+   prof.c
+
+   This example shows how to use the PVR frame profiler. It draws a few
+   thousand translucent triangles a frame, getting heavier as it goes, with
+   the profiler keeping records of the last few frames. At the end it prints
+   how long the CPU, the TA and the render took on average over those frames,
+   and how long the CPU was kept waiting, in the form
+
+   RESULT <test> <metric> <value> <unit>
+
+   and writes the frames out as a Chrome trace to /pc/pvr_trace.json (when
+   run with dcload), which can be opened in chrome://tracing or Perfetto.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <dc/pvr.h>
+
+#define FRAMES      300
+#define KEEP        120
+#define TRACE_PATH  "/pc/pvr_trace.json"
+
+static pvr_vertex_t verts[3] __attribute__((aligned(32)));
+static pvr_prof_frame_t frames[KEEP];
+static uint32_t rand_state = 1;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+static void draw(int count) {
+    int i, j;
+
+    for(i = 0; i < count; ++i) {
+        for(j = 0; j < 3; ++j) {
+            verts[j].flags = j == 2 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+            verts[j].x = rnd() % 640;
+            verts[j].y = rnd() % 480;
+            verts[j].z = 1.0f + i * 0.0001f;
+            verts[j].u = verts[j].v = 0.0f;
+            verts[j].argb = 0x40000000 | (rnd() & 0xffffff);
+            verts[j].oargb = 0;
+        }
+
+        pvr_prim(verts, sizeof(verts));
+    }
+}
+
+/* Average of end - start over the frames that have both. */
+static unsigned long average_us(size_t off_start, size_t off_end,
+                                size_t count) {
+    uint64_t total = 0, start, end;
+    size_t i, n = 0;
+
+    for(i = 0; i < count; ++i) {
+        start = *(uint64_t *)((uint8_t *)&frames[i] + off_start);
+        end = *(uint64_t *)((uint8_t *)&frames[i] + off_end);
+
+        if(start && end > start) {
+            total += end - start;
+            ++n;
+        }
+    }
+
+    return n ? (unsigned long)(total / n / 1000) : 0;
+}
+
+int main(int argc, char *argv[]) {
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    uint64_t wait = 0;
+    size_t count, i;
+    unsigned long missed = 0, bytes = 0;
+    int frame;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_TR_POLY);
+    pvr_poly_compile(&hdr, &cxt);
+
+    if(pvr_prof_start(KEEP)) {
+        printf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for(frame = 0; frame < FRAMES; ++frame) {
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_TR_POLY);
+        pvr_prim(&hdr, sizeof(hdr));
+        draw(1000 + frame * 20);
+        pvr_list_finish();
+        pvr_scene_finish();
+    }
+
+    count = pvr_prof_get(frames, KEEP);
+
+    for(i = 0; i < count; ++i) {
+        wait += frames[i].ready_wait + frames[i].dma_wait;
+        missed += frames[i].vbl_missed;
+        bytes += frames[i].lists[PVR_LIST_TR_POLY].bytes;
+    }
+
+    printf("RESULT prof frames %lu frames\n", (unsigned long)count);
+
+    if(count) {
+        printf("RESULT prof cpu_time %lu us\n",
+               average_us(offsetof(pvr_prof_frame_t, begin),
+                          offsetof(pvr_prof_frame_t, finish), count));
+        printf("RESULT prof ta_time %lu us\n",
+               average_us(offsetof(pvr_prof_frame_t, reg_start),
+                          offsetof(pvr_prof_frame_t, reg_done), count));
+        printf("RESULT prof render_time %lu us\n",
+               average_us(offsetof(pvr_prof_frame_t, rnd_start),
+                          offsetof(pvr_prof_frame_t, rnd_done), count));
+        printf("RESULT prof cpu_wait %lu us\n",
+               (unsigned long)(wait / count / 1000));
+        printf("RESULT prof tr_bytes %lu bytes\n", bytes / count);
+        printf("RESULT prof vbl_missed %lu vblanks\n", missed);
+    }
+
+    if(pvr_prof_export(TRACE_PATH))
+        printf("Couldn't write %s\n", TRACE_PATH);
+    else
+        printf("Wrote %s\n", TRACE_PATH);
+
+    pvr_prof_stop();
+    pvr_shutdown();
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
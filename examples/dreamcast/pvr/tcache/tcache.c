@@ -0,0 +1,188 @@
+/* KallistiOS ##version##
+
+   tcache.c
+
+   This example shows how to use the texture cache to draw with more textures
+   than fit in VRAM at once. It makes up 48 textures of 256x256 (6MB worth at
+   16bpp) but only lets the cache use 1MB of VRAM, which is room for eight of
+   them. Every frame draws a grid of eight textures, and every so often a new
+   texture slides into the grid and the oldest one slides out, so the cache has
+   to drop a texture from VRAM and bring another one back in.
+
+   Textures that aren't in VRAM yet are drawn as a plain gray square until
+   they've been copied in. Half of the textures are mostly flat, and have their
+   copies in main RAM compressed.
+
+   The hit rate and upload bandwidth of the cache are printed once a second.
+   The example runs for 20 seconds, or until start is pressed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <dc/pvr.h>
+#include <dc/maple.h>
+#include <dc/maple/controller.h>
+
+#define TXR_SIZE    256
+#define TXR_COUNT   48
+#define BUDGET      (1024 * 1024)
+#define COLS        4
+#define ROWS        2
+#define SLIDE       20          /* Frames between textures sliding along */
+#define RUN_FRAMES  (60 * 20)
+
+static pvr_tcache_txr_t *txrs[TXR_COUNT];
+static uint16_t buf[TXR_SIZE * TXR_SIZE];
+
+/* Make up texture n: a colored checkerboard, or mostly flat with a border. */
+static void make_txr(int n) {
+    uint16_t c = ((n * 5) & 31) << 11 | ((n * 13) & 63) << 5 | ((n * 7) & 31);
+    int x, y;
+
+    for(y = 0; y < TXR_SIZE; ++y) {
+        for(x = 0; x < TXR_SIZE; ++x) {
+            if(n & 1)
+                buf[y * TXR_SIZE + x] = (x < 8 || y < 8) ? 0xffff : c;
+            else
+                buf[y * TXR_SIZE + x] = ((x ^ y) & 32) ? c : ~c;
+        }
+    }
+
+    txrs[n] = pvr_tcache_add(buf, TXR_SIZE, TXR_SIZE, PVR_TXRLOAD_16BPP,
+                             (n & 1) ? PVR_TCACHE_COMPRESS : 0);
+}
+
+static void draw_quad(pvr_ptr_t txr, float x, float y, float w, float h) {
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    pvr_vertex_t vert;
+
+    if(txr)
+        pvr_poly_cxt_txr(&cxt, PVR_LIST_OP_POLY, PVR_TXRFMT_RGB565 |
+                         PVR_TXRFMT_TWIDDLED, TXR_SIZE, TXR_SIZE, txr,
+                         PVR_FILTER_BILINEAR);
+    else
+        pvr_poly_cxt_col(&cxt, PVR_LIST_OP_POLY);
+
+    pvr_poly_compile(&hdr, &cxt);
+    pvr_prim(&hdr, sizeof(hdr));
+
+    vert.flags = PVR_CMD_VERTEX;
+    vert.z = 1.0f;
+    vert.argb = txr ? 0xffffffff : 0xff404040;
+    vert.oargb = 0;
+
+    vert.x = x;
+    vert.y = y + h;
+    vert.u = 0.0f;
+    vert.v = 1.0f;
+    pvr_prim(&vert, sizeof(vert));
+
+    vert.y = y;
+    vert.v = 0.0f;
+    pvr_prim(&vert, sizeof(vert));
+
+    vert.x = x + w;
+    vert.y = y + h;
+    vert.u = 1.0f;
+    vert.v = 1.0f;
+    pvr_prim(&vert, sizeof(vert));
+
+    vert.flags = PVR_CMD_VERTEX_EOL;
+    vert.y = y;
+    vert.v = 0.0f;
+    pvr_prim(&vert, sizeof(vert));
+}
+
+static int start_pressed(void) {
+    maple_device_t *cont;
+    cont_state_t *state;
+
+    if(!(cont = maple_enum_type(0, MAPLE_FUNC_CONTROLLER)))
+        return 0;
+
+    state = (cont_state_t *)maple_dev_status(cont);
+    return state && (state->buttons & CONT_START);
+}
+
+int main(int argc, char *argv[]) {
+    pvr_tcache_stats_t st;
+    uint64_t hits = 0, misses = 0, uploads = 0, bytes = 0, us = 0;
+    uint64_t total_hits = 0, total_misses = 0;
+    int i, frame, first;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+    pvr_set_bg_color(0.0f, 0.0f, 0.2f);
+
+    if(pvr_tcache_init(BUDGET)) {
+        printf("Can't start the texture cache\n");
+        return EXIT_FAILURE;
+    }
+
+    for(i = 0; i < TXR_COUNT; ++i)
+        make_txr(i);
+
+    pvr_tcache_get_stats(&st);
+    printf("%lu textures, %lu bytes of main RAM for them\n",
+           (unsigned long)st.count, (unsigned long)st.ram_bytes);
+
+    for(frame = 0; frame < RUN_FRAMES && !start_pressed(); ++frame) {
+        first = frame / SLIDE;
+
+        pvr_wait_ready();
+        pvr_scene_begin();
+        pvr_list_begin(PVR_LIST_OP_POLY);
+
+        for(i = 0; i < COLS * ROWS; ++i)
+            draw_quad(pvr_tcache_use(txrs[(first + i) % TXR_COUNT]),
+                      32.0f + (i % COLS) * 148.0f, 64.0f + (i / COLS) * 192.0f,
+                      128.0f, 128.0f);
+
+        pvr_list_finish();
+        pvr_scene_finish();
+        pvr_tcache_frame();
+
+        pvr_tcache_get_stats(&st);
+        hits += st.hits;
+        misses += st.misses;
+        uploads += st.uploads;
+        bytes += st.upload_bytes;
+        us += st.upload_us;
+
+        if(frame % 60 == 59) {
+            printf("Frame %lu: %lu%% hits, %lu uploads, %lu KiB/s uploading, "
+                   "%lu of %lu textures (%lu KiB) in VRAM\n",
+                   (unsigned long)st.frame_count,
+                   (unsigned long)(hits * 100 / (hits + misses)),
+                   (unsigned long)uploads,
+                   (unsigned long)(us ? bytes * 1000000 / us / 1024 : 0),
+                   (unsigned long)st.resident, (unsigned long)st.count,
+                   (unsigned long)(st.vram_bytes / 1024));
+
+            total_hits += hits;
+            total_misses += misses;
+            hits = misses = uploads = bytes = us = 0;
+        }
+    }
+
+    printf("Overall: %llu hits, %llu misses\n",
+           (unsigned long long)(total_hits + hits),
+           (unsigned long long)(total_misses + misses));
+
+    /* Make sure the PVR is done with the textures before getting rid of
+       them. */
+    pvr_wait_ready();
+
+    for(i = 0; i < TXR_COUNT; ++i)
+        pvr_tcache_remove(txrs[i]);
+
+    pvr_tcache_shutdown();
+    pvr_shutdown();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/* KallistiOS ##version##
+
+   vertbuf_queue.c
+
+   This example compares vertex DMA with the usual two vertex buffers against
+   four, where finished scenes are queued up for the TA rather than waited
+   for. Each frame draws a few thousand translucent triangles and spends a
+   varying amount of time on the CPU, as a game would, so that some frames
+   are quick to put together and others are slow. With scenes queued up, the
+   quick frames can get ahead to make up for the slow ones.
+
+   The translucent list's buffer is only big enough for about half of what's
+   drawn, and is allowed to grow with pvr_set_vertbuf_overflow(). Nothing
+   sent should be refused.
+
+   The results are printed in the form
+
+   RESULT <test> <metric> <value> <unit>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <dc/pvr.h>
+#include <arch/timer.h>
+
+#define FRAMES      300
+#define TRIS        3000
+#define OP_SLICE    (8 * 1024)
+#define TR_SLICE    (128 * 1024)
+#define CHUNK       (64 * 1024)
+
+static uint8_t op_buf[OP_SLICE * PVR_VERTBUF_MAX] __attribute__((aligned(32)));
+static uint8_t tr_buf[TR_SLICE * PVR_VERTBUF_MAX] __attribute__((aligned(32)));
+static pvr_vertex_t verts[3] __attribute__((aligned(32)));
+static uint32_t rand_state = 1;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+/* Something for the CPU to do, from none to about two frames' worth. */
+static void think(int frame) {
+    uint64_t until = timer_us_gettime64() + ((frame * 7919) % 11) * 3000;
+
+    while(timer_us_gettime64() < until)
+        ;
+}
+
+static int draw(pvr_poly_hdr_t *hdr) {
+    int i, j, refused = 0;
+
+    refused += pvr_prim(hdr, sizeof(*hdr)) < 0;
+
+    for(i = 0; i < TRIS; ++i) {
+        for(j = 0; j < 3; ++j) {
+            verts[j].flags = j == 2 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX;
+            verts[j].x = rnd() % 640;
+            verts[j].y = rnd() % 480;
+            verts[j].z = 1.0f + i * 0.0001f;
+            verts[j].u = verts[j].v = 0.0f;
+            verts[j].argb = 0x20000000 | (rnd() & 0xffffff);
+            verts[j].oargb = 0;
+        }
+
+        refused += pvr_prim(verts, sizeof(verts)) < 0;
+    }
+
+    return refused;
+}
+
+static void run(const char *test, int count) {
+    pvr_init_params_t params = {
+        { PVR_BINSIZE_16, PVR_BINSIZE_0, PVR_BINSIZE_16, PVR_BINSIZE_0,
+          PVR_BINSIZE_0 },
+        1024 * 1024,
+        .dma_enabled = 1,
+        .vertbuf_count = count
+    };
+    pvr_poly_cxt_t cxt;
+    pvr_poly_hdr_t hdr;
+    uint64_t start, stall = 0, t;
+    unsigned long refused = 0;
+    int frame;
+
+    pvr_init(&params);
+
+    pvr_set_vertbuf(PVR_LIST_OP_POLY, op_buf, OP_SLICE * count);
+    pvr_set_vertbuf(PVR_LIST_TR_POLY, tr_buf, TR_SLICE * count);
+    pvr_set_vertbuf_overflow(PVR_LIST_TR_POLY, CHUNK);
+
+    pvr_poly_cxt_col(&cxt, PVR_LIST_TR_POLY);
+    pvr_poly_compile(&hdr, &cxt);
+
+    start = timer_us_gettime64();
+
+    for(frame = 0; frame < FRAMES; ++frame) {
+        t = timer_us_gettime64();
+        pvr_wait_ready();
+        pvr_scene_begin();
+        stall += timer_us_gettime64() - t;
+
+        think(frame);
+
+        pvr_list_begin(PVR_LIST_TR_POLY);
+        refused += draw(&hdr);
+        pvr_list_finish();
+
+        t = timer_us_gettime64();
+        pvr_scene_finish();
+        stall += timer_us_gettime64() - t;
+    }
+
+    t = timer_us_gettime64() - start;
+
+    printf("RESULT %s fps %lu.%02lu fps\n", test,
+           (unsigned long)(FRAMES * 1000000ULL / t),
+           (unsigned long)(FRAMES * 100000000ULL / t % 100));
+    printf("RESULT %s cpu_stall %lu us/frame\n", test,
+           (unsigned long)(stall / FRAMES));
+    printf("RESULT %s refused %lu prims\n", test, refused);
+
+    pvr_shutdown();
+}
+
+int main(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+
+    run("double", 2);
+    run("queued", 4);
+
+    printf("DONE\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,253 @@
+/* KallistiOS ##version##
+
+   vqbench.c
+
+   This example benchmarks the runtime VQ texture compression done by
+   pvr_txr_vq_encode() and pvr_txr_load_ex() with PVR_TXRLOAD_VQ_LOAD. It
+   makes up a few textures that look quite different from each other (smooth,
+   noisy and full of hard edges), compresses each of them with a varying
+   number of refinement passes, and also with the codebook of the first one
+   (a fixed codebook). For each, it prints how long the compression took and
+   how close the result is to the original, as the PSNR over all components.
+
+   Every result is printed on a line of its own in the form
+
+   RESULT <test> <metric> <value> <unit>
+
+   Last of all, one of the textures is loaded with pvr_txr_load_ex() to make
+   sure that what ends up in VRAM is the same as what pvr_txr_vq_encode()
+   gives. The last line is either "DONE" or "FAILED".
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <dc/pvr.h>
+#include <arch/timer.h>
+
+#define SIZE        256
+#define TEXELS      (SIZE * SIZE)
+#define CODEBOOK    2048
+
+typedef struct {
+    const char *name;
+    uint32_t flags;
+    uint32_t (*gen)(int x, int y);
+} tex_t;
+
+static uint32_t rand_state = 1;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+static uint32_t clamp8(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Smooth plasma, like the plasma example. */
+static uint32_t gen_plasma(int x, int y) {
+    float r = sinf(x * 0.05f) + sinf(y * 0.07f);
+    float g = sinf((x + y) * 0.04f) + cosf(y * 0.03f);
+    float b = sinf(sqrtf((x - 128.0f) * (x - 128.0f) +
+                         (y - 128.0f) * (y - 128.0f)) * 0.08f);
+
+    return 0xff000000 | (clamp8(r * 63 + 128) << 16) |
+           (clamp8(g * 63 + 128) << 8) | clamp8(b * 127 + 128);
+}
+
+/* The same plasma, with lots of noise on top. */
+static uint32_t gen_noise(int x, int y) {
+    uint32_t p = gen_plasma(x, y);
+    int n = (int)(rnd() & 63) - 32;
+
+    return 0xff000000 | (clamp8(((p >> 16) & 255) + n) << 16) |
+           (clamp8(((p >> 8) & 255) + n) << 8) | clamp8((p & 255) + n);
+}
+
+/* Hard edges and a bit of alpha: bricks with see-through mortar. */
+static uint32_t gen_bricks(int x, int y) {
+    int row = y / 16, bx = (x + (row & 1) * 16) % 32, by = y % 16;
+    uint32_t shade = 64 + ((x / 32 + row * 7) % 5) * 24 + bx * 2 + by;
+
+    if(bx < 2 || by < 2)
+        return 0x40808080;
+
+    return 0xff000000 | (shade << 16) | ((shade / 2) << 8) | (shade / 3);
+}
+
+static const tex_t texs[] = {
+    { "plasma", PVR_TXRLOAD_CONV_RGB565, gen_plasma },
+    { "noise", PVR_TXRLOAD_CONV_RGB565, gen_noise },
+    { "bricks", PVR_TXRLOAD_CONV_ARGB4444, gen_bricks }
+};
+
+#define TEX_COUNT   (sizeof(texs) / sizeof(texs[0]))
+
+static const int passes[] = { 0, 1, 2, 4 };
+
+#define PASS_COUNT  (sizeof(passes) / sizeof(passes[0]))
+
+static uint32_t src[TEXELS];
+static uint16_t src16[TEXELS];
+static uint8_t vq[CODEBOOK + TEXELS / 4] __attribute__((aligned(32)));
+static uint8_t codebook[CODEBOOK];
+
+/* Expand a 16-bit texel to ARGB8888, the same way the encoder does. */
+static void unpack(uint16_t p, uint32_t fmt, int *out) {
+    if(fmt == PVR_TXRLOAD_CONV_RGB565) {
+        out[0] = 255;
+        out[1] = ((p >> 11) << 3) | (p >> 13);
+        out[2] = (((p >> 5) & 63) << 2) | ((p >> 9) & 3);
+        out[3] = ((p & 31) << 3) | ((p >> 2) & 7);
+    }
+    else {
+        out[0] = (p >> 12) * 17;
+        out[1] = ((p >> 8) & 15) * 17;
+        out[2] = ((p >> 4) & 15) * 17;
+        out[3] = (p & 15) * 17;
+    }
+}
+
+static uint32_t untwid(uint32_t i) {
+    uint32_t r = 0, b;
+
+    for(b = 0; b < 16; ++b)
+        r |= ((i >> (b * 2)) & 1) << b;
+
+    return r;
+}
+
+/* Decode the VQ texture and compare it with the source, as rounded to the
+   16-bit format (since that's the best that could be done). */
+static double psnr(uint32_t fmt) {
+    const uint16_t *cb = (const uint16_t *)vq;
+    const uint8_t *idx = vq + CODEBOOK;
+    int a[4], b[4], i, t, c, x, y;
+    double err = 0.0;
+
+    for(i = 0; i < TEXELS / 4; ++i) {
+        x = untwid(i >> 1) * 2;
+        y = untwid(i) * 2;
+
+        for(t = 0; t < 4; ++t) {
+            unpack(cb[idx[i] * 4 + t], fmt, a);
+            unpack(src16[(y + (t & 1)) * SIZE + x + (t >> 1)], fmt, b);
+
+            for(c = 0; c < 4; ++c)
+                err += (a[c] - b[c]) * (a[c] - b[c]);
+        }
+    }
+
+    err /= TEXELS * 4.0;
+    return err ? 10.0 * log10(255.0 * 255.0 / err) : 99.0;
+}
+
+static int encode(const char *test, uint32_t fmt, pvr_txr_vq_params_t *p) {
+    uint64_t start, end;
+
+    start = timer_us_gettime64();
+
+    if(pvr_txr_vq_encode(src, vq, SIZE, SIZE, PVR_TXRLOAD_32BPP | fmt, p)) {
+        perror("pvr_txr_vq_encode");
+        return -1;
+    }
+
+    end = timer_us_gettime64();
+
+    printf("RESULT %s encode_time %.1f ms\n", test, (end - start) / 1000.0);
+    printf("RESULT %s psnr %.2f dB\n", test, psnr(fmt));
+    return 0;
+}
+
+/* Load a texture into VRAM and check that it came out right. */
+static int check_load(uint32_t fmt, uint32_t how) {
+    size_t size = pvr_txr_vq_size(SIZE, SIZE, 0);
+    pvr_ptr_t txr;
+    size_t i;
+    int rv = 0;
+
+    if(!(txr = pvr_mem_malloc(size)))
+        return -1;
+
+    pvr_txr_load_ex(src, txr, SIZE, SIZE, PVR_TXRLOAD_32BPP | fmt |
+                    PVR_TXRLOAD_VQ_LOAD | how);
+    pvr_txr_vq_encode(src, vq, SIZE, SIZE, PVR_TXRLOAD_32BPP | fmt, NULL);
+
+    for(i = 0; i < size; i += 2) {
+        if(((volatile uint16_t *)txr)[i / 2] != *(uint16_t *)(vq + i)) {
+            printf("VRAM differs at byte %u\n", (unsigned)i);
+            rv = -1;
+            break;
+        }
+    }
+
+    pvr_mem_free(txr);
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    pvr_txr_vq_params_t p = { 0, NULL };
+    char test[64];
+    unsigned t, i;
+    int x, y, fails = 0;
+
+    (void)argc;
+    (void)argv;
+
+    pvr_init_defaults();
+
+    for(t = 0; t < TEX_COUNT; ++t) {
+        for(y = 0; y < SIZE; ++y) {
+            for(x = 0; x < SIZE; ++x) {
+                uint32_t c = texs[t].gen(x, y);
+
+                src[y * SIZE + x] = c;
+
+                if(texs[t].flags == PVR_TXRLOAD_CONV_RGB565)
+                    src16[y * SIZE + x] = ((c >> 8) & 0xf800) |
+                                          ((c >> 5) & 0x07e0) |
+                                          ((c >> 3) & 0x001f);
+                else
+                    src16[y * SIZE + x] = ((c >> 16) & 0xf000) |
+                                          ((c >> 12) & 0x0f00) |
+                                          ((c >> 8) & 0x00f0) |
+                                          ((c >> 4) & 0x000f);
+            }
+        }
+
+        p.codebook = NULL;
+
+        for(i = 0; i < PASS_COUNT; ++i) {
+            p.passes = passes[i];
+            snprintf(test, sizeof(test), "%s_p%d", texs[t].name, passes[i]);
+            fails |= encode(test, texs[t].flags, &p);
+
+            /* Hang on to the best codebook of the first texture. */
+            if(!t && i == PASS_COUNT - 1)
+                memcpy(codebook, vq, CODEBOOK);
+        }
+
+        /* A fixed codebook only makes sense in the same format. */
+        if(t && texs[t].flags == texs[0].flags) {
+            p.codebook = (const uint16_t *)codebook;
+            snprintf(test, sizeof(test), "%s_fixed", texs[t].name);
+            fails |= encode(test, texs[t].flags, &p);
+        }
+    }
+
+    if(check_load(texs[TEX_COUNT - 1].flags, PVR_TXRLOAD_SQ) ||
+       check_load(texs[TEX_COUNT - 1].flags, PVR_TXRLOAD_DMA)) {
+        printf("Loading a VQ texture with pvr_txr_load_ex() failed\n");
+        fails = 1;
+    }
+
+    pvr_shutdown();
+
+    printf("%s\n", fails ? "FAILED" : "DONE");
+    return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -378,6 +378,60 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Input a packet buffer into the protocol (optional).
+
+        This is the same as the input function, but additionally passes the
+        packet buffer the data lives in, so that the protocol can take a
+        reference on it (see net_pbuf_hold()) instead of copying the data when
+        it needs to queue it. If this is NULL, input is used instead.
+
+        \param  src         The interface the packet was received on.
+        \param  domain      The domain the packet came in on.
+        \param  hdr         The network-level header of the packet.
+        \param  data        The packet itself, including any protocol headers.
+        \param  size        The size of the packet (data), in bytes.
+        \param  pkt         The buffer holding the packet, or NULL if the data
+                            does not live in one.
+        \retval -1          On error (the packet is discarded).
+        \retval 0           On success.
+    */
+    int (*input_pbuf)(netif_t *src, int domain, const void *hdr,
+                      const uint8 *data, size_t size, net_pbuf_t *pkt);
+
+    /** \brief  Receive a batch of messages on a socket (optional).
+
+        This function should implement the ::recvmmsg() system call for the
+        protocol, and is also used for ::recvmsg() with a vlen of 1. If this is
+        NULL, those calls are emulated with recvfrom instead.
+
+        \param  s           The socket to receive messages on
+        \param  msgvec      The messages to fill in
+        \param  vlen        The number of messages in msgvec
+        \param  flags       Flags to the function
+        \param  timeout     The longest time to wait, or NULL to wait forever
+        \retval -1          On error (set errno appropriately)
+        \retval n           The number of messages received
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags, struct timespec *timeout);
+
+    /** \brief  Send a batch of messages on a socket (optional).
+
+        This function should implement the ::sendmmsg() system call for the
+        protocol, and is also used for ::sendmsg() with a vlen of 1. If this is
+        NULL, those calls are emulated with sendto instead.
+
+        \param  s           The socket to send messages on
+        \param  msgvec      The messages to send
+        \param  vlen        The number of messages in msgvec
+        \param  flags       Flags to the function
+        \retval -1          On error sending the first message (set errno
+                            appropriately)
+        \retval n           The number of messages sent
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags);
 } fs_socket_proto_t;
 
 /** \brief   Initializer for the entry field in the fs_socket_proto_t struct. 
@@ -450,6 +504,29 @@ net_socket_t *fs_socket_open_sock(fs_socket_proto_t *proto);
 int fs_socket_input(netif_t *src, int domain, int protocol, const void *hdr,
                     const uint8 *data, size_t size);
 
+/** \brief   Input a packet buffer into some socket family handler.
+    \ingroup vfs_sockets
+
+    This works just like fs_socket_input(), but also passes along the packet
+    buffer the data lives in (if any) to protocols that can make use of it.
+
+    \param  src         The network interface the packet came in on
+    \param  domain      The low-level protocol used (AF_INET or AF_INET6)
+    \param  protocol    The upper-level protocol that we're looking for
+    \param  hdr         The low-level protocol header
+    \param  data        The upper-level packet, without any lower-level protocol
+                        headers, but with the upper-level ones intact
+    \param  size        The size of the packet (the data parameter)
+    \param  pkt         The packet buffer holding data, or NULL
+
+    \retval -2          The protocol is not known
+    \retval -1          Protocol-level error processing packet
+    \retval 0           On success
+*/
+int fs_socket_input_pbuf(netif_t *src, int domain, int protocol,
+                         const void *hdr, const uint8 *data, size_t size,
+                         net_pbuf_t *pkt);
+
 /** \brief   Add a new protocol for use with fs_socket.
     \ingroup vfs_sockets
 
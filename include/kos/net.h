@@ -42,6 +42,60 @@ __BEGIN_DECLS
     \ingroup                        networking
 */
 
+/** \brief   Network packet buffer.
+    \ingroup networking_drivers
+
+    Packets travel through the stack in one of these, so that each layer can
+    prepend its header in the reserved headroom (or strip it on input) without
+    copying the payload around. Buffers are reference counted; anyone wanting
+    to hold on to a packet past the call it was handed to them in should take
+    a reference with net_pbuf_ref() (or net_pbuf_hold()).
+
+    \headerfile kos/net.h
+*/
+typedef struct net_pbuf {
+    /** \brief  Start of the valid data in the buffer */
+    uint8_t             *data;
+
+    /** \brief  Length of the valid data, in bytes */
+    size_t              len;
+
+    /** \brief  Start of the underlying storage */
+    uint8_t             *buf;
+
+    /** \brief  Size of the underlying storage, in bytes */
+    size_t              size;
+
+    /** \brief  Buffer flags (see \ref net_pbuf_flags) */
+    uint32_t            flags;
+
+    /** \brief  Reference count */
+    int                 refcnt;
+} net_pbuf_t;
+
+/** \defgroup net_pbuf_flags   Packet Buffer Flags
+    \brief                     Flags for the net_pbuf_t structure
+    \ingroup                   networking_drivers
+    @{
+*/
+#define NET_PBUF_BORROWED   0x00000001  /**< \brief Storage not owned by pbuf */
+#define NET_PBUF_POOL       0x00000002  /**< \brief Allocated from the pool */
+/** @} */
+
+/** \brief   Default headroom to reserve in front of outgoing packets.
+    \ingroup networking_drivers
+
+    Enough for the link and network layer headers the stack prepends to a
+    transport payload. The value is chosen so that the ethernet header of an
+    IPv4 packet ends up on a 32-byte boundary in pool buffers.
+*/
+#define NET_PBUF_HEADROOM   98
+
+/** \brief   Size of the storage of pool buffers.
+    \ingroup networking_drivers
+*/
+#define NET_PBUF_POOL_SIZE  1664
+
 /** \brief   Structure describing one usable network device.
     \ingroup networking_drivers
 
@@ -181,6 +235,21 @@ typedef struct knetif {
         \param  count       The number of addresses in list.
     */
     int (*if_set_mc)(struct knetif *self, const uint8_t *list, int count);
+
+    /** \brief  Queue a packet buffer for transmission (optional).
+
+        Drivers that can transmit straight out of a packet buffer may set this
+        to avoid an intermediate copy. The driver must take a reference on the
+        buffer if it needs it after returning. If this is NULL, if_tx is used.
+
+        \param  self        The network device in question.
+        \param  pkt         The packet to transmit.
+        \param  blocking    1 if we should block if needed, 0 otherwise.
+        \retval NETIF_TX_OK     On success.
+        \retval NETIF_TX_ERROR  On general failure.
+        \retval NETIF_TX_AGAIN  If non-blocking and we must block to send.
+    */
+    int (*if_tx_pbuf)(struct knetif *self, net_pbuf_t *pkt, int blocking);
 } netif_t;
 
 /** \defgroup net_drivers_flags netif_t Flags
@@ -196,6 +265,7 @@ typedef struct knetif {
 #define NETIF_PROMISC       0x00010000      /**< \brief Promiscuous mode */
 #define NETIF_NEEDSPOLL     0x01000000      /**< \brief Needs to be polled for input */
 #define NETIF_NOETH         0x10000000      /**< \brief Does not use ethernet */
+#define NETIF_LOOPBACK      0x20000000      /**< \brief Is a loopback device */
 /** @} */
 
 /** \defgroup net_drivers_returns    TX Return Values
@@ -311,7 +381,8 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     If no entry is found, then an ARP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. A few packets can be held for each address being resolved;
+    past that, the oldest one is dropped for each new one.
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
@@ -322,8 +393,10 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
     \param  data_size       The size of data.
 
     \retval 0               On success.
-    \retval -1              A query is outstanding for that address.
-    \retval -2              Address not found, query generated.
+    \retval -1              A query is outstanding for that address (and no
+                            packet was queued).
+    \retval -2              Address not found, query generated or packet
+                            queued for when the reply comes in.
     \retval -3              Error allocating memory.
 */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
@@ -335,7 +408,7 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
     This function looks for an IP for a given mac address; note that if this
     fails, you have no recourse.
 
-    \param  nif             The network device in use.
+    \param  nif             The network device in use, or NULL for any.
     \param  ip_out          Storage for the IPv4 address.
     \param  mac_in          The MAC address to look up.
 
@@ -365,6 +438,29 @@ int net_arp_input(netif_t *nif, const uint8_t *pkt, int len);
 */
 int net_arp_query(netif_t *nif, const uint8_t ip[4]);
 
+/** \brief   ARP cache statistics.
+    \ingroup networking_arp
+
+    This structure contains statistics about the ARP cache since it was last
+    initialized.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_arp_stats {
+    uint32_t  lookups;                /**< \brief Calls to net_arp_lookup() */
+    uint32_t  hits;                   /**< \brief Lookups that found a MAC */
+    uint32_t  misses;                 /**< \brief Lookups that did not */
+    uint32_t  pending_queued;         /**< \brief Packets held for a reply */
+    uint32_t  pending_dropped;        /**< \brief Held packets thrown away */
+} net_arp_stats_t;
+
+/** \brief   Retrieve statistics from the ARP cache.
+    \ingroup networking_arp
+
+    \return                 The ARP cache statistics.
+*/
+net_arp_stats_t net_arp_get_stats(void);
+
 
 /***** net_input.c *********************************************************/
 
@@ -399,6 +495,36 @@ extern net_input_func net_input_target;
 */
 int net_input(netif_t *device, const uint8_t *data, int len);
 
+/** \brief   Submit a received packet buffer to the network stack.
+    \ingroup networking_drivers
+
+    This is the zero-copy variant of net_input(). The stack takes its own
+    reference on the buffer if it needs to queue the data, so the caller still
+    owns (and must free) its reference once this returns.
+
+    \param  device          The network device submitting packets.
+    \param  pkt             The packet to submit.
+
+    \return                 0 on success, <0 on failure.
+*/
+int net_input_pbuf(netif_t *device, net_pbuf_t *pkt);
+
+/** \brief   Submit a batch of received packet buffers to the network stack.
+    \ingroup networking_drivers
+
+    This works like calling net_input_pbuf() on each of the packets in order,
+    but lets drivers that drain their receive queues in one go (rather than
+    taking a trip through the scheduler per packet) hand everything over at
+    once. As with net_input_pbuf(), the caller still owns the buffers.
+
+    \param  device          The network device submitting packets.
+    \param  pkts            The packets to submit.
+    \param  count           The number of packets in pkts.
+
+    \return                 0 on success, <0 on failure.
+*/
+int net_input_batch(netif_t *device, net_pbuf_t **pkts, int count);
+
 /** \brief   Setup a network input target.
     \ingroup networking_drivers
 
@@ -537,6 +663,49 @@ uint32_t __pure net_ipv4_address(const uint8_t addr[4]);
 */
 void net_ipv4_parse_address(uint32_t addr, uint8_t out[4]);
 
+/***** net_checksum.c *****************************************************/
+
+/** \brief   Calculate an Internet checksum over a block of data.
+    \ingroup networking_ipv4
+
+    This computes the standard 16-bit one's complement checksum used by IPv4,
+    ICMP, UDP and TCP. The data may be at any alignment, but it is fastest when
+    it is 32-bit aligned.
+
+    \param  data            The data to checksum.
+    \param  bytes           The number of bytes of data.
+    \param  start           A partial sum to start with (for instance, the
+                            complemented result of a previous call or the sum
+                            of a pseudo-header), or 0.
+
+    \return                 The checksum, in the same byte order as the data.
+*/
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes,
+                                  uint16_t start);
+
+/** \brief   Copy a block of data and calculate its Internet checksum.
+    \ingroup networking_ipv4
+
+    This is equivalent to a memcpy() followed by net_ipv4_checksum() on the
+    copy, but only goes through the data once. It is fastest when the source is
+    32-bit aligned and the destination is 16-bit aligned.
+
+    When building a checksum up out of several pieces, pass the complemented
+    result of the previous piece as start. If a piece starts at an odd offset
+    into the checksummed data, the bytes of its (complemented) result must be
+    swapped before adding it in.
+
+    \param  dst             Where to copy the data to.
+    \param  src             The data to copy and checksum.
+    \param  bytes           The number of bytes of data.
+    \param  start           A partial sum to start with, or 0.
+
+    \return                 The checksum of the data, as net_ipv4_checksum()
+                            would return it.
+*/
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
+
 /***** net_icmp6.c ********************************************************/
 
 /** \defgroup networking_icmpv6     ICMPv6
@@ -792,6 +961,8 @@ typedef struct net_udp_stats {
     uint32_t  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32_t  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32_t  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32_t  pkt_recv_dropped;       /**< \brief Packets dropped because the
+                                                  socket's buffer was full */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
@@ -800,6 +971,20 @@ typedef struct net_udp_stats {
 */
 net_udp_stats_t net_udp_get_stats(void);
 
+/** \brief  Run a network thread callback when a UDP socket gets data.
+
+    This is for the parts of the network stack that run their own sockets from
+    the network thread, like DHCP, so that they can sleep until a datagram
+    arrives rather than checking the socket every so often.
+
+    \param  sock            The UDP socket.
+    \param  cbid            The callback to run, or 0 for none.
+    \retval 0               On success.
+    \retval -1              On error, with errno set to EBADF if sock is not a
+                            UDP socket.
+*/
+int net_udp_set_thd_cb(int sock, int cbid);
+
 /** \brief  Init UDP.
 
     \retval 0               On success (no error conditions defined).
@@ -919,6 +1104,204 @@ void net_multicast_shutdown(void);
 
 /** @} */
 
+/***** net_pbuf.c *********************************************************/
+
+/** \brief   Set up the packet buffer pool.
+    \ingroup networking_drivers
+
+    This is done by net_init(), and by drivers that allocate buffers from their
+    interrupt handlers, since those can only come from the pool. Calling it
+    again once the pool is set up does nothing.
+
+    \retval 0               On success.
+    \retval -1              If the pool couldn't be allocated.
+*/
+int net_pbuf_init(void);
+
+/** \brief   Free the packet buffer pool.
+    \ingroup networking_drivers
+
+    The pool is only freed once every buffer taken from it has been released.
+*/
+void net_pbuf_shutdown(void);
+
+/** \brief   Allocate a packet buffer.
+    \ingroup networking_drivers
+
+    Buffers that fit are taken from a preallocated pool, so this is safe to
+    call from an interrupt handler (as long as the pool has been set up with
+    net_pbuf_init() and is not exhausted).
+
+    \param  headroom        Space to reserve in front of the data, in bytes.
+    \param  len             Initial length of the data, in bytes.
+
+    \return                 The new buffer, or NULL on failure.
+*/
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len);
+
+/** \brief   Take a reference on a packet buffer.
+    \ingroup networking_drivers
+
+    \param  pkt             The buffer in question.
+    \return                 The same buffer.
+*/
+net_pbuf_t *net_pbuf_ref(net_pbuf_t *pkt);
+
+/** \brief   Drop a reference on a packet buffer.
+    \ingroup networking_drivers
+
+    The buffer is returned to the pool (or freed) once the last reference is
+    dropped. Passing NULL is allowed.
+
+    \param  pkt             The buffer in question.
+*/
+void net_pbuf_free(net_pbuf_t *pkt);
+
+/** \brief   Prepend space to the data of a packet buffer.
+    \ingroup networking_drivers
+
+    \param  pkt             The buffer in question.
+    \param  n               The number of bytes to prepend.
+    \return                 The new start of the data, or NULL if there is not
+                            enough headroom.
+*/
+uint8_t *net_pbuf_push(net_pbuf_t *pkt, size_t n);
+
+/** \brief   Strip bytes from the front of a packet buffer.
+    \ingroup networking_drivers
+
+    \param  pkt             The buffer in question.
+    \param  n               The number of bytes to strip.
+    \return                 The new start of the data, or NULL if the buffer
+                            holds less than n bytes.
+*/
+uint8_t *net_pbuf_pull(net_pbuf_t *pkt, size_t n);
+
+/** \brief   Wrap existing memory in a (borrowed) packet buffer.
+    \ingroup networking_drivers
+
+    The resulting buffer does not own its storage and is only valid for as long
+    as the memory it points to; it must not be passed to net_pbuf_free().
+
+    \param  pkt             The buffer to initialize.
+    \param  data            The memory to wrap.
+    \param  len             The length of the memory, in bytes.
+    \return                 pkt.
+*/
+net_pbuf_t *net_pbuf_wrap(net_pbuf_t *pkt, const uint8_t *data, size_t len);
+
+/** \brief   Keep a part of a packet buffer for later use.
+    \ingroup networking_drivers
+
+    If pkt owns its storage, a reference is taken on it. Otherwise (pkt is NULL
+    or borrowed, or the buffer pool is running low), the len bytes at *data are
+    copied into a new buffer and *data is updated to point into it.
+
+    \param  pkt             The buffer holding the data, or NULL.
+    \param  data            Pointer to the start of the data to keep.
+    \param  len             Length of the data to keep, in bytes.
+    \return                 A buffer to pass to net_pbuf_free() when done, or
+                            NULL if out of memory.
+*/
+net_pbuf_t *net_pbuf_hold(net_pbuf_t *pkt, const uint8_t **data, size_t len);
+
+/***** net_capture.c ******************************************************/
+
+/** \defgroup networking_capture    Packet Capture
+    \brief                          Capturing frames to a pcap file
+    \ingroup                        networking
+
+    Frames can be captured as they are handed to and received from the network
+    devices, and written out in the pcap or pcapng formats to any path on the
+    VFS. Frames are copied into a ring buffer by whatever sends or receives them
+    (possibly in an interrupt) and written to the file by a thread of its own,
+    so the file system never gets in the way of the network stack. If that
+    thread falls behind, frames are dropped from the capture rather than
+    holding up the network.
+
+    @{
+*/
+
+/** \brief  Capture frames received by a device. */
+#define NET_CAPTURE_RX      0x00000001
+
+/** \brief  Capture frames sent by a device. */
+#define NET_CAPTURE_TX      0x00000002
+
+/** \brief  Write a classic pcap file. */
+#define NET_CAPTURE_PCAP    0
+
+/** \brief  Write a pcapng file (records the device and direction of frames). */
+#define NET_CAPTURE_PCAPNG  1
+
+/** \brief   Packet capture options.
+
+    Zero any fields that you don't care about. The filter fields are all
+    optional; a frame is captured only if it matches all of the ones given.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_capture_opts {
+    int         format;     /**< \brief NET_CAPTURE_PCAP or NET_CAPTURE_PCAPNG */
+    size_t      snaplen;    /**< \brief Bytes kept per frame (0 = all) */
+    size_t      ring_size;  /**< \brief Ring buffer size (0 = 128KiB) */
+    uint32_t    dir;        /**< \brief NET_CAPTURE_RX/TX (0 = both) */
+    netif_t     *netif;     /**< \brief Only this device (NULL = any) */
+    uint16_t    ethertype;  /**< \brief Only this ethertype (0 = any) */
+    uint8_t     ip_proto;   /**< \brief Only this IP protocol (0 = any) */
+    uint16_t    port;       /**< \brief TCP/UDP port, host order (0 = any) */
+} net_capture_opts_t;
+
+/** \brief   Packet capture statistics.
+
+    This structure contains statistics about the running (or last) capture.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_capture_stats {
+    uint32_t    captured;   /**< \brief Frames put in the ring buffer */
+    uint32_t    filtered;   /**< \brief Frames that didn't match the filter */
+    uint32_t    dropped;    /**< \brief Frames lost to a full ring buffer */
+    uint64_t    bytes;      /**< \brief Bytes written to the file */
+} net_capture_stats_t;
+
+/** \brief   Start capturing frames.
+
+    Only one capture can be running at a time.
+
+    \param  path            The file to write the capture to. It will be
+                            created or truncated as needed.
+    \param  opts            Capture options, or NULL for the defaults (a pcap
+                            file of whole frames, on all devices).
+
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EBUSY - a capture is already running \n
+    \em     EINVAL - the options are invalid \n
+    \em     ENOMEM - out of memory \n
+    Any error from opening the file.
+*/
+int net_capture_start(const char *path, const net_capture_opts_t *opts);
+
+/** \brief   Stop capturing frames.
+
+    Everything captured so far is written out and the file is closed.
+
+    \retval 0               On success.
+    \retval -1              If no capture was running.
+*/
+int net_capture_stop(void);
+
+/** \brief   Retrieve statistics about the running (or last) capture.
+
+    \param  stats           Where to store the statistics.
+*/
+void net_capture_get_stats(net_capture_stats_t *stats);
+
+/** @} */
+
 /***** net_core.c *********************************************************/
 
 /** \brief   Interface list; note: do not manipulate directly!
@@ -968,6 +1351,20 @@ int net_reg_device(netif_t *device);
 */
 int net_unreg_device(netif_t *device);
 
+/** \brief   Transmit a packet buffer on a network device.
+    \ingroup networking_drivers
+
+    Uses the device's if_tx_pbuf callback if present, falling back to if_tx
+    otherwise. The caller keeps its reference on the buffer.
+
+    \param  net             The device to transmit on.
+    \param  pkt             The packet to transmit.
+    \param  blocking        1 if we should block if needed, 0 otherwise.
+
+    \return                 A NETIF_TX_* value.
+*/
+int net_if_tx_pbuf(netif_t *net, net_pbuf_t *pkt, int blocking);
+
 /** \brief   Init network support.
     \ingroup networking_drivers
 
@@ -202,6 +202,43 @@ struct hostent *gethostbyname(const char *name);
 */
 struct hostent *gethostbyname2(const char *name, int af);
 
+/** \brief   DNS cache statistics.
+    \ingroup network_db
+
+    This structure contains statistics about the cache of DNS answers used by
+    getaddrinfo() (and thus gethostbyname() too). Each name looked up counts
+    once per address family.
+
+    \headerfile netdb.h
+*/
+typedef struct dns_cache_stats {
+    uint32_t lookups;       /**< \brief Names looked up through DNS */
+    uint32_t hits;          /**< \brief Answered from the cache */
+    uint32_t neg_hits;      /**< \brief Answered "no such name" from the cache */
+    uint32_t misses;        /**< \brief Had to ask the server */
+    uint32_t expired;       /**< \brief Misses due to a stale entry */
+    uint32_t coalesced;     /**< \brief Waited on another thread's query */
+    uint32_t entries;       /**< \brief Names currently in the cache */
+} dns_cache_stats_t;
+
+/** \brief   Retrieve statistics from the DNS cache.
+    \ingroup network_db
+
+    This function is a KOS extension.
+
+    \param  stats           Where to store the statistics.
+*/
+void dns_cache_get_stats(dns_cache_stats_t *stats);
+
+/** \brief   Throw away everything in the DNS cache.
+    \ingroup network_db
+
+    After this, every name has to be looked up from the server again. The
+    cache is also thrown away by itself whenever the DNS server changes. This
+    function is a KOS extension.
+*/
+void dns_cache_flush(void);
+
 __END_DECLS
 
 #endif /* !__NETDB_H */
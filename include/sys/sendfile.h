@@ -0,0 +1,67 @@
+/* KallistiOS ##version##
+
+   sys/sendfile.h
+
+*/
+
+/** \file    sys/sendfile.h
+    \brief   Sending files over sockets.
+    \ingroup networking_sockets
+
+    This file contains the sendfile() function, which sends data from a file
+    out over a socket without it having to pass through a buffer of the
+    caller's.
+*/
+
+#ifndef __SYS_SENDFILE_H
+#define __SYS_SENDFILE_H
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+/** \addtogroup networking_sockets
+    @{
+*/
+
+/** \brief  Send data from a file over a socket (non-standard).
+
+    This function sends up to count bytes from the file in_fd out over the
+    socket out_fd. On filesystems that support fs_mmap() (such as the romdisk
+    and ramdisk), the data is handed to the socket straight out of the file's
+    own storage, so nothing is copied until it goes into the socket's send
+    buffer. On all others, the file is read in large blocks internally.
+
+    Unless the socket is non-blocking, this function blocks until all of the
+    data has been sent.
+
+    \param  out_fd      The socket to send on.
+    \param  in_fd       The file to send data from.
+    \param  offset      If not NULL, the offset in the file to start sending
+                        from. This is updated to just past the last byte sent,
+                        and the file's own position is left alone. If NULL,
+                        sending starts at the file's current position, which
+                        is then moved past the data sent.
+    \param  count       The most bytes to send.
+    \return             The number of bytes sent, which is only less than
+                        count if the end of the file was reached or an error
+                        occurred after some data was sent. -1 on error, with
+                        errno set appropriately.
+
+    \par    Error Conditions:
+    \em     EBADF - out_fd or in_fd is not a valid file descriptor \n
+    \em     ENOTSOCK - out_fd is not a socket \n
+    \em     EINVAL - the offset is negative \n
+    \em     ENOMEM - out of memory for the internal read buffer \n
+    \em     EWOULDBLOCK - the socket is non-blocking and its send buffer is
+            full \n
+    \em     Any error the socket's send function can return
+*/
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* __SYS_SENDFILE_H */
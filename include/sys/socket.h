@@ -87,6 +87,37 @@ struct sockaddr_storage {
     char _ss_pad2[_SS_PAD2SIZE];
 };
 
+/** \brief  Message header structure.
+
+    This structure describes a message to be sent or received with sendmsg() or
+    recvmsg(). The data of the message is scattered across (or gathered from)
+    the I/O vectors pointed to by msg_iov. Ancillary data is not currently
+    supported, so msg_controllen is always set to 0 on return from recvmsg().
+
+    \headerfile sys/socket.h
+*/
+struct msghdr {
+    void *msg_name;             /**< \brief Optional address */
+    socklen_t msg_namelen;      /**< \brief Size of address */
+    struct iovec *msg_iov;      /**< \brief Scatter/gather array */
+    int msg_iovlen;             /**< \brief Members in msg_iov */
+    void *msg_control;          /**< \brief Ancillary data (U) */
+    socklen_t msg_controllen;   /**< \brief Ancillary data buffer length */
+    int msg_flags;              /**< \brief Flags on received message */
+};
+
+/** \brief  Batched message header structure (non-standard).
+
+    This structure describes one of the messages sent or received by a single
+    call to sendmmsg() or recvmmsg().
+
+    \headerfile sys/socket.h
+*/
+struct mmsghdr {
+    struct msghdr msg_hdr;      /**< \brief The message itself */
+    unsigned int msg_len;       /**< \brief Bytes sent or received */
+};
+
 /** \brief  Datagram socket type.
 
     This socket type specifies that the socket in question transmits datagrams
@@ -168,9 +199,10 @@ struct sockaddr_storage {
 #define MSG_EOR         0x04    /**< \brief Terminate a record (U) */
 #define MSG_OOB         0x08    /**< \brief Out-of-band data (U) */
 #define MSG_PEEK        0x10    /**< \brief Leave received data in queue */
-#define MSG_TRUNC       0x20    /**< \brief Normal data truncated (U) */
+#define MSG_TRUNC       0x20    /**< \brief Normal data truncated */
 #define MSG_WAITALL     0x40    /**< \brief Attempt to fill read buffer */
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
+#define MSG_WAITFORONE  0x100   /**< \brief Only block for the first message of recvmmsg() (non-standard) */
 /** @} */
 
 /** \addtogroup networking_sockets
@@ -339,6 +371,83 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Receive a message on a socket, scattering it into a set of buffers.
+
+    This function receives a message from a peer, storing the data into the
+    I/O vectors described by the message header. On a datagram socket, one
+    datagram is received per call and MSG_TRUNC is set in msg_flags if it did
+    not fit in the buffers given.
+
+    \param  socket      The socket to receive on.
+    \param  message     The message header describing where to store the
+                        message and the address of the peer.
+    \param  flags       The type of message reception.
+
+    \return             On success, the length of the message in bytes. If no
+                        messages are available, and the socket has been shut
+                        down, 0. On error, -1, and sets errno as appropriate.
+*/
+ssize_t recvmsg(int socket, struct msghdr *message, int flags);
+
+/** \brief  Send a message on a socket, gathering it from a set of buffers.
+
+    This function sends a message to a peer, with the data of the message
+    taken from the I/O vectors described by the message header. On a datagram
+    socket, all of the vectors are sent as one datagram.
+
+    \param  socket      The socket to send on.
+    \param  message     The message header describing the message and the
+                        address of the peer (if the socket isn't connected).
+    \param  flags       The type of message transmission. Set to 0 for now.
+
+    \return             On success, the number of bytes sent. On error, -1,
+                        and sets errno as appropriate.
+*/
+ssize_t sendmsg(int socket, const struct msghdr *message, int flags);
+
+struct timespec;
+
+/** \brief  Receive multiple messages on a socket (non-standard).
+
+    This function receives up to vlen messages in one call, filling in the
+    msg_len field of each message that is received. On datagram sockets, the
+    whole batch is pulled off of the socket's queue under a single lock, which
+    is significantly cheaper than calling recvmsg() repeatedly.
+
+    Unless the socket is non-blocking or MSG_DONTWAIT is set, this function
+    blocks until vlen messages have been received. With MSG_WAITFORONE, it
+    only blocks for the first one and returns whatever else is already queued.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The array of messages to fill in.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message reception.
+    \param  timeout     If not NULL, the longest time to wait for messages.
+                        Only datagram sockets honor this.
+
+    \return             On success, the number of messages received. On
+                        error, -1, and sets errno as appropriate.
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
+/** \brief  Send multiple messages on a socket (non-standard).
+
+    This function sends up to vlen messages in one call, filling in the msg_len
+    field of each message that is sent. On datagram sockets, the socket is only
+    locked once for the whole batch.
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The array of messages to send.
+    \param  vlen        The number of messages in msgvec.
+    \param  flags       The type of message transmission. Set to 0 for now.
+
+    \return             On success, the number of messages sent, which may be
+                        less than vlen. If the first message could not be
+                        sent, -1, and sets errno as appropriate.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
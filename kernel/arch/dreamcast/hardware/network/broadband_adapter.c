@@ -463,15 +463,18 @@ static void g2_read_block_8_fast(uint8 *dst, uint8 *src, int len) {
 }
 
 
-#define RXBSZ    (64*1024) /* must be a power of two */
-#define MAX_PKTS (RXBSZ / 32)
-static struct pkt {
-    int pkt_size;
-    uint8 * rxbuff;
-} rx_pkt[MAX_PKTS];
-
-static uint8 rxbuff[RXBSZ + 2 * 1600] __attribute__((aligned(32)));
-static uint32 rxbuff_pos;
+/* Received packets are copied out of the chip into packet buffers, which are
+   then handed up to the network stack as-is. */
+#define MAX_PKTS 32
+static net_pbuf_t *rx_pkt[MAX_PKTS];
+
+/* Headroom in front of received packets. The DMA copy needs to be able to
+   start up to 31 bytes early to keep everything 32-byte aligned. */
+#define RX_HEADROOM 32
+
+/* Most packets handed up to the network stack in one go. */
+#define RX_BUDGET 16
+
 static int rxin;
 static int rxout;
 static int dma_used;
@@ -483,7 +486,14 @@ static semaphore_t bba_rx_sema;
 static int bba_rx_exit_thread;
 static semaphore_t bba_rx_sema2;
 
+/* Set while there are packets queued up that the RX thread has been woken for
+   and hasn't finished with yet. Receive interrupts are kept off meanwhile, so
+   that a burst of packets costs one wakeup instead of one per packet. */
+static volatile int rx_wake;
+
 static void bba_rx(void);
+static void bba_if_netinput(uint8 *pkt, int pktsize);
+extern netif_t bba_if;
 
 static semaphore_t tx_sema;
 
@@ -491,6 +501,16 @@ static uint8 * next_dst;
 static uint8 * next_src;
 static int next_len;
 
+/* Turn the receive interrupt on or off, leaving the others alone. */
+static void rx_intr_enable(int on) {
+    uint16 mask = g2_read_16(NIC(RT_INTRMASK));
+
+    if(on)
+        g2_write_16(NIC(RT_INTRMASK), mask | RT_INT_RX_OK);
+    else
+        g2_write_16(NIC(RT_INTRMASK), mask & ~RT_INT_RX_OK);
+}
+
 static void rx_finish_enq(int room) {
     /* Tell the chip where we are for overflow checking */
     rtl.cur_rx = (rtl.cur_rx + rx_size + 4 + 3) & ~3;
@@ -498,8 +518,18 @@ static void rx_finish_enq(int room) {
 
     if(room > 0 && (((rxin + 1) % MAX_PKTS) != rxout)) {
         rxin = (rxin + 1) % MAX_PKTS;
-        sem_signal(&bba_rx_sema);
-        thd_schedule(true);
+
+        /* If the RX thread is already awake, it'll get to this one too. */
+        if(!rx_wake) {
+            rx_wake = 1;
+            rx_intr_enable(0);
+            sem_signal(&bba_rx_sema);
+            thd_schedule(true);
+        }
+    }
+    else if(rx_pkt[rxin]) {
+        net_pbuf_free(rx_pkt[rxin]);
+        rx_pkt[rxin] = NULL;
     }
 }
 
@@ -585,27 +615,85 @@ static int  bba_copy_packet(uint8 * dst, uint32 src, int len) {
 }
 
 static int rx_enq(int ring_offset, size_t pkt_size) {
+    net_pbuf_t *pkt;
+    uint8 *dst;
+
     /* If there's no one to receive it, don't bother. */
-    if(eth_rx_callback) {
-        if(rxin != rxout &&
-                (((rx_pkt[rxout].rxbuff - (rxbuff + 32)) - rxbuff_pos) & (RXBSZ - 1)) < pkt_size + 2048) {
-            return -1;
-        }
+    if(!eth_rx_callback)
+        return -1;
 
-        /* Receive buffer: temporary space to copy out received data */
+    /* Drop the packet if the queue is full or we're out of buffers. */
+    if(((rxin + 1) % MAX_PKTS) == rxout)
+        return -1;
 
-        if(__is_defined(USE_P2_AREA))
-            rx_pkt[rxin].rxbuff = rxbuff + 32 + (rxbuff_pos | MEM_AREA_P2_BASE) + (ring_offset & 31);
-        else
-            rx_pkt[rxin].rxbuff = rxbuff + 32 + rxbuff_pos + (ring_offset & 31);
+    /* Give the data the same alignment within a cache line as it has in the
+       chip's ring buffer, so that the DMA can be done in whole blocks. */
+    if(!(pkt = net_pbuf_alloc(RX_HEADROOM + (ring_offset & 31), pkt_size)))
+        return -1;
 
-        rxbuff_pos = (rxbuff_pos + pkt_size + 63) & (RXBSZ - 32);
+    dst = pkt->data;
 
-        rx_pkt[rxin].pkt_size = pkt_size;
-        return bba_copy_packet(rx_pkt[rxin].rxbuff, ring_offset, pkt_size);
+    if(__is_defined(USE_P2_AREA)) {
+        /* The pool buffer may have dirty lines in the cache from its previous
+           use, get rid of them before writing through P2. Only the copy goes
+           through P2, the buffer itself stays in P1 for the rest of the stack
+           to use. */
+        dcache_purge_range((uint32)pkt->buf, pkt->size);
+        dst = (uint8 *)(((uint32)dst & MEM_AREA_CACHE_MASK) | MEM_AREA_P2_BASE);
     }
-    else
-        return 1;
+
+    rx_pkt[rxin] = pkt;
+    return bba_copy_packet(dst, ring_offset, pkt_size);
+}
+
+/* Take up to max packets off of the receive queue. Once it has been emptied,
+   have another look at the chip for anything that arrived while receive
+   interrupts were off, and only turn them back on if there's nothing. */
+static int rx_dequeue(net_pbuf_t **pkts, int max) {
+    irq_mask_t old;
+    int cnt;
+
+    old = irq_disable();
+
+    if(rxout == rxin) {
+        rx_wake = 1;
+        g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_OK);
+
+        if(!dma_used)
+            bba_rx();
+    }
+
+    for(cnt = 0; cnt < max && rxout != rxin; ++cnt) {
+        pkts[cnt] = rx_pkt[rxout];
+        rx_pkt[rxout] = NULL;
+        rxout = (rxout + 1) % MAX_PKTS;
+    }
+
+    /* Anything that comes in from here on (including a DMA that is still in
+       progress) will wake the thread back up. */
+    if(!cnt) {
+        rx_wake = 0;
+        rx_intr_enable(1);
+    }
+
+    irq_restore(old);
+    return cnt;
+}
+
+/* Hand a batch of received packets to whoever wants them, and release them. */
+static void rx_deliver(net_pbuf_t **pkts, int cnt) {
+    int i;
+
+    if(eth_rx_callback == bba_if_netinput) {
+        net_input_batch(&bba_if, pkts, cnt);
+    }
+    else if(eth_rx_callback) {
+        for(i = 0; i < cnt; ++i)
+            eth_rx_callback(pkts[i]->data, pkts[i]->len);
+    }
+
+    for(i = 0; i < cnt; ++i)
+        net_pbuf_free(pkts[i]);
 }
 
 /* Transmit a single packet */
@@ -700,6 +788,9 @@ void bba_unlock(void) {
 }
 
 static void *bba_rx_threadfunc(void *dummy) {
+    net_pbuf_t *pkts[RX_BUDGET];
+    int cnt;
+
     (void)dummy;
 
     while(!bba_rx_exit_thread) {
@@ -711,13 +802,10 @@ static void *bba_rx_threadfunc(void *dummy) {
 
         bba_lock();
 
-        if(rxout != rxin) {
-
-            /* Call the callback to process it */
-            eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
-
-            rxout = (rxout + 1) % MAX_PKTS;
-        }
+        /* Keep handing packets up until there are none left, both in our
+           queue and in the chip. */
+        while((cnt = rx_dequeue(pkts, RX_BUDGET)))
+            rx_deliver(pkts, cnt);
 
         bba_unlock();
     }
@@ -745,6 +833,11 @@ static void bba_rx(void) {
         }
 
         if((rx_status & 1) && (pkt_size <= 1514)) {
+            /* If our queue is full, leave the rest in the chip's ring buffer
+               for the RX thread to pick up once it has made some room. */
+            if(eth_rx_callback && ((rxin + 1) % MAX_PKTS) == rxout)
+                break;
+
             /* Add it to the rx queue */
             int res = rx_enq(ring_offset + 4, pkt_size);
 
@@ -919,6 +1012,7 @@ static int bba_if_start(netif_t *self) {
     assert(bba_rx_thread == NULL);
     sem_init(&bba_rx_sema, 0);
     sem_init(&bba_rx_sema2, 1);
+    rx_wake = 0;
     bba_rx_thread = thd_create(0, bba_rx_threadfunc, 0);
     bba_rx_thread->prio = 1;
     thd_set_label(bba_rx_thread, "BBA-rx-thd");
@@ -983,7 +1077,8 @@ static int bba_if_tx_commit(netif_t *self) {
 }
 
 static int bba_if_rx_poll(netif_t *self) {
-    int intr;
+    net_pbuf_t *pkts[RX_BUDGET];
+    int intr, cnt;
 
     (void)self;
 
@@ -996,12 +1091,8 @@ static int bba_if_rx_poll(netif_t *self) {
         g2_write_16(NIC(RT_INTRSTATUS), RT_INT_RX_ACK);
     }
 
-    if(rxout != rxin) {
-        /* Call the callback to process it */
-        eth_rx_callback(rx_pkt[rxout].rxbuff, rx_pkt[rxout].pkt_size);
-
-        rxout = (rxout + 1) % MAX_PKTS;
-    }
+    if((cnt = rx_dequeue(pkts, RX_BUDGET)))
+        rx_deliver(pkts, cnt);
 
     return 0;
 }
@@ -1118,6 +1209,11 @@ int bba_init(void) {
         return -1;
     }
 
+    /* Packets are received into buffers from the pool in the interrupt
+       handler, so make sure there is one, even without the network stack. */
+    if(net_pbuf_init() < 0)
+        dbglog(DBG_ERROR, "bba: can't allocate receive buffers\n");
+
     bba_get_mac(bba_if.mac_addr);
     memset(bba_if.ip_addr, 0, sizeof(bba_if.ip_addr));
     memset(bba_if.netmask, 0, sizeof(bba_if.netmask));
@@ -0,0 +1,299 @@
+/* KallistiOS ##version##
+
+   pvr_batch.c
+
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   State-sorted quad batching
+
+   Quads are kept in the order they come in, and strung together into runs
+   that share a header. When any order will do, there's one run per header,
+   so each header is sent exactly once. When the order matters, a quad joins
+   the closest earlier run with its header as long as it doesn't overlap any
+   of the runs after that one, and otherwise starts a new run at the end. Only
+   the last few runs are looked at, to keep adding a quad cheap.
+
+   Quads are sent straight from where they were put when added, so nothing
+   gets copied around when they're sorted.
+
+*/
+
+/* How many runs back a quad may move, when the order matters. */
+#define BATCH_LOOKBACK  32
+
+#define QUAD_SIZE       128
+
+typedef struct batch_run {
+    int32_t head, tail;         /* First and last quads in the run */
+    int state;
+    float x0, y0, x1, y1;       /* Bounding box of the quads in it */
+} batch_run_t;
+
+struct pvr_batch {
+    int keep_order;
+
+    pvr_poly_hdr_t *states;
+    uint8_t *sprite;            /* Set for states with a sprite header */
+    int16_t *hash;
+    size_t nstates, max_states, hash_mask;
+    int32_t *state_run;         /* Each state's run, when any order will do */
+
+    uint8_t *quads;
+    int32_t *next;              /* Next quad in the same run */
+    size_t nquads, max_quads;
+
+    batch_run_t *runs;
+    size_t nruns;
+};
+
+pvr_batch_t *pvr_batch_create(pvr_list_t list, size_t max_quads,
+                              size_t max_states, int flags) {
+    pvr_batch_t *b;
+    size_t hsize;
+
+    if(!max_quads || !max_states || max_states > INT16_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(b = (pvr_batch_t *)calloc(1, sizeof(pvr_batch_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(hsize = 16; hsize < max_states * 2; hsize <<= 1)
+        ;
+
+    b->max_quads = max_quads;
+    b->max_states = max_states;
+    b->hash_mask = hsize - 1;
+
+    if(flags & PVR_BATCH_KEEP_ORDER)
+        b->keep_order = 1;
+    else if(!(flags & PVR_BATCH_ANY_ORDER))
+        b->keep_order = list == PVR_LIST_TR_POLY || list == PVR_LIST_TR_MOD;
+
+    b->states = aligned_alloc(32, max_states * sizeof(pvr_poly_hdr_t));
+    b->sprite = (uint8_t *)malloc(max_states);
+    b->hash = (int16_t *)malloc(hsize * sizeof(int16_t));
+    b->state_run = (int32_t *)malloc(max_states * sizeof(int32_t));
+    b->quads = aligned_alloc(32, max_quads * QUAD_SIZE);
+    b->next = (int32_t *)malloc(max_quads * sizeof(int32_t));
+    b->runs = (batch_run_t *)malloc(max_quads * sizeof(batch_run_t));
+
+    if(!b->states || !b->sprite || !b->hash || !b->state_run || !b->quads ||
+       !b->next || !b->runs) {
+        pvr_batch_destroy(b);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pvr_batch_reset(b);
+
+    return b;
+}
+
+void pvr_batch_destroy(pvr_batch_t *b) {
+    if(!b)
+        return;
+
+    free(b->states);
+    free(b->sprite);
+    free(b->hash);
+    free(b->state_run);
+    free(b->quads);
+    free(b->next);
+    free(b->runs);
+    free(b);
+}
+
+void pvr_batch_reset(pvr_batch_t *b) {
+    size_t i;
+
+    memset(b->hash, 0xff, (b->hash_mask + 1) * sizeof(int16_t));
+
+    for(i = 0; i < b->max_states; ++i)
+        b->state_run[i] = -1;
+
+    b->nstates = 0;
+    b->nquads = 0;
+    b->nruns = 0;
+}
+
+int pvr_batch_state(pvr_batch_t *b, const pvr_poly_hdr_t *hdr) {
+    const uint32_t *w = (const uint32_t *)hdr;
+    uint32_t h = 2166136261U;
+    size_t i;
+    int s;
+
+    for(i = 0; i < sizeof(pvr_poly_hdr_t) / 4; ++i)
+        h = (h ^ w[i]) * 16777619U;
+
+    for(i = h & b->hash_mask; (s = b->hash[i]) >= 0; i = (i + 1) & b->hash_mask) {
+        if(!memcmp(&b->states[s], hdr, sizeof(pvr_poly_hdr_t)))
+            return s;
+    }
+
+    if(b->nstates == b->max_states)
+        return -1;
+
+    s = b->nstates++;
+    memcpy(&b->states[s], hdr, sizeof(pvr_poly_hdr_t));
+    b->sprite[s] = (hdr->cmd >> 29) == PVR_HDR_SPRITE;
+    b->hash[i] = s;
+
+    return s;
+}
+
+/* Where the x of each corner of a quad is, in words. */
+static const uint8_t poly_xy[4] = { 1, 9, 17, 25 };
+static const uint8_t sprite_xy[4] = { 1, 4, 7, 10 };
+
+static inline int batch_overlap(const batch_run_t *r, float x0, float y0,
+                                float x1, float y1) {
+    return x0 <= r->x1 && x1 >= r->x0 && y0 <= r->y1 && y1 >= r->y0;
+}
+
+/* Start a new run at the end with one quad in it. */
+static void batch_new_run(pvr_batch_t *b, int state, int32_t q, float x0,
+                          float y0, float x1, float y1) {
+    batch_run_t *r = &b->runs[b->nruns];
+
+    r->head = r->tail = q;
+    r->state = state;
+    r->x0 = x0;
+    r->y0 = y0;
+    r->x1 = x1;
+    r->y1 = y1;
+
+    b->state_run[state] = b->nruns++;
+}
+
+int pvr_batch_add(pvr_batch_t *b, int state, const void *quad) {
+    const uint8_t *xy;
+    uint32_t *dst;
+    batch_run_t *r;
+    float x0, y0, x1, y1, x, y;
+    int32_t q, i, stop;
+
+    if(state < 0 || (size_t)state >= b->nstates) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(b->nquads == b->max_quads) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    q = b->nquads++;
+    dst = (uint32_t *)(b->quads + q * QUAD_SIZE);
+    b->next[q] = -1;
+
+    if(b->sprite[state]) {
+        memcpy(dst, quad, sizeof(pvr_sprite_txr_t));
+        dst[0] = PVR_CMD_VERTEX_EOL;
+        xy = sprite_xy;
+    }
+    else {
+        memcpy(dst, quad, QUAD_SIZE);
+        dst[0] = dst[8] = dst[16] = PVR_CMD_VERTEX;
+        dst[24] = PVR_CMD_VERTEX_EOL;
+        xy = poly_xy;
+    }
+
+    /* Any order will do, so there's just one run per state. */
+    if(!b->keep_order) {
+        if(b->state_run[state] < 0) {
+            batch_new_run(b, state, q, 0.0f, 0.0f, 0.0f, 0.0f);
+        }
+        else {
+            r = &b->runs[b->state_run[state]];
+            b->next[r->tail] = q;
+            r->tail = q;
+        }
+
+        return 0;
+    }
+
+    x0 = x1 = ((float *)dst)[xy[0]];
+    y0 = y1 = ((float *)dst)[xy[0] + 1];
+
+    for(i = 1; i < 4; ++i) {
+        x = ((float *)dst)[xy[i]];
+        y = ((float *)dst)[xy[i] + 1];
+
+        if(x < x0) x0 = x;
+        if(x > x1) x1 = x;
+        if(y < y0) y0 = y;
+        if(y > y1) y1 = y;
+    }
+
+    /* Look back for a run with the same state that this quad can join
+       without jumping ahead of anything it overlaps. */
+    stop = (int32_t)b->nruns > BATCH_LOOKBACK ? b->nruns - BATCH_LOOKBACK : 0;
+
+    for(i = b->nruns - 1; i >= stop; --i) {
+        r = &b->runs[i];
+
+        if(r->state == state) {
+            b->next[r->tail] = q;
+            r->tail = q;
+
+            if(x0 < r->x0) r->x0 = x0;
+            if(y0 < r->y0) r->y0 = y0;
+            if(x1 > r->x1) r->x1 = x1;
+            if(y1 > r->y1) r->y1 = y1;
+
+            return 0;
+        }
+
+        if(batch_overlap(r, x0, y0, x1, y1))
+            break;
+    }
+
+    batch_new_run(b, state, q, x0, y0, x1, y1);
+
+    return 0;
+}
+
+int pvr_batch_submit(pvr_batch_t *b) {
+    batch_run_t *r;
+    size_t i, size;
+    int32_t q;
+    int rv;
+
+    for(i = 0, r = b->runs; i < b->nruns; ++i, ++r) {
+        if(pvr_prim(&b->states[r->state], sizeof(pvr_poly_hdr_t)) < 0)
+            break;
+
+        size = b->sprite[r->state] ? sizeof(pvr_sprite_txr_t) : QUAD_SIZE;
+
+        for(q = r->head; q >= 0; q = b->next[q]) {
+            if(pvr_prim(b->quads + q * QUAD_SIZE, size) < 0)
+                break;
+        }
+
+        if(q >= 0)
+            break;
+    }
+
+    /* Whatever didn't make it is dropped, since the list can't take it. */
+    rv = i < b->nruns ? -1 : (int)i;
+
+    for(i = 0, r = b->runs; i < b->nruns; ++i, ++r)
+        b->state_run[r->state] = -1;
+
+    b->nquads = 0;
+    b->nruns = 0;
+
+    return rv;
+}
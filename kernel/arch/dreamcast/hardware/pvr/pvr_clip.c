@@ -0,0 +1,294 @@
+/* KallistiOS ##version##
+
+   pvr_clip.c
+
+ */
+
+#include <errno.h>
+#include <dc/pvr.h>
+#include <dc/matrix.h>
+#include "pvr_internal.h"
+
+/*
+
+   Near plane clipping
+
+   Strips are walked one triangle at a time, with the last three vertices
+   kept around after they've been through the matrix. Each vertex gets an
+   outcode saying which side of the near plane and of the screen edges it's
+   on. Triangles that are all the way off one side are dropped, triangles
+   that are entirely in front of the near plane are sent on as part of a
+   strip, and the rest are clipped on their own and sent as a strip of three
+   or four vertices.
+
+   Every second triangle in a strip is wound the other way around, and the TA
+   knows that from where it is in the strip. So when a strip has to be started
+   again on one of those, the first vertex is sent twice, which puts the new
+   strip back in step with the old one at the cost of one empty triangle.
+
+   The last vertex is held back until the next one comes along, so that it can
+   be sent with the end of strip flag if it turns out to be the last one.
+
+*/
+
+#define CLIP_NEAR       0x01
+#define CLIP_LEFT       0x02
+#define CLIP_RIGHT      0x04
+#define CLIP_TOP        0x08
+#define CLIP_BOTTOM     0x10
+
+typedef struct clip_vtx {
+    float x, y, w;              /* After the matrix, before dividing */
+    int code;
+    const pvr_vertex_t *src;
+} clip_vtx_t;
+
+typedef struct clip_out {
+    pvr_vertex_t *dst;          /* NULL when going to the store queues */
+    pvr_dr_state_t *dr;
+    size_t count, max;
+
+    int pending;
+    pvr_vertex_t last;
+} clip_out_t;
+
+static float clip_near = 1.0f;
+
+void pvr_clip_set_near(float near_w) {
+    clip_near = near_w;
+}
+
+static inline void clip_xform(clip_vtx_t *c, const pvr_vertex_t *v) {
+    float x = v->x, y = v->y, z = v->z, w = 1.0f;
+
+    mat_trans_nodiv(x, y, z, w);
+
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->src = v;
+
+    /* The screen edges are only checked for vertices in front of the near
+       plane, since the signs are the wrong way around behind it. */
+    if(w < clip_near)
+        c->code = CLIP_NEAR;
+    else
+        c->code = (x < 0.0f ? CLIP_LEFT : 0) |
+                  (x > pvr_state.w * w ? CLIP_RIGHT : 0) |
+                  (y < 0.0f ? CLIP_TOP : 0) |
+                  (y > pvr_state.h * w ? CLIP_BOTTOM : 0);
+}
+
+static inline void clip_write(pvr_vertex_t *d, const pvr_vertex_t *s,
+                              uint32_t flags) {
+    d->flags = flags;
+    d->x = s->x;
+    d->y = s->y;
+    d->z = s->z;
+    d->u = s->u;
+    d->v = s->v;
+    d->argb = s->argb;
+    d->oargb = s->oargb;
+}
+
+/* Send the vertex that was held back. */
+static inline void clip_flush(clip_out_t *o, uint32_t flags) {
+    pvr_vertex_t *d;
+
+    if(!o->dst) {
+        d = pvr_dr_target(*o->dr);
+        clip_write(d, &o->last, flags);
+        pvr_dr_commit(d);
+    }
+    else if(o->count < o->max) {
+        clip_write(&o->dst[o->count], &o->last, flags);
+    }
+
+    ++o->count;
+}
+
+static inline void clip_end(clip_out_t *o) {
+    if(o->pending)
+        clip_flush(o, PVR_CMD_VERTEX_EOL);
+
+    o->pending = 0;
+}
+
+static inline void clip_emit(clip_out_t *o, const clip_vtx_t *c) {
+    float rw = 1.0f / c->w;
+
+    if(o->pending)
+        clip_flush(o, PVR_CMD_VERTEX);
+
+    o->last.x = c->x * rw;
+    o->last.y = c->y * rw;
+    o->last.z = rw;
+    o->last.u = c->src->u;
+    o->last.v = c->src->v;
+    o->last.argb = c->src->argb;
+    o->last.oargb = c->src->oargb;
+    o->pending = 1;
+}
+
+static inline uint32_t clip_lerp_color(uint32_t a, uint32_t b, float t) {
+    uint32_t rv = 0;
+    int i, ca, cb;
+
+    for(i = 0; i < 32; i += 8) {
+        ca = (a >> i) & 0xff;
+        cb = (b >> i) & 0xff;
+        rv |= (uint32_t)(ca + (int)((cb - ca) * t + 0.5f)) << i;
+    }
+
+    return rv;
+}
+
+/* Send the point where the edge from a, which is in front of the near plane,
+   to b, which isn't, crosses it. The edge is always taken from the vertex in
+   front, so triangles sharing it get exactly the same point. */
+static inline void clip_emit_edge(clip_out_t *o, const clip_vtx_t *a,
+                                  const clip_vtx_t *b) {
+    const pvr_vertex_t *sa = a->src, *sb = b->src;
+    float t = (clip_near - a->w) / (b->w - a->w);
+    float rw = 1.0f / clip_near;
+
+    if(o->pending)
+        clip_flush(o, PVR_CMD_VERTEX);
+
+    o->last.x = (a->x + (b->x - a->x) * t) * rw;
+    o->last.y = (a->y + (b->y - a->y) * t) * rw;
+    o->last.z = rw;
+    o->last.u = sa->u + (sb->u - sa->u) * t;
+    o->last.v = sa->v + (sb->v - sa->v) * t;
+    o->last.argb = clip_lerp_color(sa->argb, sb->argb, t);
+    o->last.oargb = clip_lerp_color(sa->oargb, sb->oargb, t);
+    o->pending = 1;
+}
+
+/* Clip a triangle that crosses the near plane, and send what's left of it as
+   a strip of its own. The vertices are in their real winding order. */
+static void clip_tri(clip_out_t *o, const clip_vtx_t *a, const clip_vtx_t *b,
+                     const clip_vtx_t *c) {
+    const clip_vtx_t *p[3] = { a, b, c }, *in, *out;
+    int i, n, first;
+
+    /* Start from a vertex that's in front, with the one after it behind. The
+       polygon is then that vertex, the crossing to the next, maybe the third
+       vertex, and the crossing back. */
+    for(first = 0; first < 3; ++first) {
+        if(!(p[first]->code & CLIP_NEAR) &&
+           (p[(first + 1) % 3]->code & CLIP_NEAR))
+            break;
+    }
+
+    in = p[first];
+    out = p[(first + 1) % 3];
+    n = !(p[(first + 2) % 3]->code & CLIP_NEAR);
+
+    clip_emit(o, in);
+    clip_emit_edge(o, in, out);
+
+    if(n) {
+        /* Two vertices in front: in, crossing, crossing, third makes a quad,
+           which goes out in strip order. */
+        i = (first + 2) % 3;
+        clip_emit(o, p[i]);
+        clip_emit_edge(o, p[i], out);
+    }
+    else {
+        clip_emit_edge(o, in, p[(first + 2) % 3]);
+    }
+
+    clip_end(o);
+}
+
+static inline void clip_strips(clip_out_t *o, const pvr_vertex_t *src,
+                               size_t count) {
+    clip_vtx_t buf[3], *a = &buf[0], *b = &buf[1], *c = &buf[2], *t;
+    size_t i, k = 0;
+    int open = 0, odd;
+
+    for(i = 0; i < count; ++i) {
+        clip_xform(c, &src[i]);
+
+        if(k >= 2) {
+            odd = (k - 2) & 1;
+
+            if(a->code & b->code & c->code) {
+                /* All the way off one side. */
+                clip_end(o);
+                open = 0;
+            }
+            else if(!((a->code | b->code | c->code) & CLIP_NEAR)) {
+                if(!open) {
+                    clip_emit(o, a);
+
+                    if(odd)
+                        clip_emit(o, a);
+
+                    clip_emit(o, b);
+                    open = 1;
+                }
+
+                clip_emit(o, c);
+            }
+            else {
+                clip_end(o);
+                open = 0;
+
+                if(odd)
+                    clip_tri(o, b, a, c);
+                else
+                    clip_tri(o, a, b, c);
+            }
+        }
+
+        ++k;
+        t = a;
+        a = b;
+        b = c;
+        c = t;
+
+        if(src[i].flags == PVR_CMD_VERTEX_EOL) {
+            clip_end(o);
+            open = 0;
+            k = 0;
+        }
+    }
+
+    clip_end(o);
+}
+
+size_t pvr_clip_strips_dr(pvr_dr_state_t *dr, const pvr_vertex_t *src,
+                          size_t count) {
+    clip_out_t o;
+
+    o.dst = NULL;
+    o.dr = dr;
+    o.count = 0;
+    o.pending = 0;
+
+    clip_strips(&o, src, count);
+
+    return o.count;
+}
+
+ssize_t pvr_clip_strips(pvr_vertex_t *dst, size_t max,
+                        const pvr_vertex_t *src, size_t count) {
+    clip_out_t o;
+
+    o.dst = dst;
+    o.dr = NULL;
+    o.count = 0;
+    o.max = max;
+    o.pending = 0;
+
+    clip_strips(&o, src, count);
+
+    if(o.count > max) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return o.count;
+}
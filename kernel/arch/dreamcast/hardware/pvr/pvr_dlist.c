@@ -0,0 +1,334 @@
+/* KallistiOS ##version##
+
+   pvr_dlist.c
+
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dc/pvr.h>
+#include <dc/matrix.h>
+#include <kos/mutex.h>
+#include "pvr_internal.h"
+
+/*
+
+   Recorded display lists
+
+   A display list is just the TA stream, kept in a 32-byte aligned buffer so
+   that it can be DMA'd as it is. To be able to put it through a matrix, the
+   positions of the vertices in it are found as it's filled: the headers say
+   how big the vertices after them are, and which of them have positions that
+   can be transformed. Runs of vertices that are next to each other are kept
+   as one piece, so that each run can go through mat_transform() in one go.
+
+   The transformed copy is kept around between frames, and only the positions
+   in it are written each time, since nothing else in it changes.
+
+*/
+
+/* What kind of vertices follow the last header. */
+#define DL_VTX_NONE     0
+#define DL_VTX_32       1       /* 32 byte polygon vertices */
+#define DL_VTX_64       2       /* 64 byte polygon vertices */
+#define DL_VTX_MOD      3       /* Modifier volume triangles */
+#define DL_VTX_SPRITE   4       /* Sprites, which aren't transformed */
+
+typedef struct dl_run {
+    uint32_t off;               /* Where the first x is */
+    uint16_t count;             /* Positions in the run */
+    uint16_t stride;            /* Bytes from one position to the next */
+} dl_run_t;
+
+struct pvr_dlist {
+    uint8_t *data;
+    uint8_t *xf;                /* Transformed copy, for pvr_dlist_submit_mat() */
+    size_t size, cap, xf_cap;
+    int xf_stale;               /* Set if the copy needs to be copied again */
+
+    dl_run_t *runs;
+    size_t nruns, runs_cap;
+
+    int vtx;                    /* DL_VTX_* for what's coming next */
+    size_t skip;                /* Bytes left of a 64 byte vertex or header */
+    int failed;                 /* Set if something recorded didn't fit */
+};
+
+pvr_dlist_t *pvr_dlist_rec;
+
+pvr_dlist_t *pvr_dlist_create(size_t size) {
+    pvr_dlist_t *dl;
+
+    if(!(dl = (pvr_dlist_t *)calloc(1, sizeof(pvr_dlist_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size = __align_up(size, 32);
+
+    if(size && !(dl->data = aligned_alloc(32, size))) {
+        free(dl);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    dl->cap = size;
+
+    return dl;
+}
+
+void pvr_dlist_destroy(pvr_dlist_t *dl) {
+    if(!dl)
+        return;
+
+    if(pvr_dlist_rec == dl)
+        pvr_dlist_rec = NULL;
+
+    free(dl->data);
+    free(dl->xf);
+    free(dl->runs);
+    free(dl);
+}
+
+void pvr_dlist_clear(pvr_dlist_t *dl) {
+    dl->size = 0;
+    dl->nruns = 0;
+    dl->vtx = DL_VTX_NONE;
+    dl->skip = 0;
+    dl->failed = 0;
+    dl->xf_stale = 1;
+}
+
+size_t pvr_dlist_size(const pvr_dlist_t *dl) {
+    return dl->size;
+}
+
+/* Note down count positions starting at off, joining them onto the last run
+   if they carry right on from it. */
+static int dl_add_run(pvr_dlist_t *dl, uint32_t off, int count, int stride) {
+    dl_run_t *run, *runs;
+
+    if(dl->nruns) {
+        run = &dl->runs[dl->nruns - 1];
+
+        if(run->stride == stride && run->count + count <= UINT16_MAX &&
+           run->off + run->count * stride == off) {
+            run->count += count;
+            return 0;
+        }
+    }
+
+    if(dl->nruns == dl->runs_cap) {
+        runs = (dl_run_t *)realloc(dl->runs, (dl->runs_cap * 2 + 16) *
+                                   sizeof(dl_run_t));
+
+        if(!runs)
+            return -1;
+
+        dl->runs = runs;
+        dl->runs_cap = dl->runs_cap * 2 + 16;
+    }
+
+    run = &dl->runs[dl->nruns++];
+    run->off = off;
+    run->count = count;
+    run->stride = stride;
+
+    return 0;
+}
+
+/* Go through newly added data, keeping track of where the vertices are. */
+static int dl_scan(pvr_dlist_t *dl, size_t off, size_t end) {
+    uint32_t cmd;
+    int col, rv = 0;
+
+    for(; off < end; off += 32) {
+        if(dl->skip) {
+            dl->skip -= 32;
+            continue;
+        }
+
+        cmd = *(uint32_t *)(dl->data + off);
+
+        switch(cmd >> 29) {
+            case PVR_HDR_POLY:
+                col = (cmd >> 4) & 3;
+
+                if(((cmd >> 24) & 7) == PVR_LIST_OP_MOD ||
+                   ((cmd >> 24) & 7) == PVR_LIST_TR_MOD) {
+                    dl->vtx = DL_VTX_MOD;
+                    break;
+                }
+
+                /* Vertices with texture coordinates are 64 bytes if they
+                   have float colors, or two volumes. */
+                if((cmd & 0x08) && (col == PVR_CLRFMT_4FLOATS || (cmd & 0x40)))
+                    dl->vtx = DL_VTX_64;
+                else
+                    dl->vtx = DL_VTX_32;
+
+                /* Intensity headers with a second color are 64 bytes. */
+                if(col == PVR_CLRFMT_INTENSITY &&
+                   (((cmd & 0x08) && (cmd & 0x04)) || (cmd & 0x40)))
+                    dl->skip = 32;
+
+                break;
+
+            case PVR_HDR_SPRITE:
+                dl->vtx = DL_VTX_SPRITE;
+                break;
+
+            case 7:
+                /* A vertex. Whatever it is, the position comes first. */
+                switch(dl->vtx) {
+                    case DL_VTX_32:
+                        rv |= dl_add_run(dl, off + 4, 1, 32);
+                        break;
+
+                    case DL_VTX_64:
+                        rv |= dl_add_run(dl, off + 4, 1, 64);
+                        dl->skip = 32;
+                        break;
+
+                    case DL_VTX_MOD:
+                        rv |= dl_add_run(dl, off + 4, 3, 12);
+                        dl->skip = 32;
+                        break;
+
+                    case DL_VTX_SPRITE:
+                        dl->skip = 32;
+                        break;
+                }
+
+                break;
+
+            default:
+                /* User clip, object list set or end of list. */
+                break;
+        }
+    }
+
+    return rv;
+}
+
+int pvr_dlist_add(pvr_dlist_t *dl, const void *data, size_t size) {
+    size_t cap;
+    uint8_t *buf;
+
+    if(size & 31) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(dl->size + size > dl->cap) {
+        for(cap = dl->cap ? dl->cap : 1024; cap < dl->size + size; cap *= 2)
+            ;
+
+        if(!(buf = aligned_alloc(32, cap))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memcpy(buf, dl->data, dl->size);
+        free(dl->data);
+        dl->data = buf;
+        dl->cap = cap;
+    }
+
+    memcpy(dl->data + dl->size, data, size);
+    dl->size += size;
+    dl->xf_stale = 1;
+
+    if(dl_scan(dl, dl->size - size, dl->size)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+void pvr_dlist_record(pvr_dlist_t *dl) {
+    dl->failed = 0;
+    pvr_dlist_rec = dl;
+}
+
+int pvr_dlist_stop(void) {
+    pvr_dlist_t *dl = pvr_dlist_rec;
+
+    pvr_dlist_rec = NULL;
+
+    return dl && dl->failed ? -1 : 0;
+}
+
+/* Called from pvr_prim() while recording. */
+int pvr_dlist_rec_prim(const void *data, size_t size) {
+    if(pvr_dlist_add(pvr_dlist_rec, data, size)) {
+        pvr_dlist_rec->failed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Send a TA stream to the open list. */
+static int dl_send(const void *data, size_t size) {
+    pvr_list_t list = pvr_state.list_reg_open;
+    int rv;
+
+    if(pvr_state.list_reg_open == -1) {
+        errno = EPERM;
+        return -1;
+    }
+
+    if(!size)
+        return 0;
+
+    /* If the list is going to a vertex buffer, it goes there too. */
+    if(pvr_state.dma_mode &&
+       pvr_state.dma_buffers[pvr_state.ram_target].base[list])
+        return pvr_list_prim(list, data, size);
+
+    mutex_lock((mutex_t *)&pvr_state.dma_lock);
+    rv = pvr_dma_load_ta(data, size, true, NULL, NULL);
+    mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+    if(!rv)
+        pvr_prof_prim(list, size);
+
+    return rv;
+}
+
+int pvr_dlist_submit(const pvr_dlist_t *dl) {
+    return dl_send(dl->data, dl->size);
+}
+
+int pvr_dlist_submit_mat(pvr_dlist_t *dl) {
+    dl_run_t *run;
+    size_t i;
+
+    if(dl->xf_cap < dl->size) {
+        free(dl->xf);
+        dl->xf_cap = 0;
+
+        if(!(dl->xf = aligned_alloc(32, dl->cap))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        dl->xf_cap = dl->cap;
+        dl->xf_stale = 1;
+    }
+
+    if(dl->xf_stale) {
+        memcpy(dl->xf, dl->data, dl->size);
+        dl->xf_stale = 0;
+    }
+
+    for(i = 0, run = dl->runs; i < dl->nruns; ++i, ++run)
+        mat_transform((const vector_t *)(dl->data + run->off),
+                      (vector_t *)(dl->xf + run->off), run->count,
+                      run->stride);
+
+    return dl_send(dl->xf, dl->size);
+}
@@ -22,6 +22,13 @@
 
 */
 
+/* Worker that sends queued scenes to the TA; it should get to run as soon as
+   the TA is free. */
+static const kthread_attr_t dma_worker_attr = {
+    .prio = PRIO_DEFAULT - 1,
+    .label = "pvr_dma"
+};
+
 /* Simpler function which initializes the PVR using 16/16 for the opaque
    and translucent lists, and 0's for everything else; 512k of vertex
    buffer. This is equivalent to the old ta_init_defaults() for now. */
@@ -46,7 +53,10 @@ int pvr_init_defaults(void) {
         3,
 
         /* Vertex buffer double-buffering enabled */
-        0
+        0,
+
+        /* Default texture memory allocator */
+        PVR_MEM_ALLOC_DEFAULT
     };
 
     return pvr_init(&params);
@@ -95,6 +105,25 @@ int pvr_init(const pvr_init_params_t *params) {
 
     pvr_state.vbuf_doublebuf = !params->vbuf_doublebuf_disabled;
 
+    pvr_state.mem_allocator = params->mem_allocator;
+
+    // Split the vertex buffers between more than two scenes if asked to. The
+    // extra ones are queued up, and a worker sends them when the TA is free.
+    pvr_state.dma_buf_count = 2;
+
+    if(pvr_state.dma_mode && params->vertbuf_count > 2) {
+        pvr_state.dma_buf_count = params->vertbuf_count > PVR_VERTBUF_MAX ?
+                                  PVR_VERTBUF_MAX : params->vertbuf_count;
+        pvr_state.dma_worker = thd_worker_create_ex(&dma_worker_attr,
+                                                    pvr_dma_worker, NULL);
+
+        if(!pvr_state.dma_worker) {
+            dbglog(DBG_WARNING, "pvr_init: couldn't start the vertex DMA "
+                                "worker, using two vertex buffers\n");
+            pvr_state.dma_buf_count = 2;
+        }
+    }
+
     /* Everything's clear, do the initial buffer pointer setup */
     pvr_allocate_buffers(params);
 
@@ -242,9 +271,21 @@ int pvr_shutdown(void) {
     asic_evt_remove_handler(ASIC_EVT_PVR_RENDERDONE_TSP);
     asic_evt_disable(ASIC_EVT_PVR_RENDERDONE_TSP, ASIC_IRQ_DEFAULT);
 
+    /* Stop sending queued scenes */
+    if(pvr_state.dma_worker) {
+        thd_worker_destroy(pvr_state.dma_worker);
+        pvr_state.dma_worker = NULL;
+    }
+
     /* Shut down PVR DMA */
     pvr_dma_shutdown();
 
+    /* Free any vertex buffer overflow chunks */
+    pvr_vertbuf_free_chunks();
+
+    /* Stop the profiler, if it's running */
+    pvr_prof_stop();
+
     /* Invalidate our memory pool */
     pvr_mem_reset();
 
@@ -18,6 +18,8 @@
 
 #include <stdbool.h>
 #include <kos/mutex.h>
+#include <kos/worker_thread.h>
+#include <arch/timer.h>
 
 /**** State stuff ***************************************************/
 
@@ -129,12 +131,29 @@ typedef struct {
     uint32  opb_overflow_count;             /* Extra OPB space after opb_size for TA overflow */
 } pvr_ta_buffers_t;
 
-// DMA buffers structure: we have two sets of these
+// Extra space for a list that outgrew its DMA buffer
+typedef struct pvr_vertbuf_chunk {
+    struct pvr_vertbuf_chunk * next;    // Next chunk for the same list
+    uint32  ptr;                        // Write pointer
+    uint32  size;                       // Size of data
+    uint8   data[] __attribute__((aligned(32)));
+} pvr_vertbuf_chunk_t;
+
+// DMA buffers structure: we have one set of these per scene in flight
 typedef struct {
     uint8   * base[PVR_OPB_COUNT];  // DMA buffers, if assigned
     uint32  ptr[PVR_OPB_COUNT];     // DMA buffer write pointer, if used
     uint32  size[PVR_OPB_COUNT];    // DMA buffer sizes, or zero if none
     int ready;                      // >0 if these buffers are ready to be DMAed
+
+    pvr_vertbuf_chunk_t * chunks[PVR_OPB_COUNT];    // Overflow chunks, in order
+    pvr_vertbuf_chunk_t * cur[PVR_OPB_COUNT];       // Chunk being written, or NULL for base
+
+    // Render target for a scene queued up for the TA
+    bool    to_texture;
+    int     to_txr_rp;
+    uint32  to_txr_addr;
+    uint32  prof_scene;             // Profiler's number for the scene
 } pvr_dma_buffers_t;
 
 // Frame buffers structure: we have two sets of these
@@ -157,7 +176,10 @@ typedef struct {
 
     // Pipeline state
     int     ram_target;                 // RAM buffer we're writing into
-                                        // (^1 == RAM buffer we're DMAing from)
+    int     dma_target;                 // RAM buffer we're DMAing from (next)
+    int     dma_buf_count;              // Number of RAM buffers
+    int     dma_queued;                 // Finished RAM buffers not fully DMA'd yet
+    int     dma_sending;                // >0 if a scene's vertex DMA is in progress
     int     ta_target;                  // TA buffer we're writing (or DMAing) into
                                         // (^1 == TA buffer we're rendering from)
     int     view_target;                // Frame buffer we're viewing
@@ -175,10 +197,14 @@ typedef struct {
     int     render_completed;           // >1 if a render has recently finished
 
     // Memory pointers / buffers
-    pvr_dma_buffers_t   dma_buffers[2];     // DMA buffers (if any)
+    pvr_dma_buffers_t   dma_buffers[PVR_VERTBUF_MAX];   // DMA buffers (if any)
+    pvr_vertbuf_chunk_t * dma_chunk;        // Next overflow chunk to DMA
+    size_t              vtx_overflow[PVR_OPB_COUNT];    // Overflow chunk sizes, or zero
+    kthread_worker_t    * dma_worker;       // Sends queued scenes (>2 RAM buffers only)
     pvr_ta_buffers_t    ta_buffers[2];      // TA buffers
     pvr_frame_buffers_t frame_buffers[2];   // Frame buffers
     uint32              texture_base;       // Start of texture RAM
+    int                 mem_allocator;      // PVR_MEM_ALLOC_* managing it
 
     // Screen size / clipping constants
     int     w, h;                       // Screen width, height
@@ -302,6 +328,93 @@ void pvr_blank_polyhdr(int type);
 void pvr_blank_polyhdr_buf(int type, pvr_poly_hdr_t * buf);
 
 
+/**** pvr_dlist.c ***************************************************/
+
+/* The display list being recorded into, if any, and how pvr_prim() adds
+   to it. */
+extern pvr_dlist_t *pvr_dlist_rec;
+int pvr_dlist_rec_prim(const void *data, size_t size);
+
+
+/**** pvr_prof.c ****************************************************/
+
+/* What's happening, for pvr_prof_event(). It's also told about the events
+   for pvr_sync_stats() above, with the same numbers. For the waits, t is when
+   the wait started, rather than when the event happened. For the DMA wait,
+   list is the number pvr_prof_scene() gave the scene being sent, or 0 for
+   the one that was just finished. */
+#define PVR_PROF_SCENE_BEGIN    16  /* pvr_scene_begin() */
+#define PVR_PROF_SCENE_FINISH   17  /* pvr_scene_finish() */
+#define PVR_PROF_LIST_BEGIN     18  /* List opened */
+#define PVR_PROF_LIST_FINISH    19  /* List closed */
+#define PVR_PROF_LIST_SQ        20  /* List opened straight to the TA */
+#define PVR_PROF_LIST_DMA       21  /* List's vertex buffer DMA started */
+#define PVR_PROF_LIST_DONE      22  /* TA done with a list IRQ */
+#define PVR_PROF_READY_WAIT     23  /* Done waiting in pvr_wait_ready() */
+#define PVR_PROF_DMA_WAIT       24  /* Done waiting for the vertex DMA */
+
+extern int pvr_prof_enabled;
+
+void pvr_prof_event(int event, int list, uint64_t t);
+void pvr_prof_count(int list, size_t size);
+uint32_t pvr_prof_scene(void);
+
+static inline void pvr_prof(int event, int list) {
+    if(pvr_prof_enabled)
+        pvr_prof_event(event, list, timer_ns_gettime64());
+}
+
+/* Note down size bytes sent to a list. */
+static inline void pvr_prof_prim(int list, size_t size) {
+    if(pvr_prof_enabled)
+        pvr_prof_count(list, size);
+}
+
+
+/**** pvr_mem_buddy.c ***********************************************/
+
+/* The slab/buddy allocator, for PVR_MEM_ALLOC_BUDDY. Resetting it with a base
+   of 0 frees everything it has in main RAM. */
+void pvr_buddy_reset(uint32_t base, uint32_t top);
+void *pvr_buddy_malloc(size_t size);
+void pvr_buddy_free(void *ptr);
+void pvr_buddy_get_stats(pvr_mem_stats_t *stats);
+void pvr_buddy_print_stats(void);
+
+
+/**** pvr_texture.c / pvr_vq.c ***************************************/
+
+/* Pull the even bits of a twiddled index back together. */
+static inline uint32_t pvr_txr_untwid(uint32_t i) {
+    i &= 0x55555555;
+    i = (i | (i >> 1)) & 0x33333333;
+    i = (i | (i >> 2)) & 0x0f0f0f0f;
+    i = (i | (i >> 4)) & 0x00ff00ff;
+    return (i | (i >> 8)) & 0x0000ffff;
+}
+
+/* Convert an ARGB8888 texel to the 16-bit format asked for in the flags. */
+static inline uint16_t pvr_txr_conv32(uint32_t p, uint32_t flags) {
+    switch(flags & PVR_TXRLOAD_CONV_MASK) {
+        case PVR_TXRLOAD_CONV_RGB565:
+            return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) |
+                   ((p >> 3) & 0x001f);
+        case PVR_TXRLOAD_CONV_ARGB4444:
+            return ((p >> 16) & 0xf000) | ((p >> 12) & 0x0f00) |
+                   ((p >> 8) & 0x00f0) | ((p >> 4) & 0x000f);
+        default:
+            return ((p >> 16) & 0x8000) | ((p >> 9) & 0x7c00) |
+                   ((p >> 6) & 0x03e0) | ((p >> 3) & 0x001f);
+    }
+}
+
+
+/**** pvr_scene.c *****************************************************/
+
+/* Free the overflow chunks of every list. */
+void pvr_vertbuf_free_chunks(void);
+
+
 /**** pvr_irq.c *******************************************************/
 
 /* Interrupt handlers for PVR events */
@@ -310,4 +423,9 @@ void pvr_vblank_handler(uint32 code, void *data);
 
 void pvr_start_dma(void);
 
+/* Worker that sends queued scenes to the TA when it's free, and how to wake
+   it up when one might be able to go. */
+void pvr_dma_worker(void *data);
+void pvr_wake_dma(void);
+
 #endif
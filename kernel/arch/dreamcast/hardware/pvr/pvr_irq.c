@@ -29,10 +29,21 @@
 // nothing. Otherwise, start the DMA and chain back to us upon completion.
 static void dma_next_list(void *thread) {
     volatile pvr_dma_buffers_t * b;
+    pvr_vertbuf_chunk_t * c;
     unsigned int i;
 
     // Get the buffers for this frame.
-    b = pvr_state.dma_buffers + (pvr_state.ram_target ^ 1);
+    b = pvr_state.dma_buffers + pvr_state.dma_target;
+
+    // Send the rest of a list that outgrew its buffer, if there's any.
+    for(c = pvr_state.dma_chunk; c && !c->ptr; c = c->next)
+        ;
+
+    if(c) {
+        pvr_state.dma_chunk = c->next;
+        pvr_dma_load_ta(c->data, c->ptr, 0, dma_next_list, thread);
+        return;
+    }
 
     for(i = 0; i < PVR_OPB_COUNT; i++) {
         if((pvr_state.lists_enabled & BIT(i))
@@ -51,6 +62,8 @@ static void dma_next_list(void *thread) {
             pvr_state.lists_dmaed |= BIT(i);
 
             // Start the DMA transfer, chaining to ourselves.
+            pvr_state.dma_chunk = b->chunks[i];
+            pvr_prof(PVR_PROF_LIST_DMA, i);
             pvr_dma_load_ta(b->base[i], b->ptr[i], 0, dma_next_list, thread);
             return;
         }
@@ -58,23 +71,94 @@ static void dma_next_list(void *thread) {
 
     // If that was the last one, then free up the DMA channel.
     pvr_state.lists_dmaed = 0;
+    pvr_state.dma_chunk = NULL;
+
+    // Buffers are now empty again
+    b->ready = 0;
+    pvr_state.dma_target = (pvr_state.dma_target + 1) % pvr_state.dma_buf_count;
+    pvr_state.dma_queued--;
+    pvr_state.dma_sending = 0;
+    genwait_wake_all((void *)&pvr_state.dma_queued);
 
     // Unlock
     if(irq_inside_int())
         mutex_unlock_as_thread((mutex_t *)&pvr_state.dma_lock, thread);
     else
         mutex_unlock((mutex_t *)&pvr_state.dma_lock);
-
-    // Buffers are now empty again
-    pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready = 0;
 }
 
 void pvr_start_dma(void) {
+    uint64_t start = pvr_prof_enabled ? timer_ns_gettime64() : 0;
+
     pvr_sync_stats(PVR_SYNC_REGSTART);
 
     mutex_lock((mutex_t *)&pvr_state.dma_lock);
 
+    if(start)
+        pvr_prof_event(PVR_PROF_DMA_WAIT, 0, start);
+
     // Begin DMAing the first list.
+    pvr_state.dma_sending = 1;
+    dma_next_list(thd_get_current());
+}
+
+// Can the next queued scene go to the TA?
+static inline bool dma_can_start(void) {
+    return pvr_state.dma_queued && !pvr_state.dma_sending
+           && !pvr_state.ta_busy
+           && (pvr_state.vbuf_doublebuf || !pvr_state.render_busy);
+}
+
+void pvr_wake_dma(void) {
+    if(!pvr_state.dma_worker || !dma_can_start())
+        return;
+
+    thd_worker_wakeup(pvr_state.dma_worker);
+
+    // Let it get going straight away.
+    if(irq_inside_int())
+        thd_schedule(true);
+    else
+        thd_pass();
+}
+
+// Send the oldest queued scene to the TA. This is done from a thread, rather
+// than straight from the interrupts that free up the TA, so that it can wait
+// its turn for the DMA lock like everything else.
+void pvr_dma_worker(void *data) {
+    volatile pvr_dma_buffers_t * b;
+    int o;
+
+    (void)data;
+
+    if(!dma_can_start())
+        return;
+
+    mutex_lock((mutex_t *)&pvr_state.dma_lock);
+
+    o = irq_disable();
+
+    if(!dma_can_start()) {
+        irq_restore(o);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+        return;
+    }
+
+    // Set the TA up for the scene, as pvr_scene_finish() would have.
+    b = pvr_state.dma_buffers + pvr_state.dma_target;
+    pvr_state.curr_to_texture = b->to_texture;
+    pvr_state.to_txr_rp = b->to_txr_rp;
+    pvr_state.to_txr_addr = b->to_txr_addr;
+    pvr_state.ta_busy = 1;
+    pvr_state.dma_sending = 1;
+
+    irq_restore(o);
+
+    pvr_sync_stats(PVR_SYNC_REGSTART);
+
+    if(pvr_prof_enabled && b->prof_scene)
+        pvr_prof_event(PVR_PROF_DMA_WAIT, b->prof_scene, timer_ns_gettime64());
+
     dma_next_list(thd_get_current());
 }
 
@@ -111,6 +195,9 @@ static void pvr_render_lists(void) {
         genwait_wake_all((void *)&pvr_state.ta_busy);
         thd_schedule(true);
     }
+
+    // If scenes are queued up, the next one might be able to go now.
+    pvr_wake_dma();
 }
 
 void pvr_vblank_handler(uint32 code, void *data) {
@@ -149,19 +236,24 @@ void pvr_int_handler(uint32 code, void *data) {
         case ASIC_EVT_PVR_OPAQUEDONE:
             //DBG(("irq_opaquedone\n"));
             pvr_state.lists_transferred |= BIT(PVR_OPB_OP);
+            pvr_prof(PVR_PROF_LIST_DONE, PVR_OPB_OP);
             break;
         case ASIC_EVT_PVR_TRANSDONE:
             //DBG(("irq_transdone\n"));
             pvr_state.lists_transferred |= BIT(PVR_OPB_TP);
+            pvr_prof(PVR_PROF_LIST_DONE, PVR_OPB_TP);
             break;
         case ASIC_EVT_PVR_OPAQUEMODDONE:
             pvr_state.lists_transferred |= BIT(PVR_OPB_OM);
+            pvr_prof(PVR_PROF_LIST_DONE, PVR_OPB_OM);
             break;
         case ASIC_EVT_PVR_TRANSMODDONE:
             pvr_state.lists_transferred |= BIT(PVR_OPB_TM);
+            pvr_prof(PVR_PROF_LIST_DONE, PVR_OPB_TM);
             break;
         case ASIC_EVT_PVR_PTDONE:
             pvr_state.lists_transferred |= BIT(PVR_OPB_PT);
+            pvr_prof(PVR_PROF_LIST_DONE, PVR_OPB_PT);
             break;
         case ASIC_EVT_PVR_RENDERDONE_TSP:
             //DBG(("irq_renderdone\n"));
@@ -171,6 +263,10 @@ void pvr_int_handler(uint32 code, void *data) {
             pvr_sync_stats(PVR_SYNC_RNDDONE);
 
             genwait_wake_all((void *)&pvr_state.render_busy);
+
+            // Without double buffering, a queued scene has to wait for the
+            // render to be done rather than just started, so see to it here.
+            pvr_wake_dma();
             break;
     }
 
@@ -9,6 +9,7 @@
 #include <dc/pvr.h>
 #include "pvr_internal.h"
 #include <stdio.h>
+#include <string.h>
 
 #include <malloc.h> /* For the struct mallinfo defs */
 
@@ -19,7 +20,8 @@
 
 This module basically serves as a KOS-friendly front end and support routines
 for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
+the PVR memory pool. It also hands off to the slab/buddy allocator in
+pvr_mem_buddy.c instead, if that was asked for at init time.
 
 I was originally going to make a totally separate thing that could be used
 to generically manage any memory pool, but then I realized what a gruelling
@@ -87,7 +89,11 @@ pvr_ptr_t pvr_mem_malloc(size_t size) {
 
     CHECK_MEM_BASE;
 
-    rv32 = (uint32)pvr_int_malloc(size);
+    if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY)
+        rv32 = (uint32)pvr_buddy_malloc(size);
+    else
+        rv32 = (uint32)pvr_int_malloc(size);
+
     assert_msg((rv32 & 0x1f) == 0,
                "dlmalloc's alignment is broken; "
                "please make a bug report");
@@ -145,7 +151,10 @@ void pvr_mem_free(pvr_ptr_t chunk) {
         }
     }
 
-    pvr_int_free((void *)chunk);
+    if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY)
+        pvr_buddy_free((void *)chunk);
+    else
+        pvr_int_free((void *)chunk);
 }
 
 /* Check the memory block list to see what's allocated */
@@ -174,9 +183,16 @@ static size_t pvr_mem_available_int(void) {
 }
 
 size_t pvr_mem_available(void) {
+    pvr_mem_stats_t st;
+
     if(!pvr_mem_base)
         return 0;
 
+    if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY) {
+        pvr_buddy_get_stats(&st);
+        return st.free;
+    }
+
     return pvr_mem_available_int() + 
         (PVR_RAM_INT_TOP - (size_t)pvr_mem_base);
 }
@@ -185,18 +201,57 @@ size_t pvr_mem_available(void) {
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
 void pvr_mem_reset(void) {
-    if(!pvr_state.valid)
+    if(!pvr_state.valid) {
         pvr_mem_base = NULL;
+        pvr_buddy_reset(0, 0);
+    }
     else {
         pvr_mem_base = (pvr_ptr_t)(PVR_RAM_INT_BASE + pvr_state.texture_base);
-        pvr_int_mem_reset();
+
+        if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY)
+            pvr_buddy_reset((uint32)pvr_mem_base, PVR_RAM_INT_TOP);
+        else
+            pvr_int_mem_reset();
     }
 }
 
 /* Print some statistics (like mallocstats) */
 void pvr_mem_stats(void) {
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32)pvr_mem_base);
+
+    if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY) {
+        pvr_buddy_print_stats();
+    }
+    else {
+        pvr_int_malloc_stats();
+        printf("max sbrk base: %08lx\n", (uint32)pvr_mem_base);
+    }
+
     pvr_mem_print_list();
 }
+
+/* Fill in statistics about the memory pool */
+void pvr_mem_get_stats(pvr_mem_stats_t *stats) {
+    struct mallinfo mi;
+    size_t tail;
+
+    if(!pvr_mem_base) {
+        memset(stats, 0, sizeof(pvr_mem_stats_t));
+        return;
+    }
+
+    if(pvr_state.mem_allocator == PVR_MEM_ALLOC_BUDDY) {
+        pvr_buddy_get_stats(stats);
+        return;
+    }
+
+    /* The top chunk and what hasn't been sbrk'd yet are one free block. */
+    mi = pvr_int_mallinfo();
+    tail = PVR_RAM_INT_TOP - (size_t)pvr_mem_base;
+
+    stats->total = PVR_RAM_INT_TOP - PVR_RAM_INT_BASE - pvr_state.texture_base;
+    stats->used = mi.uordblks;
+    stats->free = stats->total - stats->used;
+    stats->largest_free = mi.keepcost + tail;
+    stats->free_blocks = mi.ordblks + mi.smblks;
+}
@@ -0,0 +1,400 @@
+/* KallistiOS ##version##
+
+   pvr_mem_buddy.c
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <dc/pvr.h>
+#include <kos/dbglog.h>
+#include "pvr_internal.h"
+
+/*
+
+   Slab/buddy allocator for the PVR memory pool
+
+   This is the allocator used when pvr_init() is asked for
+   PVR_MEM_ALLOC_BUDDY. Texture sizes are almost all powers of two, or a bit
+   over one (mipmaps), and a general purpose malloc() ends up scattering them
+   all over VRAM as they come and go between levels. This one splits VRAM into
+   units of PVR_BUDDY_UNIT bytes and hands them out as binary buddies, so a
+   block of 2^n units is always aligned to its own size, and freed buddies
+   merge back together into the bigger block they came from.
+
+   Blocks that aren't a power of two in units get a block of the next power of
+   two up, and the part at the end that isn't needed is given back right away
+   (as the biggest aligned blocks that fit), so a 174KB mipmapped texture uses
+   174KB and not 256KB. When it's freed, it goes back as the same pieces, and
+   they all merge back together with whatever was trimmed off.
+
+   Anything smaller than half a unit comes out of a slab instead: a unit split
+   into slots of a single power of two size, with a bitmap of which of them are
+   in use. Slabs for each size that have room left are kept on a list, and a
+   slab is given back as soon as it's empty.
+
+   All of the bookkeeping is kept in main RAM, with an entry for every unit of
+   VRAM, indexed from the start of VRAM (not the texture area) so that the
+   alignment of blocks is the alignment of their real addresses.
+
+*/
+
+#define PVR_BUDDY_UNIT_BITS 11
+#define PVR_BUDDY_UNIT      (1 << PVR_BUDDY_UNIT_BITS)
+#define PVR_BUDDY_UNITS     (PVR_RAM_SIZE >> PVR_BUDDY_UNIT_BITS)
+#define PVR_BUDDY_ORDERS    14      /* Enough for 16MB, on NAOMI */
+
+#define PVR_SLAB_MIN_BITS   5       /* 32 bytes, the PVR's texture alignment */
+#define PVR_SLAB_CLASSES    (PVR_BUDDY_UNIT_BITS - PVR_SLAB_MIN_BITS)
+#define PVR_SLAB_MAX        (PVR_BUDDY_UNIT / 2)
+
+#define BK_NONE     0xffff
+
+/* What a unit is. Only the first unit of a block says anything about it;
+   the rest are just BK_INNER. */
+#define BK_INNER    0       /* Part of a block, or not in the pool */
+#define BK_FREE     1       /* First unit of a free block */
+#define BK_USED     2       /* First unit of an allocated block */
+#define BK_SLAB     3       /* A slab */
+
+typedef struct bk_slab {
+    LIST_ENTRY(bk_slab) list;
+    uint64_t map;           /* Slots in use */
+    uint16_t unit;
+    uint8_t cls;
+    uint8_t used;
+} bk_slab_t;
+
+LIST_HEAD(bk_slab_list, bk_slab);
+
+typedef struct bk_unit {
+    uint8_t state;
+    uint8_t order;          /* Size of a free block, as a power of two */
+    uint16_t len;           /* Size of an allocated block, in units */
+
+    union {
+        struct {
+            uint16_t next, prev;
+        } link;             /* Free list links, for a free block */
+        bk_slab_t *slab;    /* For a slab */
+    };
+} bk_unit_t;
+
+static bk_unit_t *units;
+static uint16_t free_list[PVR_BUDDY_ORDERS];
+static struct bk_slab_list slabs[PVR_SLAB_CLASSES];
+
+static uint32_t first, limit;   /* The units in the pool */
+static size_t used_bytes;
+
+static inline uint32_t bk_addr(uint32_t u) {
+    return PVR_RAM_INT_BASE + (u << PVR_BUDDY_UNIT_BITS);
+}
+
+static void bk_push(uint32_t u, int order) {
+    units[u].state = BK_FREE;
+    units[u].order = order;
+    units[u].link.prev = BK_NONE;
+    units[u].link.next = free_list[order];
+
+    if(free_list[order] != BK_NONE)
+        units[free_list[order]].link.prev = u;
+
+    free_list[order] = u;
+}
+
+static void bk_unlink(uint32_t u) {
+    bk_unit_t *un = &units[u];
+
+    if(un->link.prev != BK_NONE)
+        units[un->link.prev].link.next = un->link.next;
+    else
+        free_list[un->order] = un->link.next;
+
+    if(un->link.next != BK_NONE)
+        units[un->link.next].link.prev = un->link.prev;
+
+    un->state = BK_INNER;
+}
+
+/* Free a block of 2^order units, merging it with its buddy for as long as
+   the buddy is free too. */
+static void bk_free_block(uint32_t u, int order) {
+    uint32_t buddy;
+
+    for(; order < PVR_BUDDY_ORDERS - 1; ++order) {
+        buddy = u ^ (1 << order);
+
+        if(buddy < first || buddy + (1 << order) > limit ||
+           units[buddy].state != BK_FREE || units[buddy].order != order)
+            break;
+
+        bk_unlink(buddy);
+
+        if(buddy < u)
+            u = buddy;
+    }
+
+    bk_push(u, order);
+}
+
+/* Free any run of units, as the biggest aligned blocks that make it up. */
+static void bk_free_range(uint32_t u, uint32_t n) {
+    int order;
+
+    while(n) {
+        for(order = 0; order < PVR_BUDDY_ORDERS - 1; ++order) {
+            if((u & (1 << order)) || (2U << order) > n)
+                break;
+        }
+
+        units[u].state = BK_INNER;
+        bk_free_block(u, order);
+        u += 1 << order;
+        n -= 1 << order;
+    }
+}
+
+/* Allocate n units. */
+static int bk_alloc_units(uint32_t n, uint32_t *out) {
+    int order, want;
+    uint32_t u;
+
+    for(want = 0; (1U << want) < n; ++want)
+        ;
+
+    for(order = want; order < PVR_BUDDY_ORDERS; ++order) {
+        if(free_list[order] != BK_NONE)
+            break;
+    }
+
+    if(order == PVR_BUDDY_ORDERS)
+        return -1;
+
+    u = free_list[order];
+    bk_unlink(u);
+
+    /* Split it down to size, freeing the top halves. */
+    while(order > want) {
+        --order;
+        bk_push(u + (1 << order), order);
+    }
+
+    /* Give back what isn't needed at the end. */
+    if(n < (1U << want))
+        bk_free_range(u + n, (1 << want) - n);
+
+    units[u].state = BK_USED;
+    units[u].len = n;
+    *out = u;
+
+    return 0;
+}
+
+static void *bk_slab_alloc(size_t size) {
+    bk_slab_t *slab;
+    int cls, slot, slots;
+    uint32_t u;
+
+    for(cls = 0; (size_t)(1 << (cls + PVR_SLAB_MIN_BITS)) < size; ++cls)
+        ;
+
+    slots = PVR_BUDDY_UNIT >> (cls + PVR_SLAB_MIN_BITS);
+
+    if(!(slab = LIST_FIRST(&slabs[cls]))) {
+        if(!(slab = (bk_slab_t *)calloc(1, sizeof(bk_slab_t))))
+            return NULL;
+
+        if(bk_alloc_units(1, &u)) {
+            free(slab);
+            return NULL;
+        }
+
+        units[u].state = BK_SLAB;
+        units[u].slab = slab;
+        slab->unit = u;
+        slab->cls = cls;
+
+        /* Mark the slots past the end as used, for the small sizes that
+           don't fill the map. */
+        if(slots < 64)
+            slab->map = ~0ULL << slots;
+
+        LIST_INSERT_HEAD(&slabs[cls], slab, list);
+        used_bytes += PVR_BUDDY_UNIT;
+    }
+
+    slot = __builtin_ctzll(~slab->map);
+    slab->map |= 1ULL << slot;
+
+    if(++slab->used == slots)
+        LIST_REMOVE(slab, list);
+
+    return (void *)(bk_addr(slab->unit) + (slot << (cls + PVR_SLAB_MIN_BITS)));
+}
+
+static void bk_slab_free(bk_slab_t *slab, uint32_t addr) {
+    int slots = PVR_BUDDY_UNIT >> (slab->cls + PVR_SLAB_MIN_BITS);
+    int slot = (addr - bk_addr(slab->unit)) >> (slab->cls + PVR_SLAB_MIN_BITS);
+
+    if(!(slab->map & (1ULL << slot))) {
+        dbglog(DBG_ERROR, "pvr_mem_free: slot %08lx is already free\n",
+               (unsigned long)addr);
+        return;
+    }
+
+    /* Put it back on the list if it was full. */
+    if(slab->used-- == slots)
+        LIST_INSERT_HEAD(&slabs[slab->cls], slab, list);
+
+    slab->map &= ~(1ULL << slot);
+
+    if(!slab->used) {
+        LIST_REMOVE(slab, list);
+        units[slab->unit].state = BK_INNER;
+        bk_free_block(slab->unit, 0);
+        used_bytes -= PVR_BUDDY_UNIT;
+        free(slab);
+    }
+}
+
+void *pvr_buddy_malloc(size_t size) {
+    uint32_t u, n;
+
+    if(!units)
+        return NULL;
+
+    if(size <= PVR_SLAB_MAX)
+        return bk_slab_alloc(size);
+
+    n = (size + PVR_BUDDY_UNIT - 1) >> PVR_BUDDY_UNIT_BITS;
+
+    if(n > limit - first || bk_alloc_units(n, &u))
+        return NULL;
+
+    used_bytes += n << PVR_BUDDY_UNIT_BITS;
+
+    return (void *)bk_addr(u);
+}
+
+void pvr_buddy_free(void *ptr) {
+    uint32_t addr = (uint32_t)ptr, u;
+
+    if(!ptr || !units)
+        return;
+
+    u = ((addr & ~0xe0000000) - (PVR_RAM_INT_BASE & ~0xe0000000)) >>
+        PVR_BUDDY_UNIT_BITS;
+
+    if(u < first || u >= limit) {
+        dbglog(DBG_ERROR, "pvr_mem_free: %08lx isn't in the pool\n",
+               (unsigned long)addr);
+        return;
+    }
+
+    switch(units[u].state) {
+        case BK_SLAB:
+            bk_slab_free(units[u].slab, bk_addr(u) + (addr & (PVR_BUDDY_UNIT - 1)));
+            break;
+
+        case BK_USED:
+            used_bytes -= units[u].len << PVR_BUDDY_UNIT_BITS;
+            bk_free_range(u, units[u].len);
+            break;
+
+        default:
+            dbglog(DBG_ERROR, "pvr_mem_free: %08lx isn't allocated\n",
+                   (unsigned long)addr);
+            break;
+    }
+}
+
+void pvr_buddy_reset(uint32_t base, uint32_t top) {
+    uint32_t u;
+    int i;
+
+    /* Get rid of the slabs from before. */
+    if(units) {
+        for(u = first; u < limit; ++u) {
+            if(units[u].state == BK_SLAB)
+                free(units[u].slab);
+        }
+    }
+
+    for(i = 0; i < PVR_BUDDY_ORDERS; ++i)
+        free_list[i] = BK_NONE;
+
+    for(i = 0; i < PVR_SLAB_CLASSES; ++i)
+        LIST_INIT(&slabs[i]);
+
+    used_bytes = 0;
+
+    if(!base) {
+        free(units);
+        units = NULL;
+        return;
+    }
+
+    if(!units && !(units = (bk_unit_t *)malloc(PVR_BUDDY_UNITS *
+                                               sizeof(bk_unit_t)))) {
+        dbglog(DBG_ERROR, "pvr_mem: no memory for the allocator\n");
+        return;
+    }
+
+    memset(units, 0, PVR_BUDDY_UNITS * sizeof(bk_unit_t));
+
+    first = (base - PVR_RAM_INT_BASE + PVR_BUDDY_UNIT - 1) >>
+            PVR_BUDDY_UNIT_BITS;
+    limit = (top - PVR_RAM_INT_BASE) >> PVR_BUDDY_UNIT_BITS;
+
+    bk_free_range(first, limit - first);
+}
+
+void pvr_buddy_get_stats(pvr_mem_stats_t *stats) {
+    uint32_t u;
+    int i;
+
+    memset(stats, 0, sizeof(pvr_mem_stats_t));
+
+    if(!units)
+        return;
+
+    stats->total = (limit - first) << PVR_BUDDY_UNIT_BITS;
+    stats->used = used_bytes;
+    stats->free = stats->total - used_bytes;
+
+    for(i = 0; i < PVR_BUDDY_ORDERS; ++i) {
+        for(u = free_list[i]; u != BK_NONE; u = units[u].link.next) {
+            ++stats->free_blocks;
+            stats->largest_free = (size_t)PVR_BUDDY_UNIT << i;
+        }
+    }
+}
+
+void pvr_buddy_print_stats(void) {
+    pvr_mem_stats_t st;
+    bk_slab_t *slab;
+    int i, n, slots;
+
+    pvr_buddy_get_stats(&st);
+
+    printf("pool: %lu bytes, %lu used, %lu free in %lu blocks "
+           "(largest %lu)\n", (unsigned long)st.total,
+           (unsigned long)st.used, (unsigned long)st.free,
+           (unsigned long)st.free_blocks, (unsigned long)st.largest_free);
+
+    for(i = 0; i < PVR_SLAB_CLASSES; ++i) {
+        n = slots = 0;
+
+        LIST_FOREACH(slab, &slabs[i], list) {
+            ++n;
+            slots += slab->used;
+        }
+
+        if(n)
+            printf("  %4d byte slabs with room: %d, %d slots used\n",
+                   1 << (i + PVR_SLAB_MIN_BITS), n, slots);
+    }
+}
@@ -134,6 +134,9 @@ void pvr_sync_stats(int event) {
                 pvr_state.frame_count++;
                 break;
         }
+
+        if(pvr_prof_enabled)
+            pvr_prof_event(event, 0, t);
     }
 }
 
@@ -0,0 +1,432 @@
+/* KallistiOS ##version##
+
+   pvr_prof.c
+
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dc/pvr.h>
+#include <arch/irq.h>
+#include "pvr_internal.h"
+
+/*
+
+   Frame profiler
+
+   Each scene gets a number when it's begun, and a record in a ring of the
+   last few. The CPU side of things always happens to the scene that was
+   begun last. The rest of the pipeline works on older scenes, so which one
+   each stage is on is kept track of as they get it:
+
+   - The TA only ever has one scene at a time, since nothing can be sent to
+     it before the last scene's render has started. So it's on whichever
+     scene last had a list start going to it.
+   - The render starts on whatever the TA just finished.
+   - Whatever was last rendered to the screen is what gets flipped to.
+
+   Vertex DMA starts when pvr_scene_finish() is called, but might have to wait
+   for the last scene's DMA to be done, so the scene being DMA'd is only
+   switched once it has the DMA to itself. With more than two vertex buffers,
+   scenes can be queued up and sent later, so those remember their number.
+
+*/
+
+int pvr_prof_enabled;
+
+static pvr_prof_frame_t *prof_ring;
+static size_t prof_size;
+
+static uint32_t prof_next;      /* Number for the next scene */
+static uint32_t prof_cpu;       /* Scene being put together */
+static uint32_t prof_dma;       /* Scene being DMA'd */
+static uint32_t prof_ta;        /* Scene going into the TA */
+static uint32_t prof_rnd;       /* Scene being rendered */
+static uint32_t prof_flip;      /* Scene to flip to */
+
+static int prof_in_scene;
+static uint64_t prof_wait;      /* Time waited between scenes */
+static size_t prof_vbl;         /* VBlank count at the last flip */
+
+/* Get a scene's record, if it's still there. The ring has to have been read
+   with IRQs disabled, and they have to stay that way while the record is
+   used, since pvr_prof_stop() can free it otherwise. */
+static pvr_prof_frame_t *prof_frame(pvr_prof_frame_t *ring, uint32_t n) {
+    pvr_prof_frame_t *f;
+
+    if(!ring || !n)
+        return NULL;
+
+    f = &ring[n % prof_size];
+
+    return f->frame == n ? f : NULL;
+}
+
+int pvr_prof_start(size_t frames) {
+    pvr_prof_frame_t *ring;
+
+    if(!frames) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ring = (pvr_prof_frame_t *)calloc(frames, sizeof(pvr_prof_frame_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pvr_prof_stop();
+
+    irq_disable_scoped();
+
+    prof_ring = ring;
+    prof_size = frames;
+    prof_next = 1;
+    prof_cpu = prof_dma = prof_ta = prof_rnd = prof_flip = 0;
+    prof_in_scene = 0;
+    prof_wait = 0;
+    prof_vbl = 0;
+    pvr_prof_enabled = 1;
+
+    return 0;
+}
+
+void pvr_prof_stop(void) {
+    pvr_prof_frame_t *ring;
+    int o;
+
+    /* Unhook first. Anything that was using the ring did so with IRQs
+       disabled, so once they're back on, nothing can still have it. */
+    o = irq_disable();
+    pvr_prof_enabled = 0;
+    ring = prof_ring;
+    prof_ring = NULL;
+    irq_restore(o);
+
+    free(ring);
+}
+
+size_t pvr_prof_get(pvr_prof_frame_t *out, size_t max) {
+    pvr_prof_frame_t *ring, *f;
+    uint32_t n, first;
+    size_t count = 0;
+
+    irq_disable_scoped();
+
+    if(!(ring = prof_ring))
+        return 0;
+
+    first = prof_next > prof_size ? prof_next - prof_size : 1;
+
+    /* If there's not room for them all, keep the latest. */
+    if(prof_next - first > max)
+        first = prof_next - max;
+
+    for(n = first; n < prof_next; ++n) {
+        if((f = prof_frame(ring, n)))
+            out[count++] = *f;
+    }
+
+    return count;
+}
+
+void pvr_prof_count(int list, size_t size) {
+    pvr_prof_frame_t *f;
+
+    irq_disable_scoped();
+
+    f = prof_frame(prof_ring, prof_cpu);
+
+    if(f && prof_in_scene && list >= 0 && list < PVR_OPB_COUNT) {
+        f->lists[list].bytes += size;
+        f->lists[list].prims++;
+    }
+}
+
+uint32_t pvr_prof_scene(void) {
+    return prof_cpu;
+}
+
+void pvr_prof_event(int event, int list, uint64_t t) {
+    pvr_prof_frame_t *ring, *f;
+    uint64_t now;
+    size_t vbl;
+
+    /* This can be called from a thread that was between checking
+       pvr_prof_enabled and getting here when the profiler was stopped. */
+    irq_disable_scoped();
+
+    if(!(ring = prof_ring))
+        return;
+
+    switch(event) {
+        case PVR_PROF_SCENE_BEGIN:
+            prof_cpu = prof_next++;
+            f = &ring[prof_cpu % prof_size];
+            memset(f, 0, sizeof(pvr_prof_frame_t));
+            f->frame = prof_cpu;
+            f->begin = t;
+            f->ready_wait = prof_wait;
+            prof_wait = 0;
+            prof_in_scene = 1;
+            return;
+
+        case PVR_PROF_READY_WAIT:
+            now = timer_ns_gettime64();
+
+            if(!prof_in_scene)
+                prof_wait += now - t;
+            else if((f = prof_frame(ring, prof_cpu)))
+                f->ready_wait += now - t;
+
+            return;
+
+        case PVR_PROF_DMA_WAIT:
+            now = timer_ns_gettime64();
+            prof_dma = list ? (uint32_t)list : prof_cpu;
+
+            if((f = prof_frame(ring, prof_dma)))
+                f->dma_wait += now - t;
+
+            return;
+    }
+
+    switch(event) {
+        case PVR_PROF_SCENE_FINISH:
+        case PVR_PROF_LIST_BEGIN:
+        case PVR_PROF_LIST_FINISH:
+        case PVR_PROF_LIST_SQ:
+            f = prof_frame(ring, prof_cpu);
+            break;
+
+        case PVR_PROF_LIST_DMA:
+            f = prof_frame(ring, prof_dma);
+            break;
+
+        case PVR_PROF_LIST_DONE:
+        case PVR_SYNC_REGDONE:
+        case PVR_SYNC_RNDSTART:
+            f = prof_frame(ring, prof_ta);
+            break;
+
+        case PVR_SYNC_RNDDONE:
+            f = prof_frame(ring, prof_rnd);
+            break;
+
+        case PVR_SYNC_PAGEFLIP:
+            f = prof_frame(ring, prof_flip);
+            break;
+
+        default:
+            return;
+    }
+
+    if(!f)
+        return;
+
+    switch(event) {
+        case PVR_PROF_SCENE_FINISH:
+            f->finish = t;
+            prof_in_scene = 0;
+            break;
+
+        case PVR_PROF_LIST_BEGIN:
+            if(!f->lists[list].open)
+                f->lists[list].open = t;
+            break;
+
+        case PVR_PROF_LIST_FINISH:
+            f->lists[list].close = t;
+            break;
+
+        case PVR_PROF_LIST_SQ:
+        case PVR_PROF_LIST_DMA:
+            prof_ta = f->frame;
+
+            if(!f->lists[list].ta_start)
+                f->lists[list].ta_start = t;
+
+            if(!f->reg_start)
+                f->reg_start = t;
+
+            break;
+
+        case PVR_PROF_LIST_DONE:
+            f->lists[list].ta_done = t;
+            break;
+
+        case PVR_SYNC_REGDONE:
+            f->reg_done = t;
+            f->vtx_buf_used = pvr_state.vtx_buf_used;
+            break;
+
+        case PVR_SYNC_RNDSTART:
+            f->rnd_start = t;
+            prof_rnd = f->frame;
+            break;
+
+        case PVR_SYNC_RNDDONE:
+            f->rnd_done = t;
+
+            /* Renders to textures don't get flipped to. */
+            if(pvr_state.render_completed)
+                prof_flip = f->frame;
+
+            break;
+
+        case PVR_SYNC_PAGEFLIP:
+            f->flip = t;
+            vbl = pvr_state.vbl_count;
+
+            if(prof_vbl && vbl - prof_vbl > 1)
+                f->vbl_missed = vbl - prof_vbl - 1;
+
+            prof_vbl = vbl;
+            prof_flip = 0;
+            break;
+    }
+}
+
+/**** Chrome trace export *********************************************/
+
+#define TRACK_CPU       1
+#define TRACK_TA        2
+#define TRACK_RENDER    3
+#define TRACK_DISPLAY   4
+
+static const char *const prof_tracks[] = {
+    NULL, "CPU", "TA", "Render", "Display"
+};
+
+static const char *const prof_lists[] = {
+    "OP_POLY", "OP_MOD", "TR_POLY", "TR_MOD", "PT_POLY"
+};
+
+/* Trace times are in microseconds. */
+static void prof_time(FILE *fp, const char *key, uint64_t ns) {
+    fprintf(fp, "\"%s\":%" PRIu64 ".%03u", key, ns / 1000,
+            (unsigned int)(ns % 1000));
+}
+
+/* Write the start of an event, up to where its arguments would go. */
+static void prof_event(FILE *fp, int *first, const char *name, int track,
+                       uint64_t start, uint64_t end) {
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"pid\":1,\"tid\":%d,", *first ? "" : ",",
+            name, track);
+    *first = 0;
+
+    if(end) {
+        fprintf(fp, "\"ph\":\"X\",");
+        prof_time(fp, "ts", start);
+        fputc(',', fp);
+        prof_time(fp, "dur", end > start ? end - start : 0);
+    }
+    else {
+        fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+        prof_time(fp, "ts", start);
+    }
+}
+
+static void prof_write_frame(FILE *fp, int *first, const pvr_prof_frame_t *f) {
+    const pvr_prof_list_t *l;
+    char name[32];
+    int i;
+
+    sprintf(name, "frame %" PRIu32, f->frame);
+
+    if(f->ready_wait && f->begin) {
+        prof_event(fp, first, "wait ready", TRACK_CPU,
+                   f->begin - f->ready_wait, f->begin);
+        fprintf(fp, "}");
+    }
+
+    if(f->finish) {
+        prof_event(fp, first, name, TRACK_CPU, f->begin, f->finish);
+        fprintf(fp, ",\"args\":{\"ready_wait_ns\":%" PRIu64
+                ",\"dma_wait_ns\":%" PRIu64 "}}", f->ready_wait, f->dma_wait);
+    }
+
+    for(i = 0; i < PVR_OPB_COUNT; ++i) {
+        l = &f->lists[i];
+
+        if(l->open && l->close) {
+            prof_event(fp, first, prof_lists[i], TRACK_CPU, l->open, l->close);
+            fprintf(fp, ",\"args\":{\"bytes\":%" PRIu32 ",\"prims\":%" PRIu32
+                    "}}", l->bytes, l->prims);
+        }
+
+        if(l->ta_start && l->ta_done) {
+            prof_event(fp, first, prof_lists[i], TRACK_TA, l->ta_start,
+                       l->ta_done);
+            fprintf(fp, ",\"args\":{\"frame\":%" PRIu32 "}}", f->frame);
+        }
+    }
+
+    if(f->reg_start && f->reg_done) {
+        prof_event(fp, first, name, TRACK_TA, f->reg_start, f->reg_done);
+        fprintf(fp, ",\"args\":{\"vtx_buf_used\":%zu}}", f->vtx_buf_used);
+    }
+
+    if(f->rnd_start && f->rnd_done) {
+        prof_event(fp, first, name, TRACK_RENDER, f->rnd_start, f->rnd_done);
+        fprintf(fp, "}");
+    }
+
+    if(f->flip) {
+        prof_event(fp, first, name, TRACK_DISPLAY, f->flip, 0);
+        fprintf(fp, ",\"args\":{\"vbl_missed\":%" PRIu32 "}}", f->vbl_missed);
+    }
+}
+
+int pvr_prof_export(const char *path) {
+    pvr_prof_frame_t *frames;
+    size_t count, i;
+    FILE *fp;
+    int first = 1, rv = 0;
+
+    if(!pvr_prof_enabled) {
+        errno = EPERM;
+        return -1;
+    }
+
+    /* Take a copy, so that nothing changes while it's written out. */
+    if(!(frames = (pvr_prof_frame_t *)malloc(prof_size *
+                                             sizeof(pvr_prof_frame_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    count = pvr_prof_get(frames, prof_size);
+
+    if(!(fp = fopen(path, "w"))) {
+        free(frames);
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for(i = TRACK_CPU; i <= TRACK_DISPLAY; ++i) {
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",",
+                (int)i, prof_tracks[i]);
+        first = 0;
+    }
+
+    for(i = 0; i < count; ++i)
+        prof_write_frame(fp, &first, &frames[i]);
+
+    fprintf(fp, "\n]}\n");
+
+    if(ferror(fp))
+        rv = -1;
+
+    if(fclose(fp))
+        rv = -1;
+
+    free(frames);
+
+    return rv;
+}
@@ -7,8 +7,10 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <kos/dbglog.h>
 #include <kos/genwait.h>
@@ -33,8 +35,196 @@
 
 */
 
+/* Wait for the TA to be free for the next scene. */
+static int pvr_wait_ta(void) {
+    int flags, t = 0;
+    uint64_t start;
+
+    flags = irq_disable();
+
+    if(pvr_state.ta_busy) {
+        start = pvr_prof_enabled ? timer_ns_gettime64() : 0;
+        t = genwait_wait((void *)&pvr_state.ta_busy, "PVR wait ready", 100, NULL);
+
+        if(start)
+            pvr_prof_event(PVR_PROF_READY_WAIT, 0, start);
+    }
+
+    irq_restore(flags);
+
+    if(t < 0) {
+#if 0
+        dbglog(DBG_WARNING, "pvr_wait_ready: timed out\n");
+        printf("VERTBUF_ADDR: %08lx\n", PVR_GET(PVR_ISP_VERTBUF_ADDR));
+        printf("TILEMAT_ADDR: %08lx\n", PVR_GET(PVR_ISP_TILEMAT_ADDR));
+        printf("OPB_START: %08lx\n", PVR_GET(PVR_TA_OPB_START));
+        printf("OPB_END: %08lx\n", PVR_GET(PVR_TA_OPB_END));
+        printf("OPB_POS: %08lx\n", PVR_GET(PVR_TA_OPB_POS));
+        printf("OPB_INIT: %08lx\n", PVR_GET(PVR_TA_OPB_INIT));
+        printf("VERTBUF_START: %08lx\n", PVR_GET(PVR_TA_VERTBUF_START));
+        printf("VERTBUF_END: %08lx\n", PVR_GET(PVR_TA_VERTBUF_END));
+        printf("VERTBUF_POS: %08lx\n", PVR_GET(PVR_TA_VERTBUF_POS));
+#endif
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Wait for there to be no more than max finished scenes still waiting to go
+   to the TA. */
+static int pvr_wait_queued(int max) {
+    int flags, t = 0;
+    uint64_t start;
+
+    flags = irq_disable();
+
+    if(pvr_state.dma_queued > max) {
+        start = pvr_prof_enabled ? timer_ns_gettime64() : 0;
+
+        while(pvr_state.dma_queued > max && t >= 0)
+            t = genwait_wait((void *)&pvr_state.dma_queued, "PVR wait queue",
+                             100, NULL);
+
+        if(start)
+            pvr_prof_event(PVR_PROF_READY_WAIT, 0, start);
+    }
+
+    irq_restore(flags);
+
+    return t < 0 ? -1 : 0;
+}
+
+/* Wait until there are no more than max finished scenes still waiting to
+   go to the TA, however long it takes. This is for when a buffer is about to
+   be reused or freed, so carrying on after a timeout would pull it out from
+   under the DMA. */
+static void pvr_wait_queued_all(int max) {
+    while(pvr_wait_queued(max) < 0)
+        dbglog(DBG_WARNING, "pvr: still waiting for queued vertex DMA\n");
+}
+
+/* Make sure none of the DMA buffers are queued up or being sent, so they can
+   be changed. The queue has to be empty before taking the DMA lock, as the
+   worker needs the lock to empty it, and then it's checked again under the
+   lock in case anything snuck in. Returns with the lock held. */
+static void vertbuf_drain(void) {
+    for(;;) {
+        pvr_wait_queued_all(0);
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+
+        if(!pvr_state.dma_queued)
+            return;
+
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+}
+
+/* Free a list's overflow chunks in one of the DMA buffers. */
+static void vertbuf_free_list(pvr_dma_buffers_t *b, int list) {
+    pvr_vertbuf_chunk_t *c, *n;
+
+    for(c = b->chunks[list]; c; c = n) {
+        n = c->next;
+        free(c);
+    }
+
+    b->chunks[list] = NULL;
+    b->cur[list] = NULL;
+}
+
+void pvr_vertbuf_free_chunks(void) {
+    int i, j;
+
+    for(i = 0; i < PVR_VERTBUF_MAX; i++) {
+        for(j = 0; j < PVR_OPB_COUNT; j++)
+            vertbuf_free_list((pvr_dma_buffers_t *)&pvr_state.dma_buffers[i], j);
+    }
+}
+
+/* Get the end of what's in a list's buffer, making sure there's room for
+   size more bytes there. If there isn't, move on to the next overflow chunk,
+   or add one if growing is allowed. The last 32 bytes of each are kept free
+   for the end of list marker. */
+static uint8 *vertbuf_room(pvr_dma_buffers_t *b, pvr_list_t list,
+                           size_t size) {
+    pvr_vertbuf_chunk_t *c = b->cur[list], *n, *next;
+    size_t len;
+
+    if(!c) {
+        if(b->ptr[list] + size + 32 <= b->size[list])
+            return b->base[list] + b->ptr[list];
+
+        n = b->chunks[list];
+    }
+    else {
+        if(c->ptr + size + 32 <= c->size)
+            return c->data + c->ptr;
+
+        n = c->next;
+    }
+
+    // Use the next chunk from an earlier scene if it's big enough, otherwise
+    // put a new one in its place. Nothing after the one being written is
+    // in use yet, so a chunk that's too small can just be let go, which
+    // keeps the chain no longer than the most any scene has needed.
+    if(!n || n->size < size + 32) {
+        if(!pvr_state.vtx_overflow[list])
+            return NULL;
+
+        if(n) {
+            next = n->next;
+            free(n);
+        }
+        else {
+            next = NULL;
+        }
+
+        if(c)
+            c->next = next;
+        else
+            b->chunks[list] = next;
+
+        len = pvr_state.vtx_overflow[list];
+
+        if(len < size + 32)
+            len = size + 32;
+
+        if(!(n = aligned_alloc(32, sizeof(pvr_vertbuf_chunk_t) + len)))
+            return NULL;
+
+        n->size = len;
+        n->ptr = 0;
+        n->next = next;
+
+        if(c)
+            c->next = n;
+        else
+            b->chunks[list] = n;
+    }
+
+    b->cur[list] = n;
+
+    return n->data + n->ptr;
+}
+
+static inline void vertbuf_advance(pvr_dma_buffers_t *b, pvr_list_t list,
+                                   size_t amt) {
+    if(b->cur[list])
+        b->cur[list]->ptr += amt;
+    else
+        b->ptr[list] += amt;
+}
+
+static inline pvr_dma_buffers_t *vertbuf_target(void) {
+    return (pvr_dma_buffers_t *)&pvr_state.dma_buffers[pvr_state.ram_target];
+}
+
 void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len) {
+    pvr_dma_buffers_t *b;
     void *oldbuf;
+    size_t slice;
+    int i;
 
     // Make sure we have global DMA usage enabled. The DMA can still
     // be used in other situations, but the user must take care of
@@ -51,55 +241,119 @@ void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len) {
     assert(__is_aligned(buffer, 32));
     assert(!(len & 63));
 
+    // Each scene gets an equal slice, with room for at least a blank
+    // header and the end of list marker.
+    slice = (len / pvr_state.dma_buf_count) & ~31;
+    assert(slice >= 64);
+
+    // Nothing can still be sending from the old buffer or its chunks.
+    vertbuf_drain();
+
     // Save the old value.
     oldbuf = pvr_state.dma_buffers[0].base[list];
 
     // Write new values.
-    pvr_state.dma_buffers[0].base[list] = (uint8 *)buffer;
-    pvr_state.dma_buffers[0].ptr[list] = 0;
-    pvr_state.dma_buffers[0].size[list] = len / 2;
-    pvr_state.dma_buffers[0].ready = 0;
-    pvr_state.dma_buffers[1].base[list] = ((uint8 *)buffer) + len / 2;
-    pvr_state.dma_buffers[1].ptr[list] = 0;
-    pvr_state.dma_buffers[1].size[list] = len / 2;
-    pvr_state.dma_buffers[1].ready = 0;
+    for(i = 0; i < pvr_state.dma_buf_count; i++) {
+        b = (pvr_dma_buffers_t *)&pvr_state.dma_buffers[i];
+        vertbuf_free_list(b, list);
+        b->base[list] = ((uint8 *)buffer) + i * slice;
+        b->ptr[list] = 0;
+        b->size[list] = slice;
+        b->ready = 0;
+    }
+
+    mutex_unlock((mutex_t *)&pvr_state.dma_lock);
 
     return oldbuf;
 }
 
+void pvr_set_vertbuf_overflow(pvr_list_t list, size_t chunk) {
+    int i;
+
+    assert(pvr_state.dma_mode);
+    assert(list < PVR_OPB_COUNT);
+    assert(!(chunk & 31));
+
+    pvr_state.vtx_overflow[list] = chunk;
+
+    if(!chunk) {
+        vertbuf_drain();
+
+        for(i = 0; i < PVR_VERTBUF_MAX; i++)
+            vertbuf_free_list((pvr_dma_buffers_t *)&pvr_state.dma_buffers[i],
+                              list);
+
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+}
+
 void *pvr_vertbuf_tail(pvr_list_t list) {
-    uint8 *bufbase;
+    pvr_dma_buffers_t *b;
 
     // Check the validity of the request.
     assert(list < PVR_OPB_COUNT);
     assert(pvr_state.dma_mode);
 
     // Get the buffer base.
-    bufbase = pvr_state.dma_buffers[pvr_state.ram_target].base[list];
-    assert(bufbase);
+    b = vertbuf_target();
+    assert(b->base[list]);
 
     // Return the current end of the buffer.
-    return bufbase + pvr_state.dma_buffers[pvr_state.ram_target].ptr[list];
+    if(b->cur[list])
+        return b->cur[list]->data + b->cur[list]->ptr;
+
+    return b->base[list] + b->ptr[list];
+}
+
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size) {
+    pvr_dma_buffers_t *b;
+
+    // Check the validity of the request.
+    assert(list < PVR_OPB_COUNT);
+    assert(pvr_state.dma_mode);
+    assert(!(size & 31));
+
+    b = vertbuf_target();
+    assert(b->base[list]);
+
+    return vertbuf_room(b, list, size);
 }
 
 void pvr_vertbuf_written(pvr_list_t list, size_t amt) {
-    uint32 val;
+    pvr_dma_buffers_t *b;
+    uint32 val, size;
 
     // Check the validity of the request.
     assert(list < PVR_OPB_COUNT);
     assert(pvr_state.dma_mode);
 
-    // Change the current end of the buffer.
-    val = pvr_state.dma_buffers[pvr_state.ram_target].ptr[list];
+    b = vertbuf_target();
+
+    if(b->cur[list]) {
+        val = b->cur[list]->ptr;
+        size = b->cur[list]->size;
+    }
+    else {
+        val = b->ptr[list];
+        size = b->size[list];
+    }
+
+    // Change the current end of the buffer, leaving room for the end of
+    // list marker.
     val += amt;
-    assert(val < pvr_state.dma_buffers[pvr_state.ram_target].size[list]);
-    pvr_state.dma_buffers[pvr_state.ram_target].ptr[list] = val;
+    assert(val + 32 <= size);
+    (void)size;
+    vertbuf_advance(b, list, amt);
 }
 
 static void pvr_start_ta_rendering(void) {
     // Make sure to wait until the TA is ready to start rendering a new scene
     if(!pvr_state.ta_checked_ready) {
-        pvr_wait_ready();
+        // Scenes that were queued up before this one have to go first.
+        if(pvr_state.dma_worker)
+            pvr_wait_queued_all(0);
+
+        pvr_wait_ta();
 
         // If using a single vertex buffer, we have to wait until the PVR is
         // done rendering to use the TA again.
@@ -120,8 +374,12 @@ static void pvr_start_ta_rendering(void) {
 /* Begin collecting data for a frame of 3D output to the off-screen
    frame buffer */
 void pvr_scene_begin(void) {
+    pvr_dma_buffers_t *b;
+    pvr_vertbuf_chunk_t *c;
     int i;
 
+    pvr_prof(PVR_PROF_SCENE_BEGIN, 0);
+
     pvr_state.next_to_texture = 0;
     pvr_state.ta_checked_ready = 0;
     pvr_state.lists_closed = 0;
@@ -131,8 +389,18 @@ void pvr_scene_begin(void) {
 
     // Clear these out in case we're using DMA.
     if(pvr_state.dma_mode) {
+        // With scenes queued up, the buffer might still be waiting to go.
+        if(pvr_state.dma_worker)
+            pvr_wait_queued_all(pvr_state.dma_buf_count - 1);
+
+        b = vertbuf_target();
+
         for(i = 0; i < PVR_OPB_COUNT; i++) {
-            pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+            b->ptr[i] = 0;
+            b->cur[i] = NULL;
+
+            for(c = b->chunks[i]; c; c = c->next)
+                c->ptr = 0;
         }
 
         pvr_sync_stats(PVR_SYNC_BUFSTART);
@@ -202,6 +470,11 @@ int pvr_list_begin(pvr_list_t list) {
     /* Ok, set the flag */
     pvr_state.list_reg_open = list;
 
+    pvr_prof(PVR_PROF_LIST_BEGIN, list);
+
+    if(!pvr_list_dma)
+        pvr_prof(PVR_PROF_LIST_SQ, list);
+
     return 0;
 }
 
@@ -242,12 +515,17 @@ int pvr_list_finish(void) {
         pvr_sq_set32((void *)0, 0, 32, PVR_DMA_TA);
     }
 
+    pvr_prof(PVR_PROF_LIST_FINISH, pvr_state.list_reg_open);
     pvr_state.list_reg_open = -1;
 
     return 0;
 }
 
 int pvr_prim(const void *data, size_t size) {
+    /* Recording into a display list? */
+    if(pvr_dlist_rec)
+        return pvr_dlist_rec_prim(data, size);
+
     /* Check to make sure we can do this */
     if(PVR_DEBUG && pvr_state.list_reg_open == -1) {
         dbglog(DBG_WARNING, "pvr_prim: attempt to submit to unopened list\n");
@@ -263,6 +541,7 @@ int pvr_prim(const void *data, size_t size) {
 
         /* Immediately send data via SQs. */
         sq_fast_cpy(SQ_MASK_DEST(PVR_TA_INPUT), data, size >> 5);
+        pvr_prof_prim(pvr_state.list_reg_open, size);
     }
     /* Defer data to RAM buffer for DMA-ing later. */
     else return pvr_list_prim(pvr_state.list_reg_open, data, size);
@@ -271,9 +550,10 @@ int pvr_prim(const void *data, size_t size) {
 }
 
 int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
-    volatile pvr_dma_buffers_t * b;
+    pvr_dma_buffers_t *b;
+    uint8 *dst;
 
-    b = pvr_state.dma_buffers + pvr_state.ram_target;
+    b = vertbuf_target();
 
     /* Ensure we associated a DMA vertex buffer with this list type. */
     assert(b->base[list]);
@@ -283,11 +563,15 @@ int pvr_list_prim(pvr_list_t list, const void *data, size_t size) {
     /* Ensure at least 4-byte alignment. */
     assert(!((uintptr_t)data & 0x3));
 
-    /* Ensure we won't overflow the vertex buffer. */
-    assert(b->ptr[list] + size <= b->size[list]);
+    /* Find room for it, growing the list if that's allowed. */
+    if(!(dst = vertbuf_room(b, list, size))) {
+        errno = ENOSPC;
+        return -1;
+    }
 
-    memcpy(b->base[list] + b->ptr[list], data, size);
-    b->ptr[list] += size;
+    memcpy(dst, data, size);
+    vertbuf_advance(b, list, size);
+    pvr_prof_prim(list, size);
 
     return 0;
 }
@@ -313,8 +597,9 @@ int pvr_list_flush(pvr_list_t list) {
    pvr_scene_begin() functions is called again. An error (-1) is returned if
    you have not started a scene already. */
 int pvr_scene_finish(void) {
-    int i, o;
-    volatile pvr_dma_buffers_t * b;
+    int i, o, queue;
+    pvr_dma_buffers_t *b;
+    uint8 *end;
 
     /* Release Store Queues if they are used */
     if(pvr_state.dr_used) {
@@ -326,7 +611,7 @@ int pvr_scene_finish(void) {
         // DBG(("pvr_scene_finish(dma -> %d)\n", pvr_state.ram_target));
         // If any enabled lists are empty, fill them with a blank polyhdr. Also
         // add a zero-marker to the end of each list.
-        b = pvr_state.dma_buffers + pvr_state.ram_target;
+        b = vertbuf_target();
 
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             /* We never enabled the list globally with pvr_init() - skip it */
@@ -347,30 +632,45 @@ int pvr_scene_finish(void) {
                 continue;
 
             // Make sure there's at least one primitive in each.
-            if(b->ptr[i] == 0) {
+            if(b->ptr[i] == 0 && !b->cur[i]) {
                 pvr_blank_polyhdr_buf(i, (pvr_poly_hdr_t*)(b->base[i]));
                 b->ptr[i] += 32;
             }
 
-            // Put a zero-marker on the end.
-            memset(b->base[i] + b->ptr[i], 0, 32);
-            b->ptr[i] += 32;
-
-            // Verify that there is no overrun.
-            assert(b->ptr[i] <= b->size[i]);
+            // Put a zero-marker on the end. There's always room kept for it.
+            end = (uint8 *)pvr_vertbuf_tail(i);
+            memset(end, 0, 32);
+            vertbuf_advance(b, i, 32);
         }
 
-        pvr_start_ta_rendering();
+        // With more than two buffers, the scene is queued up to be sent when
+        // the TA is free, unless something already went straight to the TA.
+        queue = pvr_state.dma_worker && !pvr_state.ta_checked_ready;
 
-        // Flip buffers and mark them complete.
+        if(queue) {
+            b->to_texture = pvr_state.next_to_texture;
+            b->to_txr_rp = pvr_state.next_to_txr_rp;
+            b->to_txr_addr = pvr_state.next_to_txr_addr;
+            b->prof_scene = pvr_prof_enabled ? pvr_prof_scene() : 0;
+        }
+        else {
+            pvr_start_ta_rendering();
+        }
+
+        // Move on to the next buffers and mark these complete.
         o = irq_disable();
-        pvr_state.dma_buffers[pvr_state.ram_target].ready = 1;
-        pvr_state.ram_target ^= 1;
+        b->ready = 1;
+        pvr_state.dma_queued++;
+        pvr_state.ram_target = (pvr_state.ram_target + 1) %
+                               pvr_state.dma_buf_count;
         irq_restore(o);
 
         pvr_sync_stats(PVR_SYNC_BUFDONE);
 
-        pvr_start_dma();
+        if(queue)
+            pvr_wake_dma();
+        else
+            pvr_start_dma();
     }
     else {
         /* If a list was open, close it */
@@ -388,44 +688,29 @@ int pvr_scene_finish(void) {
         }
     }
 
+    pvr_prof(PVR_PROF_SCENE_FINISH, 0);
+
     /* Ok, now it's just a matter of waiting for the interrupt... */
     return 0;
 }
 
 int pvr_wait_ready(void) {
-    int flags, t = 0;
-
     assert(pvr_state.valid);
 
-    flags = irq_disable();
+    // With scenes being queued up, a new one can be started as soon as
+    // there's a buffer for it.
+    if(pvr_state.dma_worker)
+        return pvr_wait_queued(pvr_state.dma_buf_count - 1);
 
-    if(pvr_state.ta_busy)
-        t = genwait_wait((void *)&pvr_state.ta_busy, "PVR wait ready", 100, NULL);
-
-    irq_restore(flags);
-
-    if(t < 0) {
-#if 0
-        dbglog(DBG_WARNING, "pvr_wait_ready: timed out\n");
-        printf("VERTBUF_ADDR: %08lx\n", PVR_GET(PVR_ISP_VERTBUF_ADDR));
-        printf("TILEMAT_ADDR: %08lx\n", PVR_GET(PVR_ISP_TILEMAT_ADDR));
-        printf("OPB_START: %08lx\n", PVR_GET(PVR_TA_OPB_START));
-        printf("OPB_END: %08lx\n", PVR_GET(PVR_TA_OPB_END));
-        printf("OPB_POS: %08lx\n", PVR_GET(PVR_TA_OPB_POS));
-        printf("OPB_INIT: %08lx\n", PVR_GET(PVR_TA_OPB_INIT));
-        printf("VERTBUF_START: %08lx\n", PVR_GET(PVR_TA_VERTBUF_START));
-        printf("VERTBUF_END: %08lx\n", PVR_GET(PVR_TA_VERTBUF_END));
-        printf("VERTBUF_POS: %08lx\n", PVR_GET(PVR_TA_VERTBUF_POS));
-#endif
-        return -1;
-    }
-
-    return 0;
+    return pvr_wait_ta();
 }
 
 int pvr_check_ready(void) {
     assert(pvr_state.valid);
 
+    if(pvr_state.dma_worker)
+        return pvr_state.dma_queued < pvr_state.dma_buf_count ? 0 : -1;
+
     if(!pvr_state.ta_busy)
         return 0;
     else
@@ -0,0 +1,627 @@
+/* KallistiOS ##version##
+
+   pvr_tcache.c
+
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <dc/pvr.h>
+#include <arch/timer.h>
+#include <kos/cond.h>
+#include <kos/dbglog.h>
+#include <kos/mutex.h>
+#include <kos/worker_thread.h>
+#include "pvr_internal.h"
+
+/*
+
+   VRAM texture cache
+
+   Every texture keeps a copy of itself in main RAM, exactly as it goes in
+   VRAM (or compressed), so dropping it from VRAM costs nothing and bringing
+   it back is one DMA. Textures in VRAM sit on a list in the order they were
+   last used in, so the ones at the head are the first to go when there isn't
+   room for another one.
+
+   VRAM is only ever allocated and freed by the thread using the cache, since
+   pvr_mem_malloc() isn't thread-safe. The worker thread just does the
+   copying, and the lock is only there to hand textures back and forth
+   between the two.
+
+*/
+
+/* Where a texture is. */
+typedef enum {
+    TC_EVICTED,                 /* Only in main RAM */
+    TC_QUEUED,                  /* Has VRAM, waiting to be copied there */
+    TC_UPLOADING,               /* Being copied to VRAM */
+    TC_RESIDENT,                /* In VRAM */
+    TC_FAILED                   /* Has VRAM, but couldn't be copied there */
+} tc_state_t;
+
+struct pvr_tcache_txr {
+    TAILQ_ENTRY(pvr_tcache_txr) lru;
+    kthread_job_t job;
+
+    void *data;                 /* The copy in main RAM */
+    size_t size;                /* Size of the texture in VRAM */
+    size_t stored;              /* Size of the copy, if compressed, or 0 */
+
+    pvr_ptr_t vram;
+    uint32_t last_frame;
+    tc_state_t state;
+};
+
+TAILQ_HEAD(tc_lru, pvr_tcache_txr);
+
+static struct tc_lru lru = TAILQ_HEAD_INITIALIZER(lru);
+static kthread_worker_t *worker;
+static mutex_t tc_lock = MUTEX_INITIALIZER;
+static condvar_t tc_done = COND_INITIALIZER;
+
+static size_t budget;
+static uint32_t frame;
+
+/* Counters for the frame in progress, and the totals. */
+static pvr_tcache_stats_t cur, last;
+static uint32_t count, resident;
+static size_t vram_bytes, ram_bytes;
+
+/* Staging buffer for decompressing textures into, only used by the worker. */
+static uint8_t *stage;
+static size_t stage_size;
+
+/*
+
+   Compression of the main RAM copies
+
+   This is a simple LZ77 scheme along the lines of LZ4, chosen because it
+   decompresses about as fast as it copies. The data is a series of runs of
+   literal bytes, each followed by a match: a copy of some bytes that came
+   earlier in the data. Each run starts with a token byte, with the number of
+   literals in the top four bits and the length of the match (minus its
+   minimum of four) in the bottom four. A value of 15 in either means that more
+   bytes follow to add to it, up to the first one that isn't 255. Then come
+   the literals, and then the match as a 16-bit offset back from where it
+   goes, and the rest of its length. The last run has no match.
+
+*/
+
+#define LZ_MIN_MATCH    4
+#define LZ_HASH_BITS    12
+#define LZ_MAX_OFFSET   65535
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_len(uint8_t *out, uint8_t *end, size_t n) {
+    for(; n >= 255; n -= 255) {
+        if(out >= end)
+            return NULL;
+
+        *out++ = 255;
+    }
+
+    if(out >= end)
+        return NULL;
+
+    *out++ = n;
+    return out;
+}
+
+/* Write out a run of literals and the match after it (if len isn't 0). */
+static uint8_t *lz_run(uint8_t *out, uint8_t *end, const uint8_t *lit,
+                       size_t nlit, size_t offset, size_t len) {
+    uint8_t *token = out++;
+
+    if(out > end)
+        return NULL;
+
+    *token = (nlit < 15 ? nlit : 15) << 4;
+
+    if(nlit >= 15 && !(out = lz_len(out, end, nlit - 15)))
+        return NULL;
+
+    if(out + nlit > end)
+        return NULL;
+
+    memcpy(out, lit, nlit);
+    out += nlit;
+
+    if(!len)
+        return out;
+
+    if(out + 2 > end)
+        return NULL;
+
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+
+    len -= LZ_MIN_MATCH;
+    *token |= len < 15 ? len : 15;
+
+    if(len >= 15)
+        out = lz_len(out, end, len - 15);
+
+    return out;
+}
+
+/* Compress n bytes, returning the compressed size, or 0 if it didn't get any
+   smaller. */
+static size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    uint32_t *table;
+    uint8_t *out = dst, *end = dst + n - 1;
+    size_t i = 0, anchor = 0, cand, len;
+    uint32_t h;
+
+    if(n < 16 || !(table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t))))
+        return 0;
+
+    while(i + LZ_MIN_MATCH <= n) {
+        h = lz_hash(lz_read32(src + i));
+        cand = table[h];
+        table[h] = i;
+
+        if(cand >= i || i - cand > LZ_MAX_OFFSET ||
+           lz_read32(src + cand) != lz_read32(src + i)) {
+            ++i;
+            continue;
+        }
+
+        for(len = LZ_MIN_MATCH; i + len < n &&
+            src[cand + len] == src[i + len]; ++len)
+            ;
+
+        if(!(out = lz_run(out, end, src + anchor, i - anchor, i - cand, len)))
+            break;
+
+        i += len;
+        anchor = i;
+    }
+
+    if(out)
+        out = lz_run(out, end, src + anchor, n - anchor, 0, 0);
+
+    free(table);
+    return out ? (size_t)(out - dst) : 0;
+}
+
+static void lz_decompress(const uint8_t *src, size_t n, uint8_t *dst) {
+    const uint8_t *end = src + n, *match;
+    size_t len, i;
+    uint8_t token;
+
+    while(src < end) {
+        token = *src++;
+        len = token >> 4;
+
+        if(len == 15) {
+            do {
+                len += *src;
+            } while(*src++ == 255);
+        }
+
+        memcpy(dst, src, len);
+        dst += len;
+        src += len;
+
+        if(src >= end)
+            break;
+
+        match = dst - (src[0] | (src[1] << 8));
+        src += 2;
+        len = token & 15;
+
+        if(len == 15) {
+            do {
+                len += *src;
+            } while(*src++ == 255);
+        }
+
+        /* The match may overlap what it's making, so go a byte at a time. */
+        for(i = 0; i < len + LZ_MIN_MATCH; ++i)
+            *dst++ = match[i];
+    }
+}
+
+/* Copy textures into VRAM. */
+static void tc_worker(void *d) {
+    pvr_tcache_txr_t *txr;
+    kthread_job_t *job;
+    uint64_t start, t;
+    const void *src;
+    size_t size;
+    int ok;
+
+    (void)d;
+
+    while((job = thd_worker_dequeue_job(worker))) {
+        txr = (pvr_tcache_txr_t *)job->data;
+        size = __align_up(txr->size, 32);
+
+        mutex_lock(&tc_lock);
+        txr->state = TC_UPLOADING;
+        mutex_unlock(&tc_lock);
+
+        start = timer_us_gettime64();
+        src = txr->data;
+
+        if(txr->stored) {
+            if(stage_size < size) {
+                free(stage);
+                stage_size = 0;
+
+                if(!(stage = aligned_alloc(32, size)))
+                    dbglog(DBG_ERROR, "pvr_tcache: out of memory\n");
+                else
+                    stage_size = size;
+            }
+
+            if(stage) {
+                lz_decompress(txr->data, txr->stored, stage);
+                src = stage;
+            }
+            else {
+                src = NULL;
+            }
+        }
+
+        ok = src != NULL;
+
+        if(ok) {
+            mutex_lock((mutex_t *)&pvr_state.dma_lock);
+
+            if(pvr_txr_load_dma(src, txr->vram, size, true, NULL, NULL) < 0) {
+                dbglog(DBG_ERROR, "pvr_tcache: DMA to VRAM failed\n");
+                ok = 0;
+            }
+
+            mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+        }
+
+        t = timer_us_gettime64() - start;
+
+        mutex_lock(&tc_lock);
+
+        /* If it couldn't be decompressed or copied, it stays on the list so
+           that its VRAM is freed up (in the right thread) the next time it's
+           looked at, or as soon as room is needed. */
+        txr->state = ok ? TC_RESIDENT : TC_FAILED;
+        txr->last_frame = ok ? frame : 0;
+
+        if(ok) {
+            TAILQ_INSERT_TAIL(&lru, txr, lru);
+
+            ++cur.uploads;
+            cur.upload_bytes += size;
+            cur.upload_us += t;
+        }
+        else {
+            TAILQ_INSERT_HEAD(&lru, txr, lru);
+        }
+
+        cond_broadcast(&tc_done);
+        mutex_unlock(&tc_lock);
+    }
+}
+
+/* Drop a texture from VRAM. Called with the lock held. */
+static void tc_evict(pvr_tcache_txr_t *txr) {
+    TAILQ_REMOVE(&lru, txr, lru);
+    pvr_mem_free(txr->vram);
+
+    txr->vram = NULL;
+    txr->state = TC_EVICTED;
+
+    vram_bytes -= __align_up(txr->size, 32);
+    --resident;
+    ++cur.evictions;
+}
+
+/* Find room in VRAM, dropping textures that haven't been used lately if
+   needed. Called with the lock held. */
+static pvr_ptr_t tc_alloc(size_t size) {
+    pvr_tcache_txr_t *old;
+    pvr_ptr_t rv;
+
+    for(;;) {
+        if(!budget || vram_bytes + size <= budget) {
+            if((rv = pvr_mem_malloc(size)))
+                return rv;
+        }
+
+        old = TAILQ_FIRST(&lru);
+
+        if(!old || old->last_frame + PVR_TCACHE_KEEP_FRAMES > frame)
+            return NULL;
+
+        tc_evict(old);
+    }
+}
+
+int pvr_tcache_init(size_t vram_budget) {
+    if(worker)
+        return 0;
+
+    if(!(worker = thd_worker_create(tc_worker, NULL)))
+        return -1;
+
+    /* Start the frames far enough along that a texture that was never used
+       isn't kept around. */
+    budget = vram_budget;
+    frame = PVR_TCACHE_KEEP_FRAMES;
+    memset(&cur, 0, sizeof(cur));
+    memset(&last, 0, sizeof(last));
+
+    return 0;
+}
+
+void pvr_tcache_shutdown(void) {
+    pvr_tcache_txr_t *txr;
+
+    if(!worker)
+        return;
+
+    /* Anything that's still in the cache is lost, but its memory isn't. */
+    mutex_lock(&tc_lock);
+
+    while(resident) {
+        if((txr = TAILQ_FIRST(&lru)))
+            tc_evict(txr);
+        else
+            cond_wait(&tc_done, &tc_lock);
+    }
+
+    mutex_unlock(&tc_lock);
+
+    thd_worker_destroy(worker);
+    worker = NULL;
+
+    free(stage);
+    stage = NULL;
+    stage_size = 0;
+}
+
+static pvr_tcache_txr_t *tc_new(size_t size) {
+    pvr_tcache_txr_t *txr;
+
+    if(!(txr = (pvr_tcache_txr_t *)calloc(1, sizeof(pvr_tcache_txr_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Pad it out so that it can always be copied 32 bytes at a time. */
+    if(!(txr->data = aligned_alloc(32, __align_up(size, 32)))) {
+        free(txr);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    txr->size = size;
+    txr->job.data = txr;
+    txr->state = TC_EVICTED;
+
+    return txr;
+}
+
+/* Swap the copy for a compressed one, if it's any smaller. */
+static void tc_compress(pvr_tcache_txr_t *txr) {
+    uint8_t *buf, *tmp;
+    size_t n;
+
+    if(!(buf = (uint8_t *)malloc(txr->size)))
+        return;
+
+    if((n = lz_compress(txr->data, txr->size, buf))) {
+        if((tmp = (uint8_t *)realloc(buf, n))) {
+            free(txr->data);
+            txr->data = tmp;
+            txr->stored = n;
+            return;
+        }
+    }
+
+    free(buf);
+}
+
+static pvr_tcache_txr_t *tc_insert(pvr_tcache_txr_t *txr, uint32_t flags) {
+    if(flags & PVR_TCACHE_COMPRESS)
+        tc_compress(txr);
+
+    mutex_lock(&tc_lock);
+    ++count;
+    ram_bytes += txr->stored ? txr->stored : __align_up(txr->size, 32);
+    mutex_unlock(&tc_lock);
+
+    return txr;
+}
+
+/* How big a texture is once loaded by pvr_txr_load_ex(). */
+static size_t tc_txr_size(uint32_t w, uint32_t h, uint32_t txr_flags) {
+    size_t texels, bpp;
+
+    if(txr_flags & PVR_TXRLOAD_VQ_LOAD)
+        return pvr_txr_vq_size(w, h, txr_flags);
+
+    switch(txr_flags & PVR_TXRLOAD_FMT_MASK) {
+        case PVR_TXRLOAD_4BPP:
+            bpp = 4;
+            break;
+        case PVR_TXRLOAD_8BPP:
+            bpp = 8;
+            break;
+        default:
+            bpp = 16;
+            break;
+    }
+
+    if(txr_flags & PVR_TXRLOAD_MIPMAP) {
+        /* A bit of padding and the 1x1 level come first. */
+        for(texels = 4; w > 1; w >>= 1)
+            texels += w * w;
+    }
+    else {
+        texels = w * h;
+    }
+
+    return (texels * bpp) >> 3;
+}
+
+pvr_tcache_txr_t *pvr_tcache_add(const void *src, uint32_t w, uint32_t h,
+                                 uint32_t txr_flags, uint32_t flags) {
+    pvr_tcache_txr_t *txr;
+
+    if(!(txr = tc_new(tc_txr_size(w, h, txr_flags))))
+        return NULL;
+
+    pvr_txr_load_ex(src, (pvr_ptr_t)txr->data, w, h, txr_flags &
+                    ~(PVR_TXRLOAD_DMA | PVR_TXRLOAD_SQ | PVR_TXRLOAD_NONBLOCK));
+
+    return tc_insert(txr, flags);
+}
+
+pvr_tcache_txr_t *pvr_tcache_add_raw(const void *data, size_t size,
+                                     uint32_t flags) {
+    pvr_tcache_txr_t *txr;
+
+    if(!(txr = tc_new(size)))
+        return NULL;
+
+    memcpy(txr->data, data, size);
+
+    return tc_insert(txr, flags);
+}
+
+void pvr_tcache_remove(pvr_tcache_txr_t *txr) {
+    if(!txr)
+        return;
+
+    mutex_lock(&tc_lock);
+
+    while(txr->state == TC_QUEUED || txr->state == TC_UPLOADING)
+        cond_wait(&tc_done, &tc_lock);
+
+    if(txr->state == TC_RESIDENT || txr->state == TC_FAILED)
+        tc_evict(txr);
+
+    --count;
+    ram_bytes -= txr->stored ? txr->stored : __align_up(txr->size, 32);
+    mutex_unlock(&tc_lock);
+
+    free(txr->data);
+    free(txr);
+}
+
+/* Look up a texture, starting to bring it into VRAM if it isn't there. Called
+   with the lock held. */
+static pvr_ptr_t tc_use(pvr_tcache_txr_t *txr) {
+    size_t size = __align_up(txr->size, 32);
+
+    if(txr->state == TC_RESIDENT) {
+        ++cur.hits;
+
+        /* Only move it along the list the first time it's used each frame. */
+        if(txr->last_frame != frame) {
+            txr->last_frame = frame;
+            TAILQ_REMOVE(&lru, txr, lru);
+            TAILQ_INSERT_TAIL(&lru, txr, lru);
+        }
+
+        return txr->vram;
+    }
+
+    ++cur.misses;
+
+    if(txr->state == TC_FAILED)
+        tc_evict(txr);
+
+    if(txr->state == TC_EVICTED) {
+        if(!(txr->vram = tc_alloc(size)))
+            return NULL;
+
+        txr->state = TC_QUEUED;
+        vram_bytes += size;
+        ++resident;
+
+        thd_worker_add_job(worker, &txr->job);
+        thd_worker_wakeup(worker);
+    }
+
+    return NULL;
+}
+
+pvr_ptr_t pvr_tcache_use(pvr_tcache_txr_t *txr) {
+    pvr_ptr_t rv;
+
+    if(!worker) {
+        errno = EPERM;
+        return NULL;
+    }
+
+    mutex_lock(&tc_lock);
+    rv = tc_use(txr);
+    mutex_unlock(&tc_lock);
+
+    return rv;
+}
+
+pvr_ptr_t pvr_tcache_use_sync(pvr_tcache_txr_t *txr) {
+    pvr_ptr_t rv;
+
+    if(!worker) {
+        errno = EPERM;
+        return NULL;
+    }
+
+    mutex_lock(&tc_lock);
+
+    if(!(rv = tc_use(txr))) {
+        while(txr->state == TC_QUEUED || txr->state == TC_UPLOADING)
+            cond_wait(&tc_done, &tc_lock);
+
+        if(txr->state == TC_RESIDENT)
+            rv = txr->vram;
+    }
+
+    mutex_unlock(&tc_lock);
+
+    return rv;
+}
+
+void pvr_tcache_frame(void) {
+    mutex_lock(&tc_lock);
+
+    if(cur.upload_us)
+        cur.upload_rate = (uint32_t)(cur.upload_bytes * 1000000ULL /
+                                     cur.upload_us);
+
+    last = cur;
+    last.frame_count = ++frame - PVR_TCACHE_KEEP_FRAMES;
+    memset(&cur, 0, sizeof(cur));
+
+    mutex_unlock(&tc_lock);
+}
+
+void pvr_tcache_get_stats(pvr_tcache_stats_t *stats) {
+    mutex_lock(&tc_lock);
+
+    *stats = last;
+    stats->count = count;
+    stats->resident = resident;
+    stats->vram_bytes = vram_bytes;
+    stats->ram_bytes = ram_bytes;
+
+    mutex_unlock(&tc_lock);
+}
@@ -10,7 +10,10 @@
 #include <dc/pvr.h>
 #include <dc/sq.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
 #include <kos/regfield.h>
+#include <kos/thread.h>
+#include <stdlib.h>
 #include <string.h>
 #include "pvr_internal.h"
 
@@ -51,30 +54,308 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count) {
 /* Linear/iterative twiddling algorithm from Marcus' tatest */
 #define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
                      ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
 
 #define MIN(a, b) ( (a)<(b)? (a):(b) )
+#define MAX(a, b) ( (a)>(b)? (a):(b) )
+
+/*
+   Twiddled texture loading
+
+   In a twiddled texture, the texels of every aligned 2^n by 2^n square are
+   stored contiguously, so the texture can be twiddled a square tile at a time
+   and the tiles written out one after another. Each tile is twiddled with a
+   small lookup table into a staging buffer in cached RAM, and full staging
+   buffers are shipped out to VRAM with the Store Queues or with DMA. With
+   DMA, there are two staging buffers so that one can be filled while the
+   other is in flight.
+
+   Textures that aren't square are made of square blocks of the smaller side,
+   laid out one after another. Mipmapped textures (which must be square) have
+   their levels laid out from smallest to largest, after a bit of padding.
+*/
+
+/* Side of the tiles that textures are twiddled in, in texels. */
+#define TILE_SIZE       32
+
+/* Size of each staging buffer, in bytes. This must hold at least one full
+   16bpp tile, plus a partial Store Queue block carried over from the last
+   buffer. */
+#define STAGE_SIZE      4096
+
+/* Texels of padding at the start of a mipmapped texture, before the 1x1 level.
+   The padding is filled in with the 1x1 texel. */
+#define MIP_PAD         3
+
+/* Is an address in VRAM (either the 32-bit or the 64-bit area)? */
+#define TXR_IN_VRAM(a)  (((a) & 0x1e000000) == 0x04000000)
+
+#define TW4(n)  TWIDTAB((n)), TWIDTAB(((n) + 1)), TWIDTAB(((n) + 2)), \
+                TWIDTAB(((n) + 3))
+#define TW16(n) TW4((n)), TW4((n) + 4), TW4((n) + 8), TW4((n) + 12)
+
+/* Twiddled offsets of the rows and columns of a tile. */
+static const uint16_t twid_y[TILE_SIZE] = { TW16(0), TW16(16) };
+static const uint16_t twid_x[TILE_SIZE] = {
+#define TWX(n)  (TWIDTAB((n)) << 1)
+    TWX(0), TWX(1), TWX(2), TWX(3), TWX(4), TWX(5), TWX(6), TWX(7),
+    TWX(8), TWX(9), TWX(10), TWX(11), TWX(12), TWX(13), TWX(14), TWX(15),
+    TWX(16), TWX(17), TWX(18), TWX(19), TWX(20), TWX(21), TWX(22), TWX(23),
+    TWX(24), TWX(25), TWX(26), TWX(27), TWX(28), TWX(29), TWX(30), TWX(31)
+#undef TWX
+};
+
+static uint8_t stage_buf[2][STAGE_SIZE] __attribute__((aligned(32)));
+static mutex_t stage_lock = MUTEX_INITIALIZER;
+
+typedef struct {
+    const uint8_t *src;         /* The level being loaded */
+    uint32_t w, h;              /* Size of the level, in texels */
+    uint32_t bpp;               /* Bits per texel of the source */
+    uint32_t flags;
+
+    uint8_t *buf;               /* Staging buffer being filled */
+    size_t fill;                /* Bytes in it so far */
+    int cur;                    /* Which staging buffer buf is */
+    uintptr_t dst;              /* Where in VRAM buf goes */
+} txr_load_t;
+
+static inline const uint8_t *txr_row(const txr_load_t *l, uint32_t y) {
+    if(l->flags & PVR_TXRLOAD_INVERT_Y)
+        y = l->h - 1 - y;
+
+    return l->src + ((y * l->w * l->bpp) >> 3);
+}
+
+/* Bytes taken up by a number of texels once loaded. */
+static inline size_t txr_bytes(const txr_load_t *l, size_t texels) {
+    return (texels * MIN(l->bpp, 16)) >> 3;
+}
+
+/* Twiddle the t by t tile at (x0, y0) into the staging buffer. */
+static void txr_tile(txr_load_t *l, uint32_t x0, uint32_t y0, uint32_t t) {
+    uint32_t x, y;
+
+    switch(l->bpp) {
+        case 4: {
+            /* Each byte holds a texel and the one below it. */
+            uint8_t *out = l->buf + l->fill;
+            const uint8_t *r0, *r1;
+            uint32_t a, b;
+
+            for(y = 0; y < t; y += 2) {
+                r0 = txr_row(l, y0 + y);
+                r1 = txr_row(l, y0 + y + 1);
+
+                for(x = 0; x < t; ++x) {
+                    a = r0[(x0 + x) >> 1] >> (((x0 + x) & 1) << 2);
+                    b = r1[(x0 + x) >> 1] >> (((x0 + x) & 1) << 2);
+                    out[(twid_y[y] | twid_x[x]) >> 1] = (a & 15) | (b << 4);
+                }
+            }
+        }
+        break;
+
+        case 8: {
+            /* Likewise, each 16-bit word holds a texel and the one below. */
+            uint16_t *out = (uint16_t *)(l->buf + l->fill);
+            const uint8_t *r0, *r1;
+
+            for(y = 0; y < t; y += 2) {
+                r0 = txr_row(l, y0 + y) + x0;
+                r1 = txr_row(l, y0 + y + 1) + x0;
+
+                for(x = 0; x < t; ++x)
+                    out[(twid_y[y] | twid_x[x]) >> 1] = r0[x] | (r1[x] << 8);
+            }
+        }
+        break;
+
+        case 16: {
+            uint16_t *out = (uint16_t *)(l->buf + l->fill);
+            const uint16_t *r;
+
+            for(y = 0; y < t; ++y) {
+                r = (const uint16_t *)txr_row(l, y0 + y) + x0;
+
+                for(x = 0; x < t; ++x)
+                    out[twid_y[y] | twid_x[x]] = r[x];
+            }
+        }
+        break;
+
+        case 32: {
+            uint16_t *out = (uint16_t *)(l->buf + l->fill);
+            const uint32_t *r;
+
+            for(y = 0; y < t; ++y) {
+                r = (const uint32_t *)txr_row(l, y0 + y) + x0;
+
+                for(x = 0; x < t; ++x)
+                    out[twid_y[y] | twid_x[x]] =
+                        pvr_txr_conv32(r[x], l->flags);
+            }
+        }
+        break;
+    }
+
+    l->fill += txr_bytes(l, t * t);
+}
+
+/* Write out the staging buffer. Unless this is the last of the texture, only
+   whole 32-byte blocks are written, and whatever is left over is carried over
+   to the start of the next buffer. */
+static void txr_ship(txr_load_t *l, int last) {
+    size_t n = l->fill & ~31, i;
+    uint8_t *next;
+
+    if(!TXR_IN_VRAM(l->dst)) {
+        /* The texture is being put together in main RAM, to be loaded into
+           VRAM later on. */
+        n = last ? l->fill : n;
+        memcpy((void *)l->dst, l->buf, n);
+    }
+    else if(l->dst & 31) {
+        /* Can't use the Store Queues or DMA on this, so do it the slow way. */
+        n = last ? l->fill : n;
+
+        for(i = 0; i < n; i += 2)
+            *(volatile uint16_t *)(l->dst + i) = *(uint16_t *)(l->buf + i);
+    }
+    else if(n && (l->flags & PVR_TXRLOAD_DMA)) {
+        while(!pvr_dma_ready())
+            thd_pass();
+
+        pvr_txr_load_dma(l->buf, (pvr_ptr_t)l->dst, n, false, NULL, NULL);
+    }
+    else if(n) {
+        pvr_txr_load(l->buf, (pvr_ptr_t)l->dst, n);
+    }
+
+    l->dst += n;
+
+    if(last) {
+        /* Anything past the last whole block is written by hand, rather than
+           clobbering whatever is after the texture. */
+        if(l->flags & PVR_TXRLOAD_DMA) {
+            while(!pvr_dma_ready())
+                thd_pass();
+        }
+
+        for(i = n; i < l->fill; i += 2)
+            *(volatile uint16_t *)(l->dst + i - n) = *(uint16_t *)(l->buf + i);
+
+        return;
+    }
+
+    l->cur ^= 1;
+    next = stage_buf[l->cur];
+    memcpy(next, l->buf + n, l->fill - n);
+    l->buf = next;
+    l->fill -= n;
+}
+
+/* Twiddle one whole texture (or mipmap level) into the staging buffers. */
+static void txr_twiddle(txr_load_t *l) {
+    uint32_t side = MIN(l->w, l->h), t = MIN(side, TILE_SIZE);
+    uint32_t squares = MAX(l->w, l->h) / side, tiles = (side / t) * (side / t);
+    uint32_t sq, i, x0, y0;
+    size_t tbytes = txr_bytes(l, t * t);
+
+    for(sq = 0; sq < squares; ++sq) {
+        x0 = l->w > l->h ? sq * side : 0;
+        y0 = l->w > l->h ? 0 : sq * side;
+
+        for(i = 0; i < tiles; ++i) {
+            if(l->fill + tbytes > STAGE_SIZE)
+                txr_ship(l, 0);
+
+            txr_tile(l, x0 + pvr_txr_untwid(i >> 1) * t,
+                     y0 + pvr_txr_untwid(i) * t, t);
+        }
+    }
+}
+
+/* Write the padding and the 1x1 level at the start of a mipmap chain. */
+static void txr_mip_base(txr_load_t *l, const uint8_t *src) {
+    uint16_t texel;
+    int i;
+
+    switch(l->bpp) {
+        case 4:
+            l->buf[l->fill++] = (src[0] & 15) | (src[0] << 4);
+            l->buf[l->fill++] = (src[0] & 15) | (src[0] << 4);
+            break;
+
+        case 8:
+            for(i = 0; i <= MIP_PAD; ++i)
+                l->buf[l->fill++] = src[0];
+            break;
+
+        default:
+            texel = l->bpp == 16 ? *(const uint16_t *)src :
+                    pvr_txr_conv32(*(const uint32_t *)src, l->flags);
+
+            for(i = 0; i <= MIP_PAD; ++i, l->fill += 2)
+                *(uint16_t *)(l->buf + l->fill) = texel;
+            break;
+    }
+}
+
+/* Compress a texture and load the result, which comes out already
+   twiddled. */
+static void txr_load_vq(txr_load_t *l, const void *src) {
+    size_t size = pvr_txr_vq_size(l->w, l->h, l->flags);
+    uint8_t *vq;
+
+    assert_msg(l->bpp >= 16 && (l->flags & PVR_TXRLOAD_CONV_MASK),
+               "VQ compression needs a 16bpp or 32bpp texture and its format");
+
+    /* DMA needs the source to be 32-byte aligned. */
+    if(!(vq = (uint8_t *)aligned_alloc(32, __align_up(size, 32)))) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: out of memory for VQ texture\n");
+        return;
+    }
+
+    if(pvr_txr_vq_encode(src, vq, l->w, l->h, l->flags, NULL)) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: can't VQ compress texture\n");
+        free(vq);
+        return;
+    }
+
+    l->buf = vq;
+    l->fill = size;
+
+    if(l->flags & PVR_TXRLOAD_DMA) {
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+        txr_ship(l, 1);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+    else {
+        txr_ship(l, 1);
+    }
+
+    free(vq);
+}
 
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
    in the process.
 
-   This is a modified version of Vincent Penne's general twiddling
-   function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
-   The rectangle does not need to be a square (not tested with h>w, but
-   this is just a matter of a rotation by PI/2 and UV swapping).
-
-   - w and h must be a power of 2
+   - w and h must be a power of 2, and equal if loading mipmaps
    - flags must be a logical OR of the various texture loading
      flags available:
-       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
-       PVR_TXRLOAD_VQ (not supported yet)
-       PVR_TXRLOAD_INVERT
-
+       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP
+       PVR_TXRLOAD_CONV_* (with _32BPP)
+       PVR_TXRLOAD_MIPMAP
+       PVR_TXRLOAD_VQ_LOAD (with _16BPP or _32BPP and a _CONV_* format)
+       PVR_TXRLOAD_INVERT_Y
+       PVR_TXRLOAD_DMA or PVR_TXRLOAD_SQ (the default)
 */
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
                      uint32_t flags) {
-    uint32_t x, y, yout, min, mask, bpp, invert;
+    txr_load_t l;
+    const uint8_t *level[11];
+    uint32_t bpp, n, lvl, top = 0;
 
     /* Make sure we're attempting something we can do */
     switch(flags & PVR_TXRLOAD_FMT_MASK) {
@@ -87,79 +368,69 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
         case PVR_TXRLOAD_16BPP:
             bpp = 16;
             break;
+        case PVR_TXRLOAD_32BPP:
+            assert_msg(flags & PVR_TXRLOAD_CONV_MASK,
+                       "No 16-bit format given to convert 32bpp texture to");
+            bpp = 32;
+            break;
         default:
             assert_msg(0, "Invalid format specifier in `flags'");
             bpp = 8;
     }
 
-    assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
-    invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
-
-    min = MIN(w, h);
-    mask = min - 1;
+    assert_msg(!(flags & PVR_TXRLOAD_MIPMAP) || w == h,
+               "Mipmapped textures must be square");
+
+    l.w = w;
+    l.h = h;
+    l.bpp = bpp;
+    l.flags = flags;
+    l.fill = 0;
+    l.cur = 0;
+    l.buf = stage_buf[0];
+    l.dst = (uintptr_t)dst;
+
+    if(flags & PVR_TXRLOAD_VQ_LOAD) {
+        txr_load_vq(&l, src);
+        return;
+    }
 
-    switch(bpp) {
-        case 4: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x += 2) {
-                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
-                         (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
-                }
-            }
-        }
-        break;
-        case 8: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
-                         (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
-                }
-            }
+    if(flags & PVR_TXRLOAD_MIPMAP) {
+        /* The levels follow each other in the source, largest first. */
+        for(n = w; n; n >>= 1, ++top) {
+            level[top] = (const uint8_t *)src;
+            src = (const uint8_t *)src + MAX((n * n * bpp) >> 3, 1);
         }
-        break;
-        case 16: {
-            uint16_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint16_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y++) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT(x & mask, yout & mask) +
-                         (x / min + yout / min)*min * min] = pixels[y * w + x];
-                }
-            }
+
+        --top;
+    }
+
+    mutex_lock(&stage_lock);
+
+    if(flags & PVR_TXRLOAD_DMA)
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+
+    if(!(flags & PVR_TXRLOAD_MIPMAP)) {
+        l.src = (const uint8_t *)src;
+        txr_twiddle(&l);
+    }
+    else {
+        /* In VRAM, the levels go from smallest to largest. */
+        txr_mip_base(&l, level[top]);
+
+        for(lvl = 1; lvl <= top; ++lvl) {
+            l.src = level[top - lvl];
+            l.w = l.h = 1 << lvl;
+            txr_twiddle(&l);
         }
-        break;
     }
+
+    txr_ship(&l, 1);
+
+    if(flags & PVR_TXRLOAD_DMA)
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+    mutex_unlock(&stage_lock);
 }
 
 /* Load a KOS Platform Independent Image (subject to restraint checking) */
@@ -184,9 +455,13 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
     /* Convert it to a PVR image type */
     switch(fmt) {
         case KOS_IMG_FMT_RGB565:
+            fmt = PVR_TXRLOAD_16BPP | PVR_TXRLOAD_CONV_RGB565;
+            break;
         case KOS_IMG_FMT_ARGB4444:
+            fmt = PVR_TXRLOAD_16BPP | PVR_TXRLOAD_CONV_ARGB4444;
+            break;
         case KOS_IMG_FMT_ARGB1555:
-            fmt = PVR_TXRLOAD_16BPP;
+            fmt = PVR_TXRLOAD_16BPP | PVR_TXRLOAD_CONV_ARGB1555;
             break;
         case KOS_IMG_FMT_PAL4BPP:
             fmt = PVR_TXRLOAD_4BPP;
@@ -196,8 +471,9 @@ void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags) {
             break;
     }
 
-    /* Make sure the format part of the flags is clean */
-    flags = (flags & ~PVR_TXRLOAD_FMT_MASK) | fmt;
+    /* Make sure the format part of the flags is clean. The 16-bit formats
+       are passed along too, in case the texture is being VQ compressed. */
+    flags = (flags & ~(PVR_TXRLOAD_FMT_MASK | PVR_TXRLOAD_CONV_MASK)) | fmt;
 
     /* Call down */
     if((flags & PVR_TXRLOAD_FMT_VQ) || (flags & PVR_TXRLOAD_FMT_TWIDDLED) ||
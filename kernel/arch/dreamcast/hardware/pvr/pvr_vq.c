@@ -0,0 +1,590 @@
+/* KallistiOS ##version##
+
+   pvr_vq.c
+
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dc/pvr.h>
+#include "pvr_internal.h"
+
+/*
+
+   Runtime VQ texture compression
+
+   A VQ texture is a codebook of 256 entries, each holding a 2x2 block of
+   texels, followed by one byte per 2x2 block of the texture saying which
+   entry to draw it with. Both the codebook entries and the blocks are
+   twiddled.
+
+   Building a good codebook is the expensive part. utils/vqenc does it by
+   splitting every entry in two and moving them all around until they settle
+   down, which takes far too long to do while a game is running. Here, the
+   codebook is built the way median cut builds a palette instead: start with
+   all of the blocks in one group, and keep splitting the group with the most
+   error in two, along its widest component, until there are 256 groups. Each
+   split only looks at the blocks in that group, so this takes about eight
+   passes over the blocks in all. The average of each group is its entry.
+
+   That's usually pretty decent on its own, but each refinement pass (the
+   speed/quality knob) then maps every block to its closest entry and moves
+   each entry to the average of the blocks that picked it, like vqenc does.
+   Finding the closest entry is sped up by keeping the entries sorted by the
+   sum of their components: the difference between two sums puts a lower
+   bound on the distance between two blocks, so the search can stop early.
+
+*/
+
+#define VQ_CODES        256
+#define VQ_CODEBOOK     (VQ_CODES * 4 * sizeof(uint16_t))
+
+/* A 2x2 block, as the ARGB components of its four texels in twiddled order,
+   expanded to 8 bits. */
+#define VQ_DIM          16
+
+typedef struct {
+    uint8_t c[VQ_DIM];
+} vq_block_t;
+
+/* A group of blocks, while building the codebook. */
+typedef struct {
+    uint32_t start, count;      /* Range of the group in the order array */
+    uint32_t sum[VQ_DIM];
+    uint64_t sumsq[VQ_DIM];
+    float err;                  /* Squared error around the average */
+} vq_group_t;
+
+typedef struct {
+    uint32_t fmt;               /* PVR_TXRLOAD_CONV_* of the texture */
+    vq_block_t *blocks;
+    uint32_t count;
+    uint8_t *idx;               /* Codebook entry of each block */
+
+    vq_block_t codes[VQ_CODES];
+    uint16_t packed[VQ_CODES][4];
+    int used;
+} vq_ctx_t;
+
+static pvr_txr_vq_params_t vq_params = { PVR_TXR_VQ_PASSES_DEFAULT, NULL };
+
+void pvr_txr_set_vq_params(const pvr_txr_vq_params_t *params) {
+    if(params)
+        vq_params = *params;
+    else {
+        vq_params.passes = PVR_TXR_VQ_PASSES_DEFAULT;
+        vq_params.codebook = NULL;
+    }
+}
+
+/* Expand a 16-bit texel into 8-bit A, R, G and B. */
+static inline void vq_unpack(uint16_t p, uint32_t fmt, uint8_t *out) {
+    uint32_t r, g, b;
+
+    switch(fmt) {
+        case PVR_TXRLOAD_CONV_RGB565:
+            r = p >> 11;
+            g = (p >> 5) & 63;
+            b = p & 31;
+            out[0] = 255;
+            out[1] = (r << 3) | (r >> 2);
+            out[2] = (g << 2) | (g >> 4);
+            out[3] = (b << 3) | (b >> 2);
+            break;
+
+        case PVR_TXRLOAD_CONV_ARGB4444:
+            out[0] = (p >> 12) * 17;
+            out[1] = ((p >> 8) & 15) * 17;
+            out[2] = ((p >> 4) & 15) * 17;
+            out[3] = (p & 15) * 17;
+            break;
+
+        default:
+            r = (p >> 10) & 31;
+            g = (p >> 5) & 31;
+            b = p & 31;
+            out[0] = (p & 0x8000) ? 255 : 0;
+            out[1] = (r << 3) | (r >> 2);
+            out[2] = (g << 3) | (g >> 2);
+            out[3] = (b << 3) | (b >> 2);
+            break;
+    }
+}
+
+/* Round 8-bit A, R, G and B to the closest 16-bit texel. */
+static inline uint16_t vq_pack(const uint8_t *in, uint32_t fmt) {
+#define Q(v, bits) (((v) * ((1 << (bits)) - 1) + 127) / 255)
+    switch(fmt) {
+        case PVR_TXRLOAD_CONV_RGB565:
+            return (Q(in[1], 5) << 11) | (Q(in[2], 6) << 5) | Q(in[3], 5);
+
+        case PVR_TXRLOAD_CONV_ARGB4444:
+            return (Q(in[0], 4) << 12) | (Q(in[1], 4) << 8) |
+                   (Q(in[2], 4) << 4) | Q(in[3], 4);
+
+        default:
+            return (in[0] >= 128 ? 0x8000 : 0) | (Q(in[1], 5) << 10) |
+                   (Q(in[2], 5) << 5) | Q(in[3], 5);
+    }
+#undef Q
+}
+
+static inline uint32_t vq_dist(const vq_block_t *a, const vq_block_t *b,
+                               uint32_t limit) {
+    uint32_t d = 0;
+    int i, t;
+
+    for(i = 0; i < VQ_DIM; i += 4) {
+        t = a->c[i] - b->c[i];
+        d += t * t;
+        t = a->c[i + 1] - b->c[i + 1];
+        d += t * t;
+        t = a->c[i + 2] - b->c[i + 2];
+        d += t * t;
+        t = a->c[i + 3] - b->c[i + 3];
+        d += t * t;
+
+        /* Give up as soon as it can't be the closest. */
+        if(d >= limit)
+            break;
+    }
+
+    return d;
+}
+
+static inline uint32_t vq_key(const vq_block_t *b) {
+    uint32_t k = 0;
+    int i;
+
+    for(i = 0; i < VQ_DIM; ++i)
+        k += b->c[i];
+
+    return k;
+}
+
+/* Set a codebook entry, rounding it to what the texture format can hold. */
+static void vq_set_code(vq_ctx_t *v, int code, const uint8_t *c) {
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        v->packed[code][i] = vq_pack(c + i * 4, v->fmt);
+        vq_unpack(v->packed[code][i], v->fmt, v->codes[code].c + i * 4);
+    }
+}
+
+/* Pull the blocks of one texture (or mipmap level) out of the source, in the
+   order their indices go in the texture. */
+static vq_block_t *vq_gather(vq_block_t *out, const uint8_t *src, uint32_t w,
+                             uint32_t h, uint32_t bpp, uint32_t flags) {
+    uint32_t bw = w >> 1, bh = h >> 1, side = bw < bh ? bw : bh;
+    uint32_t i, n = bw * bh, x, y, tx, ty, sq;
+    uint16_t p;
+
+    for(i = 0; i < n; ++i, ++out) {
+        /* Non-square textures are made of square blocks of the smaller side,
+           one after another. */
+        sq = i / (side * side);
+        x = (pvr_txr_untwid((i % (side * side)) >> 1) +
+             (bw > bh ? sq * side : 0)) << 1;
+        y = (pvr_txr_untwid(i % (side * side)) +
+             (bw > bh ? 0 : sq * side)) << 1;
+
+        for(tx = 0; tx < 2; ++tx) {
+            for(ty = 0; ty < 2; ++ty) {
+                uint32_t row = (flags & PVR_TXRLOAD_INVERT_Y) ?
+                               h - 1 - (y + ty) : y + ty;
+
+                if(bpp == 16)
+                    p = ((const uint16_t *)src)[row * w + x + tx];
+                else
+                    p = pvr_txr_conv32(((const uint32_t *)src)[row * w + x +
+                                       tx], flags);
+
+                vq_unpack(p, flags & PVR_TXRLOAD_CONV_MASK,
+                          out->c + (tx * 2 + ty) * 4);
+            }
+        }
+    }
+
+    return out;
+}
+
+/* Add up the components of the blocks in a group. */
+static void vq_group_stats(const vq_ctx_t *v, const uint32_t *order,
+                           vq_group_t *g) {
+    const vq_block_t *b;
+    uint32_t i, j;
+
+    memset(g->sum, 0, sizeof(g->sum));
+    memset(g->sumsq, 0, sizeof(g->sumsq));
+
+    for(i = 0; i < g->count; ++i) {
+        b = &v->blocks[order[g->start + i]];
+
+        for(j = 0; j < VQ_DIM; ++j) {
+            g->sum[j] += b->c[j];
+            g->sumsq[j] += b->c[j] * b->c[j];
+        }
+    }
+}
+
+/* How much one component varies in a group, times the size of the group.
+   This is done in integers, so that it comes out as exactly zero when the
+   component doesn't vary at all. */
+static inline uint64_t vq_group_var(const vq_group_t *g, int i) {
+    return g->sumsq[i] * g->count - (uint64_t)g->sum[i] * g->sum[i];
+}
+
+static void vq_group_err(vq_group_t *g) {
+    uint64_t err = 0;
+    int i;
+
+    for(i = 0; i < VQ_DIM; ++i)
+        err += vq_group_var(g, i);
+
+    g->err = (float)err / (float)g->count;
+}
+
+/* Build the codebook by splitting the blocks up into groups. */
+static int vq_split(vq_ctx_t *v) {
+    vq_group_t *groups, *g, *ng;
+    uint32_t *order, i, lo, hi, t;
+    uint64_t var, best;
+    uint8_t c[VQ_DIM];
+    int n = 1, j, d;
+
+    groups = (vq_group_t *)malloc(sizeof(vq_group_t) * VQ_CODES);
+    order = (uint32_t *)malloc(sizeof(uint32_t) * v->count);
+
+    if(!groups || !order) {
+        free(groups);
+        free(order);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0; i < v->count; ++i)
+        order[i] = i;
+
+    groups[0].start = 0;
+    groups[0].count = v->count;
+    vq_group_stats(v, order, &groups[0]);
+    vq_group_err(&groups[0]);
+
+    while(n < VQ_CODES) {
+        /* Split up whichever group is the worst. */
+        for(j = 1, g = groups; j < n; ++j) {
+            if(groups[j].err > g->err)
+                g = &groups[j];
+        }
+
+        if(g->err <= 0.0f)
+            break;
+
+        /* ... along whichever component varies the most in it. */
+        for(j = 0, d = 0, best = 0; j < VQ_DIM; ++j) {
+            var = vq_group_var(g, j);
+
+            if(var > best) {
+                best = var;
+                d = j;
+            }
+        }
+
+        /* Everything at or below the average goes in the first half. Since
+           the component varies, neither half can end up empty. */
+        lo = g->start;
+        hi = g->start + g->count;
+
+        while(lo < hi) {
+            if(v->blocks[order[lo]].c[d] * g->count <= g->sum[d]) {
+                ++lo;
+            }
+            else {
+                --hi;
+                t = order[lo];
+                order[lo] = order[hi];
+                order[hi] = t;
+            }
+        }
+
+        ng = &groups[n++];
+        ng->start = lo;
+        ng->count = g->start + g->count - lo;
+        g->count -= ng->count;
+
+        vq_group_stats(v, order, ng);
+
+        for(j = 0; j < VQ_DIM; ++j) {
+            g->sum[j] -= ng->sum[j];
+            g->sumsq[j] -= ng->sumsq[j];
+        }
+
+        vq_group_err(g);
+        vq_group_err(ng);
+    }
+
+    for(j = 0; j < n; ++j) {
+        g = &groups[j];
+
+        for(d = 0; d < VQ_DIM; ++d)
+            c[d] = (g->sum[d] + g->count / 2) / g->count;
+
+        vq_set_code(v, j, c);
+
+        for(i = 0; i < g->count; ++i)
+            v->idx[order[g->start + i]] = j;
+    }
+
+    v->used = n;
+
+    free(order);
+    free(groups);
+    return 0;
+}
+
+/* Map every block to its closest codebook entry. If sums isn't NULL, the
+   blocks picking each entry are added up in it, and the worst fit of them
+   all is returned. */
+static uint32_t vq_map(vq_ctx_t *v, uint32_t (*sums)[VQ_DIM + 1]) {
+    uint32_t keys[VQ_CODES], k, d, best, worst = 0, worst_d = 0, i;
+    uint8_t sorted[VQ_CODES], c;
+    int n = v->used, lo, hi, mid, j, m;
+    const vq_block_t *b;
+
+    /* Sort the entries by the sum of their components. */
+    for(j = 0; j < n; ++j) {
+        k = vq_key(&v->codes[j]);
+
+        for(m = j; m > 0 && keys[m - 1] > k; --m) {
+            keys[m] = keys[m - 1];
+            sorted[m] = sorted[m - 1];
+        }
+
+        keys[m] = k;
+        sorted[m] = j;
+    }
+
+    for(i = 0; i < v->count; ++i) {
+        b = &v->blocks[i];
+        k = vq_key(b);
+
+        /* Start at the entry with the closest sum... */
+        for(lo = 0, hi = n - 1; lo < hi;) {
+            mid = (lo + hi) >> 1;
+
+            if(keys[mid] < k)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        c = sorted[lo];
+        best = vq_dist(b, &v->codes[c], UINT32_MAX);
+
+        /* ... and work outwards from it, until the sums alone are too far
+           apart for anything to beat the best so far. For 16 components,
+           (sum a - sum b)^2 <= 16 * |a - b|^2. */
+        for(hi = lo + 1, --lo; best && (lo >= 0 || hi < n);) {
+            if(lo >= 0) {
+                d = k - keys[lo];
+
+                if(d * d >= best * VQ_DIM) {
+                    lo = -1;
+                }
+                else {
+                    if((d = vq_dist(b, &v->codes[sorted[lo]], best)) < best) {
+                        best = d;
+                        c = sorted[lo];
+                    }
+
+                    --lo;
+                }
+            }
+
+            if(hi < n) {
+                d = keys[hi] - k;
+
+                if(d * d >= best * VQ_DIM) {
+                    hi = n;
+                }
+                else {
+                    if((d = vq_dist(b, &v->codes[sorted[hi]], best)) < best) {
+                        best = d;
+                        c = sorted[hi];
+                    }
+
+                    ++hi;
+                }
+            }
+        }
+
+        v->idx[i] = c;
+
+        if(sums) {
+            for(j = 0; j < VQ_DIM; ++j)
+                sums[c][j] += b->c[j];
+
+            ++sums[c][VQ_DIM];
+
+            if(best > worst_d) {
+                worst_d = best;
+                worst = i;
+            }
+        }
+    }
+
+    return worst;
+}
+
+/* Move every entry to the average of the blocks that picked it. */
+static int vq_refine(vq_ctx_t *v, int passes) {
+    uint32_t (*sums)[VQ_DIM + 1], worst;
+    uint8_t c[VQ_DIM];
+    int j, d, reseeded;
+
+    if(!(sums = malloc(sizeof(*sums) * VQ_CODES))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(passes--) {
+        memset(sums, 0, sizeof(*sums) * VQ_CODES);
+        worst = vq_map(v, sums);
+
+        for(j = 0, reseeded = 0; j < v->used; ++j) {
+            if(sums[j][VQ_DIM]) {
+                for(d = 0; d < VQ_DIM; ++d)
+                    c[d] = (sums[j][d] + sums[j][VQ_DIM] / 2) / sums[j][VQ_DIM];
+
+                vq_set_code(v, j, c);
+            }
+            else if(!reseeded) {
+                /* Give an entry nobody wants to the block that fits worst. */
+                vq_set_code(v, j, v->blocks[worst].c);
+                reseeded = 1;
+            }
+        }
+    }
+
+    free(sums);
+    return 0;
+}
+
+size_t pvr_txr_vq_size(uint32_t w, uint32_t h, uint32_t flags) {
+    size_t n = 0;
+
+    if(flags & PVR_TXRLOAD_MIPMAP) {
+        /* The 1x1 level takes a whole index of its own. */
+        for(n = 1; w > 1; w >>= 1)
+            n += (w >> 1) * (w >> 1);
+    }
+    else {
+        n = (w >> 1) * (h >> 1);
+    }
+
+    return VQ_CODEBOOK + n;
+}
+
+int pvr_txr_vq_encode(const void *src, void *out, uint32_t w, uint32_t h,
+                      uint32_t flags, const pvr_txr_vq_params_t *params) {
+    vq_ctx_t *v;
+    vq_block_t *b;
+    const uint8_t *s = (const uint8_t *)src;
+    uint32_t bpp, n, i;
+    int rv = 0;
+
+    if(!params)
+        params = &vq_params;
+
+    switch(flags & PVR_TXRLOAD_FMT_MASK) {
+        case PVR_TXRLOAD_16BPP:
+            bpp = 16;
+            break;
+        case PVR_TXRLOAD_32BPP:
+            bpp = 32;
+            break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    /* The blocks must be 2x2 and the format has to be known. */
+    if(w < 2 || h < 2 || (w & (w - 1)) || (h & (h - 1)) ||
+       !(flags & PVR_TXRLOAD_CONV_MASK) ||
+       ((flags & PVR_TXRLOAD_MIPMAP) && w != h)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(v = (vq_ctx_t *)malloc(sizeof(vq_ctx_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    v->fmt = flags & PVR_TXRLOAD_CONV_MASK;
+    v->count = pvr_txr_vq_size(w, h, flags) - VQ_CODEBOOK;
+    v->idx = (uint8_t *)out + VQ_CODEBOOK;
+
+    if(!(v->blocks = (vq_block_t *)malloc(sizeof(vq_block_t) * v->count))) {
+        free(v);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if(!(flags & PVR_TXRLOAD_MIPMAP)) {
+        vq_gather(v->blocks, s, w, h, bpp, flags);
+    }
+    else {
+        /* The levels follow each other in the source, largest first, but go
+           from smallest to largest in the texture. The 1x1 level is drawn
+           from the first texel of its entry, so it gets a block of its
+           own with that texel in all four spots. */
+        const uint8_t *level[11];
+        int top = 0, lvl;
+
+        for(n = w; n; n >>= 1, ++top) {
+            level[top] = s;
+            s += (n * n * bpp) >> 3;
+        }
+
+        b = v->blocks;
+        vq_unpack(bpp == 16 ? *(const uint16_t *)level[top - 1] :
+                  pvr_txr_conv32(*(const uint32_t *)level[top - 1], flags),
+                  v->fmt, b->c);
+        memcpy(b->c + 4, b->c, 4);
+        memcpy(b->c + 8, b->c, 8);
+        ++b;
+
+        for(lvl = top - 2; lvl >= 0; --lvl)
+            b = vq_gather(b, level[lvl], w >> lvl, w >> lvl, bpp, flags);
+    }
+
+    if(params->codebook) {
+        /* Just map the blocks onto the codebook we were given. */
+        for(i = 0; i < VQ_CODES; ++i) {
+            for(n = 0; n < 4; ++n) {
+                v->packed[i][n] = params->codebook[i * 4 + n];
+                vq_unpack(v->packed[i][n], v->fmt, v->codes[i].c + n * 4);
+            }
+        }
+
+        v->used = VQ_CODES;
+        vq_map(v, NULL);
+    }
+    else if(!(rv = vq_split(v)) && params->passes > 0) {
+        rv = vq_refine(v, params->passes);
+    }
+
+    if(!rv) {
+        memcpy(out, v->packed, v->used * 4 * sizeof(uint16_t));
+        memset((uint8_t *)out + v->used * 4 * sizeof(uint16_t), 0,
+               VQ_CODEBOOK - v->used * 4 * sizeof(uint16_t));
+    }
+
+    free(v->blocks);
+    free(v);
+    return rv;
+}
@@ -27,6 +27,7 @@
 #include <sys/cdefs.h>
 __BEGIN_DECLS
 
+#include <stdint.h>
 #include <dc/vector.h>
 
 /** \defgroup math_matrices Matrices
@@ -132,6 +133,111 @@ void mat_transform(const vector_t *invecs, vector_t *outvecs,
 */
 void mat_transform_sq(void *input, void *output, int veccnt);
 
+/** \brief  Most planes mat_cull_boxes() will test against. */
+#define MAT_CULL_MAX_PLANES     8
+
+/** \brief  Most lights mat_light_diffuse() will add up. */
+#define MAT_LIGHT_MAX           8
+
+/** \brief  Cull bounding spheres against a set of planes.
+
+    This tests many bounding spheres against the planes of a view frustum at
+    once, four planes at a time with the matrix unit. A plane is given as
+    (a, b, c, d), and a point (x, y, z) is in front of it when
+    ax + by + cz + d >= 0. The normals don't need to be normalized, but the
+    radii of the spheres are compared against distances along them, so they
+    usually should be.
+
+    The internal matrix is used along the way, and put back afterwards.
+
+    \param  planes          The planes.
+    \param  plane_count     How many planes there are.
+    \param  spheres         The spheres, as (x, y, z, radius).
+    \param  count           How many spheres there are.
+    \param  visible         Set to 1 for each sphere that's at least partly in
+                            front of every plane, or 0 if it isn't.
+    \return                 How many spheres are visible.
+*/
+int mat_cull_spheres(const vector_t *planes, int plane_count,
+                     const vector_t *spheres, int count, uint8_t *visible);
+
+/** \brief  Cull axis-aligned bounding boxes against a set of planes.
+
+    This is the same as mat_cull_spheres(), but for boxes given by their
+    centers and half their sizes. A box is only culled when all of it is
+    behind one of the planes.
+
+    \param  planes          The planes, as for mat_cull_spheres().
+    \param  plane_count     How many planes there are. Only the first
+                            \ref MAT_CULL_MAX_PLANES are used.
+    \param  centers         The middle of each box.
+    \param  extents         How far each box reaches from its middle, along
+                            each axis.
+    \param  count           How many boxes there are.
+    \param  visible         Set to 1 for each box that's visible, or 0.
+    \return                 How many boxes are visible.
+*/
+int mat_cull_boxes(const vector_t *planes, int plane_count,
+                   const vector_t *centers, const vector_t *extents,
+                   int count, uint8_t *visible);
+
+/** \brief  Light normals with directional lights.
+
+    Each normal is put through the internal matrix (without translation) and
+    lit by each light: the light's color times how directly the normal faces
+    it, added on to the ambient color. The result is written out as a packed
+    ARGB color, so it can go straight into the argb of a pvr_vertex_t.
+
+    Four lights are done at a time with the matrix unit. The internal matrix
+    is used along the way, and put back afterwards. Normals aren't normalized
+    again after the matrix, so it shouldn't scale them.
+
+    \param  normals         The normals, in model space. w is ignored.
+    \param  argb            Where to write the first color.
+    \param  count           How many normals there are.
+    \param  stride          Bytes from one color to the next, for example
+                            sizeof(pvr_vertex_t).
+    \param  dirs            Directions towards the lights, after the matrix,
+                            normalized.
+    \param  colors          The color of each light, as (r, g, b, unused),
+                            from 0 to 1.
+    \param  light_count     How many lights there are. Only the first
+                            \ref MAT_LIGHT_MAX are used.
+    \param  ambient         The ambient color as (r, g, b, a). The alpha of
+                            every color written is taken from here.
+*/
+void mat_light_diffuse(const vector_t *normals, uint32_t *argb, int count,
+                       int stride, const vector_t *dirs,
+                       const vector_t *colors, int light_count,
+                       const vector_t *ambient);
+
+/** \brief  Skin vectors with a matrix palette.
+
+    Each vector is put through up to bones_per_vertex of the matrices in the
+    palette, and the results are added up by the weight given to each. The
+    whole vector goes through the matrices, w and all, so positions should
+    have a w of 1, and normals a w of 0.
+
+    Vertices that use the same bones as the one before don't need their
+    matrices to be loaded again, so sorting vertices by their bones helps a
+    lot. Weights of 0 are skipped. The internal matrix is used along the way,
+    and put back afterwards.
+
+    \param  in              The vectors to skin.
+    \param  out             Where to write the skinned vectors.
+    \param  count           How many vectors there are.
+    \param  palette         The matrices for the bones.
+    \param  bones           bones_per_vertex palette indices for each vector.
+    \param  weights         bones_per_vertex weights for each vector, which
+                            should add up to 1.
+    \param  bones_per_vertex
+                            How many bones can move each vector, usually
+                            from 1 to 4.
+*/
+void mat_skin(const vector_t *in, vector_t *out, int count,
+              const matrix_t *palette, const uint8_t *bones,
+              const float *weights, int bones_per_vertex);
+
 /** \brief  Macro to transform a single vertex by the internal matrix.
 
     This macro is an inline assembly operation to transform a single vertex. It
@@ -1034,6 +1034,25 @@ typedef struct {
         but it allows using much smaller vertex buffers. */
     int     vbuf_doublebuf_disabled;
 
+    /** \brief  Texture memory allocator.
+
+        One of the \ref pvr_mem_allocators, to manage the PVR RAM pool with.
+        Leave this as 0 for the default one. */
+    int     mem_allocator;
+
+    /** \brief  Number of scenes to split the vertex DMA buffers between.
+
+        Normally each buffer given to pvr_set_vertbuf() is split in two, so
+        that one scene can be put together while the last one is sent to the
+        TA. With more, up to \ref PVR_VERTBUF_MAX, pvr_scene_finish() doesn't
+        wait for the TA: the scene is queued up and sent as soon as the TA is
+        free, so the CPU can get that many scenes ahead of it. Scenes that send
+        anything straight to the TA can't be queued, and wait for the ones
+        before them to go first.
+
+        Leave this as 0 for two. Only used with vertex DMA. */
+    int     vertbuf_count;
+
 } pvr_init_params_t;
 
 /** \brief   Initialize the PVR chip to ready status.
@@ -1133,6 +1152,13 @@ int pvr_shutdown(void);
 */
 int pvr_vertex_dma_enabled(void);
 
+/** \brief   Most scenes the vertex DMA buffers can be split between.
+    \ingroup pvr_vertex_dma
+
+    \see    pvr_init_params_t::vertbuf_count
+*/
+#define PVR_VERTBUF_MAX     4
+
 /** \brief   Setup a vertex buffer for one of the list types.
     \ingroup pvr_list_mgmt
 
@@ -1140,8 +1166,10 @@ int pvr_vertex_dma_enabled(void);
     by the new one. 
 
     \note
-    Each buffer should actually be twice as long as what you will need to hold
-    two frames worth of data).
+    The buffer is split evenly between the scenes that can be in flight at
+    once, which is two unless pvr_init_params_t::vertbuf_count says otherwise.
+    So each buffer should be that many times as long as what you will need to
+    hold one frame's worth of data, or see pvr_set_vertbuf_overflow().
 
     \warning
     You should generally not try to do this at any time besides before a frame
@@ -1158,6 +1186,25 @@ int pvr_vertex_dma_enabled(void);
 */
 void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len);
 
+/** \brief   Let a list's vertex buffer grow when it fills up.
+    \ingroup pvr_vertex_dma
+
+    Normally, once a list's part of its vertex buffer is full, anything else
+    sent to it is refused. With this, chunks of the given size are allocated
+    as needed instead, and chained on after the buffer to be sent along with
+    it. Chunks are kept for the scenes that come after, so the buffer only has
+    to be big enough for a usual scene, and a heavy one just costs a few
+    allocations the first time.
+
+    \warning
+    Like pvr_set_vertbuf(), this should only be done between frames.
+
+    \param  list            The primitive list to set it for.
+    \param  chunk           How many bytes to add at a time, as a multiple of
+                            32, or 0 to stop growing and free the chunks.
+*/
+void pvr_set_vertbuf_overflow(pvr_list_t list, size_t chunk);
+
 /** \brief   Retrieve a pointer to the current output location in the DMA buffer
              for the requested list.
     \ingroup pvr_vertex_dma
@@ -1172,6 +1219,22 @@ void *pvr_set_vertbuf(pvr_list_t list, void *buffer, size_t len);
 */
 void *pvr_vertbuf_tail(pvr_list_t list);
 
+/** \brief   Make sure there's room at the end of the DMA buffer for a list.
+    \ingroup pvr_vertex_dma
+
+    This is pvr_vertbuf_tail() for writing more than might fit. If the
+    buffer doesn't have room for size more bytes, it moves on to an overflow
+    chunk, if pvr_set_vertbuf_overflow() allows that. As with
+    pvr_vertbuf_tail(), call pvr_vertbuf_written() once the data is there.
+
+    \param  list            The primitive list to get the buffer for.
+    \param  size            How many bytes will be written. Must be a
+                            multiple of 32.
+
+    \return                 Where to write them, or NULL if there's no room.
+*/
+void *pvr_vertbuf_reserve(pvr_list_t list, size_t size);
+
 /** \brief   Notify the PVR system that data have been written into the output
              buffer for the given list.
     \ingroup pvr_vertex_dma
@@ -1257,7 +1320,8 @@ int pvr_list_finish(void);
     wrong type will quite likely ruin your scene. Note that this also will not
     work if you haven't begun any list types (i.e., all data is queued). If DMA
     is enabled, the primitive will be appended to the end of the currently
-    selected list's buffer.
+    selected list's buffer. While recording a display list (see
+    pvr_dlist_record()), the primitive is added to it instead.
 
     \warning
     \p data must be 32-byte aligned!
@@ -1336,7 +1400,9 @@ void pvr_send_to_ta(void *data);
     \ingroup pvr_list_mgmt
 
     Data will be queued in a vertex buffer, thus one must be available for the
-    list specified (will be asserted by the code).
+    list specified (will be asserted by the code). If the buffer is full, it
+    grows if pvr_set_vertbuf_overflow() allows that, otherwise the data is
+    refused.
 
     \param  list            The list to submit to.
     \param  data            The primitive to submit.
@@ -1344,7 +1410,7 @@ void pvr_send_to_ta(void *data);
                             multiple of 32.
     
     \retval 0               On success.
-    \retval -1              On error.
+    \retval -1              If the buffer is full (errno is set to ENOSPC).
 */
 int pvr_list_prim(pvr_list_t list, const void *data, size_t size);
 
@@ -1384,6 +1450,9 @@ int pvr_scene_finish(void);
     essentially waits until a rendered frame is complete and a vertical blank
     happens.
 
+    With more than two vertex buffers (see pvr_init_params_t::vertbuf_count),
+    this only waits for a buffer to be free for the new frame.
+
     \retval 0               On success. A new scene can be started now.
     \retval -1              On error. Something is probably very wrong...
 */
@@ -1611,6 +1680,11 @@ pvr_ptr_t pvr_get_front_buffer(void);
 #include "pvr/pvr_fog.h"
 #include "pvr/pvr_pal.h"
 #include "pvr/pvr_txr.h"
+#include "pvr/pvr_tcache.h"
+#include "pvr/pvr_dlist.h"
+#include "pvr/pvr_batch.h"
+#include "pvr/pvr_clip.h"
+#include "pvr/pvr_prof.h"
 
 __END_DECLS
 
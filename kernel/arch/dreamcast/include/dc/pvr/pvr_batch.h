@@ -0,0 +1,139 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_batch.h
+
+*/
+
+/** \file       dc/pvr/pvr_batch.h
+    \brief      State-sorted quad batching
+    \ingroup    pvr_batch
+*/
+
+#ifndef __DC_PVR_PVR_BATCH_H
+#define __DC_PVR_PVR_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_batch      Batching
+    \brief                   Group quads by state to send fewer headers
+    \ingroup                 pvr_scene_mgmt
+
+    Things like 2D interfaces and particles are made of lots of small quads,
+    each with its own texture or blending, and sending them as they come
+    means sending a new header for almost every quad. A batch holds on to the
+    quads for one list instead, and sends them grouped by header when it's
+    submitted, so that each header is sent once for as many quads as possible.
+
+    Headers are registered with a batch once, with pvr_batch_state(), and
+    quads are added with the state number it returns. Registering the same
+    header again gives back the same number, so headers can also just be
+    compiled and registered as quads come along.
+
+    Where the order quads are drawn in matters (in translucent lists, unless
+    \ref PVR_BATCH_ANY_ORDER is given), a quad is only moved ahead of other
+    quads it doesn't overlap, so everything that overlaps is still drawn in
+    the order it was added in. Quads are compared by their bounding boxes on
+    the screen, so this assumes the vertices are already in screen space.
+*/
+
+/** \defgroup pvr_batch_flags    Flags
+    \brief                       Flags for creating batches
+    \ingroup                     pvr_batch
+
+    @{
+*/
+#define PVR_BATCH_KEEP_ORDER    0x01    /**< \brief Keep the order where quads overlap */
+#define PVR_BATCH_ANY_ORDER     0x02    /**< \brief Draw quads in any order */
+/** @} */
+
+/** \brief   A batch of quads.
+    \ingroup pvr_batch
+*/
+typedef struct pvr_batch pvr_batch_t;
+
+/** \brief   Create a batch.
+    \ingroup pvr_batch
+
+    Unless told otherwise with flags, the order of overlapping quads is kept
+    in translucent lists, and quads are drawn in any order in the others.
+
+    \param  list            The list the batch is for.
+    \param  max_quads       The most quads the batch will hold between
+                            submissions.
+    \param  max_states      The most headers that will be registered.
+    \param  flags           Some set of \ref pvr_batch_flags.
+    \return                 The batch, or NULL if out of memory.
+*/
+pvr_batch_t *pvr_batch_create(pvr_list_t list, size_t max_quads,
+                              size_t max_states, int flags);
+
+/** \brief   Destroy a batch.
+    \ingroup pvr_batch
+
+    \param  batch           The batch to destroy.
+*/
+void pvr_batch_destroy(pvr_batch_t *batch);
+
+/** \brief   Register a header with a batch.
+    \ingroup pvr_batch
+
+    \param  batch           The batch.
+    \param  hdr             A polygon or sprite header, compiled for the
+                            batch's list.
+    \return                 The state number to add quads with, or -1 if
+                            there's no room for another header.
+*/
+int pvr_batch_state(pvr_batch_t *batch, const pvr_poly_hdr_t *hdr);
+
+/** \brief   Forget all headers registered with a batch.
+    \ingroup pvr_batch
+
+    This also drops any quads that haven't been submitted.
+
+    \param  batch           The batch.
+*/
+void pvr_batch_reset(pvr_batch_t *batch);
+
+/** \brief   Add a quad to a batch.
+    \ingroup pvr_batch
+
+    For a polygon header, the quad is four pvr_vertex_t (or other 32-byte
+    vertices) in triangle strip order. The flags of the vertices are filled
+    in by the batch. For a sprite header, it's one pvr_sprite_txr_t or
+    pvr_sprite_col_t.
+
+    \param  batch           The batch.
+    \param  state           The state number from pvr_batch_state().
+    \param  quad            The quad.
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - state isn't one from pvr_batch_state() \n
+    \em     ENOSPC - the batch is full
+*/
+int pvr_batch_add(pvr_batch_t *batch, int state, const void *quad);
+
+/** \brief   Send everything in a batch.
+    \ingroup pvr_batch
+
+    The quads are sent with pvr_prim(), so the batch's list has to be open,
+    and they go through the store queues or into the vertex buffer the same
+    way anything else sent to the list does. The batch is left empty.
+
+    If pvr_prim() fails, such as when the list's vertex buffer is full, this
+    stops there, and the quads that weren't sent are dropped.
+
+    \param  batch           The batch.
+    \return                 The number of headers that were sent, or -1 if
+                            pvr_prim() failed, with errno as it left it.
+*/
+int pvr_batch_submit(pvr_batch_t *batch);
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_BATCH_H */
@@ -0,0 +1,95 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_clip.h
+
+*/
+
+/** \file       dc/pvr/pvr_clip.h
+    \brief      Near plane clipping of triangle strips
+    \ingroup    pvr_clip
+*/
+
+#ifndef __DC_PVR_PVR_CLIP_H
+#define __DC_PVR_PVR_CLIP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_clip       Clipping
+    \brief                   Transform strips and clip them to the near plane
+    \ingroup                 pvr_scene_mgmt
+
+    The TA clips everything to the screen, but it doesn't do anything about
+    vertices that are behind the camera. Once those have been through the
+    perspective divide they end up somewhere else entirely, so anything that
+    crosses the near plane has to be clipped before it's sent.
+
+    These functions take triangle strips of pvr_vertex_t in model space, put
+    them through the current matrix (see mat_load()) and clip them against the
+    near plane before dividing by w. Where a triangle crosses the plane, the
+    new vertices get their texture coordinates and both colors interpolated
+    along the edge. The rest of each strip is sent as a strip, so unclipped
+    geometry costs hardly any more than with mat_transform(). As with
+    mat_transform(), z is set to 1/w for the depth compare.
+
+    Triangles that are entirely off one side of the screen are dropped. Those
+    that are only partly off it are sent as they are, since the TA already
+    clips to the screen, and it takes any coordinates well outside of it.
+
+    A vertex is in front of the near plane when its w after the matrix is at
+    least the value set with pvr_clip_set_near(). That's 1.0 to start with,
+    which keeps 1/w between 0 and 1.
+
+    The vertices given can hold any number of strips, each ending with a vertex
+    whose flags are \ref PVR_CMD_VERTEX_EOL, the same as if they were sent with
+    pvr_prim(). The flags of the vertices sent are filled in.
+*/
+
+/** \brief   Set where the near plane is.
+    \ingroup pvr_clip
+
+    \param  near_w          The smallest w a vertex can have after the matrix
+                            without being clipped. Must be above 0.
+*/
+void pvr_clip_set_near(float near_w);
+
+/** \brief   Transform, clip and send triangle strips with Direct Rendering.
+    \ingroup pvr_clip
+
+    The vertices are sent straight to the TA through the store queues, the same
+    way as with pvr_dr_target() and pvr_dr_commit(). The header for them has to
+    have been sent already.
+
+    \param  dr              The Direct Rendering state, from pvr_dr_init().
+    \param  src             The vertices, in model space.
+    \param  count           How many vertices there are.
+    \return                 The number of vertices sent.
+*/
+size_t pvr_clip_strips_dr(pvr_dr_state_t *dr, const pvr_vertex_t *src,
+                          size_t count);
+
+/** \brief   Transform and clip triangle strips into a buffer.
+    \ingroup pvr_clip
+
+    This does the same as pvr_clip_strips_dr(), but writes the vertices out to
+    memory, so that they can be sent with pvr_prim(), added to a display list,
+    or looked at. Clipping can add vertices: each triangle of a strip comes out
+    as at most four vertices, so (count - 2) * 4 vertices is always enough room.
+
+    \param  dst             Where to write the vertices.
+    \param  max             How many vertices fit in dst.
+    \param  src             The vertices, in model space.
+    \param  count           How many vertices there are.
+    \return                 The number of vertices written, or -1 if there
+                            wasn't enough room. Nothing past max is written.
+*/
+ssize_t pvr_clip_strips(pvr_vertex_t *dst, size_t max,
+                        const pvr_vertex_t *src, size_t count);
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_CLIP_H */
@@ -0,0 +1,146 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_dlist.h
+
+*/
+
+/** \file       dc/pvr/pvr_dlist.h
+    \brief      Recorded display lists
+    \ingroup    pvr_dlist
+*/
+
+#ifndef __DC_PVR_PVR_DLIST_H
+#define __DC_PVR_PVR_DLIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_dlist      Display Lists
+    \brief                   Record primitives once, and send them every frame
+    \ingroup                 pvr_scene_mgmt
+
+    A display list holds headers and vertices exactly as they are sent to the
+    TA, in a buffer in main RAM. Geometry that doesn't change from one frame
+    to the next can be put together into one once, and then sent as it is with
+    a single DMA every frame, instead of being put together and sent with the
+    store queues every time.
+
+    Display lists can be filled with pvr_dlist_add(), or by recording what is
+    sent with pvr_prim() between pvr_dlist_record() and pvr_dlist_stop().
+    Nothing sent with the pvr_dr_* functions can be recorded, as that goes
+    straight to the store queues.
+
+    With pvr_dlist_submit_mat(), the positions of the vertices can be put
+    through the current matrix (see mat_load()) on the way, so a display list
+    can be recorded once in model space, and drawn with a new camera or in a
+    new place every frame. Only the positions are touched, so this is still a
+    lot cheaper than putting the whole thing together again.
+
+    Display lists are sent to whichever list is open. They must only hold
+    primitives for that list.
+*/
+
+/** \brief   A display list.
+    \ingroup pvr_dlist
+*/
+typedef struct pvr_dlist pvr_dlist_t;
+
+/** \brief   Create a display list.
+    \ingroup pvr_dlist
+
+    \param  size            How many bytes to make room for to start with. The
+                            display list grows as needed, so this can be 0.
+    \return                 The display list, or NULL if out of memory.
+*/
+pvr_dlist_t *pvr_dlist_create(size_t size);
+
+/** \brief   Destroy a display list.
+    \ingroup pvr_dlist
+
+    Don't do this while the display list may still be being sent.
+
+    \param  dl              The display list to destroy.
+*/
+void pvr_dlist_destroy(pvr_dlist_t *dl);
+
+/** \brief   Empty a display list, so that it can be filled again.
+    \ingroup pvr_dlist
+
+    \param  dl              The display list to empty.
+*/
+void pvr_dlist_clear(pvr_dlist_t *dl);
+
+/** \brief   Add primitives to a display list.
+    \ingroup pvr_dlist
+
+    \param  dl              The display list to add to.
+    \param  data            The headers and vertices to add.
+    \param  size            The size of the data, in bytes. Must be a multiple
+                            of 32.
+    \retval 0               On success.
+    \retval -1              If out of memory.
+*/
+int pvr_dlist_add(pvr_dlist_t *dl, const void *data, size_t size);
+
+/** \brief   Start recording into a display list.
+    \ingroup pvr_dlist
+
+    Until pvr_dlist_stop() is called, everything sent with pvr_prim() is added
+    to the display list instead of being sent to the TA. There doesn't need to
+    be a scene or a list open while recording.
+
+    \param  dl              The display list to record into.
+*/
+void pvr_dlist_record(pvr_dlist_t *dl);
+
+/** \brief   Stop recording into a display list.
+    \ingroup pvr_dlist
+
+    \retval 0               On success.
+    \retval -1              If some of what was recorded didn't fit in memory.
+*/
+int pvr_dlist_stop(void);
+
+/** \brief   Get the size of a display list.
+    \ingroup pvr_dlist
+
+    \param  dl              The display list.
+    \return                 The size of what's in the display list, in bytes.
+*/
+size_t pvr_dlist_size(const pvr_dlist_t *dl);
+
+/** \brief   Send a display list to the TA.
+    \ingroup pvr_dlist
+
+    This has to be done with a list open, as with pvr_prim(). If the open
+    list has a vertex buffer, the display list is copied into it. Otherwise,
+    it is sent to the TA by DMA, and this waits for that to be done.
+
+    \param  dl              The display list to send.
+    \retval 0               On success.
+    \retval -1              If there's no list open, or the DMA failed.
+*/
+int pvr_dlist_submit(const pvr_dlist_t *dl);
+
+/** \brief   Send a display list to the TA, putting it through the matrix.
+    \ingroup pvr_dlist
+
+    This is the same as pvr_dlist_submit(), except that the position of every
+    polygon and modifier volume vertex is transformed by the current matrix
+    with mat_transform() on the way, perspective divide and all. The display
+    list itself isn't changed, so it can be sent again with another matrix.
+    Sprites are sent as they are.
+
+    \param  dl              The display list to send.
+    \retval 0               On success.
+    \retval -1              If there's no list open, the DMA failed, or there
+                            wasn't enough memory.
+*/
+int pvr_dlist_submit_mat(pvr_dlist_t *dl);
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_DLIST_H */
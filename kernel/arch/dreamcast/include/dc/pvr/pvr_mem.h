@@ -25,6 +25,7 @@
 #define __DC_PVR_PVR_MEM_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <sys/cdefs.h>
 __BEGIN_DECLS
@@ -48,9 +49,47 @@ typedef void *pvr_ptr_t;
     \brief                   Memory management API for VRAM
     \ingroup                 pvr_vram
 
-    PVR memory management in KOS uses a modified dlmalloc; see the
+    PVR memory management in KOS uses a modified dlmalloc by default; see the
     source file pvr_mem_core.c for more info. 
+
+    A slab/buddy allocator can be picked instead at pvr_init() time, with the
+    mem_allocator member of pvr_init_params_t. It keeps blocks aligned to
+    their size (up to 2KB for small blocks, and to the power of two they are
+    rounded up to for big ones), so textures of power of two sizes can come
+    and go without leaving VRAM full of holes too small for anything. Small
+    allocations come out of slabs of a single size each. Prefer it for
+    programs that load and free a lot of textures of different sizes, like
+    between levels.
+*/
+
+/** \defgroup pvr_mem_allocators    Allocators
+    \brief                          Allocators to manage the PVR RAM pool with
+    \ingroup                        pvr_mem_mgmt
+
+    These are the values for the mem_allocator member of pvr_init_params_t.
+
+    @{
+*/
+#define PVR_MEM_ALLOC_DEFAULT   0   /**< \brief dlmalloc */
+#define PVR_MEM_ALLOC_BUDDY     1   /**< \brief Slabs and buddy blocks */
+/** @} */
+
+/** \brief   PVR RAM pool statistics.
+    \ingroup pvr_mem_mgmt
+
+    How fragmented the pool is can be judged by how much smaller largest_free
+    is than free. With the default allocator, largest_free only counts the free
+    space at the end of the pool, so it may be smaller than the real thing.
+
+    \see    pvr_mem_get_stats()
 */
+typedef struct pvr_mem_stats {
+    size_t  total;              /**< \brief Size of the pool, in bytes */
+    size_t  used;               /**< \brief Bytes allocated */
+    size_t  free;               /**< \brief Bytes not allocated */
+    size_t  largest_free;       /**< \brief Biggest block that could be allocated */
+    size_t  free_blocks;        /**< \brief Pieces the free space is in */
+} pvr_mem_stats_t;
 
 /** \brief   Allocate a chunk of memory from texture space.
     \ingroup pvr_mem_mgmt
@@ -105,6 +144,13 @@ void pvr_mem_print_list(void);
 */
 void pvr_mem_stats(void);
 
+/** \brief   Get statistics about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \param  stats           Where to put the statistics
+*/
+void pvr_mem_get_stats(pvr_mem_stats_t *stats);
+
 __END_DECLS
 
 #endif /* __DC_PVR_PVR_MEM_H */
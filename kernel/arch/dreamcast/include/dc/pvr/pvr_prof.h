@@ -0,0 +1,131 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_prof.h
+
+*/
+
+/** \file       dc/pvr/pvr_prof.h
+    \brief      Per-frame profiling of the PVR pipeline
+    \ingroup    pvr_prof
+*/
+
+#ifndef __DC_PVR_PVR_PROF_H
+#define __DC_PVR_PVR_PROF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_prof       Frame Profiler
+    \brief                   Keep timings for each of the last few frames
+    \ingroup                 pvr_stats
+
+    pvr_get_stats() only says how long the last frame took in total. The
+    profiler keeps a record for each of the last few frames instead, saying
+    when each part of the pipeline started and finished with it: the CPU
+    putting it together, the TA taking in each of its lists, the render, and
+    the page flip. Each record also says how much was sent to each list, how
+    long the CPU was kept waiting for the PVR, and how many vertical blanks
+    were missed, which together show whether it's the CPU, the TA or the
+    render that's holding things up.
+
+    Since the PVR works on up to three frames at once, a record is only
+    complete a couple of frames after the scene is finished.
+
+    The records can be written out with pvr_prof_export() in the Chrome trace
+    format, which can be loaded into chrome://tracing or Perfetto to see the
+    frames on a timeline.
+
+    Everything sent with pvr_prim(), pvr_list_prim() or pvr_dlist_submit()
+    is counted. Vertices written with the pvr_dr_* functions aren't, as they
+    go straight to the store queues.
+*/
+
+/** \brief   What happened to one list in a frame.
+    \ingroup pvr_prof
+
+    All times are in nanoseconds, as from timer_ns_gettime64(), and are 0 for
+    anything that didn't happen.
+*/
+typedef struct pvr_prof_list {
+    uint64_t open;              /**< \brief When the list was opened */
+    uint64_t close;             /**< \brief When the list was closed */
+    uint64_t ta_start;          /**< \brief When the list started going to the TA */
+    uint64_t ta_done;           /**< \brief When the TA was done with the list */
+    uint32_t bytes;             /**< \brief Bytes sent to the list */
+    uint32_t prims;             /**< \brief Number of times something was sent */
+} pvr_prof_list_t;
+
+/** \brief   What happened to one frame.
+    \ingroup pvr_prof
+
+    All times are in nanoseconds, as from timer_ns_gettime64(), and are 0 for
+    anything that hasn't happened (yet).
+*/
+typedef struct pvr_prof_frame {
+    uint32_t frame;             /**< \brief Which scene this is, counting from 1 */
+    uint32_t vbl_missed;        /**< \brief Vertical blanks missed before it was shown */
+    uint64_t begin;             /**< \brief When pvr_scene_begin() was called */
+    uint64_t finish;            /**< \brief When pvr_scene_finish() was done */
+    uint64_t reg_start;         /**< \brief When the first list started going to the TA */
+    uint64_t reg_done;          /**< \brief When the TA was done with all lists */
+    uint64_t rnd_start;         /**< \brief When the render started */
+    uint64_t rnd_done;          /**< \brief When the render was done */
+    uint64_t flip;              /**< \brief When it was put on the screen */
+    uint64_t ready_wait;        /**< \brief Time spent in pvr_wait_ready() for it */
+    uint64_t dma_wait;          /**< \brief Time spent waiting for the DMA to be free */
+    size_t   vtx_buf_used;      /**< \brief Bytes of the TA's vertex buffer used */
+
+    /** \brief  Each list, by pvr_list_t. */
+    pvr_prof_list_t lists[5];
+} pvr_prof_frame_t;
+
+/** \brief   Start profiling.
+    \ingroup pvr_prof
+
+    If the profiler was already running, what it had is thrown away.
+
+    \param  frames          How many frames to keep records for.
+    \retval 0               On success.
+    \retval -1              If out of memory, or frames is 0.
+*/
+int pvr_prof_start(size_t frames);
+
+/** \brief   Stop profiling, and throw the records away.
+    \ingroup pvr_prof
+
+    This is done by pvr_shutdown() too.
+*/
+void pvr_prof_stop(void);
+
+/** \brief   Get the records for the last few frames.
+    \ingroup pvr_prof
+
+    The records are copied out oldest first. Records for the last few frames
+    may not be complete yet.
+
+    \param  out             Where to copy them.
+    \param  max             How many records fit in out.
+    \return                 How many records were copied.
+*/
+size_t pvr_prof_get(pvr_prof_frame_t *out, size_t max);
+
+/** \brief   Write the records out as a Chrome trace.
+    \ingroup pvr_prof
+
+    The trace has a track each for the CPU, the TA, the render and the
+    display. Frames, lists and waits are shown as spans, with the amounts sent
+    and missed vertical blanks as their arguments.
+
+    \param  path            The file to write, for example "/pc/trace.json".
+    \retval 0               On success.
+    \retval -1              If the profiler isn't running, or the file
+                            couldn't be written.
+*/
+int pvr_prof_export(const char *path);
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_PROF_H */
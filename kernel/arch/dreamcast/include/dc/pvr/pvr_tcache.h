@@ -0,0 +1,200 @@
+/* KallistiOS ##version##
+
+   dc/pvr/pvr_tcache.h
+
+*/
+
+/** \file       dc/pvr/pvr_tcache.h
+    \brief      VRAM texture cache
+    \ingroup    pvr_tcache
+*/
+
+#ifndef __DC_PVR_PVR_TCACHE_H
+#define __DC_PVR_PVR_TCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+/** \defgroup pvr_tcache     Texture Cache
+    \brief                   Keep more textures around than fit in VRAM
+    \ingroup                 pvr_vram
+
+    The texture cache keeps a copy of every texture given to it in main RAM,
+    and only keeps the ones that are actually being drawn with in VRAM. When
+    VRAM runs out (or the cache goes over the budget it was given), the
+    textures that were used the longest time ago are dropped from VRAM to make
+    room. Textures that were used in the last \ref PVR_TCACHE_KEEP_FRAMES
+    frames are never dropped, as the PVR may still be drawing with them.
+
+    Every frame, ask for the VRAM location of each texture about to be drawn
+    with pvr_tcache_use(). If the texture isn't in VRAM, it gets copied back in
+    by DMA in the background, and NULL is returned in the meantime so that
+    something else (a smaller texture, or nothing at all) can be drawn in its
+    place. Use pvr_tcache_use_sync() instead for textures that can't wait.
+    The location of a texture may change every time it is brought back into
+    VRAM, so polygon headers using it have to be compiled again each frame.
+
+    Copies in main RAM can optionally be compressed (without any loss), which
+    helps a lot on textures with large areas of the same color.
+
+    The cache allocates VRAM with pvr_mem_malloc(), which isn't thread-safe,
+    so all of the functions here should be called from the same thread as the
+    rest of the PVR memory management.
+*/
+
+/** \brief   Frames after its last use that a texture is kept in VRAM.
+    \ingroup pvr_tcache
+*/
+#define PVR_TCACHE_KEEP_FRAMES  2
+
+/** \defgroup pvr_tcache_flags  Flags
+    \brief                      Flags for adding textures to the cache
+    \ingroup                    pvr_tcache
+
+    @{
+*/
+#define PVR_TCACHE_COMPRESS     0x01    /**< \brief Compress the copy in main RAM */
+/** @} */
+
+/** \brief   A texture in the cache.
+    \ingroup pvr_tcache
+*/
+typedef struct pvr_tcache_txr pvr_tcache_txr_t;
+
+/** \brief   Texture cache statistics.
+    \ingroup pvr_tcache
+
+    The per frame counters are for the last frame ended with
+    pvr_tcache_frame().
+
+    \see    pvr_tcache_get_stats()
+*/
+typedef struct pvr_tcache_stats {
+    uint32_t frame_count;       /**< \brief Frames ended so far */
+
+    uint32_t hits;              /**< \brief Uses of textures in VRAM */
+    uint32_t misses;            /**< \brief Uses of textures not in VRAM */
+    uint32_t uploads;           /**< \brief Textures copied into VRAM */
+    uint32_t evictions;         /**< \brief Textures dropped from VRAM */
+    size_t upload_bytes;        /**< \brief Bytes copied into VRAM */
+    uint32_t upload_us;         /**< \brief Time spent copying, in microseconds */
+    uint32_t upload_rate;       /**< \brief Upload bandwidth, in bytes/second */
+
+    uint32_t count;             /**< \brief Textures in the cache */
+    uint32_t resident;          /**< \brief Textures in VRAM (or on their way) */
+    size_t vram_bytes;          /**< \brief VRAM used by the cache */
+    size_t ram_bytes;           /**< \brief Main RAM used by the copies */
+} pvr_tcache_stats_t;
+
+/** \brief   Set up the texture cache.
+    \ingroup pvr_tcache
+
+    The PVR must be initialized first.
+
+    \param  budget          Most VRAM the cache may use, in bytes, or 0 to use
+                            as much as pvr_mem_malloc() will give.
+    \retval 0               On success.
+    \retval -1              If the worker thread couldn't be started.
+*/
+int pvr_tcache_init(size_t budget);
+
+/** \brief   Shut down the texture cache.
+    \ingroup pvr_tcache
+
+    This removes every texture still in the cache.
+*/
+void pvr_tcache_shutdown(void);
+
+/** \brief   Add a texture to the cache.
+    \ingroup pvr_tcache
+
+    The texture is prepared in main RAM the same way pvr_txr_load_ex() would
+    load it (twiddled, VQ compressed, with mipmaps, etc), so src can be thrown
+    away once this returns. It isn't put in VRAM until it's used.
+
+    \param  src             The texture, as for pvr_txr_load_ex().
+    \param  w               The width of the texture, in pixels.
+    \param  h               The height of the texture, in pixels.
+    \param  txr_flags       Flags for pvr_txr_load_ex(). The ones about how to
+                            copy to VRAM are ignored.
+    \param  flags           Some set of \ref pvr_tcache_flags.
+    \return                 The texture, or NULL if out of memory.
+*/
+pvr_tcache_txr_t *pvr_tcache_add(const void *src, uint32_t w, uint32_t h,
+                                 uint32_t txr_flags, uint32_t flags);
+
+/** \brief   Add a texture that is ready to go into VRAM to the cache.
+    \ingroup pvr_tcache
+
+    This is for textures that are already in the form the PVR wants them in,
+    like the ones loaded from .dt or .kmg files.
+
+    \param  data            The texture data, which is copied.
+    \param  size            The size of the texture data, in bytes.
+    \param  flags           Some set of \ref pvr_tcache_flags.
+    \return                 The texture, or NULL if out of memory.
+*/
+pvr_tcache_txr_t *pvr_tcache_add_raw(const void *data, size_t size,
+                                     uint32_t flags);
+
+/** \brief   Remove a texture from the cache.
+    \ingroup pvr_tcache
+
+    This frees the texture's VRAM (waiting for it to be copied in first, if
+    it's on its way) and its copy in main RAM. Don't do this while the PVR
+    may still be drawing with it.
+
+    \param  txr             The texture to remove.
+*/
+void pvr_tcache_remove(pvr_tcache_txr_t *txr);
+
+/** \brief   Get the VRAM location of a texture about to be drawn with.
+    \ingroup pvr_tcache
+
+    This marks the texture as used in this frame. If it isn't in VRAM, room
+    is made for it and it's copied in by the cache's worker thread.
+
+    \param  txr             The texture to use.
+    \return                 The texture's VRAM location, or NULL if it isn't
+                            there yet.
+
+    \par    Error Conditions:
+    \em     EPERM - the cache hasn't been set up with pvr_tcache_init()
+*/
+pvr_ptr_t pvr_tcache_use(pvr_tcache_txr_t *txr);
+
+/** \brief   Get the VRAM location of a texture, waiting for it if needed.
+    \ingroup pvr_tcache
+
+    \param  txr             The texture to use.
+    \return                 The texture's VRAM location, or NULL if there
+                            isn't room for it in VRAM right now, or it
+                            couldn't be copied there.
+
+    \par    Error Conditions:
+    \em     EPERM - the cache hasn't been set up with pvr_tcache_init()
+*/
+pvr_ptr_t pvr_tcache_use_sync(pvr_tcache_txr_t *txr);
+
+/** \brief   End a frame.
+    \ingroup pvr_tcache
+
+    Call this once a frame, after the last texture of the frame has been used
+    (pvr_scene_finish() is a good place), to close out the statistics of the
+    frame and let old textures be dropped.
+*/
+void pvr_tcache_frame(void);
+
+/** \brief   Get texture cache statistics.
+    \ingroup pvr_tcache
+
+    \param  stats           Where to put the statistics.
+*/
+void pvr_tcache_get_stats(pvr_tcache_stats_t *stats);
+
+__END_DECLS
+
+#endif /* __DC_PVR_PVR_TCACHE_H */
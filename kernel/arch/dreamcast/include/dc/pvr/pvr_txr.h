@@ -107,9 +107,15 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_4BPP            0x01    /**< \brief 4BPP format */
 #define PVR_TXRLOAD_8BPP            0x02    /**< \brief 8BPP format */
 #define PVR_TXRLOAD_16BPP           0x03    /**< \brief 16BPP format */
+#define PVR_TXRLOAD_32BPP           0x04    /**< \brief 32BPP ARGB8888 format, converted to 16BPP */
 #define PVR_TXRLOAD_FMT_MASK        0x0f    /**< \brief Bits used for basic formats */
 
-#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (not supported yet, if ever) */
+#define PVR_TXRLOAD_CONV_ARGB1555   0x100   /**< \brief Convert 32BPP to ARGB1555 */
+#define PVR_TXRLOAD_CONV_RGB565     0x200   /**< \brief Convert 32BPP to RGB565 */
+#define PVR_TXRLOAD_CONV_ARGB4444   0x300   /**< \brief Convert 32BPP to ARGB4444 */
+#define PVR_TXRLOAD_CONV_MASK       0x300   /**< \brief Bits used for 32BPP conversion */
+
+#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding while loading */
 #define PVR_TXRLOAD_INVERT_Y        0x20    /**< \brief Invert the Y axis while loading */
 #define PVR_TXRLOAD_FMT_VQ          0x40    /**< \brief Texture is already VQ encoded */
 #define PVR_TXRLOAD_FMT_TWIDDLED    0x80    /**< \brief Texture is already twiddled */
@@ -117,6 +123,7 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_DMA             0x8000  /**< \brief Use DMA to load the texture */
 #define PVR_TXRLOAD_NONBLOCK        0x4000  /**< \brief Use non-blocking loads (only for DMA) */
 #define PVR_TXRLOAD_SQ              0x2000  /**< \brief Use Store Queues to load */
+#define PVR_TXRLOAD_MIPMAP          0x1000  /**< \brief Load a full mipmap chain */
 /** @} */
 
 /** \brief   Load texture data from an SH-4 buffer into PVR RAM, twiddling it in
@@ -124,16 +131,34 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
     \ingroup pvr_txr_mgmt
 
     This function loads a texture to the PVR's RAM with the specified set of
-    flags. It will currently always twiddle the data, whether you ask it to or
-    not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
-
-    This will be slower than using pvr_txr_load() in pretty much all cases, so
-    unless you need to twiddle your texture, just use that instead.
+    flags, always twiddling the data. The texture is twiddled a tile at a time
+    into a staging buffer in main RAM, which is then shipped out to PVR RAM
+    with the Store Queues (the default) or DMA (with \ref PVR_TXRLOAD_DMA).
+    DMA loads always wait for the transfer to finish before returning, so
+    \ref PVR_TXRLOAD_NONBLOCK has no effect here.
+
+    32BPP textures are given in ARGB8888 and converted to the 16BPP format
+    picked with one of the PVR_TXRLOAD_CONV_* flags, since the PVR has no
+    32-bit texture formats of its own.
+
+    With \ref PVR_TXRLOAD_MIPMAP, src holds every level of a square texture,
+    from the full size one down to 1x1, one right after the other (each level
+    starts on a byte boundary). They are laid out the way the PVR expects, so
+    dst must have room for the whole chain.
+
+    With \ref PVR_TXRLOAD_VQ_LOAD, a 16BPP or 32BPP texture is VQ compressed
+    with pvr_txr_vq_encode() (using the parameters set with
+    pvr_txr_set_vq_params()) before being loaded, so dst needs room for
+    pvr_txr_vq_size() bytes. One of the PVR_TXRLOAD_CONV_* flags must say what
+    format the texture is in (or is to be converted to). Use
+    \ref PVR_TXRFMT_VQ_ENABLE along with that format when drawing with it.
+
+    dst may also be in main RAM, in which case the texture is put together
+    there, ready to be copied into VRAM as is later on.
 
     \param  src             The location to copy from.
-    \param  dst             The location to copy to.
+    \param  dst             The location to copy to. This should be 32-byte
+                            aligned, or the Store Queues and DMA can't be used.
     \param  w               The width of the texture, in pixels.
     \param  h               The height of the texture, in pixels.
     \param  flags           Some set of flags, ORed together.
@@ -143,6 +168,99 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                      uint32_t w, uint32_t h, uint32_t flags);
 
+/** \brief   Default number of VQ refinement passes.
+    \ingroup pvr_txr_mgmt
+*/
+#define PVR_TXR_VQ_PASSES_DEFAULT   1
+
+/** \brief   Runtime VQ compression parameters.
+    \ingroup pvr_txr_mgmt
+
+    These control how pvr_txr_vq_encode() builds the codebook of a texture.
+
+    \see    pvr_txr_vq_encode()
+    \see    pvr_txr_set_vq_params()
+*/
+typedef struct pvr_txr_vq_params {
+    /** \brief  Refinement passes over the codebook.
+
+        This is the speed/quality knob. With no passes at all, the codebook
+        is built in roughly eight quick passes over the texture. Each pass on
+        top of that moves the codebook closer to the texture, but takes about
+        as long as building it did (or longer, on noisy textures).
+    */
+    int passes;
+
+    /** \brief  Fixed codebook to use, or NULL to build one.
+
+        This is 256 entries of four texels each (in the twiddled order of the
+        PVR), in the same format as the texture. This is exactly the first
+        2048 bytes of a VQ texture, so the codebook of one texture can be used
+        to encode others quickly (and will work best on ones that look
+        alike). The passes are ignored with a fixed codebook.
+    */
+    const uint16_t *codebook;
+} pvr_txr_vq_params_t;
+
+/** \brief   Set the VQ compression parameters used when loading textures.
+    \ingroup pvr_txr_mgmt
+
+    This sets the parameters used by pvr_txr_load_ex() with
+    \ref PVR_TXRLOAD_VQ_LOAD, as well as by pvr_txr_vq_encode() when it isn't
+    given any. The parameters are copied, but a fixed codebook isn't, so it
+    needs to stick around for as long as it is in use.
+
+    \param  params          The parameters to use, or NULL for the defaults.
+*/
+void pvr_txr_set_vq_params(const pvr_txr_vq_params_t *params);
+
+/** \brief   Get the size of a VQ compressed texture.
+    \ingroup pvr_txr_mgmt
+
+    \param  w               The width of the texture, in pixels.
+    \param  h               The height of the texture, in pixels.
+    \param  flags           The flags the texture is encoded with. Only
+                            \ref PVR_TXRLOAD_MIPMAP matters here.
+    \return                 The size of the codebook and indices, in bytes.
+*/
+size_t pvr_txr_vq_size(uint32_t w, uint32_t h, uint32_t flags);
+
+/** \brief   VQ compress a texture in main RAM.
+    \ingroup pvr_txr_mgmt
+
+    This compresses a 16BPP or 32BPP texture into a twiddled VQ texture,
+    which takes up about an eighth of the space of a 16BPP one. The output is
+    the 2048 byte codebook followed by the indices, ready to be copied to PVR
+    RAM as is. This doesn't touch the PVR at all, so it can be done ahead of
+    time in another thread.
+
+    The source takes the same flags as pvr_txr_load_ex() does:
+    \ref PVR_TXRLOAD_16BPP or \ref PVR_TXRLOAD_32BPP, one of the
+    PVR_TXRLOAD_CONV_* flags to say which format the texture is in (or is to
+    be converted to), \ref PVR_TXRLOAD_INVERT_Y and
+    \ref PVR_TXRLOAD_MIPMAP. Mipmapped textures share one codebook between all
+    of their levels.
+
+    While encoding, this needs about 4 bytes of temporary memory per texel.
+
+    \param  src             The texture to compress.
+    \param  out             Where to put the result. This must have room for
+                            pvr_txr_vq_size() bytes.
+    \param  w               The width of the texture, in pixels.
+    \param  h               The height of the texture, in pixels.
+    \param  flags           Some set of flags, ORed together.
+    \param  params          The parameters to use, or NULL for the ones set
+                            with pvr_txr_set_vq_params().
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - the format or size of the texture isn't supported \n
+    \em     ENOMEM - out of memory
+*/
+int pvr_txr_vq_encode(const void *src, void *out, uint32_t w, uint32_t h,
+                      uint32_t flags, const pvr_txr_vq_params_t *params);
+
 /** \brief   Load a KOS Platform Independent Image (subject to constraint
              checking).
     \ingroup pvr_txr_mgmt
@@ -168,9 +286,6 @@ void pvr_txr_load_ex(const void *src, pvr_ptr_t dst,
                             \ref PVR_TXRLOAD_FMT_NOTWIDDLE (or equivalently
                             \ref PVR_TXRLOAD_FMT_TWIDDLED) and
                             \ref PVR_TXRLOAD_INVERT_Y in the flags.
-    \note                   DMA and Store Queue based loading is not available
-                            from this function if it twiddles the texture while
-                            loading.
 */
 void pvr_txr_load_kimg(const kos_img_t *img, pvr_ptr_t dst, uint32_t flags);
 
@@ -0,0 +1,281 @@
+/* KallistiOS ##version##
+
+   matrix_batch.c
+
+ */
+
+#include <math.h>
+#include <dc/matrix.h>
+#include <dc/fmath.h>
+
+/*
+
+   Batch kernels built on ftrv and fipr
+
+   ftrv does four dot products at once, so anything that needs a vector dotted
+   with up to four others goes through it: the four others are loaded into
+   the internal matrix as rows, and each vector put through it comes out as
+   the four dot products. That's how the frustum culling takes on four planes
+   at a time, and how the lighting does four lights at a time. Anything past
+   four is done with fipr, one dot product at a time.
+
+   All of these load their own matrix, so they put the one that was there
+   back when they're done.
+
+*/
+
+/* Load up to four vectors in as the rows of the internal matrix. Rows past
+   count are set to 0 0 0 pad. */
+static void mat_load_rows(const vector_t *rows, int count, float pad) {
+    matrix_t m __attribute__((aligned(32)));
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        if(i < count) {
+            m[0][i] = rows[i].x;
+            m[1][i] = rows[i].y;
+            m[2][i] = rows[i].z;
+            m[3][i] = rows[i].w;
+        }
+        else {
+            m[0][i] = m[1][i] = m[2][i] = 0.0f;
+            m[3][i] = pad;
+        }
+    }
+
+    mat_load(&m);
+}
+
+int mat_cull_spheres(const vector_t *planes, int plane_count,
+                     const vector_t *spheres, int count, uint8_t *visible) {
+    matrix_t saved __attribute__((aligned(32)));
+    const vector_t *p;
+    float x, y, z, w, r;
+    int i, j, in, total = 0;
+
+    mat_store(&saved);
+
+    /* Missing planes are 0 0 0 1, which everything is in front of. */
+    mat_load_rows(planes, plane_count, 1.0f);
+
+    for(i = 0; i < count; ++i, ++spheres) {
+        x = spheres->x;
+        y = spheres->y;
+        z = spheres->z;
+        w = 1.0f;
+        r = -spheres->w;
+
+        mat_trans_nodiv(x, y, z, w);
+
+        in = (x >= r) & (y >= r) & (z >= r) & (w >= r);
+
+        for(j = 4, p = planes + 4; in && j < plane_count; ++j, ++p)
+            in = fipr(spheres->x, spheres->y, spheres->z, 1.0f,
+                      p->x, p->y, p->z, p->w) >= r;
+
+        visible[i] = in;
+        total += in;
+    }
+
+    mat_load(&saved);
+
+    return total;
+}
+
+int mat_cull_boxes(const vector_t *planes, int plane_count,
+                   const vector_t *centers, const vector_t *extents,
+                   int count, uint8_t *visible) {
+    matrix_t saved __attribute__((aligned(32)));
+    vector_t absn[MAT_CULL_MAX_PLANES];
+    const vector_t *c, *e, *p;
+    float x, y, z, w;
+    int i, j, in, total = 0;
+
+    if(plane_count > MAT_CULL_MAX_PLANES)
+        plane_count = MAT_CULL_MAX_PLANES;
+
+    /* How far a box's corners reach along each plane's normal only depends
+       on the size of the normal's parts, so keep them positive. */
+    for(j = 0; j < plane_count; ++j) {
+        absn[j].x = fabsf(planes[j].x);
+        absn[j].y = fabsf(planes[j].y);
+        absn[j].z = fabsf(planes[j].z);
+        absn[j].w = 0.0f;
+    }
+
+    mat_store(&saved);
+    mat_load_rows(planes, plane_count, 1.0f);
+
+    for(i = 0; i < count; ++i) {
+        c = &centers[i];
+        e = &extents[i];
+        x = c->x;
+        y = c->y;
+        z = c->z;
+        w = 1.0f;
+
+        mat_trans_nodiv(x, y, z, w);
+
+        /* Out if the center is further behind a plane than the box reaches. */
+        in = x >= -fipr(e->x, e->y, e->z, 0.0f, absn[0].x, absn[0].y,
+                        absn[0].z, 0.0f);
+
+        if(plane_count > 1)
+            in &= y >= -fipr(e->x, e->y, e->z, 0.0f, absn[1].x, absn[1].y,
+                             absn[1].z, 0.0f);
+
+        if(plane_count > 2)
+            in &= z >= -fipr(e->x, e->y, e->z, 0.0f, absn[2].x, absn[2].y,
+                             absn[2].z, 0.0f);
+
+        if(plane_count > 3)
+            in &= w >= -fipr(e->x, e->y, e->z, 0.0f, absn[3].x, absn[3].y,
+                             absn[3].z, 0.0f);
+
+        for(j = 4, p = planes + 4; in && j < plane_count; ++j, ++p)
+            in = fipr(c->x, c->y, c->z, 1.0f, p->x, p->y, p->z, p->w) >=
+                 -fipr(e->x, e->y, e->z, 0.0f, absn[j].x, absn[j].y,
+                       absn[j].z, 0.0f);
+
+        visible[i] = in;
+        total += in;
+    }
+
+    mat_load(&saved);
+
+    return total;
+}
+
+static inline uint32_t mat_pack_color(float a, float r, float g, float b) {
+    a = a > 1.0f ? 255.0f : a * 255.0f;
+    r = r > 1.0f ? 255.0f : r * 255.0f;
+    g = g > 1.0f ? 255.0f : g * 255.0f;
+    b = b > 1.0f ? 255.0f : b * 255.0f;
+
+    return ((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) |
+           (uint32_t)b;
+}
+
+void mat_light_diffuse(const vector_t *normals, uint32_t *argb, int count,
+                       int stride, const vector_t *dirs,
+                       const vector_t *colors, int light_count,
+                       const vector_t *ambient) {
+    matrix_t saved __attribute__((aligned(32)));
+    vector_t ldir[MAT_LIGHT_MAX];
+    float col[3][4];
+    const vector_t *n;
+    float x, y, z, w, r, g, b, d;
+    int i, j;
+
+    if(light_count > MAT_LIGHT_MAX)
+        light_count = MAT_LIGHT_MAX;
+
+    mat_store(&saved);
+
+    /* Rather than turn every normal around, turn the lights around the other
+       way: M n . L is the same as n . (M^T L). */
+    for(j = 0; j < light_count; ++j) {
+        ldir[j].x = saved[0][0] * dirs[j].x + saved[0][1] * dirs[j].y +
+                    saved[0][2] * dirs[j].z;
+        ldir[j].y = saved[1][0] * dirs[j].x + saved[1][1] * dirs[j].y +
+                    saved[1][2] * dirs[j].z;
+        ldir[j].z = saved[2][0] * dirs[j].x + saved[2][1] * dirs[j].y +
+                    saved[2][2] * dirs[j].z;
+        ldir[j].w = 0.0f;
+    }
+
+    /* The colors of the first four lights, a channel at a time, to add up the
+       four dot products with fipr. */
+    for(j = 0; j < 4; ++j) {
+        col[0][j] = j < light_count ? colors[j].x : 0.0f;
+        col[1][j] = j < light_count ? colors[j].y : 0.0f;
+        col[2][j] = j < light_count ? colors[j].z : 0.0f;
+    }
+
+    mat_load_rows(ldir, light_count, 0.0f);
+
+    for(i = 0, n = normals; i < count; ++i, ++n) {
+        x = n->x;
+        y = n->y;
+        z = n->z;
+        w = 0.0f;
+
+        mat_trans_nodiv(x, y, z, w);
+
+        x = x > 0.0f ? x : 0.0f;
+        y = y > 0.0f ? y : 0.0f;
+        z = z > 0.0f ? z : 0.0f;
+        w = w > 0.0f ? w : 0.0f;
+
+        r = ambient->x + fipr(x, y, z, w, col[0][0], col[0][1], col[0][2],
+                              col[0][3]);
+        g = ambient->y + fipr(x, y, z, w, col[1][0], col[1][1], col[1][2],
+                              col[1][3]);
+        b = ambient->z + fipr(x, y, z, w, col[2][0], col[2][1], col[2][2],
+                              col[2][3]);
+
+        for(j = 4; j < light_count; ++j) {
+            d = fipr(n->x, n->y, n->z, 0.0f, ldir[j].x, ldir[j].y, ldir[j].z,
+                     0.0f);
+
+            if(d > 0.0f) {
+                r += d * colors[j].x;
+                g += d * colors[j].y;
+                b += d * colors[j].z;
+            }
+        }
+
+        *argb = mat_pack_color(ambient->w, r, g, b);
+        argb = (uint32_t *)((uint8_t *)argb + stride);
+    }
+
+    mat_load(&saved);
+}
+
+void mat_skin(const vector_t *in, vector_t *out, int count,
+              const matrix_t *palette, const uint8_t *bones,
+              const float *weights, int bones_per_vertex) {
+    matrix_t saved __attribute__((aligned(32)));
+    float x, y, z, w, ax, ay, az, aw, wt;
+    int i, j, loaded = -1;
+
+    mat_store(&saved);
+
+    for(i = 0; i < count; ++i, ++in, ++out) {
+        ax = ay = az = aw = 0.0f;
+
+        for(j = 0; j < bones_per_vertex; ++j) {
+            if((wt = weights[j]) == 0.0f)
+                continue;
+
+            /* Meshes mostly have runs of vertices on the same bones, so only
+               load a bone's matrix when it changes. */
+            if(bones[j] != loaded) {
+                loaded = bones[j];
+                mat_load(&palette[loaded]);
+            }
+
+            x = in->x;
+            y = in->y;
+            z = in->z;
+            w = in->w;
+
+            mat_trans_nodiv(x, y, z, w);
+
+            ax += x * wt;
+            ay += y * wt;
+            az += z * wt;
+            aw += w * wt;
+        }
+
+        out->x = ax;
+        out->y = ay;
+        out->z = az;
+        out->w = aw;
+
+        bones += bones_per_vertex;
+        weights += bones_per_vertex;
+    }
+
+    mat_load(&saved);
+}
@@ -16,9 +16,13 @@
 
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+/* Size of the blocks sendfile() reads files in when they can't be mapped. */
+#define SENDFILE_BLOCK  16384
+
 /* Define the protocol list type */
 TAILQ_HEAD(proto_list, fs_socket_proto);
 
@@ -187,6 +191,12 @@ int fs_socket_shutdown(void) {
 
 int fs_socket_input(netif_t *src, int domain, int protocol, const void *hdr,
                     const uint8 *data, size_t size) {
+    return fs_socket_input_pbuf(src, domain, protocol, hdr, data, size, NULL);
+}
+
+int fs_socket_input_pbuf(netif_t *src, int domain, int protocol,
+                         const void *hdr, const uint8 *data, size_t size,
+                         net_pbuf_t *pkt) {
     fs_socket_proto_t *i;
     int rv = -2;
 
@@ -199,7 +209,10 @@ int fs_socket_input(netif_t *src, int domain, int protocol, const void *hdr,
 
     TAILQ_FOREACH(i, &protocols, entry) {
         if(i->protocol == protocol) {
-            rv = i->input(src, domain, hdr, data, size);
+            if(i->input_pbuf)
+                rv = i->input_pbuf(src, domain, hdr, data, size, pkt);
+            else
+                rv = i->input(src, domain, hdr, data, size);
             break;
         }
     }
@@ -505,6 +518,359 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+/* Make sure the I/O vector of a message looks sane. */
+static int msg_check(const struct msghdr *msg) {
+    if(msg == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(msg->msg_iov == NULL && msg->msg_iovlen) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Emulate recvmsg() for protocols that don't implement recvmmsg. Anything with
+   more than one I/O vector is bounced through a temporary buffer, so that the
+   message boundaries of datagram protocols are respected. */
+static ssize_t recvmsg_emul(net_socket_t *hnd, struct msghdr *msg, int flags) {
+    socklen_t *namelen = msg->msg_name ? &msg->msg_namelen : NULL;
+    size_t total = 0, n;
+    uint8_t *buf, *tmp;
+    ssize_t rv;
+    int i;
+
+    msg->msg_flags = 0;
+    msg->msg_controllen = 0;
+
+    if(msg->msg_iovlen == 1)
+        return hnd->protocol->recvfrom(hnd, msg->msg_iov[0].iov_base,
+                                       msg->msg_iov[0].iov_len, flags,
+                                       msg->msg_name, namelen);
+
+    for(i = 0; i < msg->msg_iovlen; ++i)
+        total += msg->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(total ? total : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rv = hnd->protocol->recvfrom(hnd, buf, total, flags, msg->msg_name,
+                                 namelen);
+
+    for(i = 0, tmp = buf, total = rv > 0 ? rv : 0; total; ++i) {
+        n = msg->msg_iov[i].iov_len < total ? msg->msg_iov[i].iov_len : total;
+        memcpy(msg->msg_iov[i].iov_base, tmp, n);
+        tmp += n;
+        total -= n;
+    }
+
+    free(buf);
+    return rv;
+}
+
+/* Emulate sendmsg() for protocols that don't implement sendmmsg. */
+static ssize_t sendmsg_emul(net_socket_t *hnd, const struct msghdr *msg,
+                            int flags) {
+    size_t total = 0;
+    uint8_t *buf, *tmp;
+    ssize_t rv;
+    int i;
+
+    if(msg->msg_iovlen == 1)
+        return hnd->protocol->sendto(hnd, msg->msg_iov[0].iov_base,
+                                     msg->msg_iov[0].iov_len, flags,
+                                     msg->msg_name, msg->msg_namelen);
+
+    for(i = 0; i < msg->msg_iovlen; ++i)
+        total += msg->msg_iov[i].iov_len;
+
+    if(!(buf = (uint8_t *)malloc(total ? total : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0, tmp = buf; i < msg->msg_iovlen; ++i) {
+        memcpy(tmp, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        tmp += msg->msg_iov[i].iov_len;
+    }
+
+    rv = hnd->protocol->sendto(hnd, buf, total, flags, msg->msg_name,
+                               msg->msg_namelen);
+    free(buf);
+    return rv;
+}
+
+ssize_t recvmsg(int sock, struct msghdr *message, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr m;
+    int rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg_check(message))
+        return -1;
+
+    if(!hnd->protocol->recvmmsg)
+        return recvmsg_emul(hnd, message, flags);
+
+    m.msg_hdr = *message;
+    m.msg_len = 0;
+
+    if((rv = hnd->protocol->recvmmsg(hnd, &m, 1, flags, NULL)) <= 0)
+        return rv;
+
+    *message = m.msg_hdr;
+    return m.msg_len;
+}
+
+ssize_t sendmsg(int sock, const struct msghdr *message, int flags) {
+    net_socket_t *hnd;
+    struct mmsghdr m;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msg_check(message))
+        return -1;
+
+    if(!hnd->protocol->sendmmsg)
+        return sendmsg_emul(hnd, message, flags);
+
+    m.msg_hdr = *message;
+    m.msg_len = 0;
+
+    if(hnd->protocol->sendmmsg(hnd, &m, 1, flags) < 1)
+        return -1;
+
+    return m.msg_len;
+}
+
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(vlen > IOV_MAX)
+        vlen = IOV_MAX;
+
+    for(i = 0; i < vlen; ++i) {
+        if(msg_check(&msgvec[i].msg_hdr))
+            return -1;
+    }
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags, timeout);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = recvmsg_emul(hnd, &msgvec[i].msg_hdr, flags)) <= 0)
+            return (i || !rv) ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+
+        if(flags & MSG_WAITFORONE)
+            flags |= MSG_DONTWAIT;
+    }
+
+    return i;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(vlen > IOV_MAX)
+        vlen = IOV_MAX;
+
+    for(i = 0; i < vlen; ++i) {
+        if(msg_check(&msgvec[i].msg_hdr))
+            return -1;
+    }
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = sendmsg_emul(hnd, &msgvec[i].msg_hdr, flags)) < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return i;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    net_socket_t *hnd;
+    const uint8_t *map, *data;
+    uint8_t *buf = NULL;
+    size_t total, done = 0, sent = 0, n;
+    off_t pos, orig = -1;
+    ssize_t rv = 0;
+    int err;
+
+    hnd = (net_socket_t *)fs_get_handle(out_fd);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(out_fd) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if((pos = offset ? *offset : fs_tell(in_fd)) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((total = fs_total(in_fd)) == (size_t)-1)
+        return -1;
+
+    if((size_t)pos >= total)
+        count = 0;
+    else if(count > total - pos)
+        count = total - pos;
+
+    /* Send straight out of the file's data if the filesystem lets us get at
+       it, otherwise read it in a block at a time. */
+    err = errno;
+
+    if(!(map = (const uint8_t *)fs_mmap(in_fd))) {
+        errno = err;
+
+        if(!(buf = (uint8_t *)malloc(SENDFILE_BLOCK))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        if(offset)
+            orig = fs_tell(in_fd);
+
+        if(fs_seek(in_fd, pos, SEEK_SET) < 0) {
+            free(buf);
+            return -1;
+        }
+    }
+
+    while(done < count) {
+        if(map) {
+            data = map + pos + done;
+            n = count - done;
+        }
+        else {
+            n = count - done < SENDFILE_BLOCK ? count - done : SENDFILE_BLOCK;
+
+            if((rv = fs_read(in_fd, buf, n)) <= 0)
+                break;
+
+            data = buf;
+            n = rv;
+        }
+
+        for(sent = 0; sent < n; sent += rv) {
+            if((rv = hnd->protocol->sendto(hnd, data + sent, n - sent, 0,
+                                           NULL, 0)) <= 0)
+                break;
+        }
+
+        done += sent;
+
+        if(sent < n)
+            break;
+    }
+
+    /* Leave the file where we stopped sending, or where it was if the caller
+       gave us the offset to use. */
+    err = errno;
+
+    if(offset) {
+        *offset = pos + done;
+
+        if(orig >= 0)
+            fs_seek(in_fd, orig, SEEK_SET);
+    }
+    else {
+        fs_seek(in_fd, pos + done, SEEK_SET);
+    }
+
+    free(buf);
+    errno = err;
+
+    return (done || rv >= 0) ? (ssize_t)done : -1;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
@@ -18,10 +18,10 @@
    The implementations of getaddrinfo() and freeaddrinfo() are new to this
    version of the code though.
 
-   Eventually, I'd like to add some sort of caching of results to this file so
-   that if you look something up more than once, it doesn't have to go back out
-   to the server to do so. But, for now, there is no local database of cached
-   addresses...
+   Answers from the server are kept in a small cache, shared by all threads,
+   for as long as their TTL allows (negative answers included). If a lookup
+   comes in for a name that another thread is already asking the server about,
+   it waits for that answer rather than sending a query of its own.
 */
 
 #include <stdio.h>
@@ -38,6 +38,9 @@
 
 #include <kos/net.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <arch/timer.h>
 
 /* How many attempts to make at contacting the DNS server before giving up. */
 #define DNS_ATTEMPTS    4
@@ -45,6 +48,52 @@
 /* How long to wait between attempts. */
 #define DNS_TIMEOUT     500
 
+/* Number of names that the cache can hold. IPv4 and IPv6 lookups of the same
+   name take up an entry each. */
+#define DNS_CACHE_SIZE  32
+
+/* Maximum number of addresses kept for each name. */
+#define DNS_CACHE_ADDRS 8
+
+/* Longest name that will be cached. Anything longer is still looked up, it
+   just always goes to the server. */
+#define DNS_NAME_MAX    128
+
+/* Upper bound on how long anything is cached, regardless of its TTL. */
+#define DNS_TTL_MAX     (24 * 60 * 60)
+
+/* How long a negative answer is cached if the server doesn't say (seconds). */
+#define DNS_NEG_TTL     60
+
+/* The result of a query, as kept in the cache. */
+typedef struct dns_result {
+    int err;                /* 0, or the EAI_* error from the lookup */
+    int sys_errno;          /* errno to go with EAI_SYSTEM */
+    uint32_t ttl;           /* Seconds the result is good for */
+    int count;              /* Number of addresses */
+    uint8_t addrs[DNS_CACHE_ADDRS][16];
+} dns_result_t;
+
+#define DNS_ENT_FREE    0   /* Unused slot */
+#define DNS_ENT_PENDING 1   /* Query in progress */
+#define DNS_ENT_VALID   2   /* Result filled in */
+
+typedef struct dns_cache_ent {
+    char name[DNS_NAME_MAX];
+    int family;
+    int state;
+    uint32_t seq;           /* Bumped each time a query completes */
+    uint64_t expires;       /* When the result goes stale (ms) */
+    uint64_t last_used;     /* For picking an entry to evict (ms) */
+    dns_result_t res;
+} dns_cache_ent_t;
+
+static dns_cache_ent_t dns_cache[DNS_CACHE_SIZE];
+static in_addr_t dns_cache_srv;     /* Server everything in the cache came from */
+static dns_cache_stats_t dns_stats;
+static mutex_t dns_mutex = MUTEX_INITIALIZER;
+static condvar_t dns_cv = COND_INITIALIZER;
+
 /*
    This performs a simple DNS A-record query. It hasn't been tested extensively
    but so far it seems to work fine.
@@ -214,85 +263,94 @@ static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
 
 // Scans through and skips a label in the data payload, starting
 // at the given offset. The new offset (after the label) will be
-// returned.
-static int dns_skip_label(dnsmsg_t *resp, int o) {
+// returned, or -1 if the label runs off the end of the payload.
+static int dns_skip_label(dnsmsg_t *resp, int o, int size) {
     int cnt;
 
+    if(o < 0)
+        return -1;
+
     // End of the label?
-    while(resp->data[o] != 0) {
+    while(o < size && resp->data[o] != 0) {
         // Is it a pointer?
         if((resp->data[o] & 0xc0) == 0xc0)
-            return o + 2;
+            return o + 2 <= size ? o + 2 : -1;
 
         // Skip this part.
         cnt = resp->data[o++];
         o += cnt;
     }
 
+    if(o >= size)
+        return -1;
+
     // Skip the terminator
     o++;
 
     return o;
 }
 
-// Scans through and copies out a label in the data payload,
-// starting at the given offset. The new offset (after the label)
-// will be returned as well as the label string.
-static int dns_copy_label(dnsmsg_t *resp, int o, char *outbuf) {
-    int cnt;
-    int rv = -1;
+/* Read a 16 or 32-bit big endian value out of a DNS message. */
+static inline uint16_t dns_get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
 
-    // Do each part.
-    outbuf[0] = 0;
+static inline uint32_t dns_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-    for(;;) {
-        // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0) {
-            int offs = ((resp->data[o] & ~0xc0) << 8) | resp->data[o + 1];
+/* Figure out how long a negative answer can be cached for, from the SOA record
+   in the authority section, if there is one (RFC 2308 section 5). The offset
+   is that of the start of the authority section. */
+static uint32_t dns_neg_ttl(dnsmsg_t *resp, int o, int size) {
+    uint16_t nscnt = ntohs(resp->nscount), len;
+    uint32_t ttl, min;
+    int i, r;
 
-            if(rv < 0)
-                rv = o + 2;
+    for(i = 0; i < nscnt; i++) {
+        if((o = dns_skip_label(resp, o, size)) < 0 || o + 10 > size)
+            break;
 
-            o = offs - sizeof(dnsmsg_t);
-        }
-        else {
-            cnt = resp->data[o++];
+        len = dns_get16(&resp->data[o + 8]);
 
-            if(cnt) {
-                if(outbuf[0] != 0)
-                    strcat(outbuf, ".");
+        if(dns_get16(&resp->data[o]) == 6) {
+            ttl = dns_get32(&resp->data[o + 4]);
 
-                strncat(outbuf, (char *)(resp->data + o), cnt);
-                o += cnt;
-            }
-            else {
+            /* Skip MNAME and RNAME, then SERIAL, REFRESH, RETRY and EXPIRE to
+               get to MINIMUM. */
+            r = dns_skip_label(resp, o + 10, size);
+            r = dns_skip_label(resp, r, size);
+
+            if(r < 0 || r + 20 > size)
                 break;
-            }
+
+            min = dns_get32(&resp->data[r + 16]);
+
+            return ttl < min ? ttl : min;
         }
+
+        o += 10 + len;
     }
 
-    if(rv < 0)
-        return o;
-    else
-        return rv;
+    return DNS_NEG_TTL;
 }
 
-/* Forward declaration... */
-static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-
-// Parse a response packet from the DNS server. The IP address
-// will be filled in upon a successful return, otherwise the
-// return value will be <0.
-static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
-                              uint16_t port, struct addrinfo **res) {
-    int i, o, arecs;
-    uint16_t flags;
-    char tmp[64];
+// Parse a response packet from the DNS server, rsize bytes long. The
+// addresses of the given family will be filled in upon a successful return,
+// otherwise the return value will be the EAI_* error.
+static int dns_parse_response(dnsmsg_t *resp, int rsize, int family,
+                              dns_result_t *res) {
+    int i, o, rcode, size = rsize - (int)sizeof(dnsmsg_t);
+    uint16_t flags, type;
     uint16_t ancnt, len;
-    struct addrinfo *ptr = NULL;
+    uint32_t ttl;
+
+    res->count = 0;
+    res->ttl = DNS_TTL_MAX;
+
+    /* Anything shorter than the header can't be a response at all. */
+    if(size < 0)
+        return EAI_FAIL;
 
     /* Check the flags first to see if it was successful. */
     flags = ntohs(resp->flags);
@@ -303,8 +361,9 @@ static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
     }
 
     /* Did the server report an error? */
-    switch(flags & 0x000f) {
+    switch((rcode = flags & 0x000f)) {
         case 0:   /* No error */
+        case 3:   /* Name error */
             break;
 
         case 1:   /* Format error */
@@ -313,160 +372,155 @@ static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
         default:
             return EAI_FAIL;
 
-        case 3:   /* Name error */
-            return EAI_NONAME;
-
         case 2:   /* Server failure */
             return EAI_AGAIN;
     }
 
-    /* Getting zero answers is also a failure. */
-    ancnt = ntohs(resp->ancount);
-
-    if(ancnt < 1)
-        return EAI_NONAME;
-
     /* If we have any query sections (should have at least one), skip 'em. */
     o = 0;
     len = ntohs(resp->qdcount);
 
     for(i = 0; i < len; i++) {
         /* Skip the label. */
-        o = dns_skip_label(resp, o);
+        if((o = dns_skip_label(resp, o, size)) < 0)
+            return EAI_FAIL;
 
         /* And the two type fields. */
         o += 4;
     }
 
-    /* Ok, now the answer section (what we're interested in). */
-    arecs = 0;
-
-    for(i = 0; i < ancnt; i++) {
-        /* Copy out the label, in case we need it. */
-        o = dns_copy_label(resp, o, tmp);
-
-        /* Get the type code. If it's not A or AAAA, skip it. */
-        if(resp->data[o] == 0 && resp->data[o + 1] == 1 &&
-           (hints->ai_family == AF_INET || hints->ai_family == AF_UNSPEC)) {
-            uint32_t addr;
-
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
-
-            /* Grab the address from the response. */
-            addr = htonl((resp->data[o] << 24) | (resp->data[o + 1] << 16) |
-                         (resp->data[o + 2] << 8) | resp->data[o + 3]);
+    /* A name error or getting zero answers is a failure, and one that can be
+       cached for as long as the server says. */
+    ancnt = ntohs(resp->ancount);
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv4_ai(addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+    if(rcode == 3 || ancnt < 1) {
+        /* Skip over any answers (CNAMEs) to get to the authority section. */
+        for(i = 0; i < ancnt && o >= 0; i++) {
+            if((o = dns_skip_label(resp, o, size)) < 0 || o + 10 > size)
+                o = -1;
+            else
+                o += 10 + dns_get16(&resp->data[o + 8]);
+        }
 
-            if(!*res)
-                *res = ptr;
+        res->ttl = o >= 0 ? dns_neg_ttl(resp, o, size) : DNS_NEG_TTL;
+        return EAI_NONAME;
+    }
 
-            o += len;
-            arecs++;
+    /* Ok, now the answer section (what we're interested in). */
+    for(i = 0; i < ancnt; i++) {
+        /* Skip the name, and make sure the record fits in what we got. A
+           malformed answer still gives us whatever came before it went
+           wrong. */
+        if((o = dns_skip_label(resp, o, size)) < 0 || o + 10 > size)
+            return res->count ? 0 : EAI_FAIL;
+
+        type = dns_get16(&resp->data[o]);
+        ttl = dns_get32(&resp->data[o + 4]);
+        len = dns_get16(&resp->data[o + 8]);
+        o += 10;
+
+        if(o + len > size)
+            return res->count ? 0 : EAI_FAIL;
+
+        /* The answer is only good for as long as the shortest lived record
+           that went into it, including any CNAMEs along the way. */
+        if(ttl < res->ttl)
+            res->ttl = ttl;
+
+        /* Grab the address from the response, if it is one we want. */
+        if(res->count < DNS_CACHE_ADDRS &&
+           ((type == QTYPE_A && family == AF_INET && len == 4) ||
+            (type == QTYPE_AAAA && family == AF_INET6 && len == 16))) {
+            memcpy(res->addrs[res->count++], &resp->data[o], len);
         }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 28 &&
-                (hints->ai_family == AF_INET6 || hints->ai_family == AF_UNSPEC)) {
-            struct in6_addr addr;
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+        o += len;
+    }
 
-            /* Grab the address from the response. */
-            memcpy(addr.s6_addr, &resp->data[o], 16);
+    /* Did we find something? */
+    if(!res->count) {
+        res->ttl = DNS_NEG_TTL;
+        return EAI_NONAME;
+    }
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv6_ai(&addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+    return 0;
+}
 
-            if(!*res)
-                *res = ptr;
+/* Forward declaration... */
+static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
+static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
+                                    struct addrinfo *h, struct addrinfo *tail);
 
-            o += len;
-            arecs++;
-        }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 5) {
-            char tmp2[64];
+/* Find the DNS server to use, returning its address (in host byte order), or
+   zero if there isn't one. */
+static in_addr_t dns_server(void) {
+    netif_t *net = net_default_dev;
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
-            o = dns_copy_label(resp, o, tmp2);
-        }
-        else {
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2 + len;
+    /* Use the default device's DNS server. If there's no default device (or it
+       doesn't have one), take the first device that does have one. */
+    if(!net || !(net->dns[0] | net->dns[1] | net->dns[2] | net->dns[3])) {
+        LIST_FOREACH(net, net_get_if_list(), if_list) {
+            if(net->dns[0] | net->dns[1] | net->dns[2] | net->dns[3])
+                break;
         }
     }
 
-    /* Did we find something? */
-    return arecs > 0 ? 0 : EAI_NONAME;
+    if(!net)
+        return 0;
+
+    return (net->dns[0] << 24) | (net->dns[1] << 16) | (net->dns[2] << 8) |
+           net->dns[3];
 }
 
-static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
-                           uint16_t port, struct addrinfo **res) {
+/* Send off a query for the given name to the given server and wait for the
+   answer. */
+static void dns_query(const char *name, int family, in_addr_t raddr,
+                      dns_result_t *res) {
     struct sockaddr_in toaddr;
     uint8_t qb[512];
     size_t size;
-    int sock, rv, tries;
-    in_addr_t raddr;
+    int sock, tries;
     ssize_t rsize = 0;
     struct pollfd pfd;
 
-    /* Make sure we have a network device to communicate on. */
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return EAI_SYSTEM;
-    }
+    res->count = 0;
+    res->ttl = 0;
+    res->sys_errno = 0;
 
     /* Do we have a DNS server specified? */
-    if(net_default_dev->dns[0] == 0 && net_default_dev->dns[1] == 0 &&
-       net_default_dev->dns[2] == 0 && net_default_dev->dns[3] == 0) {
-        return EAI_FAIL;
+    if(!raddr) {
+        res->err = net_default_dev ? EAI_FAIL : EAI_SYSTEM;
+        res->sys_errno = ENETDOWN;
+        return;
     }
 
-    /* Setup a query */
-    if(hints->ai_family == AF_UNSPEC)
-        /* Note: This should (in theory) work, but it seems that some resolvers
-           cannot handle multiple questions in one query. So... while the code
-           here supports multiple questions in one query, this branch will never
-           actually be taken -- getaddrinfo() will always make two separate
-           calls if we need to do both IPv4 and IPv6. */
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 1);
-    else if(hints->ai_family == AF_INET)
+    /* Setup a query. getaddrinfo() always makes two separate calls if we need
+       to do both IPv4 and IPv6, since it seems that some resolvers cannot
+       handle multiple questions in one query. */
+    if(family == AF_INET)
         size = dns_make_query(name, (dnsmsg_t *)qb, 1, 0);
-    else if(hints->ai_family == AF_INET6)
+    else
         size = dns_make_query(name, (dnsmsg_t *)qb, 0, 1);
-    else {
-        errno = EAFNOSUPPORT;
-        return EAI_SYSTEM;
-    }
+
+    res->err = EAI_SYSTEM;
 
     /* Make a socket to talk to the DNS server. */
-    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        return EAI_SYSTEM;
+    if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        res->sys_errno = errno;
+        return;
+    }
 
     /* "Connect" the socket to the DNS server's address. */
-    raddr = (net_default_dev->dns[0] << 24) | (net_default_dev->dns[1] << 16) |
-            (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
-
     memset(&toaddr, 0, sizeof(toaddr));
     toaddr.sin_family = AF_INET;
     toaddr.sin_port = htons(53);
     toaddr.sin_addr.s_addr = htonl(raddr);
 
     if(connect(sock, (struct sockaddr *)&toaddr, sizeof(toaddr))) {
+        res->sys_errno = errno;
         close(sock);
-        return EAI_SYSTEM;
+        return;
     }
 
     /* Set up the structure we'll use to feed to the poll function. */
@@ -477,14 +531,18 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
     for(tries = 0; tries < DNS_ATTEMPTS; ++tries) {
         /* Send the query to the server. */
         if(send(sock, qb, size, 0) < 0) {
-            return EAI_SYSTEM;
+            res->sys_errno = errno;
+            close(sock);
+            return;
         }
 
         /* Wait for the timeout to expire or for us to get the response. */
         if(poll(&pfd, 1, DNS_TIMEOUT) == 1) {
             /* Get the response. */
             if((rsize = recv(sock, qb, 512, 0)) < 0) {
-                return EAI_SYSTEM;
+                res->sys_errno = errno;
+                close(sock);
+                return;
             }
 
             break;
@@ -499,23 +557,239 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
        case, to be perfectly honest. I suppose that EAI_SYSTEM + ETIMEDOUT would
        make the most sense, since that's really what happened... */
     if(!rsize) {
-        errno = ETIMEDOUT;
-        return EAI_SYSTEM;
+        res->sys_errno = ETIMEDOUT;
+        return;
     }
 
     /* Parse the response. */
-    rv = dns_parse_response((dnsmsg_t *)qb, hints, port, res);
+    res->err = dns_parse_response((dnsmsg_t *)qb, (int)rsize, family, res);
+}
+
+/* Find the cache entry for the given name, if there is one. Must be called with
+   the lock held. */
+static dns_cache_ent_t *dns_cache_find(const char *name, int family) {
+    int i;
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].state != DNS_ENT_FREE &&
+           dns_cache[i].family == family && !strcmp(dns_cache[i].name, name))
+            return &dns_cache[i];
+    }
+
+    return NULL;
+}
+
+/* Grab an entry for a new name, throwing out the least recently used one if
+   need be. Entries with a query in progress are never thrown out. Must be
+   called with the lock held. */
+static dns_cache_ent_t *dns_cache_alloc(void) {
+    dns_cache_ent_t *rv = NULL;
+    int i;
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].state == DNS_ENT_FREE)
+            return &dns_cache[i];
 
-    /* If we got something in the result, but got an error value in the return,
-       free whatever we got. */
-    if(rv != 0 && *res) {
-        freeaddrinfo(*res);
-        *res = NULL;
+        if(dns_cache[i].state == DNS_ENT_VALID &&
+           (!rv || dns_cache[i].last_used < rv->last_used))
+            rv = &dns_cache[i];
     }
 
     return rv;
 }
 
+/* Throw away everything in the cache. Anything that's being looked up right
+   now is left alone, the threads waiting on it still need the answer. Must be
+   called with the lock held. */
+static void dns_cache_clear(void) {
+    int i;
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].state == DNS_ENT_VALID)
+            dns_cache[i].state = DNS_ENT_FREE;
+    }
+}
+
+/* Look up a name, using the cache if we can. */
+static void dns_lookup(const char *name, int family, dns_result_t *res) {
+    char key[DNS_NAME_MAX];
+    dns_cache_ent_t *ent;
+    uint64_t now;
+    uint32_t seq;
+    in_addr_t srv = dns_server();
+    size_t i, len = strlen(name);
+
+    /* Names are case-insensitive, and may or may not have the root on the
+       end. Anything too long for the cache just goes to the server. */
+    if(len && name[len - 1] == '.')
+        --len;
+
+    if(len >= DNS_NAME_MAX) {
+        dns_query(name, family, srv, res);
+        return;
+    }
+
+    for(i = 0; i < len; ++i)
+        key[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + 32 : name[i];
+
+    key[len] = 0;
+
+    mutex_lock(&dns_mutex);
+    ++dns_stats.lookups;
+
+    /* A different server may well give different answers (a DHCP lease on
+       another network, say), so start over if the server has changed. */
+    if(srv != dns_cache_srv) {
+        dns_cache_clear();
+        dns_cache_srv = srv;
+    }
+
+    for(;;) {
+        now = timer_ms_gettime64();
+        ent = dns_cache_find(key, family);
+
+        if(!ent || ent->state != DNS_ENT_PENDING)
+            break;
+
+        /* Somebody else is already asking about this one, so wait for their
+           answer instead. Whatever that answer is, it's what we use, even if
+           it already went stale (i.e, had a TTL of zero). */
+        ++dns_stats.coalesced;
+        seq = ent->seq;
+
+        while(ent->state == DNS_ENT_PENDING && ent->seq == seq)
+            cond_wait(&dns_cv, &dns_mutex);
+
+        if(ent->state == DNS_ENT_VALID && ent->seq == seq + 1 &&
+           !strcmp(ent->name, key) && ent->family == family) {
+            *res = ent->res;
+            mutex_unlock(&dns_mutex);
+            return;
+        }
+    }
+
+    if(ent && now < ent->expires) {
+        /* We have a good answer already. */
+        if(ent->res.err)
+            ++dns_stats.neg_hits;
+        else
+            ++dns_stats.hits;
+
+        ent->last_used = now;
+        *res = ent->res;
+        mutex_unlock(&dns_mutex);
+        return;
+    }
+
+    ++dns_stats.misses;
+
+    if(ent)
+        ++dns_stats.expired;
+    else if((ent = dns_cache_alloc()))
+        strcpy(ent->name, key);
+
+    /* If every entry has a query in progress, just go it alone. */
+    if(!ent) {
+        mutex_unlock(&dns_mutex);
+        dns_query(name, family, srv, res);
+        return;
+    }
+
+    ent->family = family;
+    ent->state = DNS_ENT_PENDING;
+    ent->last_used = now;
+    mutex_unlock(&dns_mutex);
+
+    dns_query(name, family, srv, res);
+
+    mutex_lock(&dns_mutex);
+    now = timer_ms_gettime64();
+
+    /* Only real answers from the server get cached, anything else gets handed
+       to whoever was waiting on it and then forgotten. So does an answer from
+       a server that has since been replaced. */
+    if((res->err == 0 || res->err == EAI_NONAME) && srv == dns_cache_srv)
+        ent->expires = now + (uint64_t)(res->ttl < DNS_TTL_MAX ?
+                                         res->ttl : DNS_TTL_MAX) * 1000;
+    else
+        ent->expires = now;
+
+    ent->res = *res;
+    ent->state = DNS_ENT_VALID;
+    ++ent->seq;
+    cond_broadcast(&dns_cv);
+    mutex_unlock(&dns_mutex);
+}
+
+static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
+                           uint16_t port, struct addrinfo **res) {
+    dns_result_t dr;
+    struct addrinfo *ptr = NULL;
+    uint32_t addr4;
+    struct in6_addr addr6;
+    int i;
+
+    if(hints->ai_family != AF_INET && hints->ai_family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return EAI_SYSTEM;
+    }
+
+    dns_lookup(name, hints->ai_family, &dr);
+
+    if(dr.err) {
+        if(dr.err == EAI_SYSTEM)
+            errno = dr.sys_errno;
+
+        return dr.err;
+    }
+
+    /* Build the chain of results. */
+    for(i = 0; i < dr.count; ++i) {
+        if(hints->ai_family == AF_INET) {
+            memcpy(&addr4, dr.addrs[i], 4);
+            ptr = add_ipv4_ai(addr4, port, hints, ptr);
+        }
+        else {
+            memcpy(addr6.s6_addr, dr.addrs[i], 16);
+            ptr = add_ipv6_ai(&addr6, port, hints, ptr);
+        }
+
+        if(!ptr) {
+            /* If something goes wrong in here, it's in calling malloc, so it
+               is definitely a system error. */
+            freeaddrinfo(*res);
+            *res = NULL;
+            return EAI_SYSTEM;
+        }
+
+        if(!*res)
+            *res = ptr;
+    }
+
+    return 0;
+}
+
+void dns_cache_get_stats(dns_cache_stats_t *stats) {
+    int i;
+
+    mutex_lock(&dns_mutex);
+    *stats = dns_stats;
+    stats->entries = 0;
+
+    for(i = 0; i < DNS_CACHE_SIZE; ++i) {
+        if(dns_cache[i].state == DNS_ENT_VALID)
+            ++stats->entries;
+    }
+
+    mutex_unlock(&dns_mutex);
+}
+
+void dns_cache_flush(void) {
+    mutex_lock(&dns_mutex);
+    dns_cache_clear();
+    mutex_unlock(&dns_mutex);
+}
+
 /* New stuff below here... */
 
 static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
@@ -14,6 +14,7 @@
 #include <kos/dbglog.h>
 #include <kos/net.h>
 #include <kos/thread.h>
+#include <kos/mutex.h>
 #include <arch/timer.h>
 
 #include "net_ipv4.h"
@@ -37,30 +38,55 @@ typedef struct {
     uint8_t pr_recv[6];
 } __packed arp_pkt_t;
 
+/* Number of buckets in the ARP cache hash table. Must be a power of two. */
+#define ARP_HASH_SIZE       32
+
+/* Maximum number of packets held on an incomplete entry while we wait for the
+   reply to come in. Once this many are queued, the oldest one is dropped to
+   make room for each new one. */
+#define ARP_PENDING_MAX     4
+
+/* How long entries live for, and how long to wait before asking again for an
+   incomplete entry (both in milliseconds). */
+#define ARP_ENTRY_TIMEOUT   (120 * 1000)
+#define ARP_QUERY_TIMEOUT   (5 * 1000)
+
+/* Don't walk the whole cache looking for expired entries more often than this
+   (in milliseconds). */
+#define ARP_GC_INTERVAL     1000
+
+/* A packet waiting on an incomplete entry. The data follows the header. */
+typedef struct arp_pending {
+    ip_hdr_t            hdr;
+    int                 data_size;
+    uint8_t             data[];
+} arp_pending_t;
+
 /* Structure describing an ARP entry; each entry contains a MAC address,
    an IP address, and a timestamp from 'jiffies'. The timestamp allows
    aging and eventual removal. */
 typedef struct netarp {
-    /* ARP cache list handle */
+    /* ARP cache hash chain handle */
     LIST_ENTRY(netarp)  ac_list;
 
+    /* The device the entry belongs to */
+    netif_t             *nif;
+
     /* Mac address */
     uint8_t             mac[6];
 
     /* Associated IP address */
     uint8_t             ip[4];
 
+    /* Has the MAC address been filled in yet? */
+    int                 complete;
+
     /* Cache entry time; if zero, this entry won't expire */
     uint64_t            timestamp;
 
-    /* Optional packet to send when the entry is filled in */
-    ip_hdr_t            *pkt;
-
-    /* Additional data for that packet, if any */
-    uint8_t             *data;
-
-    /* Size of the additional data for the packet */
-    int                 data_size;
+    /* Packets to send when the entry is filled in, oldest first */
+    arp_pending_t       *pending[ARP_PENDING_MAX];
+    int                 pending_count;
 } netarp_t;
 
 /* Define the list type */
@@ -69,160 +95,239 @@ LIST_HEAD(netarp_list, netarp);
 /**************************************************************************/
 /* Variables */
 
-/* ARP cache */
-struct netarp_list net_arp_cache = LIST_HEAD_INITIALIZER(0);
+/* ARP cache, hashed on the device and IP address */
+static struct netarp_list net_arp_cache[ARP_HASH_SIZE];
+
+/* Lock protecting the cache */
+static mutex_t arp_mutex = MUTEX_INITIALIZER;
+
+/* When the cache was last garbage collected */
+static uint64_t arp_last_gc;
+
+/* Statistics */
+static net_arp_stats_t arp_stats;
 
 /**************************************************************************/
 /* Cache management */
 
-/* Garbage collect timed out entries */
-static int net_arp_gc(netif_t *nif) {
+static inline struct netarp_list *arp_bucket(const netif_t *nif,
+                                             const uint8_t ip[4]) {
+    uint32_t h = (uint32_t)(uintptr_t)nif;
+
+    h ^= (ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3];
+    h ^= h >> 16;
+    h ^= h >> 8;
+
+    return &net_arp_cache[h & (ARP_HASH_SIZE - 1)];
+}
+
+static netarp_t *arp_find(const netif_t *nif, const uint8_t ip[4]) {
+    netarp_t *cur;
+
+    LIST_FOREACH(cur, arp_bucket(nif, ip), ac_list) {
+        if(cur->nif == nif && !memcmp(ip, cur->ip, 4))
+            return cur;
+    }
+
+    return NULL;
+}
+
+static void arp_free(netarp_t *a) {
+    int i;
+
+    for(i = 0; i < a->pending_count; ++i)
+        free(a->pending[i]);
+
+    free(a);
+}
+
+/* Put a copy of a packet on an incomplete entry's queue. */
+static int arp_queue(netarp_t *a, const ip_hdr_t *pkt, const uint8_t *data,
+                     int data_size) {
+    arp_pending_t *p;
+
+    if(!(p = (arp_pending_t *)malloc(sizeof(arp_pending_t) + data_size)))
+        return -1;
+
+    memcpy(&p->hdr, pkt, sizeof(ip_hdr_t));
+    memcpy(p->data, data, data_size);
+    p->data_size = data_size;
+
+    if(a->pending_count == ARP_PENDING_MAX) {
+        free(a->pending[0]);
+        memmove(a->pending, a->pending + 1,
+                (ARP_PENDING_MAX - 1) * sizeof(arp_pending_t *));
+        --a->pending_count;
+        ++arp_stats.pending_dropped;
+    }
+
+    a->pending[a->pending_count++] = p;
+    ++arp_stats.pending_queued;
+
+    return 0;
+}
+
+/* Garbage collect timed out entries. Must be called with the lock held. */
+static void net_arp_gc(uint64_t now) {
     netarp_t *a1, *a2;
-    uint64_t now = timer_ms_gettime64();
+    int i;
+
+    if(now < arp_last_gc + ARP_GC_INTERVAL)
+        return;
 
-    a1 = LIST_FIRST(&net_arp_cache);
+    arp_last_gc = now;
 
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        a1 = LIST_FIRST(&net_arp_cache[i]);
 
-        if(a1->timestamp) {
-            if(now >= (a1->timestamp + 120 * 1000)) {
-                LIST_REMOVE(a1, ac_list);
+        while(a1 != NULL) {
+            a2 = LIST_NEXT(a1, ac_list);
 
-                if(a1->pkt) {
-                    free(a1->pkt);
-                    free(a1->data);
+            if(a1->timestamp) {
+                if(now >= (a1->timestamp + ARP_ENTRY_TIMEOUT)) {
+                    LIST_REMOVE(a1, ac_list);
+                    arp_stats.pending_dropped += a1->pending_count;
+                    arp_free(a1);
+                    a1 = a2;
+                    continue;
                 }
 
-                free(a1);
-                a1 = a2;
-                continue;
+                /* If the entry is incomplete and it's been more than 5 seconds
+                   since we queried it, try again. */
+                if(!a1->complete && now > (a1->timestamp + ARP_QUERY_TIMEOUT))
+                    net_arp_query(a1->nif, a1->ip);
             }
 
-            /* If the entry is incomplete and it's been more than 5 seconds
-               since we queried it, try again. */
-            if(a1->mac[0] == 0 && a1->mac[1] == 0 && a1->mac[2] == 0 &&
-               a1->mac[3] == 0 && a1->mac[4] == 0 && a1->mac[5] == 0 &&
-               now > (a1->timestamp + 5 * 1000)) {
-                net_arp_query(nif, a1->ip);
-            }
+            a1 = a2;
         }
-
-        a1 = a2;
     }
-
-    return 0;
 }
 
 /* Add an entry to the ARP cache manually */
 int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
                    uint64_t timestamp) {
+    arp_pending_t *pending[ARP_PENDING_MAX];
+    int count = 0, i;
     netarp_t *cur;
 
-    /* First make sure the entry isn't already there */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip, cur->ip, 4)) {
-            memcpy(cur->mac, mac, 6);
-            cur->timestamp = timestamp;
-
-            /* Send our queued packet, if we have one */
-            if(cur->pkt) {
-                net_ipv4_send_packet(nif, cur->pkt, cur->data, cur->data_size);
-                free(cur->pkt);
-                free(cur->data);
-
-                cur->pkt = NULL;
-                cur->data = NULL;
-                cur->data_size = 0;
-            }
+    if(mutex_lock_irqsafe(&arp_mutex))
+        return -1;
 
-            return 0;
-        }
+    /* First see if the entry is already there */
+    if((cur = arp_find(nif, ip))) {
+        memcpy(cur->mac, mac, 6);
+        cur->complete = 1;
+        cur->timestamp = timestamp;
+
+        /* Grab any queued packets, to send once we've let go of the lock
+           (sending them will come back through net_arp_lookup()). */
+        count = cur->pending_count;
+        memcpy(pending, cur->pending, count * sizeof(arp_pending_t *));
+        cur->pending_count = 0;
     }
+    else {
+        /* It's not there, add an entry */
+        cur = (netarp_t *)malloc(sizeof(netarp_t));
 
-    /* It's not there, add an entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-
-    if(cur == NULL)
-        return -1;
+        if(cur == NULL) {
+            mutex_unlock(&arp_mutex);
+            return -1;
+        }
 
-    memcpy(cur->mac, mac, 6);
-    memcpy(cur->ip, ip, 4);
-    cur->timestamp = timestamp;
-    cur->pkt = NULL;
-    cur->data = NULL;
-    cur->data_size = 0;
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+        memset(cur, 0, sizeof(netarp_t));
+        cur->nif = nif;
+        memcpy(cur->mac, mac, 6);
+        memcpy(cur->ip, ip, 4);
+        cur->complete = 1;
+        cur->timestamp = timestamp;
+        LIST_INSERT_HEAD(arp_bucket(nif, ip), cur, ac_list);
+    }
 
     /* Garbage collect expired entries */
-    net_arp_gc(nif);
+    net_arp_gc(timer_ms_gettime64());
+
+    mutex_unlock(&arp_mutex);
+
+    /* Send our queued packets, if we have any */
+    for(i = 0; i < count; ++i) {
+        net_ipv4_send_packet(nif, &pending[i]->hdr, pending[i]->data,
+                             pending[i]->data_size);
+        free(pending[i]);
+    }
 
     return 0;
 }
 
 /* Look up an entry from the ARP cache; if no entry is found, then an ARP
-   query will be sent and an error will be returned. Thus your packet send
-   should also fail. Later when the transmit retries, hopefully the answer
-   will have arrived. */
+   query will be sent and an error will be returned. If a packet is given, it
+   is held on to and sent once the reply comes in. */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
                    const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
+    uint64_t now = timer_ms_gettime64();
+    int have_pkt = pkt && data && data_size;
     netarp_t *cur;
 
+    if(mutex_lock_irqsafe(&arp_mutex))
+        return -3;
+
+    ++arp_stats.lookups;
+
     /* Garbage collect expired entries */
-    net_arp_gc(nif);
+    net_arp_gc(now);
 
     /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip_in, cur->ip, 4)) {
-            if(cur->mac[0] == 0 && cur->mac[1] == 0 &&
-               cur->mac[2] == 0 && cur->mac[3] == 0 &&
-               cur->mac[4] == 0 && cur->mac[5] == 0) {
-                return -1;
-            }
-
+    if((cur = arp_find(nif, ip_in))) {
+        if(cur->complete) {
+            ++arp_stats.hits;
             memcpy(mac_out, cur->mac, 6);
 
             if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
+                cur->timestamp = now;
 
+            mutex_unlock(&arp_mutex);
             return 0;
         }
+
+        /* We're still waiting on the reply, queue up the packet to go along
+           with the others. */
+        ++arp_stats.misses;
+        memset(mac_out, 0, 6);
+
+        if(have_pkt && !arp_queue(cur, pkt, data, data_size)) {
+            mutex_unlock(&arp_mutex);
+            return -2;
+        }
+
+        mutex_unlock(&arp_mutex);
+        return -1;
     }
 
+    ++arp_stats.misses;
+
     /* It's not there... Add an incomplete ARP entry */
     cur = (netarp_t *)malloc(sizeof(netarp_t));
 
-    if(cur == NULL)
+    if(cur == NULL) {
+        mutex_unlock(&arp_mutex);
         return -3;
+    }
 
     memset(cur, 0, sizeof(netarp_t));
+    cur->nif = nif;
     memcpy(cur->ip, ip_in, 4);
-    cur->timestamp = timer_ms_gettime64();
+    cur->timestamp = now;
 
     /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        cur->data = (uint8_t *)malloc(data_size);
-
-        if(cur->data) {
-            cur->pkt = (ip_hdr_t *)malloc(sizeof(ip_hdr_t));
-
-            if(!cur->pkt) {
-                free(cur->data);
-                cur->data = NULL;
-            }
-            else {
-                memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
-                cur->data_size = data_size;
-            }
-        }
-    }
+    if(have_pkt)
+        arp_queue(cur, pkt, data, data_size);
 
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+    LIST_INSERT_HEAD(arp_bucket(nif, ip_in), cur, ac_list);
 
     /* Generate an ARP who-has packet */
     net_arp_query(nif, ip_in);
 
+    mutex_unlock(&arp_mutex);
+
     /* Return failure */
     memset(mac_out, 0, 6);
     return -2;
@@ -232,29 +337,43 @@ int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
    that if this fails, you have no recourse. */
 int net_arp_revlookup(netif_t *nif, uint8_t ip_out[4], const uint8_t mac_in[6]) {
     netarp_t *cur;
+    int i;
 
-    (void)nif;
+    if(mutex_lock_irqsafe(&arp_mutex))
+        return -1;
 
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(mac_in, cur->mac, 6)) {
-            memcpy(ip_out, cur->ip, 4);
+    /* Look for the entry. This isn't something that gets done often, so
+       there's no index by MAC address to go along with the hash table. */
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        LIST_FOREACH(cur, &net_arp_cache[i], ac_list) {
+            if((!nif || cur->nif == nif) && cur->complete &&
+               !memcmp(mac_in, cur->mac, 6)) {
+                memcpy(ip_out, cur->ip, 4);
 
-            if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
+                if(cur->timestamp != 0)
+                    cur->timestamp = timer_ms_gettime64();
 
-            return 0;
+                mutex_unlock(&arp_mutex);
+                return 0;
+            }
         }
     }
 
+    mutex_unlock(&arp_mutex);
     return -1;
 }
 
+/* Retrieve the ARP cache statistics */
+net_arp_stats_t net_arp_get_stats(void) {
+    return arp_stats;
+}
+
 /* Send an ARP reply packet on the specified network adapter */
 static int net_arp_send(netif_t *nif, arp_pkt_t *pkt) {
     arp_pkt_t pkt_out;
     eth_hdr_t eth_hdr;
     uint8_t buf[sizeof(arp_pkt_t) + sizeof(eth_hdr_t)];
+    net_pbuf_t frame;
 
     /* First, fill in the ARP packet. */
     pkt_out.hw_type[0] = 0;
@@ -280,7 +399,7 @@ static int net_arp_send(netif_t *nif, arp_pkt_t *pkt) {
     memcpy(buf + sizeof(eth_hdr_t), &pkt_out, sizeof(arp_pkt_t));
 
     /* Send it away */
-    nif->if_tx(nif, buf, sizeof(eth_hdr_t) + sizeof(arp_pkt_t), NETIF_BLOCK);
+    net_if_tx_pbuf(nif, net_pbuf_wrap(&frame, buf, sizeof(buf)), NETIF_BLOCK);
 
     return 0;
 }
@@ -319,6 +438,7 @@ int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
     arp_pkt_t pkt_out;
     eth_hdr_t eth_hdr;
     uint8_t buf[sizeof(arp_pkt_t) + sizeof(eth_hdr_t)];
+    net_pbuf_t frame;
 
     /* First, fill in the ARP packet. */
     pkt_out.hw_type[0] = 0;
@@ -354,7 +474,7 @@ int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
     memcpy(buf + sizeof(eth_hdr_t), &pkt_out, sizeof(arp_pkt_t));
 
     /* Send it away */
-    nif->if_tx(nif, buf, sizeof(eth_hdr_t) + sizeof(arp_pkt_t), NETIF_BLOCK);
+    net_if_tx_pbuf(nif, net_pbuf_wrap(&frame, buf, sizeof(buf)), NETIF_BLOCK);
 
     return 0;
 }
@@ -364,8 +484,14 @@ int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
 
 /* Init */
 int net_arp_init(void) {
+    int i;
+
     /* Initialize the ARP cache */
-    LIST_INIT(&net_arp_cache);
+    for(i = 0; i < ARP_HASH_SIZE; ++i)
+        LIST_INIT(&net_arp_cache[i]);
+
+    arp_last_gc = 0;
+    memset(&arp_stats, 0, sizeof(arp_stats));
 
     return 0;
 }
@@ -374,20 +500,21 @@ int net_arp_init(void) {
 void net_arp_shutdown(void) {
     /* Free all ARP entries */
     netarp_t *a1, *a2;
+    int i;
 
-    a1 = LIST_FIRST(&net_arp_cache);
+    mutex_lock(&arp_mutex);
 
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        a1 = LIST_FIRST(&net_arp_cache[i]);
 
-        if(a1->pkt) {
-            free(a1->pkt);
-            free(a1->data);
+        while(a1 != NULL) {
+            a2 = LIST_NEXT(a1, ac_list);
+            arp_free(a1);
+            a1 = a2;
         }
 
-        free(a1);
-        a1 = a2;
+        LIST_INIT(&net_arp_cache[i]);
     }
 
-    LIST_INIT(&net_arp_cache);
+    mutex_unlock(&arp_mutex);
 }
@@ -0,0 +1,552 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_capture.c
+
+*/
+
+/* This file implements packet capture. Whoever sends or receives a frame
+   copies it into a ring buffer of records, which a thread of its own then
+   writes out to a pcap or pcapng file.
+
+   Frames can be captured from interrupt handlers, so nothing on the capturing
+   side may block. Space in the ring is claimed with interrupts disabled, which
+   only takes a few instructions, and the frame is copied in afterwards with
+   them enabled again. Once the copy is done the record is marked ready, and
+   the writer thread only ever looks at records in order up to the first one
+   that isn't. Only the writer thread moves the tail of the ring, so it doesn't
+   need to disable interrupts at all. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+#include <kos/fs.h>
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/genwait.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
+
+#include "net_capture.h"
+
+/* Default size of the ring buffer, in bytes. */
+#define CAP_RING_SIZE       (128 * 1024)
+
+/* Size of the buffer that writes to the file are gathered up in. Some file
+   systems (dcload in particular) are much happier with a few large writes
+   than with lots of small ones. */
+#define CAP_OUT_SIZE        (16 * 1024)
+
+/* How long the writer thread sleeps if the ring doesn't fill up (in ms). */
+#define CAP_WAIT            100
+
+/* Snapshot length used when the caller doesn't give one. */
+#define CAP_SNAPLEN_MAX     65535
+
+/* Maximum number of devices given their own pcapng interface block. */
+#define CAP_MAX_IFS         8
+
+/* Longest device name written to a pcapng interface block. */
+#define CAP_IF_NAMELEN      32
+
+/* Records are padded to this size, and the header of each one takes up exactly
+   this much space. That way, the space left at the end of the ring is always
+   either nothing or enough for a header saying to skip to the start. */
+#define CAP_ALIGN           32
+
+/* Direction flag for a record that just pads out the end of the ring. */
+#define CAP_PAD             0x80000000
+
+#define CAP_ROUND(x)        (((x) + CAP_ALIGN - 1) & ~(CAP_ALIGN - 1))
+
+typedef struct cap_rec {
+    volatile uint32_t ready;
+    uint32_t size;              /* Including this header */
+    uint32_t dir;
+    uint32_t caplen;
+    uint32_t origlen;
+    uint32_t ts;                /* Microseconds since boot, low 32 bits */
+    netif_t *nif;
+} cap_rec_t;
+
+_Static_assert(sizeof(cap_rec_t) <= CAP_ALIGN, "capture record too big");
+
+#define CAP_DATA(rec)       ((uint8_t *)(rec) + CAP_ALIGN)
+
+/* pcap and pcapng block types and options. */
+#define PCAP_MAGIC          0xA1B2C3D4
+#define PCAP_LINKTYPE_ETH   1
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BOM          0x1A2B3C4D
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_IF_NAME  2
+#define PCAPNG_OPT_EPB_FLAGS 2
+
+volatile int net_capture_active = 0;
+
+static uint8_t *cap_ring;
+static uint32_t cap_size;
+static volatile uint32_t cap_head, cap_tail;  /* Free-running byte counts */
+static volatile int cap_busy;               /* Records being filled in */
+
+static net_capture_opts_t cap_opts;
+static net_capture_stats_t cap_stats;
+
+static kthread_t *cap_thd;
+static volatile int cap_done;
+static file_t cap_fd = FILEHND_INVALID;
+static int cap_error;
+static uint64_t cap_time_base;             /* Unix time at boot, in us */
+static uint64_t cap_last_ts;               /* Time of the last record */
+
+static uint8_t *cap_out;
+static size_t cap_out_len;
+
+static netif_t *cap_ifs[CAP_MAX_IFS];
+static int cap_if_count;
+
+static uint16_t cap_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/* Check a frame against the filter in the options. */
+static int cap_match(netif_t *nif, const uint8_t *data, size_t len,
+                     uint32_t dir) {
+    uint16_t type;
+    uint8_t proto;
+    size_t off;
+
+    if(cap_opts.dir && !(cap_opts.dir & dir))
+        return 0;
+
+    if(cap_opts.netif && cap_opts.netif != nif)
+        return 0;
+
+    if(!cap_opts.ethertype && !cap_opts.ip_proto && !cap_opts.port)
+        return 1;
+
+    if(len < 14)
+        return 0;
+
+    type = cap_get16(data + 12);
+
+    if(cap_opts.ethertype && cap_opts.ethertype != type)
+        return 0;
+
+    if(!cap_opts.ip_proto && !cap_opts.port)
+        return 1;
+
+    /* Find the transport header. IPv6 extension headers aren't followed, so
+       fragments and the like will only match on the protocol. */
+    if(type == 0x0800 && len >= 14 + 20) {
+        proto = data[14 + 9];
+        off = 14 + (data[14] & 0x0F) * 4;
+
+        /* Only the first fragment has the ports in it. */
+        if(cap_get16(data + 14 + 6) & 0x1FFF)
+            off = len;
+    }
+    else if(type == 0x86DD && len >= 14 + 40) {
+        proto = data[14 + 6];
+        off = 14 + 40;
+    }
+    else {
+        return 0;
+    }
+
+    if(cap_opts.ip_proto && cap_opts.ip_proto != proto)
+        return 0;
+
+    if(!cap_opts.port)
+        return 1;
+
+    if((proto != IPPROTO_TCP && proto != IPPROTO_UDP) || off + 4 > len)
+        return 0;
+
+    return cap_get16(data + off) == cap_opts.port ||
+           cap_get16(data + off + 2) == cap_opts.port;
+}
+
+void net_capture_frame(netif_t *nif, const uint8_t *data, size_t len,
+                       uint32_t dir) {
+    cap_rec_t *rec, *pad = NULL;
+    uint32_t caplen, size, pos, skip = 0;
+    irq_mask_t old;
+    int match, wake;
+
+    match = cap_match(nif, data, len, dir);
+    caplen = len < cap_opts.snaplen ? len : cap_opts.snaplen;
+    size = CAP_ROUND(CAP_ALIGN + caplen);
+
+    /* Claim the space for the record. */
+    old = irq_disable();
+
+    if(!net_capture_active || !match) {
+        if(net_capture_active)
+            ++cap_stats.filtered;
+
+        irq_restore(old);
+        return;
+    }
+
+    pos = cap_head & (cap_size - 1);
+
+    /* Records can't wrap around, so skip what's left at the end if it isn't
+       big enough. */
+    if(cap_size - pos < size)
+        skip = cap_size - pos;
+
+    if(cap_head - cap_tail + skip + size > cap_size) {
+        ++cap_stats.dropped;
+        irq_restore(old);
+        return;
+    }
+
+    if(skip) {
+        pad = (cap_rec_t *)(cap_ring + pos);
+        pad->size = skip;
+        pad->dir = CAP_PAD;
+        pos = 0;
+    }
+
+    rec = (cap_rec_t *)(cap_ring + pos);
+    wake = cap_head - cap_tail < cap_size / 2;
+    cap_head += skip + size;
+    wake = wake && cap_head - cap_tail >= cap_size / 2;
+    ++cap_busy;
+    ++cap_stats.captured;
+
+    if(pad)
+        pad->ready = 1;
+
+    /* Don't let the writer sleep through half of the ring filling up. */
+    if(wake)
+        genwait_wake_one(&cap_ring);
+
+    irq_restore(old);
+
+    /* Fill in the record. */
+    rec->size = size;
+    rec->nif = nif;
+    rec->dir = dir;
+    rec->ts = (uint32_t)timer_us_gettime64();
+    rec->caplen = caplen;
+    rec->origlen = len;
+    memcpy(CAP_DATA(rec), data, caplen);
+
+    /* Make sure all of that is in memory before the record is marked ready. */
+    __asm__ __volatile__("" : : : "memory");
+    rec->ready = 1;
+
+    old = irq_disable();
+    --cap_busy;
+    irq_restore(old);
+}
+
+static void cap_flush(void) {
+    if(cap_out_len && !cap_error) {
+        if(fs_write(cap_fd, cap_out, cap_out_len) != (ssize_t)cap_out_len) {
+            dbglog(DBG_ERROR, "net_capture: error writing capture file\n");
+            cap_error = 1;
+        }
+        else {
+            cap_stats.bytes += cap_out_len;
+        }
+    }
+
+    cap_out_len = 0;
+}
+
+static void cap_write(const void *data, size_t len) {
+    if(cap_out_len + len > CAP_OUT_SIZE)
+        cap_flush();
+
+    /* Things too big for the buffer go straight out. */
+    if(len > CAP_OUT_SIZE) {
+        if(cap_error)
+            return;
+
+        if(fs_write(cap_fd, data, len) != (ssize_t)len) {
+            dbglog(DBG_ERROR, "net_capture: error writing capture file\n");
+            cap_error = 1;
+        }
+        else {
+            cap_stats.bytes += len;
+        }
+
+        return;
+    }
+
+    memcpy(cap_out + cap_out_len, data, len);
+    cap_out_len += len;
+}
+
+static void cap_write_header(void) {
+    uint32_t hdr[7];
+
+    if(cap_opts.format == NET_CAPTURE_PCAP) {
+        hdr[0] = PCAP_MAGIC;
+        hdr[1] = 2 | (4 << 16);         /* Version 2.4 */
+        hdr[2] = 0;                     /* Time zone */
+        hdr[3] = 0;                     /* Timestamp accuracy */
+        hdr[4] = cap_opts.snaplen;
+        hdr[5] = PCAP_LINKTYPE_ETH;
+        cap_write(hdr, 24);
+    }
+    else {
+        hdr[0] = PCAPNG_SHB;
+        hdr[1] = 28;
+        hdr[2] = PCAPNG_BOM;
+        hdr[3] = 1;                     /* Version 1.0 */
+        hdr[4] = hdr[5] = 0xFFFFFFFF;   /* Section length unknown */
+        hdr[6] = 28;
+        cap_write(hdr, 28);
+    }
+}
+
+/* Find the pcapng interface number of a device, writing out an interface
+   block for it if it hasn't been seen yet. */
+static int cap_if_id(netif_t *nif) {
+    uint32_t blk[(16 + 4 + CAP_IF_NAMELEN + 8) / 4];
+    size_t nlen, len;
+    int i;
+
+    for(i = 0; i < cap_if_count; ++i) {
+        if(cap_ifs[i] == nif)
+            return i;
+    }
+
+    /* Lump anything past the limit in with the last device. */
+    if(cap_if_count == CAP_MAX_IFS)
+        return CAP_MAX_IFS - 1;
+
+    nlen = strnlen(nif->name, CAP_IF_NAMELEN);
+    len = 16 + 4 + ((nlen + 3) & ~3) + 8;
+
+    memset(blk, 0, sizeof(blk));
+    blk[0] = PCAPNG_IDB;
+    blk[1] = len;
+    blk[2] = PCAP_LINKTYPE_ETH;
+    blk[3] = cap_opts.snaplen;
+    blk[4] = PCAPNG_OPT_IF_NAME | (nlen << 16);
+    memcpy(blk + 5, nif->name, nlen);
+
+    /* The end of options marker is already zero, leaving the length. */
+    blk[len / 4 - 1] = len;
+    cap_write(blk, len);
+
+    cap_ifs[cap_if_count] = nif;
+    return cap_if_count++;
+}
+
+static void cap_write_rec(const cap_rec_t *rec) {
+    static const uint32_t zero = 0;
+    uint64_t ts;
+    uint32_t hdr[7], pad = (4 - (rec->caplen & 3)) & 3;
+    int id;
+
+    /* Records only have the bottom of the timestamp, which will only have
+       moved on a bit (or even back a bit) since the last one. */
+    cap_last_ts += (int32_t)(rec->ts - (uint32_t)cap_last_ts);
+    ts = cap_last_ts + cap_time_base;
+
+    if(cap_opts.format == NET_CAPTURE_PCAP) {
+        hdr[0] = (uint32_t)(ts / 1000000);
+        hdr[1] = (uint32_t)(ts % 1000000);
+        hdr[2] = rec->caplen;
+        hdr[3] = rec->origlen;
+        cap_write(hdr, 16);
+        cap_write(CAP_DATA(rec), rec->caplen);
+        return;
+    }
+
+    id = cap_if_id(rec->nif);
+
+    hdr[0] = PCAPNG_EPB;
+    hdr[1] = 28 + rec->caplen + pad + 12 + 4;
+    hdr[2] = id;
+    hdr[3] = (uint32_t)(ts >> 32);
+    hdr[4] = (uint32_t)ts;
+    hdr[5] = rec->caplen;
+    hdr[6] = rec->origlen;
+    cap_write(hdr, 28);
+    cap_write(CAP_DATA(rec), rec->caplen);
+    cap_write(&zero, pad);
+
+    /* The direction goes in the flags option: 1 is inbound, 2 outbound. */
+    hdr[0] = PCAPNG_OPT_EPB_FLAGS | (4 << 16);
+    hdr[1] = (rec->dir & NET_CAPTURE_RX) ? 1 : 2;
+    hdr[2] = PCAPNG_OPT_END;
+    hdr[3] = 28 + rec->caplen + pad + 12 + 4;
+    cap_write(hdr, 16);
+}
+
+/* Write out everything in the ring up to the first record that isn't ready. */
+static void cap_drain(void) {
+    cap_rec_t *rec;
+    uint32_t size;
+
+    while(cap_tail != cap_head) {
+        rec = (cap_rec_t *)(cap_ring + (cap_tail & (cap_size - 1)));
+
+        if(!rec->ready)
+            break;
+
+        if(!(rec->dir & CAP_PAD))
+            cap_write_rec(rec);
+
+        size = rec->size;
+        rec->ready = 0;
+        __asm__ __volatile__("" : : : "memory");
+        cap_tail += size;
+    }
+
+    cap_flush();
+}
+
+static void *cap_thd_func(void *data) {
+    irq_mask_t old;
+
+    (void)data;
+
+    while(!cap_done) {
+        old = irq_disable();
+
+        if(!cap_done && cap_head - cap_tail < cap_size / 2)
+            genwait_wait(&cap_ring, "net_capture", CAP_WAIT, NULL);
+
+        irq_restore(old);
+        cap_drain();
+    }
+
+    cap_drain();
+    return NULL;
+}
+
+int net_capture_start(const char *path, const net_capture_opts_t *opts) {
+    net_capture_opts_t o;
+    uint32_t size;
+
+    if(cap_thd) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(opts)
+        o = *opts;
+    else
+        memset(&o, 0, sizeof(o));
+
+    if(o.format != NET_CAPTURE_PCAP && o.format != NET_CAPTURE_PCAPNG) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!o.snaplen || o.snaplen > CAP_SNAPLEN_MAX)
+        o.snaplen = CAP_SNAPLEN_MAX;
+
+    /* The ring has to be a power of two, and hold at least one whole frame. */
+    if(!o.ring_size)
+        o.ring_size = CAP_RING_SIZE;
+
+    for(size = CAP_ALIGN; size < o.ring_size; size <<= 1) {
+        if(size >= 0x80000000) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if(size < CAP_ROUND(CAP_ALIGN + 1514)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(cap_ring = (uint8_t *)memalign(CAP_ALIGN, size)))
+        goto out_nomem;
+
+    if(!(cap_out = (uint8_t *)malloc(CAP_OUT_SIZE)))
+        goto out_nomem;
+
+    if((cap_fd = fs_open(path, O_WRONLY | O_CREAT | O_TRUNC)) ==
+       FILEHND_INVALID)
+        goto out_free;
+
+    memset(cap_ring, 0, size);
+    memset(&cap_stats, 0, sizeof(cap_stats));
+    cap_opts = o;
+    cap_size = size;
+    cap_head = cap_tail = 0;
+    cap_busy = 0;
+    cap_done = 0;
+    cap_error = 0;
+    cap_out_len = 0;
+    cap_if_count = 0;
+    cap_last_ts = timer_us_gettime64();
+    cap_time_base = (uint64_t)time(NULL) * 1000000 - cap_last_ts;
+
+    cap_write_header();
+
+    if(!(cap_thd = thd_create(0, cap_thd_func, NULL))) {
+        fs_close(cap_fd);
+        cap_fd = FILEHND_INVALID;
+        goto out_free;
+    }
+
+    thd_set_label(cap_thd, "net-capture");
+    net_capture_active = 1;
+
+    return 0;
+
+out_nomem:
+    errno = ENOMEM;
+out_free:
+    free(cap_out);
+    free(cap_ring);
+    cap_out = cap_ring = NULL;
+    return -1;
+}
+
+int net_capture_stop(void) {
+    irq_mask_t old;
+
+    if(!cap_thd)
+        return -1;
+
+    /* Stop anyone else from claiming space, then wait for the ones that
+       already have to finish filling it in. */
+    old = irq_disable();
+    net_capture_active = 0;
+    irq_restore(old);
+
+    while(cap_busy)
+        thd_pass();
+
+    cap_done = 1;
+    genwait_wake_one(&cap_ring);
+    thd_join(cap_thd, NULL);
+    cap_thd = NULL;
+
+    fs_close(cap_fd);
+    cap_fd = FILEHND_INVALID;
+
+    free(cap_out);
+    free(cap_ring);
+    cap_out = cap_ring = NULL;
+
+    return 0;
+}
+
+void net_capture_get_stats(net_capture_stats_t *stats) {
+    irq_mask_t old;
+
+    old = irq_disable();
+    *stats = cap_stats;
+    irq_restore(old);
+}
@@ -0,0 +1,35 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_capture.h
+
+*/
+
+#ifndef __LOCAL_NET_CAPTURE_H
+#define __LOCAL_NET_CAPTURE_H
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <kos/cdefs.h>
+#include <kos/net.h>
+
+__BEGIN_DECLS
+
+/* Non-zero while a capture is running. */
+extern volatile int net_capture_active;
+
+void net_capture_frame(netif_t *nif, const uint8_t *data, size_t len,
+                       uint32_t dir);
+
+/* Hand a frame to the capture, if one is running. This is called on every
+   frame going to or coming from a device, so it has to cost next to nothing
+   when nobody is capturing. */
+static inline void net_capture(netif_t *nif, const uint8_t *data, size_t len,
+                               uint32_t dir) {
+    if(__unlikely(net_capture_active))
+        net_capture_frame(nif, data, len, dir);
+}
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_CAPTURE_H */
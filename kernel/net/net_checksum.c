@@ -0,0 +1,385 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_checksum.c
+
+   Copyright (C) 2005, 2006, 2007, 2008, 2009, 2010, 2012, 2013,
+                 2016 Lawrence Sebald
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <kos/net.h>
+
+/* Add up a block of 32-bit words into a 64-bit accumulator. All of the carry
+   handling is deferred until the caller folds the result down to 16 bits, since
+   the one's complement sum of 32-bit words folds to the same value as the sum
+   of the 16-bit halves. */
+static inline uint64_t cksum_words(const uint32_t *ptr, size_t words,
+                                   uint64_t sum) {
+#ifdef __sh__
+    uint32_t lo = (uint32_t)sum, carries = (uint32_t)(sum >> 32), tmp, pf;
+    size_t blocks = words >> 3;
+
+    /* Run full 32-byte cache blocks through an addc chain, prefetching the
+       next block as we go. The T bit holds the running carry within a block;
+       it gets stashed before dt clobbers it at the bottom of the loop. */
+    if(blocks) {
+        __asm__ __volatile__(
+            "clrt\n"
+            "1:\n\t"
+            "mov     %[p], %[pf]\n\t"
+            "add     #32, %[pf]\n\t"
+            "pref    @%[pf]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "mov.l   @%[p]+, %[t]\n\t"
+            "addc    %[t], %[lo]\n\t"
+            "movt    %[t]\n\t"
+            "add     %[t], %[c]\n\t"
+            "dt      %[n]\n\t"
+            "bf      1b\n"
+            : [p] "+r" (ptr), [lo] "+r" (lo), [c] "+r" (carries),
+              [n] "+r" (blocks), [t] "=&r" (tmp), [pf] "=&r" (pf)
+            :
+            : "t", "memory");
+    }
+
+    sum = ((uint64_t)carries << 32) | lo;
+    words &= 7;
+#else
+    while(words >= 8) {
+        sum += ptr[0];
+        sum += ptr[1];
+        sum += ptr[2];
+        sum += ptr[3];
+        sum += ptr[4];
+        sum += ptr[5];
+        sum += ptr[6];
+        sum += ptr[7];
+        ptr += 8;
+        words -= 8;
+    }
+#endif
+
+    while(words--)
+        sum += *ptr++;
+
+    return sum;
+}
+
+/* Fold a 64-bit partial sum down to a 16-bit one's complement sum. */
+static inline uint32_t cksum_fold(uint64_t sum) {
+    uint32_t rv;
+
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    rv = (uint32_t)sum;
+    rv = (rv & 0xFFFF) + (rv >> 16);
+    rv = (rv & 0xFFFF) + (rv >> 16);
+
+    return rv;
+}
+
+/* Perform an IP-style checksum on a block of data */
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
+    uint64_t sum = start;
+    int odd = (((uintptr_t)data) & 0x01) && bytes;
+    uint32_t rv;
+
+    /* If we start on an odd address, every byte lands in the opposite half of
+       its 16-bit word from where it belongs. Sum everything up that way anyway,
+       then swap the bytes of the result, which is equivalent. */
+    if(odd) {
+        sum = ((start & 0xFF) << 8) | (start >> 8);
+        sum += *data++ << 8;
+        --bytes;
+    }
+
+    if((((uintptr_t)data) & 0x02) && bytes >= 2) {
+        sum += *(const uint16_t *)data;
+        data += 2;
+        bytes -= 2;
+    }
+
+    sum = cksum_words((const uint32_t *)data, bytes >> 2, sum);
+    data += bytes & ~3;
+
+    if(bytes & 2) {
+        sum += *(const uint16_t *)data;
+        data += 2;
+    }
+
+    /* Handle the last byte, if we have an odd byte count */
+    if(bytes & 1)
+        sum += *data;
+
+    rv = cksum_fold(sum);
+
+    if(odd)
+        rv = ((rv & 0xFF) << 8) | (rv >> 8);
+
+    return rv ^ 0xFFFF;
+}
+
+/* Copy a block of 32-bit words from src to dst, adding them up as we go. The
+   source must be 32-bit aligned; the destination is handled here, since the
+   payload of an outgoing packet usually sits two bytes off of a word boundary
+   (so that the ethernet header in front of it is aligned). The sum is the
+   same as the one from cksum_words() over the source. */
+static inline uint64_t cksum_copy_words(uint8_t *dst, const uint32_t *src,
+                                        size_t words, uint64_t sum) {
+    uint32_t *d, v, prev;
+#ifdef __sh__
+    uint32_t lo, carries, tmp, pf;
+    size_t blocks;
+#endif
+
+    if(!words)
+        return sum;
+
+    switch((uintptr_t)dst & 3) {
+        case 0:
+            d = (uint32_t *)dst;
+
+            /* Get the destination to a cache block boundary first. */
+            while(words && ((uintptr_t)d & 31)) {
+                v = *src++;
+                *d++ = v;
+                sum += v;
+                --words;
+            }
+
+#ifdef __sh__
+            /* Whole destination blocks are allocated in the cache with movca.l
+               rather than being read in from memory just to be overwritten. */
+            if((blocks = words >> 3)) {
+                lo = (uint32_t)sum;
+                carries = (uint32_t)(sum >> 32);
+
+                __asm__ __volatile__(
+                    "clrt\n"
+                    "1:\n\t"
+                    "mov     %[s], %[pf]\n\t"
+                    "add     #32, %[pf]\n\t"
+                    "pref    @%[pf]\n\t"
+                    "mov.l   @%[s]+, %[v]\n\t"
+                    "addc    %[v], %[lo]\n\t"
+                    "movca.l %[v], @%[d]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(4, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(8, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(12, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(16, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(20, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(24, %[d])\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "mov.l   %[t], @(28, %[d])\n\t"
+                    "add     #32, %[d]\n\t"
+                    "movt    %[t]\n\t"
+                    "add     %[t], %[c]\n\t"
+                    "dt      %[n]\n\t"
+                    "bf      1b\n"
+                    : [s] "+r" (src), [d] "+r" (d), [lo] "+r" (lo),
+                      [c] "+r" (carries), [n] "+r" (blocks), [v] "=&z" (v),
+                      [t] "=&r" (tmp), [pf] "=&r" (pf)
+                    :
+                    : "t", "memory");
+
+                sum = ((uint64_t)carries << 32) | lo;
+                words &= 7;
+            }
+#endif
+
+            while(words--) {
+                v = *src++;
+                *d++ = v;
+                sum += v;
+            }
+
+            return sum;
+
+        case 2:
+            /* Store the low half of the first word to get the destination
+               aligned, then build each destination word out of the top half of
+               the previous source word and the bottom half of the next one. */
+            prev = *src++;
+            sum += prev;
+            *(uint16_t *)dst = (uint16_t)prev;
+            d = (uint32_t *)(dst + 2);
+            --words;
+
+            while(words && ((uintptr_t)d & 31)) {
+                v = *src++;
+                sum += v;
+                *d++ = (prev >> 16) | (v << 16);
+                prev = v;
+                --words;
+            }
+
+#ifdef __sh__
+            /* Same as above, with xtrct doing the shuffling. */
+            if((blocks = words >> 3)) {
+                lo = (uint32_t)sum;
+                carries = (uint32_t)(sum >> 32);
+
+                __asm__ __volatile__(
+                    "clrt\n"
+                    "1:\n\t"
+                    "mov     %[s], %[pf]\n\t"
+                    "add     #32, %[pf]\n\t"
+                    "pref    @%[pf]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "movca.l %[pv], @%[d]\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(4, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(8, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(12, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(16, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(20, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(24, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "mov.l   @%[s]+, %[t]\n\t"
+                    "addc    %[t], %[lo]\n\t"
+                    "xtrct   %[t], %[pv]\n\t"
+                    "mov.l   %[pv], @(28, %[d])\n\t"
+                    "mov     %[t], %[pv]\n\t"
+                    "add     #32, %[d]\n\t"
+                    "movt    %[t]\n\t"
+                    "add     %[t], %[c]\n\t"
+                    "dt      %[n]\n\t"
+                    "bf      1b\n"
+                    : [s] "+r" (src), [d] "+r" (d), [lo] "+r" (lo),
+                      [c] "+r" (carries), [n] "+r" (blocks), [pv] "+z" (prev),
+                      [t] "=&r" (tmp), [pf] "=&r" (pf)
+                    :
+                    : "t", "memory");
+
+                sum = ((uint64_t)carries << 32) | lo;
+                words &= 7;
+            }
+#endif
+
+            while(words--) {
+                v = *src++;
+                sum += v;
+                *d++ = (prev >> 16) | (v << 16);
+                prev = v;
+            }
+
+            *(uint16_t *)d = (uint16_t)(prev >> 16);
+            return sum;
+
+        default:
+            while(words--) {
+                v = *src++;
+                memcpy(dst, &v, 4);
+                dst += 4;
+                sum += v;
+            }
+
+            return sum;
+    }
+}
+
+/* Copy a block of data and perform an IP-style checksum on it in one pass */
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start) {
+    uint64_t sum = start;
+    int odd = (((uintptr_t)src) & 0x01) && bytes;
+    size_t words;
+    uint16_t h;
+    uint32_t rv;
+
+    /* This follows net_ipv4_checksum() exactly, going by the alignment of the
+       source, see the comments in there. */
+    if(odd) {
+        sum = ((start & 0xFF) << 8) | (start >> 8);
+        sum += *src << 8;
+        *dst++ = *src++;
+        --bytes;
+    }
+
+    if((((uintptr_t)src) & 0x02) && bytes >= 2) {
+        h = *(const uint16_t *)src;
+        memcpy(dst, &h, 2);
+        sum += h;
+        src += 2;
+        dst += 2;
+        bytes -= 2;
+    }
+
+    words = bytes >> 2;
+    sum = cksum_copy_words(dst, (const uint32_t *)src, words, sum);
+    src += words << 2;
+    dst += words << 2;
+
+    if(bytes & 2) {
+        h = *(const uint16_t *)src;
+        memcpy(dst, &h, 2);
+        sum += h;
+        src += 2;
+        dst += 2;
+    }
+
+    if(bytes & 1) {
+        *dst = *src;
+        sum += *src;
+    }
+
+    rv = cksum_fold(sum);
+
+    if(odd)
+        rv = ((rv & 0xFF) << 8) | (rv >> 8);
+
+    return rv ^ 0xFFFF;
+}
@@ -19,6 +19,9 @@
 #include "net_thd.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_loopback.h"
+#include "net_capture.h"
+#include "net_frag.h"
 
 /*
 
@@ -98,6 +101,16 @@ struct netif_list * net_get_if_list(void) {
     return &net_if_list;
 }
 
+/* Transmit a packet buffer, letting the driver take it as-is if it can. */
+int net_if_tx_pbuf(netif_t *net, net_pbuf_t *pkt, int blocking) {
+    net_capture(net, pkt->data, pkt->len, NET_CAPTURE_TX);
+
+    if(net->if_tx_pbuf)
+        return net->if_tx_pbuf(net, pkt, blocking);
+
+    return net->if_tx(net, pkt->data, (int)pkt->len, blocking);
+}
+
 /*****************************************************************************/
 /* Init/shutdown */
 
@@ -153,9 +166,18 @@ int net_init(uint32_t ip) {
     if(net_initted)
         return 0;
 
-    /* Detect and potentially initialize devices */
+    /* Set up the packet buffer pool before any device can receive into it. */
+    if(net_pbuf_init() < 0)
+        dbglog(DBG_WARNING, "net_init: no packet buffer pool\n");
+
+    /* Detect and potentially initialize devices. Even without any, the stack
+       still comes up so that it can be used over the loopback device. */
     if(net_dev_init() < 0)
-        return -1;
+        dbglog(DBG_INFO, "net_init: no network device, using loopback only\n");
+
+    /* Bring up the loopback device. This happens after the detection above so
+       that it never gets picked as the default device. */
+    net_lo_init();
 
     /* Initialize the network thread. */
     net_thd_init();
@@ -166,8 +188,8 @@ int net_init(uint32_t ip) {
     /* Initialize the NDP cache */
     net_ndp_init();
 
-    /* Initialize IPv4 fragmentation support */
-    net_ipv4_frag_init();
+    /* Initialize fragment reassembly */
+    net_frag_init();
 
     /* Initialize multicast support */
     net_multicast_init();
@@ -233,14 +255,20 @@ void net_shutdown(void) {
     /* Shut down the sockets-like interface */
     fs_socket_shutdown();
 
+    /* Stop any packet capture that is still running */
+    net_capture_stop();
+
+    /* Shut down the loopback device */
+    net_lo_shutdown();
+
     /* Shut down IPv6 support */
     net_ipv6_shutdown();
 
     /* Shut down multicast support */
     net_multicast_shutdown();
 
-    /* Shut down IPv4 fragmentation support */
-    net_ipv4_frag_shutdown();
+    /* Shut down fragment reassembly */
+    net_frag_shutdown();
 
     /* Shut down the NDP cache */
     net_ndp_shutdown();
@@ -265,5 +293,8 @@ void net_shutdown(void) {
     /* Blank out the list */
     LIST_INIT(&net_if_list);
 
+    /* Now that nothing can receive into them, free the packet buffers. */
+    net_pbuf_shutdown();
+
     net_initted = 0;
 }
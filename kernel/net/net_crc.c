@@ -7,24 +7,54 @@
 
 #include <kos/net.h>
 
-/* Calculate a CRC-32 checksum over a given block of data. Somewhat inspired by
-   the CRC32 function in Figure 14-6 of http://www.hackersdelight.org/crc.pdf */
+#include "net_crc_tables.h"
+
+/* Both of the table-driven CRCs below use the "slicing-by-4" approach: once the
+   data pointer is 32-bit aligned, four bytes are folded into the CRC at a time
+   with one 32-bit load and four independent table lookups. Slicing-by-8 would
+   need 8KB of tables for CRC-32 alone, which is half of the SH4's operand
+   cache, so we stick to four tables. */
+
+/* Calculate a CRC-32 checksum over a given block of data. */
 uint32_t __pure net_crc32le(const uint8_t *data, int size) {
-    int i;
     uint32_t rv = 0xFFFFFFFF;
+    const uint32_t *ptr;
 
-    for(i = 0; i < size; ++i) {
-        rv ^= data[i];
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
-        rv = (0xEDB88320 & (-(rv & 1))) ^(rv >> 1);
+    /* Deal with any leading bytes to get us to a 32-bit boundary. */
+    while(size > 0 && (((uintptr_t)data) & 0x03)) {
+        rv = crc32le_tab[0][(rv ^ *data++) & 0xFF] ^ (rv >> 8);
+        --size;
+    }
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+    ptr = (const uint32_t *)data;
+
+    while(size >= 8) {
+        rv ^= *ptr++;
+        rv = crc32le_tab[3][rv & 0xFF] ^ crc32le_tab[2][(rv >> 8) & 0xFF] ^
+             crc32le_tab[1][(rv >> 16) & 0xFF] ^ crc32le_tab[0][rv >> 24];
+        rv ^= *ptr++;
+        rv = crc32le_tab[3][rv & 0xFF] ^ crc32le_tab[2][(rv >> 8) & 0xFF] ^
+             crc32le_tab[1][(rv >> 16) & 0xFF] ^ crc32le_tab[0][rv >> 24];
+        size -= 8;
+    }
+
+    if(size >= 4) {
+        rv ^= *ptr++;
+        rv = crc32le_tab[3][rv & 0xFF] ^ crc32le_tab[2][(rv >> 8) & 0xFF] ^
+             crc32le_tab[1][(rv >> 16) & 0xFF] ^ crc32le_tab[0][rv >> 24];
+        size -= 4;
     }
 
+    data = (const uint8_t *)ptr;
+#else
+    (void)ptr;
+#endif
+
+    /* Finish off anything that's left a byte at a time. */
+    while(size-- > 0)
+        rv = crc32le_tab[0][(rv ^ *data++) & 0xFF] ^ (rv >> 8);
+
     return ~rv;
 }
 
@@ -48,16 +78,43 @@ uint32_t __pure net_crc32be(const uint8_t *data, int size) {
     return rv;
 }
 
-/* Based on code found at: http://www.ccsinfo.com/forum/viewtopic.php?t=24977 */
+/* CRC16-CCITT is not bit-reflected, so the CRC register lines up with the data
+   most significant byte first. That means the first two bytes of each 32-bit
+   word get mixed into the CRC register and the last two get looked up on their
+   own. */
 uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
-    uint16_t rv = start, tmp;
+    uint32_t rv = start;
+    const uint32_t *ptr;
+    uint32_t tmp;
+
+    while(size > 0 && (((uintptr_t)data) & 0x03)) {
+        rv = (rv << 8) ^ crc16ccitt_tab[0][((rv >> 8) ^ *data++) & 0xFF];
+        rv &= 0xFFFF;
+        --size;
+    }
 
-    while(size--) {
-        tmp = (rv >> 8) ^ *data++;
-        tmp ^= tmp >> 4;
+#if BYTE_ORDER == LITTLE_ENDIAN
+    ptr = (const uint32_t *)data;
 
-        rv = (rv << 8) ^ (tmp << 12) ^ (tmp << 5) ^ tmp;
+    while(size >= 4) {
+        tmp = *ptr++;
+        rv = crc16ccitt_tab[3][((rv >> 8) ^ tmp) & 0xFF] ^
+             crc16ccitt_tab[2][(rv ^ (tmp >> 8)) & 0xFF] ^
+             crc16ccitt_tab[1][(tmp >> 16) & 0xFF] ^
+             crc16ccitt_tab[0][tmp >> 24];
+        size -= 4;
     }
 
-    return rv;
+    data = (const uint8_t *)ptr;
+#else
+    (void)ptr;
+    (void)tmp;
+#endif
+
+    while(size-- > 0) {
+        rv = (rv << 8) ^ crc16ccitt_tab[0][((rv >> 8) ^ *data++) & 0xFF];
+        rv &= 0xFFFF;
+    }
+
+    return (uint16_t)rv;
 }
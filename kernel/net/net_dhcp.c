@@ -33,6 +33,13 @@
 
 #define DHCP_MIN_OPTIONS_SIZE 64
 
+/* How often to check on things while a request is waiting on a reply, in case
+   one slips in without waking us up, and how long to sleep at most when there
+   isn't anything going on. Anything with a deadline of its own (resending a
+   request, renewing or rebinding a lease) schedules itself for that time. */
+#define DHCP_POLL_INTERVAL    50
+#define DHCP_IDLE_INTERVAL    (60 * 1000)
+
 
 static int dhcp_sock = -1;
 struct sockaddr_in srv_addr;
@@ -271,6 +278,10 @@ int net_dhcp_request(uint32_t required_address) {
     state = DHCP_STATE_SELECTING;
     mutex_unlock(&dhcp_lock);
 
+    /* Get the discover out now, rather than whenever the thread next wakes. */
+    if(dhcp_cbid > 0)
+        net_thd_schedule(dhcp_cbid, 0);
+
     /* We need to wait til we're either bound to an IP address, or until we give
        up all hope of doing so (give us 60 seconds). */
     if(!net_thd_is_current()) {
@@ -483,7 +494,7 @@ static void net_dhcp_bind(dhcp_pkt_t *pkt, int len) {
 
 static void net_dhcp_thd(void *obj) {
     struct dhcp_pkt_out *qpkt, *q_tmp;
-    uint64_t now;
+    uint64_t now, next = UINT64_MAX;
     struct sockaddr_in addr;
     uint8_t buf[1500];
     ssize_t len = 0;
@@ -617,7 +628,29 @@ static void net_dhcp_thd(void *obj) {
             qpkt->next_send = now + qpkt->next_delay;
             qpkt->next_delay <<= 1;
         }
+
+        if(qpkt->next_send < next)
+            next = qpkt->next_send;
     }
+
+    /* Only check back soon while there's a request out. Otherwise, sleep until
+       something needs doing with the lease. */
+    if(!STAILQ_EMPTY(&dhcp_pkts) && now + DHCP_POLL_INTERVAL < next)
+        next = now + DHCP_POLL_INTERVAL;
+
+    if(state == DHCP_STATE_BOUND && renew_time < next)
+        next = renew_time;
+
+    if((state == DHCP_STATE_BOUND || state == DHCP_STATE_RENEWING) &&
+       rebind_time < next)
+        next = rebind_time;
+
+    if((state == DHCP_STATE_BOUND || state == DHCP_STATE_RENEWING ||
+        state == DHCP_STATE_REBINDING) && lease_expires < next)
+        next = lease_expires;
+
+    if(next != UINT64_MAX)
+        net_thd_schedule(dhcp_cbid, next);
 }
 
 int net_dhcp_init(void) {
@@ -649,8 +682,12 @@ int net_dhcp_init(void) {
     /* Make the socket non-blocking */
     fs_fcntl(dhcp_sock, F_SETFL, O_NONBLOCK);
 
-    /* Create the callback for processing DHCP packets */
-    dhcp_cbid = net_thd_add_callback(&net_dhcp_thd, NULL, 50);
+    /* Create the callback for processing DHCP packets, and have it run as soon
+       as one comes in. */
+    dhcp_cbid = net_thd_add_callback(&net_dhcp_thd, NULL, DHCP_IDLE_INTERVAL);
+
+    if(dhcp_cbid != -1)
+        net_udp_set_thd_cb(dhcp_sock, dhcp_cbid);
 
     return 0;
 }
@@ -0,0 +1,255 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.c
+
+*/
+
+/* This file implements fragment reassembly for both IPv4 and IPv6. The two
+   only differ in where they find the offset, flags and identification of a
+   fragment, so the protocol code pulls those out of its own headers and hands
+   the rest of the work off to here.
+
+   Each datagram being put back together keeps a bitfield with one bit per
+   8-byte block of its payload, as in the reassembly procedure of RFC 791. Once
+   the last fragment has told us how long the payload is and all of the bits up
+   to there are set, the datagram is passed back up to the protocol. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/queue.h>
+
+#include <kos/net.h>
+#include <kos/mutex.h>
+#include <arch/timer.h>
+
+#include "net_frag.h"
+#include "net_thd.h"
+
+/* Largest payload that can be reassembled. Both IPv4 and IPv6 (without jumbo
+   payloads) cap datagrams at 64KiB. */
+#define FRAG_MAX_SIZE       65535
+
+/* One bit for each 8-byte block of the largest payload, plus a byte so that
+   checking the bits never has to special-case a whole number of bytes. */
+#define FRAG_BITFIELD_SIZE  ((FRAG_MAX_SIZE + 7) / 64 + 1)
+
+/* Most datagrams that can be in the middle of being reassembled at once. When
+   another one shows up, the oldest one is dropped to make room for it. */
+#define FRAG_MAX_PENDING    16
+
+struct net_frag {
+    TAILQ_ENTRY(net_frag) listhnd;
+
+    net_frag_key_t key;
+    net_frag_done_t done;
+
+    uint8_t hdr[NET_FRAG_HDR_MAX];
+    size_t hdr_size;
+
+    uint8_t *data;
+    size_t cur_length;
+    size_t total_length;
+    uint8_t bitfield[FRAG_BITFIELD_SIZE];
+    uint64_t death_time;
+};
+
+TAILQ_HEAD(net_frag_list, net_frag);
+
+static struct net_frag_list frags = TAILQ_HEAD_INITIALIZER(frags);
+static mutex_t frag_mutex = MUTEX_INITIALIZER;
+static int frag_count = 0;
+static int cbid = -1;
+
+static void frag_free(struct net_frag *f) {
+    TAILQ_REMOVE(&frags, f, listhnd);
+    --frag_count;
+    free(f->data);
+    free(f);
+}
+
+/* Fragment "thread" -- this is set up to delete datagrams for which the
+   death_time has passed. This is run approximately once every two seconds
+   (since death_time is always on the order of seconds). */
+static void frag_thd_cb(void *data) {
+    struct net_frag *f, *n;
+    uint64_t now = timer_ms_gettime64();
+
+    (void)data;
+
+    mutex_lock_scoped(&frag_mutex);
+
+    f = TAILQ_FIRST(&frags);
+
+    while(f) {
+        n = TAILQ_NEXT(f, listhnd);
+
+        if(f->death_time < now)
+            frag_free(f);
+
+        f = n;
+    }
+}
+
+/* Set the bits for blocks start through end - 1 in the bitfield. */
+static void set_bits(uint8_t *bitfield, size_t start, size_t end) {
+    while(start < end && (start & 7)) {
+        bitfield[start >> 3] |= 1 << (start & 7);
+        ++start;
+    }
+
+    if(end - start >= 8) {
+        memset(bitfield + (start >> 3), 0xFF, (end - start) >> 3);
+        start += (end - start) & ~7;
+    }
+
+    while(start < end) {
+        bitfield[start >> 3] |= 1 << (start & 7);
+        ++start;
+    }
+}
+
+/* Check if the bits for blocks 0 through end - 1 are all set. */
+static int __pure all_bits_set(const uint8_t *bitfield, size_t end) {
+    uint8_t mask = (1 << (end & 7)) - 1;
+    size_t i;
+
+    for(i = 0; i < (end >> 3); ++i) {
+        if(bitfield[i] != 0xFF)
+            return 0;
+    }
+
+    return (bitfield[end >> 3] & mask) == mask;
+}
+
+static struct net_frag *frag_find(const net_frag_key_t *key) {
+    struct net_frag *f;
+
+    TAILQ_FOREACH(f, &frags, listhnd) {
+        if(f->key.ident == key->ident && f->key.proto == key->proto &&
+           !memcmp(&f->key.src, &key->src, sizeof(struct in6_addr)) &&
+           !memcmp(&f->key.dst, &key->dst, sizeof(struct in6_addr)))
+            return f;
+    }
+
+    return NULL;
+}
+
+int net_frag_import(netif_t *src, const net_frag_key_t *key, size_t offset,
+                    const uint8_t *data, size_t size, int more,
+                    const void *hdr, size_t hdr_size, uint32_t timeout,
+                    net_frag_done_t done) {
+    struct net_frag *f;
+    size_t end = offset + size;
+    uint64_t now = timer_ms_gettime64();
+    void *tmp;
+    int rv;
+
+    if(end > FRAG_MAX_SIZE || hdr_size > NET_FRAG_HDR_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    /* This is usually called inside an interrupt, so try to safely lock the
+       mutex, and bail if we can't. */
+    if(mutex_lock_irqsafe(&frag_mutex))
+        return -1;
+
+    /* Find the datagram if we already have some of it, otherwise start on a
+       new one. */
+    if(!(f = frag_find(key))) {
+        if(frag_count == FRAG_MAX_PENDING)
+            frag_free(TAILQ_FIRST(&frags));
+
+        if(!(f = (struct net_frag *)malloc(sizeof(struct net_frag)))) {
+            mutex_unlock(&frag_mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset(f, 0, sizeof(struct net_frag));
+        f->key = *key;
+        f->done = done;
+        TAILQ_INSERT_TAIL(&frags, f, listhnd);
+        ++frag_count;
+    }
+
+    /* Drop anything that contradicts what we already know about the length of
+       the datagram. */
+    if((f->total_length && end > f->total_length) ||
+       (!more && (end < f->cur_length ||
+                  (f->total_length && end != f->total_length)))) {
+        frag_free(f);
+        mutex_unlock(&frag_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Grow the data buffer, if needed. */
+    if(end > f->cur_length) {
+        if(!(tmp = realloc(f->data, end))) {
+            frag_free(f);
+            mutex_unlock(&frag_mutex);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        f->data = (uint8_t *)tmp;
+        f->cur_length = end;
+    }
+
+    memcpy(f->data + offset, data, size);
+    set_bits(f->bitfield, offset >> 3, (end + 7) >> 3);
+
+    /* The last fragment tells us how long the whole thing is. */
+    if(!more)
+        f->total_length = end;
+
+    /* The first fragment has the header to pass on. */
+    if(!offset) {
+        memcpy(f->hdr, hdr, hdr_size);
+        f->hdr_size = hdr_size;
+    }
+
+    /* If we're not done yet, update the timer and wait for the rest. */
+    if(!f->total_length || !f->hdr_size ||
+       !all_bits_set(f->bitfield, (f->total_length + 7) >> 3)) {
+        if(f->death_time < now + timeout)
+            f->death_time = now + timeout;
+
+        mutex_unlock(&frag_mutex);
+        return 0;
+    }
+
+    /* Take the datagram off the list so that nothing else can get at it, and
+       pass it on without holding the lock. */
+    TAILQ_REMOVE(&frags, f, listhnd);
+    --frag_count;
+    mutex_unlock(&frag_mutex);
+
+    rv = f->done(src, f->hdr, f->data, f->total_length);
+
+    free(f->data);
+    free(f);
+
+    return rv;
+}
+
+int net_frag_init(void) {
+    if(cbid == -1)
+        cbid = net_thd_add_callback(&frag_thd_cb, NULL, 2000);
+
+    return cbid == -1 ? -1 : 0;
+}
+
+void net_frag_shutdown(void) {
+    if(cbid != -1)
+        net_thd_del_callback(cbid);
+
+    cbid = -1;
+
+    mutex_lock_scoped(&frag_mutex);
+
+    while(!TAILQ_EMPTY(&frags))
+        frag_free(TAILQ_FIRST(&frags));
+}
@@ -0,0 +1,51 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_frag.h
+
+*/
+
+#ifndef __LOCAL_NET_FRAG_H
+#define __LOCAL_NET_FRAG_H
+
+#include <sys/cdefs.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <kos/net.h>
+
+__BEGIN_DECLS
+
+/* Largest network-layer header saved from the first fragment of a datagram. */
+#define NET_FRAG_HDR_MAX    60
+
+/* What identifies the datagram that a fragment belongs to. IPv4 addresses are
+   stored v4-mapped. Anything not used by a protocol must be zeroed. */
+typedef struct net_frag_key {
+    struct in6_addr src;
+    struct in6_addr dst;
+    uint32_t ident;
+    uint8_t proto;
+} net_frag_key_t;
+
+/* Called once all the fragments of a datagram are in. The header is the one
+   given with the first fragment (which can be modified freely), and the data
+   is the reassembled payload. Nothing is locked at that point. */
+typedef int (*net_frag_done_t)(netif_t *src, void *hdr, const uint8_t *data,
+                               size_t size);
+
+/* Add a fragment of size bytes starting at offset (which must be a multiple of
+   8) to the datagram identified by key. more is non-zero if the fragment is
+   not the last one. hdr is saved if this is the first fragment. The datagram
+   is thrown away if it's not complete timeout milliseconds after the last
+   fragment came in. Returns what done returns if this completes the datagram,
+   0 if it's still waiting on more fragments, or -1 on error. */
+int net_frag_import(netif_t *src, const net_frag_key_t *key, size_t offset,
+                    const uint8_t *data, size_t size, int more,
+                    const void *hdr, size_t hdr_size, uint32_t timeout,
+                    net_frag_done_t done);
+
+int net_frag_init(void);
+void net_frag_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_FRAG_H */
@@ -17,6 +17,7 @@
 #include "net_icmp6.h"
 #include "net_ipv6.h"
 #include "net_ipv4.h"   /* For net_ipv4_checksum() */
+#include "net_loopback.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -28,6 +29,7 @@ This file implements RFC 4443, the Internet Control Message Protocol for IPv6.
 All messages mentioned below are from that RFC, unless otherwise specified.
 Currently implemented message types are:
     1   - Destination Unreachable -- Sending only
+    2   - Packet Too Big (RFC 8201) -- Receiving only
     3   - Time Exceeded -- Sending only
     4   - Parameter Problem -- Sending only
     128 - Echo
@@ -39,7 +41,6 @@ Currently implemented message types are:
     137 - Redirect (RFC 4861) -- partial
 
 Message types that are not implemented yet (if ever):
-    2   - Packet Too Big
     Any other numbers not listed in the first list...
 */
 
@@ -65,6 +66,43 @@ static void icmp6_default_echo_cb(const struct in6_addr *ip, uint16_t seq,
 /* The default echo (ping6) callback */
 net6_echo_cb net_icmp6_echo_cb = icmp6_default_echo_cb;
 
+/* Handle Packet Too Big (ICMPv6 type 2) packets */
+static void net_icmp6_input_2(netif_t *net, ipv6_hdr_t *ip, icmp6_hdr_t *icmp,
+                              const uint8_t *d, size_t s) {
+    const icmp6_pkt_too_big_t *ptb = (const icmp6_pkt_too_big_t *)d;
+    const ipv6_hdr_t *orig;
+    netif_t *onet;
+    int i;
+
+    (void)ip;
+    (void)icmp;
+
+    /* We need at least the IPv6 header of the packet that was too big. */
+    if(s < sizeof(icmp6_pkt_too_big_t) + sizeof(ipv6_hdr_t))
+        return;
+
+    orig = (const ipv6_hdr_t *)(d + sizeof(icmp6_pkt_too_big_t));
+
+    /* Make sure it was actually one of ours. */
+    onet = net ? net : net_default_dev;
+
+    if(!onet)
+        return;
+
+    if(memcmp(&orig->src_addr, &onet->ip6_lladdr, sizeof(struct in6_addr))) {
+        for(i = 0; i < onet->ip6_addr_count; ++i) {
+            if(!memcmp(&orig->src_addr, &onet->ip6_addrs[i],
+                       sizeof(struct in6_addr)))
+                break;
+        }
+
+        if(i == onet->ip6_addr_count)
+            return;
+    }
+
+    net_ipv6_pmtu_update(&orig->dst_addr, ntohl(ptb->mtu));
+}
+
 /* Handle Echo Reply (ICMPv6 type 129) packets */
 static void net_icmp6_input_129(netif_t *net, ipv6_hdr_t *ip, icmp6_hdr_t *icmp,
                                 const uint8_t *d, size_t s) {
@@ -443,6 +481,10 @@ int net_icmp6_input(netif_t *net, ipv6_hdr_t *ip, const uint8_t *d, size_t s) {
     }
 
     switch(icmp->type) {
+        case ICMP6_MESSAGE_PKT_TOO_BIG:
+            net_icmp6_input_2(net, ip, icmp, d, s);
+            break;
+
         case ICMP6_MESSAGE_ECHO:
             net_icmp6_input_128(net, ip, icmp, d, s);
             break;
@@ -485,10 +527,8 @@ int net_icmp6_send_echo(netif_t *net, const struct in6_addr *dst, uint16_t ident
     uint64_t t;
     uint16_t sz = sizeof(icmp6_echo_hdr_t) + size + 8;
 
-    if(!net) {
-        if(!(net = net_default_dev)) {
-            return -1;
-        }
+    if(!(net = net_lo_route6(net, dst))) {
+        return -1;
     }
 
     /* If we're sending to the loopback, set that as our source too */
@@ -10,6 +10,7 @@
 #include <kos/net.h>
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_capture.h"
 
 /*
 
@@ -17,7 +18,9 @@
 
 */
 
-static int net_default_input(netif_t *nif, const uint8_t *data, int len) {
+static int net_pbuf_input(netif_t *nif, net_pbuf_t *pkt) {
+    const uint8_t *data = pkt->data;
+    int len = (int)pkt->len;
     uint16_t proto = (uint16_t)((data[12] << 8) | (data[13]));
 
     /* If this is bound for a multicast address, make sure we actually care
@@ -31,9 +34,9 @@ static int net_default_input(netif_t *nif, const uint8_t *data, int len) {
 
     switch(proto) {
         case 0x0800:
-            return net_ipv4_input(nif, data + sizeof(eth_hdr_t),
-                                  len - sizeof(eth_hdr_t),
-                                  (const eth_hdr_t *)data);
+            return net_ipv4_input_pbuf(nif, data + sizeof(eth_hdr_t),
+                                       len - sizeof(eth_hdr_t),
+                                       (const eth_hdr_t *)data, pkt);
 
         case 0x0806:
             return net_arp_input(nif, data, len);
@@ -41,24 +44,68 @@ static int net_default_input(netif_t *nif, const uint8_t *data, int len) {
         case 0x86DD:
             return net_ipv6_input(nif, data + sizeof(eth_hdr_t),
                                   len - sizeof(eth_hdr_t),
-                                  (const eth_hdr_t *)data);
+                                  (const eth_hdr_t *)data, pkt);
 
         default:
             return 0;
     }
 }
 
+static int net_default_input(netif_t *nif, const uint8_t *data, int len) {
+    net_pbuf_t pkt;
+
+    return net_pbuf_input(nif, net_pbuf_wrap(&pkt, data, len));
+}
+
 /* Where will input packets be routed? */
 net_input_func net_input_target = net_default_input;
 
 /* Process an incoming packet */
 int net_input(netif_t *device, const uint8_t *data, int len) {
+    net_capture(device, data, len, NET_CAPTURE_RX);
+
     if(net_input_target != NULL)
         return net_input_target(device, data, len);
     else
         return 0;
 }
 
+/* Process an incoming packet buffer. If nobody has overridden the input
+   target, the buffer itself goes up the stack so that the upper layers can
+   keep a reference to it instead of copying out the data they queue. */
+int net_input_pbuf(netif_t *device, net_pbuf_t *pkt) {
+    net_capture(device, pkt->data, pkt->len, NET_CAPTURE_RX);
+
+    if(net_input_target == net_default_input)
+        return net_pbuf_input(device, pkt);
+    else if(net_input_target != NULL)
+        return net_input_target(device, pkt->data, (int)pkt->len);
+    else
+        return 0;
+}
+
+/* Process a batch of incoming packet buffers. */
+int net_input_batch(netif_t *device, net_pbuf_t **pkts, int count) {
+    net_input_func target = net_input_target;
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        /* Get the headers of the next packet on their way into the cache
+           while this one is being processed. */
+        if(i + 1 < count)
+            __builtin_prefetch(pkts[i + 1]->data);
+
+        net_capture(device, pkts[i]->data, pkts[i]->len, NET_CAPTURE_RX);
+
+        if(target == net_default_input)
+            net_pbuf_input(device, pkts[i]);
+        else if(target != NULL)
+            target(device, pkts[i]->data, (int)pkts[i]->len);
+    }
+
+    return 0;
+}
+
 /* Setup an input target; returns the old target */
 net_input_func net_input_set_target(net_input_func t) {
     net_input_func old = net_input_target;
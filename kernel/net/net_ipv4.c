@@ -22,50 +22,10 @@
 
 #include "net_ipv4.h"
 #include "net_icmp.h"
+#include "net_loopback.h"
 
 static net_ipv4_stats_t ipv4_stats = { 0 };
 
-/* Perform an IP-style checksum on a block of data */
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start) {
-    uint32_t sum = start;
-    size_t i = bytes;
-
-    /* Make sure we don't do any unaligned memory accesses */
-    if(((uint32_t)data) & 0x01) {
-        const uint8_t *ptr = data;
-
-        while(i > 1) {
-            sum += *ptr | ((*ptr + 1) << 8);
-            ptr += 2;
-            i -= 2;
-
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
-    }
-    else {
-        const uint16_t *ptr = (const uint16_t *)data;
-
-        while(i > 1) {
-            sum += *ptr++;
-            i -= 2;
-
-            while(sum >> 16)
-                sum = (sum >> 16) + (sum & 0xFFFF);
-        }
-    }
-
-    /* Handle the last byte, if we have an odd byte count */
-    if(i)
-        sum += data[bytes - 1];
-
-    /* Take care of any carry bits */
-    while(sum >> 16)
-        sum = (sum >> 16) + (sum & 0xFFFF);
-
-    return sum ^ 0xFFFF;
-}
-
 /* Determine if a given IP is in the current network */
 static int __pure is_in_network(const uint8_t src[4], const uint8_t dest[4],
                          const uint8_t netmask[4]) {
@@ -91,53 +51,57 @@ static int __pure is_broadcast(const uint8_t dest[4], const uint8_t bc[4]) {
     return 1;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
-                         size_t size) {
+/* Send a packet on the specified network adapter. The payload is in pkt, with
+   enough headroom in front of it for the IP and ethernet headers. */
+int net_ipv4_send_packet_pbuf(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *pkt) {
     uint8_t dest_ip[4];
     uint8_t dest_mac[6];
-    uint8_t pkt[size + sizeof(ip_hdr_t) + sizeof(eth_hdr_t)];
+    size_t hdrlen = 4 * (hdr->version_ihl & 0x0f);
+    size_t size = pkt->len;
     eth_hdr_t *ehdr;
+    uint8_t *ip;
     int err;
 
-    if(net == NULL) {
-        net = net_default_dev;
+    /* Loopback addresses (127/8) always go out on the loopback device. */
+    net = net_lo_route4(net, hdr->dest);
 
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    if(!net) {
+        errno = ENETDOWN;
+        return -1;
     }
 
-    net_ipv4_parse_address(ntohl(hdr->dest), dest_ip);
+    /* Put the IP header in front of the data */
+    if(!(ip = net_pbuf_push(pkt, hdrlen))) {
+        errno = ENOBUFS;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
 
-    /* Is this a loopback address (127/8)? */
-    if(dest_ip[0] == 0x7F) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
+    memcpy(ip, hdr, hdrlen);
+    net_ipv4_parse_address(ntohl(hdr->dest), dest_ip);
 
+    /* If the loopback device isn't up, short-circuit loopback packets. */
+    if(dest_ip[0] == 0x7F && !(net->flags & NETIF_LOOPBACK)) {
         ++ipv4_stats.pkt_sent;
 
         /* Send it "away" */
-        net_ipv4_input(NULL, pkt, 4 * (hdr->version_ihl & 0x0f) + size, NULL);
+        net_ipv4_input_pbuf(NULL, ip, hdrlen + size, NULL, pkt);
 
         return 0;
     }
     else if(net->flags & NETIF_NOETH) {
-        /* Put the IP header / data into our packet */
-        memcpy(pkt, hdr, 4 * (hdr->version_ihl & 0x0f));
-        memcpy(pkt + 4 * (hdr->version_ihl & 0x0f), data, size);
-
         ++ipv4_stats.pkt_sent;
 
         /* Send it away */
-        return net->if_tx(net, pkt, 4 * (hdr->version_ihl & 0x0f) + size,
-                          NETIF_BLOCK);
+        return net_if_tx_pbuf(net, pkt, NETIF_BLOCK);
     }
 
-    /* Are we sending a broadcast packet? */
-    if(hdr->dest == 0xFFFFFFFF || is_broadcast(dest_ip, net->broadcast)) {
+    /* Are we sending a broadcast packet? Nothing needs resolving on the
+       loopback device either. */
+    if(net->flags & NETIF_LOOPBACK) {
+        memset(dest_mac, 0, 6);
+    }
+    else if(hdr->dest == 0xFFFFFFFF || is_broadcast(dest_ip, net->broadcast)) {
         /* Set the destination to the datalink layer broadcast address. */
         memset(dest_mac, 0xFF, 6);
     }
@@ -150,7 +114,7 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
         /* Get our destination's MAC address. If we do not have the MAC address
            cached, return a distinguished error to the upper-level protocol so
            that it can decide what to do. */
-        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
+        err = net_arp_lookup(net, dest_ip, dest_mac, hdr, ip + hdrlen, size);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -165,30 +129,45 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
     }
 
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    if(!(ehdr = (eth_hdr_t *)net_pbuf_push(pkt, sizeof(eth_hdr_t)))) {
+        errno = ENOBUFS;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
     memcpy(ehdr->dest, dest_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x08;
     ehdr->type[1] = 0x00;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, 4 * (hdr->version_ihl & 0x0f));
-    memcpy(pkt + sizeof(eth_hdr_t) + 4 * (hdr->version_ihl & 0x0f), data,
-           size);
-
     ++ipv4_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ip_hdr_t) + size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_if_tx_pbuf(net, pkt, NETIF_BLOCK);
 
     return 0;
 }
 
-int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
-                  int proto, uint32_t src, uint32_t dst) {
-    ip_hdr_t hdr;
+int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
+                         size_t size) {
+    net_pbuf_t *pkt;
+    int rv;
 
+    if(!(pkt = net_pbuf_alloc(NET_PBUF_HEADROOM, size))) {
+        errno = ENOMEM;
+        ++ipv4_stats.pkt_send_failed;
+        return -1;
+    }
+
+    memcpy(pkt->data, data, size);
+    rv = net_ipv4_send_packet_pbuf(net, hdr, pkt);
+    net_pbuf_free(pkt);
+
+    return rv;
+}
+
+static void ipv4_fill_hdr(ip_hdr_t *hdr, size_t size, int id, int ttl,
+                          int proto, uint32_t src, uint32_t dst) {
     /* If the ID is -1, generate a random ID value that can be used in case the
        packet gets fragmented. */
     if(id == -1) {
@@ -196,24 +175,52 @@ int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int tt
     }
 
     /* Fill in the IPv4 Header */
-    hdr.version_ihl = 0x45;
-    hdr.tos = 0;
-    hdr.length = htons(size + 20);
-    hdr.packet_id = id;
-    hdr.flags_frag_offs = 0;
-    hdr.ttl = ttl;
-    hdr.protocol = proto;
-    hdr.checksum = 0;
-    hdr.src = src;
-    hdr.dest = dst;
-
-    hdr.checksum = net_ipv4_checksum((uint8_t *)&hdr, sizeof(ip_hdr_t), 0);
+    hdr->version_ihl = 0x45;
+    hdr->tos = 0;
+    hdr->length = htons(size + 20);
+    hdr->packet_id = id;
+    hdr->flags_frag_offs = 0;
+    hdr->ttl = ttl;
+    hdr->protocol = proto;
+    hdr->checksum = 0;
+    hdr->src = src;
+    hdr->dest = dst;
+
+    hdr->checksum = net_ipv4_checksum((uint8_t *)hdr, sizeof(ip_hdr_t), 0);
+}
+
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pkt, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst) {
+    ip_hdr_t hdr;
+
+    ipv4_fill_hdr(&hdr, pkt->len, id, ttl, proto, src, dst);
+
+    net = net_lo_route4(net, dst);
+
+    /* Packets that need fragmenting go the copying way, everything else is
+       sent straight out of the buffer. */
+    if(net && pkt->len + sizeof(ip_hdr_t) >= (size_t)net->mtu)
+        return net_ipv4_frag_send(net, &hdr, pkt->data, pkt->len);
+
+    return net_ipv4_send_packet_pbuf(net, &hdr, pkt);
+}
+
+int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
+                  int proto, uint32_t src, uint32_t dst) {
+    ip_hdr_t hdr;
+
+    ipv4_fill_hdr(&hdr, size, id, ttl, proto, src, dst);
 
     return net_ipv4_frag_send(net, &hdr, data, size);
 }
 
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth) {
+    return net_ipv4_input_pbuf(src, pkt, pktsize, eth, NULL);
+}
+
+int net_ipv4_input_pbuf(netif_t *src, const uint8_t *pkt, size_t pktsize,
+                        const eth_hdr_t *eth, net_pbuf_t *pb) {
     const ip_hdr_t *ip;
     const uint8_t *data;
     size_t hdrlen;
@@ -244,16 +251,17 @@ int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
     data = (const uint8_t *)(pkt + hdrlen);
 
     /* Add the sender to the ARP cache, if they're not already there. */
-    if(eth) {
+    if(eth && !(src->flags & NETIF_LOOPBACK)) {
         net_ipv4_parse_address(ntohl(ip->src), ipa);
         net_arp_insert(src, eth->src, ipa, timer_ms_gettime64());
     }
 
     /* Submit the packet for possible reassembly. */
-    return net_ipv4_reassemble(src, ip, data, ntohs(ip->length) - hdrlen);
+    return net_ipv4_reassemble(src, ip, data, ntohs(ip->length) - hdrlen, pb);
 }
 
-int net_ipv4_input_proto(netif_t *src, const ip_hdr_t *ip, const uint8_t *data) {
+int net_ipv4_input_proto(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
+                         net_pbuf_t *pb) {
     size_t hdrlen = (ip->version_ihl & 0x0F) << 2;
     size_t datalen = ntohs(ip->length) - hdrlen;
     int rv;
@@ -265,7 +273,8 @@ int net_ipv4_input_proto(netif_t *src, const ip_hdr_t *ip, const uint8_t *data)
             return net_icmp_input(src, ip, data, datalen);
 
         default:
-            rv = fs_socket_input(src, AF_INET, ip->protocol, ip, data, datalen);
+            rv = fs_socket_input_pbuf(src, AF_INET, ip->protocol, ip, data,
+                                      datalen, pb);
 
             if(rv > -2) {
                 ++ipv4_stats.pkt_recv;
@@ -25,14 +25,19 @@ typedef struct {
     uint16_t length;
 } __packed ipv4_pseudo_hdr_t;
 
-uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t start);
 int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                          size_t size);
+int net_ipv4_send_packet_pbuf(netif_t *net, ip_hdr_t *hdr, net_pbuf_t *pkt);
 int net_ipv4_send(netif_t *net, const uint8_t *data, size_t size, int id, int ttl,
                   int proto, uint32_t src, uint32_t dst);
+int net_ipv4_send_pbuf(netif_t *net, net_pbuf_t *pkt, int id, int ttl,
+                       int proto, uint32_t src, uint32_t dst);
 int net_ipv4_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
                    const eth_hdr_t *eth);
-int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data);
+int net_ipv4_input_pbuf(netif_t *src, const uint8_t *pkt, size_t pktsize,
+                        const eth_hdr_t *eth, net_pbuf_t *pb);
+int net_ipv4_input_proto(netif_t *net, const ip_hdr_t *ip, const uint8_t *data,
+                         net_pbuf_t *pb);
 
 uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t proto,
                                 uint16_t len);
@@ -41,8 +46,6 @@ uint16_t __pure net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8_t p
 int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
                        size_t size);
 int net_ipv4_reassemble(netif_t *net, const ip_hdr_t *hdr, const uint8_t *data,
-                        size_t size);
-int net_ipv4_frag_init(void);
-void net_ipv4_frag_shutdown(void);
+                        size_t size, net_pbuf_t *pb);
 
 #endif /* __LOCAL_NET_IPV4_H */
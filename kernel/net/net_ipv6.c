@@ -10,17 +10,45 @@
 #include <netinet/in.h>
 #include <kos/net.h>
 #include <kos/fs_socket.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
 #include <errno.h>
 
 #include "net_ipv6.h"
 #include "net_icmp6.h"
 #include "net_ipv4.h"
+#include "net_frag.h"
+#include "net_loopback.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Waddress-of-packed-member"
 #endif
 
+/* How long to wait for all of the fragments of a datagram (RFC 8200). */
+#define IPV6_FRAG_TIMEOUT   60000
+
+/* Number of destinations whose path MTU is remembered. */
+#define PMTU_CACHE_SIZE     16
+
+/* How long a path MTU is remembered before trying the link MTU again, as
+   suggested by RFC 8201 (in milliseconds). */
+#define PMTU_TIMEOUT        (10 * 60 * 1000)
+
+typedef struct pmtu_ent {
+    struct in6_addr dst;
+    uint32_t mtu;                   /* Zero if unused */
+    uint64_t expires;
+} pmtu_ent_t;
+
+/* The path MTU cache. It is small and looked up on every send of a large
+   packet, so it's protected by disabling interrupts. */
+static pmtu_ent_t pmtu_cache[PMTU_CACHE_SIZE];
+static int pmtu_count = 0;
+volatile uint32_t net_ipv6_pmtu_gen = 0;
+
+static uint32_t frag_ident;
+
 static net_ipv6_stats_t ipv6_stats = { 0 };
 const struct in6_addr in6addr_any = IN6ADDR_ANY_INIT;
 const struct in6_addr in6addr_loopback = IN6ADDR_LOOPBACK_INIT;
@@ -60,44 +88,135 @@ static int __pure is_in_network(netif_t *net, const struct in6_addr *ip) {
     return 0;
 }
 
-/* Send a packet on the specified network adapter */
-int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
-                         size_t data_size) {
-    uint8_t pkt[data_size + sizeof(ipv6_hdr_t) + sizeof(eth_hdr_t)];
+static inline int pmtu_match(const pmtu_ent_t *ent,
+                             const struct in6_addr *dst) {
+    return ent->mtu && !memcmp(&ent->dst, dst, sizeof(struct in6_addr));
+}
+
+uint32_t net_ipv6_pmtu(netif_t *net, const struct in6_addr *dst) {
+    uint32_t mtu;
+    uint64_t now;
+    int i;
+
+    net = net_lo_route6(net, dst);
+
+    if(!net)
+        return IPV6_MIN_MTU;
+
+    mtu = (!IN6_IS_ADDR_V4MAPPED(dst) && net->mtu6) ? net->mtu6 : net->mtu;
+
+    if(!pmtu_count || (net->flags & NETIF_LOOPBACK))
+        return mtu;
+
+    now = timer_ms_gettime64();
+    irq_disable_scoped();
+
+    for(i = 0; i < PMTU_CACHE_SIZE; ++i) {
+        if(pmtu_match(&pmtu_cache[i], dst)) {
+            if(pmtu_cache[i].expires < now) {
+                /* Time to see if the path got any better. */
+                pmtu_cache[i].mtu = 0;
+                --pmtu_count;
+                ++net_ipv6_pmtu_gen;
+            }
+            else if(pmtu_cache[i].mtu < mtu) {
+                mtu = pmtu_cache[i].mtu;
+            }
+
+            break;
+        }
+    }
+
+    return mtu;
+}
+
+void net_ipv6_pmtu_update(const struct in6_addr *dst, uint32_t mtu) {
+    pmtu_ent_t *ent = NULL;
+    uint64_t now = timer_ms_gettime64();
+    int i;
+
+    /* Nothing can claim a path MTU under the minimum for IPv6. For IPv4, the
+       minimum is 68 bytes, but nobody sensible goes below 576. */
+    if(IN6_IS_ADDR_V4MAPPED(dst)) {
+        if(mtu < 576)
+            mtu = 576;
+    }
+    else if(mtu < IPV6_MIN_MTU) {
+        mtu = IPV6_MIN_MTU;
+    }
+
+    irq_disable_scoped();
+
+    /* Find the entry for the destination, or failing that, a free one or the
+       one closest to expiring. */
+    for(i = 0; i < PMTU_CACHE_SIZE; ++i) {
+        if(pmtu_match(&pmtu_cache[i], dst)) {
+            ent = &pmtu_cache[i];
+            break;
+        }
+
+        if(!ent || (ent->mtu && (!pmtu_cache[i].mtu ||
+                                 pmtu_cache[i].expires < ent->expires)))
+            ent = &pmtu_cache[i];
+    }
+
+    /* Packet Too Big messages can only ever make the path smaller. */
+    if(pmtu_match(ent, dst) && ent->mtu <= mtu)
+        return;
+
+    if(!ent->mtu)
+        ++pmtu_count;
+
+    ent->dst = *dst;
+    ent->mtu = mtu;
+    ent->expires = now + PMTU_TIMEOUT;
+    ++net_ipv6_pmtu_gen;
+}
+
+/* Send a packet on the specified network adapter. The payload is in pkt, with
+   enough headroom in front of it for the IPv6 and ethernet headers. */
+int net_ipv6_send_packet_pbuf(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt) {
     uint8_t dst_mac[6];
     int err;
     struct in6_addr dst = hdr->dst_addr;
+    size_t data_size = pkt->len;
     eth_hdr_t *ehdr;
+    uint8_t *ip;
+
+    /* Loopback traffic (::1) always goes out on the loopback device. */
+    net = net_lo_route6(net, &hdr->dst_addr);
 
     if(!net) {
-        net = net_default_dev;
+        errno = ENETDOWN;
+        return -1;
+    }
 
-        if(!net) {
-            errno = ENETDOWN;
-            return -1;
-        }
+    /* Put the IPv6 header in front of the data */
+    if(!(ip = net_pbuf_push(pkt, sizeof(ipv6_hdr_t)))) {
+        errno = ENOBUFS;
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
     }
 
-    /* Are we sending a packet to loopback? */
-    if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr)) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
+    memcpy(ip, hdr, sizeof(ipv6_hdr_t));
 
+    /* If the loopback device isn't up, short-circuit loopback packets. */
+    if(IN6_IS_ADDR_LOOPBACK(&hdr->dst_addr) && !(net->flags & NETIF_LOOPBACK)) {
         ++ipv6_stats.pkt_sent;
 
         /* Send the packet "away" */
-        net_ipv6_input(NULL, pkt, sizeof(ipv6_hdr_t) + data_size, NULL);
+        net_ipv6_input(NULL, ip, sizeof(ipv6_hdr_t) + data_size, NULL, pkt);
         return 0;
     }
     else if(net->flags & NETIF_NOETH) {
-        memcpy(pkt, hdr, sizeof(ipv6_hdr_t));
-        memcpy(pkt + sizeof(ipv6_hdr_t), data, data_size);
-
         ++ipv6_stats.pkt_sent;
 
         /* Send the packet away */
-        return net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size,
-                          NETIF_BLOCK);
+        return net_if_tx_pbuf(net, pkt, NETIF_BLOCK);
+    }
+    else if(net->flags & NETIF_LOOPBACK) {
+        /* Nothing needs resolving on the loopback device. */
+        memset(dst_mac, 0, 6);
     }
     else if(IN6_IS_ADDR_MULTICAST(&hdr->dst_addr)) {
         dst_mac[0] = dst_mac[1] = 0x33;
@@ -111,7 +230,8 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
             dst = net->ip6_gateway;
         }
 
-        err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
+        err = net_ndp_lookup(net, &dst, dst_mac, hdr, ip + sizeof(ipv6_hdr_t),
+                             data_size);
 
         if(err == -1) {
             errno = ENETUNREACH;
@@ -124,37 +244,107 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
     }
 
     /* Fill in the ethernet header */
-    ehdr = (eth_hdr_t *)pkt;
+    if(!(ehdr = (eth_hdr_t *)net_pbuf_push(pkt, sizeof(eth_hdr_t)))) {
+        errno = ENOBUFS;
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
+
     memcpy(ehdr->dest, dst_mac, 6);
     memcpy(ehdr->src, net->mac_addr, 6);
     ehdr->type[0] = 0x86;
     ehdr->type[1] = 0xDD;
 
-    /* Put the IP header / data into our ethernet packet */
-    memcpy(pkt + sizeof(eth_hdr_t), hdr, sizeof(ipv6_hdr_t));
-    memcpy(pkt + sizeof(eth_hdr_t) + sizeof(ipv6_hdr_t), data, data_size);
-
     ++ipv6_stats.pkt_sent;
 
     /* Send it away */
-    net->if_tx(net, pkt, sizeof(ipv6_hdr_t) + data_size + sizeof(eth_hdr_t),
-               NETIF_BLOCK);
+    net_if_tx_pbuf(net, pkt, NETIF_BLOCK);
 
     return 0;
 }
 
-int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
-                  int hop_limit, int proto, const struct in6_addr *src,
-                  const struct in6_addr *dst) {
-    ipv6_hdr_t hdr;
+int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
+                         size_t data_size) {
+    net_pbuf_t *pkt;
+    int rv;
 
-    if(!net) {
-        net = net_default_dev;
+    if(!(pkt = net_pbuf_alloc(NET_PBUF_HEADROOM, data_size))) {
+        errno = ENOMEM;
+        ++ipv6_stats.pkt_send_failed;
+        return -1;
+    }
 
-        if(!net) {
-            errno = ENETDOWN;
+    memcpy(pkt->data, data, data_size);
+    rv = net_ipv6_send_packet_pbuf(net, hdr, pkt);
+    net_pbuf_free(pkt);
+
+    return rv;
+}
+
+/* Send a packet that is too big for the path in pieces. Only the source does
+   this in IPv6, so each piece just gets a fragment header after the (fixed)
+   IPv6 header, and then the part of the payload it carries. */
+static int ipv6_frag_send(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt,
+                          uint32_t mtu) {
+    size_t max, off, sz, len = pkt->len;
+    ipv6_frag_hdr_t *fh;
+    net_pbuf_t *frag;
+    uint32_t ident;
+    uint8_t next = hdr->next_header;
+    irq_mask_t old;
+    int rv;
+
+    max = (mtu - sizeof(ipv6_hdr_t) - sizeof(ipv6_frag_hdr_t)) & ~7;
+
+    if(len > 65535 - sizeof(ipv6_frag_hdr_t)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    old = irq_disable();
+    ident = ++frag_ident;
+    irq_restore(old);
+
+    hdr->next_header = IPV6_HDR_EXT_FRAGMENT;
+
+    for(off = 0; off < len; off += sz) {
+        sz = len - off > max ? max : len - off;
+
+        if(!(frag = net_pbuf_alloc(NET_PBUF_HEADROOM,
+                                   sizeof(ipv6_frag_hdr_t) + sz))) {
+            errno = ENOMEM;
+            ++ipv6_stats.pkt_send_failed;
             return -1;
         }
+
+        fh = (ipv6_frag_hdr_t *)frag->data;
+        fh->next_header = next;
+        fh->reserved = 0;
+        fh->offs_flags = htons(off | (off + sz < len ? 1 : 0));
+        fh->ident = htonl(ident);
+        memcpy(frag->data + sizeof(ipv6_frag_hdr_t), pkt->data + off, sz);
+
+        hdr->length = htons(sizeof(ipv6_frag_hdr_t) + sz);
+        rv = net_ipv6_send_packet_pbuf(net, hdr, frag);
+        net_pbuf_free(frag);
+
+        if(rv)
+            return rv;
+    }
+
+    return 0;
+}
+
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *pkt, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst) {
+    ipv6_hdr_t hdr;
+    uint32_t mtu;
+
+    net = net_lo_route6(net, dst);
+
+    if(!net) {
+        errno = ENETDOWN;
+        return -1;
     }
 
     /* Set up the hop limit. We need to do this here, in case we end up passing
@@ -171,9 +361,9 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
        send function to do the rest. Note that only V4-mapped addresses are
        supported here (::ffff:x.y.z.w) */
     if(IN6_IS_ADDR_V4MAPPED(src) && IN6_IS_ADDR_V4MAPPED(dst)) {
-        return net_ipv4_send(net, data, data_size, -1, hop_limit, proto,
-                             src->__s6_addr.__s6_addr32[3],
-                             dst->__s6_addr.__s6_addr32[3]);
+        return net_ipv4_send_pbuf(net, pkt, -1, hop_limit, proto,
+                                  src->__s6_addr.__s6_addr32[3],
+                                  dst->__s6_addr.__s6_addr32[3]);
     }
     else if(IN6_IS_ADDR_V4MAPPED(src) || IN6_IS_ADDR_V4MAPPED(dst) ||
             IN6_IS_ADDR_V4COMPAT(src) || IN6_IS_ADDR_V4COMPAT(dst)) {
@@ -183,55 +373,52 @@ int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
     hdr.version_lclass = 0x60;
     hdr.hclass_lflow = 0;
     hdr.lclass = 0;
-    hdr.length = ntohs(data_size);
+    hdr.length = ntohs(pkt->len);
     hdr.next_header = proto;
     hdr.hop_limit = hop_limit;
     hdr.src_addr = *src;
     hdr.dst_addr = *dst;
 
-    /* XXXX: Handle fragmentation... */
-    return net_ipv6_send_packet(net, &hdr, data, data_size);
+    mtu = net_ipv6_pmtu(net, dst);
+
+    if(sizeof(ipv6_hdr_t) + pkt->len > mtu)
+        return ipv6_frag_send(net, &hdr, pkt, mtu);
+
+    return net_ipv6_send_packet_pbuf(net, &hdr, pkt);
 }
 
-int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
-                   const eth_hdr_t *eth) {
-    ipv6_hdr_t *ip;
-    uint8_t next_hdr;
-    //int pos;
-    size_t len;
+int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
+                  int hop_limit, int proto, const struct in6_addr *src,
+                  const struct in6_addr *dst) {
+    net_pbuf_t *pkt;
     int rv;
 
-    if(pktsize < sizeof(ipv6_hdr_t)) {
-        /* This is obviously a bad packet, drop it */
-        ++ipv6_stats.pkt_recv_bad_size;
+    if(!(pkt = net_pbuf_alloc(NET_PBUF_HEADROOM, data_size))) {
+        errno = ENOMEM;
         return -1;
     }
 
-    ip = (ipv6_hdr_t *)pkt;
-    len = ntohs(ip->length);
-
-    if(pktsize < len + sizeof(ipv6_hdr_t)) {
-        /* The packet is of size less than the payload length + the size of a
-           minimal IPv6 header; it must be bad, drop it */
-        ++ipv6_stats.pkt_recv_bad_size;
-        return -1;
-    }
+    memcpy(pkt->data, data, data_size);
+    rv = net_ipv6_send_pbuf(net, pkt, hop_limit, proto, src, dst);
+    net_pbuf_free(pkt);
 
-    /* Parse the header to find the payload */
-    //pos = sizeof(ipv6_hdr_t); // Currently unused, but will be needed later.
-    next_hdr = ip->next_header;
+    return rv;
+}
 
-    if(eth)
-        net_ndp_insert(src, eth->src, &ip->src_addr, 1);
+/* Pass the payload of a packet on to the protocol it is for. pkt and pktsize
+   are what gets quoted back in an ICMPv6 error if nothing wants it. */
+static int ipv6_input_proto(netif_t *src, ipv6_hdr_t *ip, uint8_t next_hdr,
+                            const uint8_t *data, size_t len, net_pbuf_t *pb,
+                            const uint8_t *pkt, size_t pktsize) {
+    int rv;
 
-    /* XXXX: Parse options and deal with fragmentation */
     switch(next_hdr) {
         case IPV6_HDR_ICMP:
-            return net_icmp6_input(src, ip, pkt + sizeof(ipv6_hdr_t), len);
+            return net_icmp6_input(src, ip, data, len);
 
         default:
-            rv = fs_socket_input(src, AF_INET6, next_hdr, pkt,
-                                 pkt + sizeof(ipv6_hdr_t), len);
+            rv = fs_socket_input_pbuf(src, AF_INET6, next_hdr, (uint8_t *)ip,
+                                      data, len, pb);
 
             if(rv == -2) {
                 /* We don't know what to do with this packet, so send an ICMPv6
@@ -245,8 +432,98 @@ int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
             ++ipv6_stats.pkt_recv;
             return rv;
     }
+}
 
-    return 0;
+/* Hand a reassembled datagram on to the upper layers. The header is that of
+   the first fragment, with the next header field from its fragment header. */
+static int ipv6_frag_done(netif_t *src, void *hdr, const uint8_t *data,
+                          size_t size) {
+    ipv6_hdr_t *ip = (ipv6_hdr_t *)hdr;
+
+    ip->length = htons(size);
+
+    return ipv6_input_proto(src, ip, ip->next_header, data, size, NULL,
+                            (const uint8_t *)ip, sizeof(ipv6_hdr_t));
+}
+
+/* Deal with a packet that has a fragment header right after the IPv6 header. */
+static int ipv6_reassemble(netif_t *src, ipv6_hdr_t *ip, const uint8_t *pkt,
+                           size_t pktsize, size_t len, net_pbuf_t *pb) {
+    const ipv6_frag_hdr_t *fh;
+    net_frag_key_t key;
+    ipv6_hdr_t hdr;
+    uint16_t offs_flags;
+    const uint8_t *data;
+
+    if(len < sizeof(ipv6_frag_hdr_t)) {
+        ++ipv6_stats.pkt_recv_bad_size;
+        return -1;
+    }
+
+    fh = (const ipv6_frag_hdr_t *)(pkt + sizeof(ipv6_hdr_t));
+    offs_flags = ntohs(fh->offs_flags);
+    data = pkt + sizeof(ipv6_hdr_t) + sizeof(ipv6_frag_hdr_t);
+    len -= sizeof(ipv6_frag_hdr_t);
+
+    /* A fragment header on a packet that wasn't actually split up. */
+    if(!(offs_flags & 0xFFF9))
+        return ipv6_input_proto(src, ip, fh->next_header, data, len, pb, pkt,
+                                pktsize);
+
+    /* Every fragment but the last has to be a multiple of 8 bytes long. */
+    if((offs_flags & 1) && (len & 7)) {
+        ++ipv6_stats.pkt_recv_bad_size;
+        return net_icmp6_send_param_prob(src, ICMP6_PARAM_PROB_BAD_HEADER, 4,
+                                         pkt, pktsize);
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.src = ip->src_addr;
+    key.dst = ip->dst_addr;
+    key.ident = fh->ident;
+
+    hdr = *ip;
+    hdr.next_header = fh->next_header;
+
+    return net_frag_import(src, &key, offs_flags & 0xFFF8, data, len,
+                           offs_flags & 1, &hdr, sizeof(hdr),
+                           IPV6_FRAG_TIMEOUT, ipv6_frag_done);
+}
+
+int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
+                   const eth_hdr_t *eth, net_pbuf_t *pb) {
+    ipv6_hdr_t *ip;
+    uint8_t next_hdr;
+    size_t len;
+
+    if(pktsize < sizeof(ipv6_hdr_t)) {
+        /* This is obviously a bad packet, drop it */
+        ++ipv6_stats.pkt_recv_bad_size;
+        return -1;
+    }
+
+    ip = (ipv6_hdr_t *)pkt;
+    len = ntohs(ip->length);
+
+    if(pktsize < len + sizeof(ipv6_hdr_t)) {
+        /* The packet is of size less than the payload length + the size of a
+           minimal IPv6 header; it must be bad, drop it */
+        ++ipv6_stats.pkt_recv_bad_size;
+        return -1;
+    }
+
+    next_hdr = ip->next_header;
+
+    if(eth && !(src->flags & NETIF_LOOPBACK))
+        net_ndp_insert(src, eth->src, &ip->src_addr, 1);
+
+    /* XXXX: Parse options. Fragments are only recognized if the fragment
+       header comes first. */
+    if(next_hdr == IPV6_HDR_EXT_FRAGMENT)
+        return ipv6_reassemble(src, ip, pkt, pktsize, len, pb);
+
+    return ipv6_input_proto(src, ip, next_hdr, pkt + sizeof(ipv6_hdr_t), len,
+                            pb, pkt, pktsize);
 }
 
 net_ipv6_stats_t net_ipv6_get_stats(void) {
@@ -284,13 +561,18 @@ int net_ipv6_init(void) {
     uint8_t mac[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
     net_multicast_add(mac);
 
+    /* Don't make fragment identifiers too easy to guess (RFC 7739). */
+    frag_ident = (uint32_t)timer_us_gettime64() * 2654435761U;
+
     /* Also register for the one for our link-local address' solicited nodes
        group (which will do the same for all our other addresses too). */
-    mac[2] = 0xFF;
-    mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
-    mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
-    mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
-    net_multicast_add(mac);
+    if(net_default_dev) {
+        mac[2] = 0xFF;
+        mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
+        mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
+        mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
+        net_multicast_add(mac);
+    }
 
     return 0;
 }
@@ -298,15 +580,21 @@ int net_ipv6_init(void) {
 void net_ipv6_shutdown(void) {
     uint8_t mac[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x01 };
 
+    /* Forget everything we've learned about paths. */
+    memset(pmtu_cache, 0, sizeof(pmtu_cache));
+    pmtu_count = 0;
+
     /* Remove from the all nodes multicast group */
     net_multicast_del(mac);
 
     /* ... and our solicited nodes multicast group */
-    mac[2] = 0xFF;
-    mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
-    mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
-    mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
-    net_multicast_del(mac);
+    if(net_default_dev) {
+        mac[2] = 0xFF;
+        mac[3] = net_default_dev->ip6_lladdr.s6_addr[13];
+        mac[4] = net_default_dev->ip6_lladdr.s6_addr[14];
+        mac[5] = net_default_dev->ip6_lladdr.s6_addr[15];
+        net_multicast_del(mac);
+    }
 }
 
 #if __GNUC__ >= 9
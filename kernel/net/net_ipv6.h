@@ -18,6 +18,13 @@ typedef struct ipv6_ext_hdr_s {
     uint8_t       data[];
 } __packed ipv6_ext_hdr_t;
 
+typedef struct ipv6_frag_hdr_s {
+    uint8_t       next_header;
+    uint8_t       reserved;
+    uint16_t      offs_flags;
+    uint32_t      ident;
+} __packed ipv6_frag_hdr_t;
+
 typedef struct ipv6_pseudo_hdr_s {
     struct in6_addr src_addr;
     struct in6_addr dst_addr;
@@ -35,17 +42,33 @@ typedef struct ipv6_pseudo_hdr_s {
 #define IPV6_HDR_NONE               59
 #define IPV6_HDR_EXT_DESTINATION    60
 
+/* Smallest MTU that any link carrying IPv6 must have (RFC 8200). */
+#define IPV6_MIN_MTU                1280
+
 int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
                          size_t data_size);
+int net_ipv6_send_packet_pbuf(netif_t *net, ipv6_hdr_t *hdr, net_pbuf_t *pkt);
 int net_ipv6_send(netif_t *net, const uint8_t *data, size_t data_size,
                   int hop_limit, int proto, const struct in6_addr *src,
                   const struct in6_addr *dst);
+int net_ipv6_send_pbuf(netif_t *net, net_pbuf_t *pkt, int hop_limit, int proto,
+                       const struct in6_addr *src, const struct in6_addr *dst);
 int net_ipv6_input(netif_t *src, const uint8_t *pkt, size_t pktsize,
-                   const eth_hdr_t *eth);
+                   const eth_hdr_t *eth, net_pbuf_t *pb);
 uint16 net_ipv6_checksum_pseudo(const struct in6_addr *src,
                                 const struct in6_addr *dst,
                                 uint32_t upper_len, uint8_t next_hdr);
 
+/* Path MTU discovery. net_ipv6_pmtu() returns the largest packet that can be
+   sent to the given destination (IPv4 addresses being v4-mapped) without
+   fragmenting, as learned from ICMPv6 Packet Too Big messages passed on to
+   net_ipv6_pmtu_update(). net_ipv6_pmtu_gen changes every time what we know
+   about some path changes, so that users of the MTU can tell when to look it
+   up again. */
+extern volatile uint32_t net_ipv6_pmtu_gen;
+uint32_t net_ipv6_pmtu(netif_t *net, const struct in6_addr *dst);
+void net_ipv6_pmtu_update(const struct in6_addr *dst, uint32_t mtu);
+
 extern const struct in6_addr in6addr_linklocal_allnodes;
 extern const struct in6_addr in6addr_linklocal_allrouters;
 
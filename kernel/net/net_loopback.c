@@ -0,0 +1,293 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loopback.c
+
+*/
+
+/* This file implements the loopback network device ("lo"). Frames sent to it
+   are queued up and fed back into net_input() from a thread of its own, so
+   that traffic to 127/8 and ::1 goes through the whole stack just like traffic
+   from a real network card does, without the sender recursing into the
+   receive path while it may still be holding socket locks. */
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include <kos/net.h>
+#include <kos/thread.h>
+#include <kos/sem.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+
+#include "net_ipv4.h"
+#include "net_loopback.h"
+
+/* Number of frames that can be waiting to be looped back. Anything sent while
+   the queue is full is dropped, just like a real card would do. */
+#define LO_QUEUE_LEN    64
+
+/* Maximum number of frames handed to net_input_batch() at once. */
+#define LO_BATCH        16
+
+/* MTU of the loopback device. Nothing goes out on a wire, so this is well
+   above ethernet's to save on fragmenting large datagrams. */
+#define LO_MTU          16384
+
+netif_t *net_lo_dev = NULL;
+
+static net_pbuf_t *lo_queue[LO_QUEUE_LEN];
+static int lo_head, lo_tail, lo_count;
+static uint32_t lo_dropped;
+
+static semaphore_t lo_sema;
+static kthread_t *lo_thd;
+static volatile int lo_done;
+
+static struct in6_addr lo_addr6 = IN6ADDR_LOOPBACK_INIT;
+
+static int lo_detect(netif_t *self) {
+    self->flags |= NETIF_DETECTED;
+    return 0;
+}
+
+static int lo_init(netif_t *self) {
+    self->flags |= NETIF_INITIALIZED;
+    return 0;
+}
+
+static int lo_shutdown(netif_t *self) {
+    self->flags &= ~(NETIF_DETECTED | NETIF_INITIALIZED);
+    return 0;
+}
+
+static int lo_start(netif_t *self) {
+    self->flags |= NETIF_RUNNING;
+    return 0;
+}
+
+static int lo_stop(netif_t *self) {
+    self->flags &= ~NETIF_RUNNING;
+    return 0;
+}
+
+static int lo_enqueue(net_pbuf_t *pkt) {
+    irq_mask_t old;
+    int wake;
+
+    old = irq_disable();
+
+    if(lo_count == LO_QUEUE_LEN) {
+        ++lo_dropped;
+        irq_restore(old);
+        return -1;
+    }
+
+    lo_queue[lo_tail] = pkt;
+    lo_tail = (lo_tail + 1) % LO_QUEUE_LEN;
+    wake = !lo_count++;
+
+    irq_restore(old);
+
+    /* The thread drains everything that is queued each time it wakes up, so
+       it only needs a kick when the queue goes from empty to non-empty. */
+    if(wake)
+        sem_signal(&lo_sema);
+
+    return 0;
+}
+
+static int lo_dequeue(net_pbuf_t **pkts, int max) {
+    irq_mask_t old;
+    int cnt = 0;
+
+    old = irq_disable();
+
+    while(lo_count && cnt < max) {
+        pkts[cnt++] = lo_queue[lo_head];
+        lo_head = (lo_head + 1) % LO_QUEUE_LEN;
+        --lo_count;
+    }
+
+    irq_restore(old);
+
+    return cnt;
+}
+
+static int lo_tx_pbuf(netif_t *self, net_pbuf_t *pkt, int blocking) {
+    const uint8_t *data = pkt->data;
+    net_pbuf_t *held;
+
+    (void)blocking;
+
+    if(!(self->flags & NETIF_RUNNING) || pkt->len > LO_MTU + sizeof(eth_hdr_t))
+        return NETIF_TX_ERROR;
+
+    /* Keep the sender's buffer if we can, otherwise this makes a copy. */
+    if(!(held = net_pbuf_hold(pkt, &data, pkt->len)))
+        return NETIF_TX_ERROR;
+
+    /* Never wait for room here: the sender might be holding a lock that the
+       loopback thread needs to get through the packets ahead of this one. */
+    if(lo_enqueue(held) < 0) {
+        net_pbuf_free(held);
+        return NETIF_TX_AGAIN;
+    }
+
+    return NETIF_TX_OK;
+}
+
+static int lo_tx(netif_t *self, const uint8_t *data, int len, int blocking) {
+    net_pbuf_t pkt;
+
+    return lo_tx_pbuf(self, net_pbuf_wrap(&pkt, data, len), blocking);
+}
+
+static int lo_tx_commit(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int lo_rx_poll(netif_t *self) {
+    (void)self;
+    return 0;
+}
+
+static int lo_set_flags(netif_t *self, uint32_t flags_and, uint32_t flags_or) {
+    self->flags = (self->flags & flags_and) | flags_or;
+    return 0;
+}
+
+static int lo_set_mc(netif_t *self, const uint8_t *list, int count) {
+    (void)self;
+    (void)list;
+    (void)count;
+    return 0;
+}
+
+static netif_t lo_if = {
+    { 0 },                      /* if_list */
+    "lo",                       /* name */
+    "Loopback Device",          /* descr */
+    0,                          /* index */
+    0,                          /* dev_id */
+    NETIF_LOOPBACK,             /* flags */
+    { 0, 0, 0, 0, 0, 0 },       /* mac_addr */
+    { 127, 0, 0, 1 },           /* ip_addr */
+    { 255, 0, 0, 0 },           /* netmask */
+    { 0, 0, 0, 0 },             /* gateway */
+    { 127, 255, 255, 255 },     /* broadcast */
+    { 0, 0, 0, 0 },             /* dns */
+    LO_MTU,                     /* mtu */
+    IN6ADDR_LOOPBACK_INIT,      /* ip6_lladdr */
+    &lo_addr6,                  /* ip6_addrs */
+    1,                          /* ip6_addr_count */
+    IN6ADDR_ANY_INIT,           /* ip6_gateway */
+    LO_MTU,                     /* mtu6 */
+    64,                         /* hop_limit */
+    lo_detect,                  /* if_detect */
+    lo_init,                    /* if_init */
+    lo_shutdown,                /* if_shutdown */
+    lo_start,                   /* if_start */
+    lo_stop,                    /* if_stop */
+    lo_tx,                      /* if_tx */
+    lo_tx_commit,               /* if_tx_commit */
+    lo_rx_poll,                 /* if_rx_poll */
+    lo_set_flags,               /* if_set_flags */
+    lo_set_mc,                  /* if_set_mc */
+    lo_tx_pbuf                  /* if_tx_pbuf */
+};
+
+static void *lo_thd_func(void *data) {
+    net_pbuf_t *pkts[LO_BATCH];
+    int cnt, i;
+
+    (void)data;
+
+    while(!lo_done) {
+        sem_wait(&lo_sema);
+
+        while((cnt = lo_dequeue(pkts, LO_BATCH))) {
+            net_input_batch(&lo_if, pkts, cnt);
+
+            for(i = 0; i < cnt; ++i)
+                net_pbuf_free(pkts[i]);
+        }
+    }
+
+    return NULL;
+}
+
+netif_t *net_lo_route4(netif_t *net, uint32_t dst) {
+    if(net_lo_dev && (ntohl(dst) >> 24) == 127)
+        return net_lo_dev;
+
+    return net ? net : net_default_dev;
+}
+
+netif_t *net_lo_route6(netif_t *net, const struct in6_addr *dst) {
+    if(IN6_IS_ADDR_V4MAPPED(dst))
+        return net_lo_route4(net, dst->__s6_addr.__s6_addr32[3]);
+
+    if(net_lo_dev && IN6_IS_ADDR_LOOPBACK(dst))
+        return net_lo_dev;
+
+    return net ? net : net_default_dev;
+}
+
+int net_lo_init(void) {
+    if(lo_thd)
+        return 0;
+
+    lo_head = lo_tail = lo_count = 0;
+    lo_dropped = 0;
+    lo_done = 0;
+    sem_init(&lo_sema, 0);
+
+    if(!(lo_thd = thd_create(0, lo_thd_func, NULL))) {
+        dbglog(DBG_ERROR, "net_lo_init: can't create loopback thread\n");
+        sem_destroy(&lo_sema);
+        return -1;
+    }
+
+    thd_set_label(lo_thd, "net-lo-thd");
+
+    lo_if.if_detect(&lo_if);
+    lo_if.if_init(&lo_if);
+    lo_if.if_start(&lo_if);
+
+    if(!(lo_if.flags & NETIF_REGISTERED))
+        net_reg_device(&lo_if);
+
+    net_lo_dev = &lo_if;
+
+    return 0;
+}
+
+void net_lo_shutdown(void) {
+    net_pbuf_t *pkts[LO_BATCH];
+    int cnt, i;
+
+    if(!lo_thd)
+        return;
+
+    net_lo_dev = NULL;
+    lo_if.if_stop(&lo_if);
+    lo_if.if_shutdown(&lo_if);
+    net_unreg_device(&lo_if);
+
+    lo_done = 1;
+    sem_signal(&lo_sema);
+    thd_join(lo_thd, NULL);
+    lo_thd = NULL;
+    sem_destroy(&lo_sema);
+
+    /* Throw away anything that never got delivered. */
+    while((cnt = lo_dequeue(pkts, LO_BATCH))) {
+        for(i = 0; i < cnt; ++i)
+            net_pbuf_free(pkts[i]);
+    }
+
+    if(lo_dropped)
+        dbglog(DBG_DEBUG, "net_lo_shutdown: %lu frame(s) dropped\n",
+               (unsigned long)lo_dropped);
+}
@@ -0,0 +1,30 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_loopback.h
+
+*/
+
+#ifndef __LOCAL_NET_LOOPBACK_H
+#define __LOCAL_NET_LOOPBACK_H
+
+#include <sys/cdefs.h>
+#include <stdint.h>
+#include <kos/net.h>
+
+__BEGIN_DECLS
+
+/* The loopback device, or NULL if it isn't running. */
+extern netif_t *net_lo_dev;
+
+/* Pick the device to send to the given destination on: the loopback device for
+   loopback destinations (when it is up), otherwise net if it is not NULL, or
+   the default device. The IPv4 address is in network byte order. */
+netif_t *net_lo_route4(netif_t *net, uint32_t dst);
+netif_t *net_lo_route6(netif_t *net, const struct in6_addr *dst);
+
+int net_lo_init(void);
+void net_lo_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_LOOPBACK_H */
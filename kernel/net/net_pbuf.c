@@ -0,0 +1,211 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+
+*/
+
+/* This file implements the reference counted packet buffers that are passed
+   between the layers of the network stack. Most buffers come from a pool set
+   up by net_pbuf_init() so that drivers can grab one from their interrupt
+   handlers; anything that does not fit (or that is requested when the pool is
+   empty or was never set up) falls back to the heap, which is only possible
+   outside of interrupt context. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <kos/net.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+
+/* Number of buffers in the static pool. */
+#define PBUF_POOL_COUNT     40
+
+/* When fewer than this many pool buffers are free, net_pbuf_hold() copies the
+   data out rather than keeping a pool buffer queued on a socket, so that the
+   drivers do not run dry of receive buffers. */
+#define PBUF_POOL_LOW       (PBUF_POOL_COUNT / 4)
+
+/* Space taken by the descriptor of heap-allocated buffers, keeping the storage
+   that follows it 32-byte aligned. */
+#define PBUF_DESC_SIZE      ((sizeof(net_pbuf_t) + 31) & ~31)
+
+static net_pbuf_t pool_desc[PBUF_POOL_COUNT];
+static uint8_t *pool_mem;
+static net_pbuf_t *pool_free[PBUF_POOL_COUNT];
+static int pool_free_cnt;
+
+int net_pbuf_init(void) {
+    uint8_t *mem;
+    irq_mask_t old;
+    int i;
+
+    if(pool_mem)
+        return 0;
+
+    if(!(mem = (uint8_t *)memalign(32, PBUF_POOL_COUNT * NET_PBUF_POOL_SIZE)))
+        return -1;
+
+    old = irq_disable();
+
+    for(i = 0; i < PBUF_POOL_COUNT; ++i) {
+        pool_desc[i].buf = mem + i * NET_PBUF_POOL_SIZE;
+        pool_desc[i].size = NET_PBUF_POOL_SIZE;
+        pool_desc[i].flags = NET_PBUF_POOL;
+        pool_free[i] = &pool_desc[i];
+    }
+
+    pool_mem = mem;
+    pool_free_cnt = PBUF_POOL_COUNT;
+    irq_restore(old);
+
+    return 0;
+}
+
+void net_pbuf_shutdown(void) {
+    irq_mask_t old;
+    uint8_t *mem = NULL;
+
+    old = irq_disable();
+
+    /* Anything still out there would be left pointing at freed memory, so the
+       pool has to stay around until it all comes back. */
+    if(pool_mem && pool_free_cnt == PBUF_POOL_COUNT) {
+        mem = pool_mem;
+        pool_mem = NULL;
+        pool_free_cnt = 0;
+    }
+
+    irq_restore(old);
+
+    if(mem)
+        free(mem);
+    else if(pool_mem)
+        dbglog(DBG_WARNING, "net_pbuf: buffers still in use at shutdown\n");
+}
+
+static net_pbuf_t *pool_get(void) {
+    net_pbuf_t *rv = NULL;
+    irq_mask_t old;
+
+    old = irq_disable();
+
+    if(pool_free_cnt > 0)
+        rv = pool_free[--pool_free_cnt];
+
+    irq_restore(old);
+    return rv;
+}
+
+static net_pbuf_t *heap_get(size_t size) {
+    net_pbuf_t *rv;
+
+    if(irq_inside_int())
+        return NULL;
+
+    if(!(rv = (net_pbuf_t *)memalign(32, PBUF_DESC_SIZE + size)))
+        return NULL;
+
+    rv->buf = (uint8_t *)rv + PBUF_DESC_SIZE;
+    rv->size = size;
+    rv->flags = 0;
+
+    return rv;
+}
+
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len) {
+    net_pbuf_t *rv = NULL;
+    size_t size = headroom + len;
+
+    if(size <= NET_PBUF_POOL_SIZE)
+        rv = pool_get();
+
+    if(!rv && !(rv = heap_get(size)))
+        return NULL;
+
+    rv->data = rv->buf + headroom;
+    rv->len = len;
+    rv->refcnt = 1;
+
+    return rv;
+}
+
+net_pbuf_t *net_pbuf_ref(net_pbuf_t *pkt) {
+    irq_mask_t old;
+
+    old = irq_disable();
+    ++pkt->refcnt;
+    irq_restore(old);
+
+    return pkt;
+}
+
+void net_pbuf_free(net_pbuf_t *pkt) {
+    irq_mask_t old;
+    int last;
+
+    if(!pkt || (pkt->flags & NET_PBUF_BORROWED))
+        return;
+
+    old = irq_disable();
+    last = !--pkt->refcnt;
+
+    if(last && (pkt->flags & NET_PBUF_POOL)) {
+        pool_free[pool_free_cnt++] = pkt;
+        irq_restore(old);
+        return;
+    }
+
+    irq_restore(old);
+
+    if(last)
+        free(pkt);
+}
+
+uint8_t *net_pbuf_push(net_pbuf_t *pkt, size_t n) {
+    if((size_t)(pkt->data - pkt->buf) < n)
+        return NULL;
+
+    pkt->data -= n;
+    pkt->len += n;
+    return pkt->data;
+}
+
+uint8_t *net_pbuf_pull(net_pbuf_t *pkt, size_t n) {
+    if(pkt->len < n)
+        return NULL;
+
+    pkt->data += n;
+    pkt->len -= n;
+    return pkt->data;
+}
+
+net_pbuf_t *net_pbuf_wrap(net_pbuf_t *pkt, const uint8_t *data, size_t len) {
+    pkt->data = pkt->buf = (uint8_t *)data;
+    pkt->len = pkt->size = len;
+    pkt->flags = NET_PBUF_BORROWED;
+    pkt->refcnt = 1;
+
+    return pkt;
+}
+
+net_pbuf_t *net_pbuf_hold(net_pbuf_t *pkt, const uint8_t **data, size_t len) {
+    net_pbuf_t *rv;
+
+    if(pkt && !(pkt->flags & NET_PBUF_BORROWED) &&
+       (!(pkt->flags & NET_PBUF_POOL) || pool_free_cnt > PBUF_POOL_LOW))
+        return net_pbuf_ref(pkt);
+
+    /* Prefer the heap for copies, the pool is meant for packets in flight. */
+    if(!(rv = heap_get(len)) && !(rv = net_pbuf_alloc(0, len)))
+        return NULL;
+
+    rv->data = rv->buf;
+    rv->len = len;
+    rv->refcnt = 1;
+    memcpy(rv->data, *data, len);
+    *data = rv->data;
+
+    return rv;
+}
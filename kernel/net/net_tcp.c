@@ -28,6 +28,7 @@
 #include "net_ipv4.h"
 #include "net_ipv6.h"
 #include "net_thd.h"
+#include "net_loopback.h"
 
 /* Since some of this is a bit odd in its implementation, here's a few notes on
    what my thinking was while writing all of this...
@@ -171,6 +172,13 @@ struct tcp_sock {
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
             uint64_t timer;
+            uint32_t rto;
+            uint64_t ack_timer;
+            uint64_t cork_timer;
+            uint32_t ack_pending;
+            uint32_t rcv_adv;
+            uint16_t mss_peer;
+            uint32_t pmtu_gen;
             condvar_t send_cv;
             condvar_t recv_cv;
         } data;
@@ -194,12 +202,32 @@ static int thd_cb_id = 0;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
+/* Default retransmission timeout (in milliseconds). Each retransmission or
+   zero window probe doubles it, up to the maximum, until new data is acked. */
 #define TCP_DEFAULT_RTTO    2000
+#define TCP_MAX_RTTO        60000
 
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
 
+/* Longest time an ACK for received data may be delayed (in milliseconds). RFC
+   1122 says this must be less than 0.5 seconds. */
+#define TCP_DEFAULT_DELACK  100
+
+/* Longest time data is held back by TCP_CORK waiting for a full segment (in
+   milliseconds), matching what Linux does. */
+#define TCP_DEFAULT_CORK    200
+
+/* How long to wait before trying to send data again when it couldn't go out
+   for a reason that won't tell us when it goes away, like running out of
+   buffers (in milliseconds). */
+#define TCP_DEFAULT_RETRY   50
+
+/* How often the timer callback runs even if no socket has asked it to (in
+   milliseconds). Sockets schedule it for when their next timer expires, so
+   this is only a backstop. */
+#define TCP_THD_PERIOD      1000
+
 /* Flags that can be set in the off_flags field of the above struct */
 #define TCP_FLAG_FIN    0x01
 #define TCP_FLAG_SYN    0x02
@@ -230,6 +258,20 @@ static int thd_cb_id = 0;
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_NODELAY       0x00000008
+#define TCP_IFLAG_CORK          0x00000010
+#define TCP_IFLAG_QUICKACK      0x00000020
+#define TCP_IFLAG_PERSIST       0x00000040
+
+/* Options that are inherited by sockets returned from accept() */
+#define TCP_IFLAG_OPTS          (TCP_IFLAG_NODELAY | TCP_IFLAG_CORK | \
+                                 TCP_IFLAG_QUICKACK)
+
+/* Modes for tcp_send_data() */
+#define TCP_SEND_NEW            0   /* Send new data, subject to Nagle/cork */
+#define TCP_SEND_RESEND         1   /* Retransmit everything unacknowledged */
+#define TCP_SEND_PUSH           2   /* Send new data, even partial segments */
+#define TCP_SEND_PROBE          3   /* Send one byte into a zero window */
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
@@ -242,6 +284,7 @@ static int thd_cb_id = 0;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -251,8 +294,10 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
                     uint32_t ack);
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
-static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_send_data(struct tcp_sock *sock, int mode);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_sched(struct tcp_sock *sock);
+static void tcp_set_mss(struct tcp_sock *sock, uint16_t peer);
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -395,8 +440,11 @@ retry:
 
         case TCP_STATE_ESTABLISHED:
 
-            /* See if all sends have finished... */
+            /* See if all sends have finished. If not, push out anything that
+               is still being held back... */
             if(sock->data.sndbuf_cur_sz) {
+                sock->intflags &= ~TCP_IFLAG_CORK;
+                tcp_send_data(sock, TCP_SEND_PUSH);
                 goto ret_no_remove;
             }
 
@@ -413,8 +461,11 @@ retry:
 
         case TCP_STATE_CLOSE_WAIT:
 
-            /* See if all sends have finished... */
+            /* See if all sends have finished. If not, push out anything that
+               is still being held back... */
             if(sock->data.sndbuf_cur_sz) {
+                sock->intflags &= ~TCP_IFLAG_CORK;
+                tcp_send_data(sock, TCP_SEND_PUSH);
                 goto ret_no_remove;
             }
 
@@ -456,6 +507,7 @@ ret_no_remove:
         sock->intflags |= TCP_IFLAG_QUEUEDCLOSE;
 
     sock->sock = -1;
+    tcp_sched(sock);
 
     /* Don't free anything here, it will be dealt with later on in the
        net_thd callback. */
@@ -609,6 +661,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->hop_limit = sock->hop_limit;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
+    sock2->intflags = sock->intflags & TCP_IFLAG_OPTS;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
 
     /* Fill in the address, if they asked for it. */
@@ -707,7 +760,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.snd.una = sock2->data.snd.iss;
     sock2->data.snd.wnd = lsock.wnd;
     sock2->data.snd.wl1 = sock2->data.snd.iss;
-    sock2->data.snd.mss = lsock.mss;
+    tcp_set_mss(sock2, lsock.mss);
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
@@ -717,6 +770,8 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
     sock2->data.timer = timer_ms_gettime64();
+    sock2->data.rto = TCP_DEFAULT_RTTO;
+    tcp_sched(sock2);
     fd = sock2->sock;
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
     mutex_unlock(&sock2->mutex);
@@ -882,17 +937,13 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     struct tcp_sock *sock, *iter;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    netif_t *net;
 
     if(addr == NULL) {
         errno = EDESTADDRREQ;
         return -1;
     }
 
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return -1;
-    }
-
     switch(addr->sa_family) {
         case AF_INET:
 
@@ -932,6 +983,11 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
+    if(!(net = net_lo_route6(NULL, &realaddr6.sin6_addr))) {
+        errno = ENETDOWN;
+        return -1;
+    }
+
     if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
         return -1;
 
@@ -1002,7 +1058,10 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         if(addr->sa_family == AF_INET) {
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
             sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3] =
-                htonl(net_ipv4_address(net_default_dev->ip_addr));
+                htonl(net_ipv4_address(net->ip_addr));
+        }
+        else if(IN6_IS_ADDR_LOOPBACK(&realaddr6.sin6_addr)) {
+            sock->local_addr.sin6_addr = in6addr_loopback;
         }
     }
 
@@ -1046,7 +1105,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
 
     sock->data.rcv.wnd = sock->rcvbuf_sz;
     sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
-    sock->data.net = net_default_dev;
+    sock->data.net = net;
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
@@ -1059,6 +1118,10 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         return -1;
     }
 
+    sock->data.timer = timer_ms_gettime64();
+    sock->data.rto = TCP_DEFAULT_RTTO;
+    tcp_sched(sock);
+
     /* Release the write lock... */
     rwsem_write_unlock(&tcp_sem);
 
@@ -1281,6 +1344,19 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         sock->data.rcvbuf_head = sock->data.rcvbuf_tail = 0;
     }
 
+    /* If reading has opened up the window by a decent amount since we last told
+       the other side about it, send a window update so it doesn't have to wait
+       on us (RFC 1122, section 4.2.3.3). */
+    if(!(flags & MSG_PEEK) && (sock->state == TCP_STATE_ESTABLISHED ||
+                               sock->state == TCP_STATE_FIN_WAIT_1 ||
+                               sock->state == TCP_STATE_FIN_WAIT_2)) {
+        tmp = (int32_t)(sock->data.rcv.nxt + sock->data.rcv.wnd -
+                        sock->data.rcv_adv);
+
+        if(tmp >= (int)MIN(sock->rcvbuf_sz / 2, TCP_DEFAULT_MSS))
+            tcp_send_ack(sock);
+    }
+
     if(addr != NULL) {
         if(sock->domain == AF_INET) {
             struct sockaddr_in realaddr;
@@ -1422,6 +1498,11 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
     else
         size = length;
 
+    /* Start the clock on how long corked data can be held back if there's
+       nothing else waiting to go out already. */
+    if(sock->data.sndbuf_cur_sz == sock->data.snd.nxt - sock->data.snd.una)
+        sock->data.cork_timer = timer_ms_gettime64();
+
     sb = sock->data.sndbuf + sock->data.sndbuf_tail;
     sock->data.sndbuf_cur_sz += size;
 
@@ -1440,7 +1521,7 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
     }
 
     /* Send some data! */
-    tcp_send_data(sock, 0);
+    tcp_send_data(sock, TCP_SEND_NEW);
 
 out:
     mutex_unlock(&sock->mutex);
@@ -1539,7 +1620,15 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
         case IPPROTO_TCP:
             switch(option_name) {
                 case TCP_NODELAY:
-                    tmp = 1;
+                    tmp = !!(sock->intflags & TCP_IFLAG_NODELAY);
+                    goto copy_int;
+
+                case TCP_CORK:
+                    tmp = !!(sock->intflags & TCP_IFLAG_CORK);
+                    goto copy_int;
+
+                case TCP_QUICKACK:
+                    tmp = !!(sock->intflags & TCP_IFLAG_QUICKACK);
                     goto copy_int;
             }
 
@@ -1704,9 +1793,55 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
 
                     tmp = *((int *)option_value);
 
-                    if(tmp == 0)
+                    if(tmp)
+                        sock->intflags |= TCP_IFLAG_NODELAY;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_NODELAY;
+
+                    /* Anything Nagle was holding back can go out now. */
+                    if(tmp && (sock->state == TCP_STATE_ESTABLISHED ||
+                               sock->state == TCP_STATE_CLOSE_WAIT))
+                        tcp_send_data(sock, TCP_SEND_NEW);
+
+                    goto ret_success;
+
+                case TCP_CORK:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp)
+                        sock->intflags |= TCP_IFLAG_CORK;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_CORK;
+
+                    /* Removing the cork sends any partial segment right away,
+                       regardless of Nagle. */
+                    if(!tmp && (sock->state == TCP_STATE_ESTABLISHED ||
+                                sock->state == TCP_STATE_CLOSE_WAIT))
+                        tcp_send_data(sock, TCP_SEND_PUSH);
+
+                    goto ret_success;
+
+                case TCP_QUICKACK:
+                    if(option_len != sizeof(int))
                         goto ret_inval;
 
+                    tmp = *((int *)option_value);
+
+                    if(tmp)
+                        sock->intflags |= TCP_IFLAG_QUICKACK;
+                    else
+                        sock->intflags &= ~TCP_IFLAG_QUICKACK;
+
+                    /* Don't leave an ACK sitting around once we've been told
+                       not to delay them. */
+                    if(tmp && sock->state != TCP_STATE_LISTEN &&
+                       (sock->state & 0x0F) != TCP_STATE_CLOSED &&
+                       sock->data.ack_pending)
+                        tcp_send_ack(sock);
+
                     goto ret_success;
             }
 
@@ -2059,10 +2194,31 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
                   dst, src);
 }
 
+/* Largest segment that fits in the path MTU to the other end of the connection,
+   as far as we know. */
+static uint16_t tcp_path_mss(struct tcp_sock *sock) {
+    uint32_t mtu = net_ipv6_pmtu(sock->data.net, &sock->remote_addr.sin6_addr);
+
+    if(IN6_IS_ADDR_V4MAPPED(&sock->remote_addr.sin6_addr))
+        mtu -= sizeof(ip_hdr_t) + sizeof(tcp_hdr_t);
+    else
+        mtu -= sizeof(ipv6_hdr_t) + sizeof(tcp_hdr_t);
+
+    return mtu > 0xFFFF ? 0xFFFF : (uint16_t)mtu;
+}
+
+/* Set the MSS to send with from what the other side told us and what the path
+   to it can take. */
+static void tcp_set_mss(struct tcp_sock *sock, uint16_t peer) {
+    sock->data.mss_peer = peer;
+    sock->data.pmtu_gen = net_ipv6_pmtu_gen;
+    sock->data.snd.mss = MIN(peer, tcp_path_mss(sock));
+}
+
 static int tcp_send_syn(struct tcp_sock *sock, int ack) {
     uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+    uint16_t cs, mss;
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
@@ -2081,11 +2237,13 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack) {
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
+    /* Fill in our SYN options. The only one we worry about right now is MSS,
+       which is limited by what we know of the path to the other end. */
+    mss = MIN(TCP_DEFAULT_MSS, tcp_path_mss(sock));
     hdr->options[0] = TCP_OPT_MSS;
     hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    hdr->options[2] = (mss >> 8) & 0xFF;
+    hdr->options[3] = mss & 0xFF;
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
@@ -2093,6 +2251,8 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack) {
                                   sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
     hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
 
+    sock->data.rcv_adv = sock->data.rcv.nxt + sock->data.rcv.wnd;
+
     return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
                          sock->hop_limit, IPPROTO_TCP,
                          &sock->local_addr.sin6_addr,
@@ -2120,6 +2280,9 @@ static void tcp_send_fin_ack(struct tcp_sock *sock) {
                                   sizeof(tcp_hdr_t), IPPROTO_TCP);
     hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
 
+    sock->data.ack_pending = 0;
+    sock->data.rcv_adv = sock->data.rcv.nxt + sock->data.rcv.wnd;
+
     net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
                   IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
@@ -2145,69 +2308,130 @@ static void tcp_send_ack(struct tcp_sock *sock) {
                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
     hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
 
+    sock->data.ack_pending = 0;
+    sock->data.rcv_adv = sock->data.rcv.nxt + sock->data.rcv.wnd;
+
     net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
                   sock->hop_limit, IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz = sizeof(tcp_hdr_t);
-    uint8_t rawpkt[1500];
-    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
-    uint16_t cs;
+static void tcp_send_data(struct tcp_sock *sock, int mode) {
+    uint32_t wnd = sock->data.snd.wnd, snd, full;
+    uint64_t now = timer_ms_gettime64();
+    int sz = sizeof(tcp_hdr_t), sent = 0;
+    tcp_hdr_t base, *hdr;
+    net_pbuf_t *pkt;
+    uint16_t cs, cs2;
     uint8_t *sb, *buf;
     uint32_t seq, unacked, head;
 
-    if(!resend) {
+    /* Pick up any change in the path MTU since we last looked. */
+    if(sock->data.pmtu_gen != net_ipv6_pmtu_gen)
+        tcp_set_mss(sock, sock->data.mss_peer);
+
+    full = sock->data.snd.mss - sizeof(tcp_hdr_t);
+
+    if(mode != TCP_SEND_RESEND) {
         seq = sock->data.snd.nxt;
         unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
+        wnd = wnd > unacked ? wnd - unacked : 0;
         head = sock->data.sndbuf_head;
+
+        /* If the other side has shut its window, nothing goes out until the
+           persist timer sends a probe (RFC 1122, section 4.2.2.17). The probe
+           then gets retransmitted like any other data until it is acked. */
+        if(mode == TCP_SEND_PROBE) {
+            wnd = 1;
+        }
+        else if(!sock->data.snd.wnd && !unacked && sock->data.sndbuf_cur_sz &&
+                !(sock->intflags & TCP_IFLAG_PERSIST)) {
+            sock->intflags |= TCP_IFLAG_PERSIST;
+            sock->data.timer = now;
+        }
     }
     else {
         seq = sock->data.snd.una;
         unacked = 0;
         head = sock->data.sndbuf_acked;
-    }
 
-    if(!wnd)
-        wnd = 1;
+        if(!wnd)
+            wnd = 1;
+    }
 
     /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
+    base.src_port = sock->local_addr.sin6_port;
+    base.dst_port = sock->remote_addr.sin6_port;
+    base.ack = htonl(sock->data.rcv.nxt);
+    base.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
+    base.wnd = htons(sock->data.rcv.wnd);
+    base.urg = 0;
+    base.checksum = 0;
 
     /* Put on some data if we should do so */
     while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = rawpkt + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
         snd = wnd;
 
-        if(snd > sock->data.snd.mss - sizeof(tcp_hdr_t))
-            snd = sock->data.snd.mss - sizeof(tcp_hdr_t);
+        if(snd > full)
+            snd = full;
 
         if(snd > sock->data.sndbuf_cur_sz - unacked)
             snd = sock->data.sndbuf_cur_sz - unacked;
 
+        /* Hold back a partial segment of new data if we're corked, or while
+           earlier data is still unacknowledged unless Nagle's algorithm has
+           been turned off (RFC 1122, section 4.2.3.4). The arrival of an ACK,
+           removing the cork or the cork timing out will send it later. */
+        if(snd < full && mode == TCP_SEND_NEW) {
+            if(sock->intflags & TCP_IFLAG_CORK)
+                break;
+
+            if(unacked && !(sock->intflags & TCP_IFLAG_NODELAY))
+                break;
+        }
+
+        /* Each segment is built directly in a packet buffer with room for the
+           lower-level headers, so the data is only copied out of the send
+           buffer once. If we can't get one, the retransmit timer will pick up
+           whatever is left over. */
+        if(!(pkt = net_pbuf_alloc(NET_PBUF_HEADROOM,
+                                  snd + sizeof(tcp_hdr_t))))
+            break;
+
+        hdr = (tcp_hdr_t *)pkt->data;
+        *hdr = base;
+        hdr->seq = htonl(seq);
+        buf = pkt->data + sizeof(tcp_hdr_t);
+        sb = sock->data.sndbuf + head;
+
+        /* Start the checksum off with the pseudo-header and TCP header, then
+           add the data in as it gets copied in. */
+        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                      &sock->remote_addr.sin6_addr,
+                                      snd + sizeof(tcp_hdr_t), IPPROTO_TCP);
+        cs = ~net_ipv4_checksum(pkt->data, sizeof(tcp_hdr_t), cs);
+
         /* Copy in the data */
         if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
+            hdr->checksum = net_ipv4_checksum_copy(buf, sb, snd, cs);
             head += snd;
 
             if(head == sock->sndbuf_sz)
                 head = 0;
         }
         else {
+            /* The data wraps around the end of the ring. The second piece may
+               start at an odd offset, in which case its sum has to be byte
+               swapped before adding it to the first one. */
             sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
+            cs = ~net_ipv4_checksum_copy(buf, sb, sz, cs);
+            cs2 = ~net_ipv4_checksum_copy(buf + sz, sock->data.sndbuf,
+                                          snd - sz, 0);
+
+            if(sz & 1)
+                cs2 = (cs2 << 8) | (cs2 >> 8);
+
+            hdr->checksum = net_ipv4_checksum((const uint8_t *)&cs2, 2, cs);
             head = snd - sz;
         }
 
@@ -2216,20 +2440,33 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
         seq += snd;
         unacked += snd;
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(rawpkt, sz, cs);
+        net_ipv6_send_pbuf(sock->data.net, pkt, sock->hop_limit, IPPROTO_TCP,
+                           &sock->local_addr.sin6_addr,
+                           &sock->remote_addr.sin6_addr);
+        net_pbuf_free(pkt);
+        sent = 1;
+    }
 
-        net_ipv6_send(sock->data.net, rawpkt, sz, sock->hop_limit, IPPROTO_TCP,
-                      &sock->local_addr.sin6_addr,
-                      &sock->remote_addr.sin6_addr);
+    /* Only restart the retransmission timer if something actually went out,
+       otherwise holding data back would keep pushing it further away. Any ACK
+       we owed the other side has gone out with the data. */
+    if(sent) {
+        sock->data.timer = now;
+        sock->data.ack_pending = 0;
+        sock->data.rcv_adv = sock->data.rcv.nxt + sock->data.rcv.wnd;
+    }
+
+    /* Back off after a retransmission or probe. This happens even if we
+       couldn't get a buffer for it, so that the next try waits instead of
+       coming right back around. */
+    if(mode == TCP_SEND_RESEND || mode == TCP_SEND_PROBE) {
+        sock->data.timer = now;
+        sock->data.rto = MIN(sock->data.rto * 2, TCP_MAX_RTTO);
     }
 
-    sock->data.timer = timer_ms_gettime64();
     sock->data.sndbuf_head = head;
     sock->data.snd.nxt = seq;
+    tcp_sched(sock);
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2457,7 +2694,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
             }
         }
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
+        tcp_set_mss(s, mss > 1460 ? 1460 : mss);
         s->data.snd.wnd = htons(tcp->wnd);
 
         if(gotack) {
@@ -2490,7 +2727,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
     uint32_t seq, ack, up;
     size_t sz;
-    int bad_pkt = 0, tmp, acksyn = 0;
+    int bad_pkt = 0, tmp, acksyn = 0, ack_now = 0;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
 
@@ -2593,12 +2830,10 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
-        if(SEQ_LT(s->data.snd.wl1, seq) ||
-                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
-            s->data.snd.wl1 = seq;
-            s->data.snd.wl2 = ack;
-        }
+        /* The retransmission timeout only starts over once the window is
+           open, so that acked zero window probes keep backing off. */
+        if(!(s->intflags & TCP_IFLAG_PERSIST))
+            s->data.rto = TCP_DEFAULT_RTTO;
     }
     else if(SEQ_GT(ack, s->data.snd.nxt)) {
         /* This ACKs something we haven't sent, so try to correct the other side
@@ -2607,6 +2842,21 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Update the send window. This has to be done for duplicate ACKs too,
+       since that's how the other side opens a window it had shut. */
+    if(SEQ_LE(s->data.snd.una, ack) &&
+       (SEQ_LT(s->data.snd.wl1, seq) ||
+        (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack)))) {
+        s->data.snd.wnd = ntohs(tcp->wnd);
+        s->data.snd.wl1 = seq;
+        s->data.snd.wl2 = ack;
+
+        if(s->data.snd.wnd && (s->intflags & TCP_IFLAG_PERSIST)) {
+            s->intflags &= ~TCP_IFLAG_PERSIST;
+            s->data.rto = TCP_DEFAULT_RTTO;
+        }
+    }
+
     /* We need to do a bit more processing in certain states... */
     switch(s->state) {
         case TCP_STATE_FIN_WAIT_1:
@@ -2666,6 +2916,14 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             bad_pkt = 1;
         }
 
+        /* We don't queue up out-of-order segments, so drop anything past
+           what we're expecting and let the other side know right away what
+           we're actually waiting for (RFC 5681, section 4.2). */
+        if(sz && seq != s->data.rcv.nxt) {
+            tcp_send_ack(s);
+            return 0;
+        }
+
         /* Copy the data out */
         if(sz) {
             rb = s->data.rcvbuf + s->data.rcvbuf_tail;
@@ -2673,6 +2931,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             s->data.rcv.wnd -= sz;
             s->data.rcvbuf_cur_sz += sz;
 
+            if(!s->data.ack_pending)
+                s->data.ack_timer = timer_ms_gettime64();
+
+            s->data.ack_pending += sz;
+
             if(s->data.rcvbuf_tail + sz <= s->rcvbuf_sz) {
                 memcpy(rb, buf, sz);
                 s->data.rcvbuf_tail += sz;
@@ -2686,10 +2949,16 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 s->data.rcvbuf_tail = sz;
             }
 
-            /* Signal any waiting thread and send an ack for what we read */
+            /* Signal any waiting thread. The ACK for what we read is delayed
+               in the hope that it can ride along with a reply, but at least
+               every second full-sized segment gets acknowledged right away
+               (RFC 1122, section 4.2.3.2). */
             __poll_event_trigger(s->sock, POLLRDNORM);
             cond_signal(&s->data.recv_cv);
-            tcp_send_ack(s);
+
+            if((s->intflags & TCP_IFLAG_QUICKACK) || bad_pkt ||
+               s->data.ack_pending >= 2U * (s->data.snd.mss - sizeof(tcp_hdr_t)))
+                ack_now = 1;
         }
     }
     else if(sz) {
@@ -2733,6 +3002,16 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
+    /* Now that the ACK has been processed, anything that was being held back
+       waiting on it can go out, which also takes care of any ACK we owe. */
+    if((s->state == TCP_STATE_ESTABLISHED ||
+        s->state == TCP_STATE_CLOSE_WAIT) &&
+       s->data.sndbuf_cur_sz != s->data.snd.nxt - s->data.snd.una)
+        tcp_send_data(s, TCP_SEND_NEW);
+
+    if(ack_now && s->data.ack_pending)
+        tcp_send_ack(s);
+
     /* And... We're done, finally. */
     return 0;
 }
@@ -2825,6 +3104,7 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                 break;
         }
 
+        tcp_sched(s);
         mutex_unlock(&s->mutex);
     }
 
@@ -2838,9 +3118,71 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
+/* Figure out when the given socket next needs the attention of tcp_thd_cb(),
+   or return zero if it doesn't need any until something else happens. The
+   socket must be locked. */
+static uint64_t tcp_deadline(struct tcp_sock *sock) {
+    uint64_t rv = 0, t;
+
+#define TCP_DEADLINE(x) do { t = (x); if(!rv || t < rv) rv = t; } while(0)
+
+    switch(sock->state) {
+        case TCP_STATE_SYN_SENT:
+        case TCP_STATE_SYN_RECEIVED:
+            TCP_DEADLINE(sock->data.timer + TCP_DEFAULT_RTTO);
+            break;
+
+        case TCP_STATE_TIME_WAIT:
+            TCP_DEADLINE(sock->data.timer + 2 * TCP_DEFAULT_MSL);
+            break;
+
+        case TCP_STATE_ESTABLISHED:
+        case TCP_STATE_CLOSE_WAIT:
+            if(sock->data.snd.nxt != sock->data.snd.una)
+                TCP_DEADLINE(sock->data.timer + sock->data.rto);
+            else if(sock->data.sndbuf_cur_sz &&
+                    (sock->intflags & TCP_IFLAG_PERSIST))
+                /* Waiting on the other side to open its window. */
+                TCP_DEADLINE(sock->data.timer + sock->data.rto);
+            else if(sock->data.sndbuf_cur_sz)
+                /* Held back by TCP_CORK, or we couldn't get a buffer last time
+                   around. */
+                TCP_DEADLINE((sock->intflags & TCP_IFLAG_CORK) ?
+                             sock->data.cork_timer + TCP_DEFAULT_CORK :
+                             timer_ms_gettime64() + TCP_DEFAULT_RETRY);
+            else if(sock->intflags & TCP_IFLAG_QUEUEDCLOSE)
+                TCP_DEADLINE(timer_ms_gettime64());
+
+            break;
+    }
+
+    if((sock->state == TCP_STATE_ESTABLISHED ||
+        sock->state == TCP_STATE_FIN_WAIT_1 ||
+        sock->state == TCP_STATE_FIN_WAIT_2 ||
+        sock->state == TCP_STATE_CLOSE_WAIT) && sock->data.ack_pending)
+        TCP_DEADLINE(sock->data.ack_timer + TCP_DEFAULT_DELACK);
+
+    if((sock->intflags & TCP_IFLAG_CANBEDEL) &&
+       (sock->state & 0x0F) == TCP_STATE_CLOSED)
+        TCP_DEADLINE(timer_ms_gettime64());
+
+#undef TCP_DEADLINE
+
+    return rv;
+}
+
+/* Make sure tcp_thd_cb() gets to the socket in time for whatever it is waiting
+   on next. The socket must be locked. */
+static void tcp_sched(struct tcp_sock *sock) {
+    uint64_t when = tcp_deadline(sock);
+
+    if(when && thd_cb_id > 0)
+        net_thd_schedule(thd_cb_id, when);
+}
+
 static void tcp_thd_cb(void *arg) {
     struct tcp_sock *i, *tmp;
-    uint64_t timer;
+    uint64_t timer, next = 0, t;
 
     (void)arg;
 
@@ -2891,9 +3233,29 @@ static void tcp_thd_cb(void *arg) {
             case TCP_STATE_ESTABLISHED:
             case TCP_STATE_CLOSE_WAIT:
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
+                if(i->data.snd.nxt != i->data.snd.una &&
+                        i->data.timer + i->data.rto <= timer) {
+                    tcp_send_data(i, TCP_SEND_RESEND);
+                }
+                else if(i->data.snd.nxt == i->data.snd.una &&
+                        i->data.sndbuf_cur_sz &&
+                        (i->intflags & TCP_IFLAG_PERSIST)) {
+                    /* Probe the other side's window once the persist timer
+                       runs out. */
+                    if(i->data.timer + i->data.rto <= timer)
+                        tcp_send_data(i, TCP_SEND_PROBE);
+                }
+                else if(i->data.sndbuf_cur_sz !=
+                        i->data.snd.nxt - i->data.snd.una) {
+                    /* There's data that hasn't been sent yet, either because
+                       it is being held back or because we couldn't get a
+                       buffer for it earlier. Corked data only gets held for
+                       so long before it goes out anyway. */
+                    if((i->intflags & TCP_IFLAG_CORK) &&
+                            i->data.cork_timer + TCP_DEFAULT_CORK <= timer)
+                        tcp_send_data(i, TCP_SEND_PUSH);
+                    else
+                        tcp_send_data(i, TCP_SEND_NEW);
                 }
                 else if(!i->data.sndbuf_cur_sz &&
                         (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
@@ -2910,6 +3272,17 @@ static void tcp_thd_cb(void *arg) {
 
                 break;
         }
+
+        /* Send any ACK that we've delayed for as long as we're willing to. */
+        if((i->state == TCP_STATE_ESTABLISHED ||
+            i->state == TCP_STATE_FIN_WAIT_1 ||
+            i->state == TCP_STATE_FIN_WAIT_2 ||
+            i->state == TCP_STATE_CLOSE_WAIT) && i->data.ack_pending &&
+           i->data.ack_timer + TCP_DEFAULT_DELACK <= timer)
+            tcp_send_ack(i);
+
+        if((t = tcp_deadline(i)) && (!next || t < next))
+            next = t;
     }
 
     rwsem_read_unlock(&tcp_sem);
@@ -2937,6 +3310,11 @@ static void tcp_thd_cb(void *arg) {
     }
 
     rwsem_write_unlock(&tcp_sem);
+
+    /* Sleep until the first socket needs us again, or until something happens
+       that makes one need us sooner. */
+    if(next)
+        net_thd_schedule(thd_cb_id, next);
 }
 
 /* Protocol handler for fs_socket. */
@@ -2960,11 +3338,15 @@ static fs_socket_proto_t proto = {
     net_tcp_getsockname,                /* getsockname */
     net_tcp_getpeername,                /* getpeername */
     net_tcp_fcntl,                      /* fcntl */
-    net_tcp_poll                        /* poll */
+    net_tcp_poll,                       /* poll */
+    NULL,                               /* input_pbuf */
+    NULL,                               /* recvmmsg */
+    NULL                                /* sendmmsg */
 };
 
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
+    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL,
+                                            TCP_THD_PERIOD)) < 0)
         return -1;
 
     return fs_socket_proto_add(&proto);
@@ -5,58 +5,187 @@
 
 */
 
-#include <sys/queue.h>
+/* The network thread runs callbacks for the various parts of the network
+   stack, each one at least every so often (its timeout). Callbacks are kept in
+   a min-heap ordered by when they next need to run, and the thread sleeps until
+   the first of those comes up, rather than waking up at a fixed interval to
+   check on all of them. Callbacks can also ask to be run sooner than their
+   timeout would have them run with net_thd_schedule(), which wakes the thread
+   up early if need be. */
+
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <kos/thread.h>
+#include <kos/genwait.h>
+#include <arch/irq.h>
 #include <arch/timer.h>
 #include "net_thd.h"
 
 struct thd_cb {
-    TAILQ_ENTRY(thd_cb) thds;
-
     int cbid;
     void (*cb)(void *);
     void *data;
     uint64_t timeout;
     uint64_t nextrun;
+
+    /* Earliest time requested through net_thd_schedule() while the callback
+       was running, if any. */
+    uint64_t deadline;
+
+    /* Set if the callback gets deleted while it is running. */
+    int dead;
 };
 
-TAILQ_HEAD(thd_cb_queue, thd_cb);
+/* The heap itself, protected by disabling interrupts. */
+static struct thd_cb **heap;
+static int heap_cnt, heap_size;
+
+/* The callback that is running right now, if any. */
+static struct thd_cb *running;
+
+/* When the thread is going to wake up on its own if it is sleeping, otherwise
+   zero. */
+static uint64_t sleep_until;
 
-static struct thd_cb_queue cbs;
 static kthread_t *thd;
-static int done = 0;
+static volatile int done = 0;
 static int cbid_top;
 
+static void heap_swap(int a, int b) {
+    struct thd_cb *tmp = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = tmp;
+}
+
+static void heap_up(int i) {
+    int p;
+
+    while(i > 0) {
+        p = (i - 1) / 2;
+
+        if(heap[p]->nextrun <= heap[i]->nextrun)
+            break;
+
+        heap_swap(i, p);
+        i = p;
+    }
+}
+
+static void heap_down(int i) {
+    int l, m;
+
+    for(;;) {
+        l = 2 * i + 1;
+        m = i;
+
+        if(l < heap_cnt && heap[l]->nextrun < heap[m]->nextrun)
+            m = l;
+
+        if(l + 1 < heap_cnt && heap[l + 1]->nextrun < heap[m]->nextrun)
+            m = l + 1;
+
+        if(m == i)
+            break;
+
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void heap_remove(int i) {
+    heap[i] = heap[--heap_cnt];
+
+    if(i < heap_cnt) {
+        heap_down(i);
+        heap_up(i);
+    }
+}
+
+/* Insert a callback, waking the thread if it now needs to run sooner than it
+   planned to. Must be called with interrupts disabled. */
+static void heap_insert(struct thd_cb *cb) {
+    heap[heap_cnt] = cb;
+    heap_up(heap_cnt++);
+
+    if(sleep_until && cb->nextrun < sleep_until)
+        genwait_wake_one(&heap);
+}
+
+static int heap_find(int cbid) {
+    int i;
+
+    for(i = 0; i < heap_cnt; ++i) {
+        if(heap[i]->cbid == cbid)
+            return i;
+    }
+
+    return -1;
+}
+
 static void *net_thd_thd(void *data) {
     struct thd_cb *cb;
-    uint64_t now;
+    irq_mask_t old;
+    uint64_t now, wait;
 
     (void)data;
 
     while(!done) {
+        old = irq_disable();
         now = timer_ms_gettime64();
 
-        /* Run any callbacks that need to be run now. */
-        TAILQ_FOREACH(cb, &cbs, thds) {
-            if(now >= cb->nextrun) {
-                cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
-            }
+        /* Sleep until the first callback is due, or until something changes
+           that means we need to get up sooner. */
+        if(!heap_cnt || heap[0]->nextrun > now) {
+            sleep_until = heap_cnt ? heap[0]->nextrun : UINT64_MAX;
+            wait = heap_cnt ? heap[0]->nextrun - now : 0;
+
+            if(wait > INT_MAX)
+                wait = INT_MAX;
+
+            genwait_wait(&heap, "net_thd_thd", (int)wait, NULL);
+            sleep_until = 0;
+            irq_restore(old);
+            continue;
         }
 
-        /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
+        cb = heap[0];
+        heap_remove(0);
+        running = cb;
+        irq_restore(old);
+
+        cb->cb(cb->data);
+
+        old = irq_disable();
+        running = NULL;
+
+        if(!cb->dead) {
+            cb->nextrun = timer_ms_gettime64() + cb->timeout;
+
+            if(cb->deadline && cb->deadline < cb->nextrun)
+                cb->nextrun = cb->deadline;
+
+            cb->deadline = 0;
+            heap_insert(cb);
+        }
+
+        irq_restore(old);
+
+        if(cb->dead)
+            free(cb);
     }
 
     return NULL;
 }
 
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
-    struct thd_cb *newcb;
+    struct thd_cb *newcb, **newheap = NULL, **oldheap;
+    irq_mask_t old;
+    int size;
 
     /* Allocate space for the new callback and set it up. */
     newcb = (struct thd_cb *)malloc(sizeof(struct thd_cb));
@@ -66,40 +195,110 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout) {
         return -1;
     }
 
-    newcb->cbid = cbid_top++;
     newcb->cb = cb;
     newcb->data = data;
     newcb->timeout = timeout;
     newcb->nextrun = timer_ms_gettime64() + timeout;
+    newcb->deadline = 0;
+    newcb->dead = 0;
 
-    /* Disable interrupts, insert, and re-enable interrupts */
-    irq_disable_scoped();
+    old = irq_disable();
+
+    /* Make sure there's room in the heap for it, counting the running
+       callback, which goes back in once it's done. A bigger heap can't be
+       allocated with interrupts disabled, and someone else may have added a
+       callback in the meantime, so check again once we have it. */
+    while(heap_cnt + 1 + (running != NULL) > heap_size) {
+        size = heap_size ? heap_size * 2 : 8;
+        irq_restore(old);
+
+        free(newheap);
+
+        if(!(newheap = (struct thd_cb **)malloc(size * sizeof(*newheap)))) {
+            free(newcb);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        old = irq_disable();
+
+        if(size <= heap_size)
+            continue;
+
+        if(heap_cnt)
+            memcpy(newheap, heap, heap_cnt * sizeof(*newheap));
+
+        oldheap = heap;
+        heap = newheap;
+        heap_size = size;
+        newheap = oldheap;
+    }
+
+    newcb->cbid = cbid_top++;
+    heap_insert(newcb);
+
+    irq_restore(old);
 
-    TAILQ_INSERT_TAIL(&cbs, newcb, thds);
+    /* Whatever heap we ended up not using, old or new. */
+    free(newheap);
 
     return newcb->cbid;
 }
 
 int net_thd_del_callback(int cbid) {
     struct thd_cb *cb;
+    int i;
 
     /* Disable interrupts so we can search without fear of anything changing
        underneath us. */
     irq_disable_scoped();
 
     /* See if we can find the callback requested. */
-    TAILQ_FOREACH(cb, &cbs, thds) {
-        if(cb->cbid == cbid) {
-            TAILQ_REMOVE(&cbs, cb, thds);
-            free(cb);
-            return 0;
-        }
+    if((i = heap_find(cbid)) >= 0) {
+        cb = heap[i];
+        heap_remove(i);
+        free(cb);
+        return 0;
+    }
+
+    /* If it is running right now, the thread cleans it up when it's done. */
+    if(running && running->cbid == cbid && !running->dead) {
+        running->dead = 1;
+        return 0;
     }
 
     /* We didn't find it, punt. */
     return -1;
 }
 
+int net_thd_schedule(int cbid, uint64_t when) {
+    int i;
+
+    irq_disable_scoped();
+
+    /* If the callback is running, this takes effect once it's done. */
+    if(running && running->cbid == cbid) {
+        if(!running->deadline || when < running->deadline)
+            running->deadline = when;
+
+        return 0;
+    }
+
+    if((i = heap_find(cbid)) < 0)
+        return -1;
+
+    /* Only ever move the callback up, never back. */
+    if(when < heap[i]->nextrun) {
+        heap[i]->nextrun = when;
+        heap_up(i);
+
+        if(sleep_until && when < sleep_until)
+            genwait_wake_one(&heap);
+    }
+
+    return 0;
+}
+
 int net_thd_is_current(void) {
     return thd_current == thd;
 }
@@ -109,6 +308,7 @@ void net_thd_kill(void) {
     done = 1;
 
     if(!irq_inside_int()) {
+        genwait_wake_one(&heap);
         thd_join(thd, NULL);
     }
     else {
@@ -119,7 +319,9 @@ void net_thd_kill(void) {
 }
 
 int net_thd_init(void) {
-    TAILQ_INIT(&cbs);
+    heap_cnt = 0;
+    running = NULL;
+    sleep_until = 0;
     done = 0;
     cbid_top = 1;
 
@@ -129,7 +331,7 @@ int net_thd_init(void) {
 }
 
 void net_thd_shutdown(void) {
-    struct thd_cb *c, *n;
+    int i;
 
     /* Kill the thread. */
     if(thd) {
@@ -137,13 +339,10 @@ void net_thd_shutdown(void) {
     }
 
     /* Free any handlers that we have laying around */
-    c = TAILQ_FIRST(&cbs);
-
-    while(c) {
-        n = TAILQ_NEXT(c, thds);
-        free(c);
-        c = n;
-    }
+    for(i = 0; i < heap_cnt; ++i)
+        free(heap[i]);
 
-    TAILQ_INIT(&cbs);
+    free(heap);
+    heap = NULL;
+    heap_cnt = heap_size = 0;
 }
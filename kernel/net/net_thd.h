@@ -16,6 +16,10 @@ __BEGIN_DECLS
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64_t timeout);
 int net_thd_del_callback(int cbid);
 
+/* Run the given callback no later than when (in ms since boot), even if that
+   is sooner than its timeout would have it run. */
+int net_thd_schedule(int cbid, uint64_t when);
+
 int net_thd_is_current(void);
 
 void net_thd_kill(void);
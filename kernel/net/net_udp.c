@@ -18,12 +18,15 @@
 #include <sys/queue.h>
 #include <kos/fs_socket.h>
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <sys/socket.h>
 #include <netinet/udp.h>
 #include <netinet/udplite.h>
 
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_loopback.h"
+#include "net_thd.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -33,6 +36,11 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Receive buffer size for new sockets, and the range SO_RCVBUF can set it to */
+#define UDP_DEFAULT_RCVBUF  16384
+#define UDP_MIN_RCVBUF      256
+#define UDP_MAX_RCVBUF      262144
+
 typedef struct {
     uint16_t src_port __packed;
     uint16_t dst_port __packed;
@@ -40,14 +48,29 @@ typedef struct {
     uint16_t checksum __packed;
 } udp_hdr_t;
 
-struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
-    struct sockaddr_in6 from;
-    uint8_t *data;
+/* Received datagrams are stored back to back in a ring buffer owned by the
+   socket, each one behind one of these. A record is never split across the end
+   of the ring: if one doesn't fit there, a zero length is written in its place
+   and the record goes at the start of the ring instead. */
+struct udp_rec {
+    uint32_t len;               /* Bytes taken in the ring, 0 for a wrap */
     uint16_t datasize;
+    uint16_t port;
+    struct in6_addr addr;
 };
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+/* Bytes of the ring taken by a datagram of the given size, keeping the records
+   that follow it aligned. */
+#define UDP_REC_LEN(size) \
+    ((sizeof(struct udp_rec) + (size) + 3) & ~(size_t)3)
+
+struct udp_ring {
+    uint8_t *buf;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t used;
+};
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
@@ -64,12 +87,15 @@ struct udp_sock {
     int hop_limit;
     file_t sock;
 
+    /* Network thread callback to run when a datagram arrives, if not zero. */
+    int thd_cbid;
+
     struct {
         uint16_t send_cscov;
         uint16_t recv_cscov;
     } udp_lite;
 
-    struct udp_pkt_queue packets;
+    struct udp_ring rcv;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -79,9 +105,10 @@ static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov);
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov);
 
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
@@ -305,11 +332,213 @@ static int net_udp_listen(net_socket_t *hnd, int backlog) {
     return -1;
 }
 
+/* Add the sum of a piece of a datagram that starts at the given offset into
+   it to a running sum. Pieces at odd offsets have their sums byte swapped. */
+static inline uint16_t udp_cksum_add(uint16_t sum, uint16_t piece, size_t off) {
+    if(off & 1)
+        piece = (piece << 8) | (piece >> 8);
+
+    return ~net_ipv4_checksum((const uint8_t *)&piece, 2, sum);
+}
+
+/* Copy a datagram into the tail of a ring, checking its checksum on the way if
+   verify is set (starting with cs as the sum). If the ring doesn't have room
+   for it, it is dropped, so that a socket nobody is reading from can't eat up
+   all of memory. This is called from the receive path, so it must not allocate
+   anything. */
+static int udp_ring_put(struct udp_ring *r, const struct in6_addr *addr,
+                        uint16_t port, const uint8_t *data, size_t size,
+                        int verify, uint16_t cs) {
+    size_t len = UDP_REC_LEN(size), tail, skip = 0, avail;
+    struct udp_rec *rec;
+
+    if(!r->used)
+        r->head = r->tail = 0;
+
+    tail = r->tail;
+
+    if(r->used == r->size)
+        avail = 0;
+    else if(tail < r->head)
+        avail = r->head - tail;
+    else if(len <= r->size - tail)
+        avail = r->size - tail;
+    else {
+        /* Doesn't fit before the end, try again from the start. */
+        skip = r->size - tail;
+        tail = 0;
+        avail = r->head;
+    }
+
+    if(len > avail) {
+        ++udp_stats.pkt_recv_dropped;
+        return -1;
+    }
+
+    rec = (struct udp_rec *)(r->buf + tail);
+
+    if(!verify)
+        memcpy(rec + 1, data, size);
+    else if(net_ipv4_checksum_copy((uint8_t *)(rec + 1), data, size, cs)) {
+        ++udp_stats.pkt_recv_bad_chksum;
+        return -1;
+    }
+
+    rec->len = len;
+    rec->datasize = size;
+    rec->port = port;
+    rec->addr = *addr;
+
+    if(skip)
+        ((struct udp_rec *)(r->buf + r->tail))->len = 0;
+
+    r->tail = tail + len;
+    r->used += skip + len;
+
+    if(r->tail == r->size)
+        r->tail = 0;
+
+    return 0;
+}
+
+/* Get the oldest datagram in a ring, or NULL if it is empty. */
+static struct udp_rec *udp_ring_peek(struct udp_ring *r) {
+    struct udp_rec *rec;
+
+    if(!r->used)
+        return NULL;
+
+    rec = (struct udp_rec *)(r->buf + r->head);
+
+    /* Skip over the space left at the end when the ring wrapped. */
+    if(!rec->len) {
+        r->used -= r->size - r->head;
+        r->head = 0;
+        rec = (struct udp_rec *)r->buf;
+    }
+
+    return rec;
+}
+
+/* Remove the datagram udp_ring_peek() returned from the ring. */
+static void udp_ring_pop(struct udp_ring *r, const struct udp_rec *rec) {
+    r->head += rec->len;
+    r->used -= rec->len;
+
+    if(r->head == r->size)
+        r->head = 0;
+}
+
+/* Give a socket a new receive ring, moving over as many of the datagrams that
+   are waiting in the old one as will fit. */
+static void udp_ring_resize(struct udp_ring *r, uint8_t *buf, size_t size) {
+    struct udp_ring old = *r;
+    struct udp_rec *rec;
+
+    r->buf = buf;
+    r->size = size;
+    r->head = r->tail = r->used = 0;
+
+    while((rec = udp_ring_peek(&old))) {
+        udp_ring_put(r, &rec->addr, rec->port, (const uint8_t *)(rec + 1),
+                     rec->datasize, 0, 0);
+        udp_ring_pop(&old, rec);
+    }
+
+    free(old.buf);
+}
+
+/* Copy a queued datagram out to the user's I/O vectors. */
+static size_t udp_copy_out(const struct udp_rec *rec, const struct iovec *iov,
+                           int iovcnt) {
+    const uint8_t *data = (const uint8_t *)(rec + 1);
+    size_t off = 0, n;
+    int i;
+
+    for(i = 0; i < iovcnt && off < rec->datasize; ++i) {
+        n = iov[i].iov_len;
+
+        if(n > rec->datasize - off)
+            n = rec->datasize - off;
+
+        memcpy(iov[i].iov_base, data + off, n);
+        off += n;
+    }
+
+    return off;
+}
+
+/* Fill in the address a datagram came from for the user. */
+static void udp_fill_addr(const struct udp_sock *udpsock,
+                          const struct udp_rec *rec, struct sockaddr *addr,
+                          socklen_t *addr_len) {
+    if(udpsock->domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = rec->addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = rec->port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(udpsock->domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = rec->addr;
+        realaddr6.sin6_port = rec->port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
+/* Pull the oldest datagram off of the socket's ring into the message. This
+   must be called with the udp_mutex held. Returns -1 if the ring is empty. */
+static ssize_t udp_dequeue(struct udp_sock *udpsock, struct msghdr *msg,
+                           int flags) {
+    struct udp_rec *rec;
+    size_t rv;
+
+    if(!(rec = udp_ring_peek(&udpsock->rcv)))
+        return -1;
+
+    rv = udp_copy_out(rec, msg->msg_iov, msg->msg_iovlen);
+
+    msg->msg_flags = rv < rec->datasize ? MSG_TRUNC : 0;
+    msg->msg_controllen = 0;
+
+    if(msg->msg_name != NULL)
+        udp_fill_addr(udpsock, rec, (struct sockaddr *)msg->msg_name,
+                      &msg->msg_namelen);
+
+    /* Remove the datagram if we're pulling data out of the queue. */
+    if(!(flags & MSG_PEEK))
+        udp_ring_pop(&udpsock->rcv, rec);
+
+    return (ssize_t)rv;
+}
+
 static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
                                 int flags, struct sockaddr *addr,
                                 socklen_t *addr_len) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
+    struct iovec iov = { buffer, length };
+    struct msghdr msg;
+    ssize_t rv;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return -1;
@@ -333,7 +562,16 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(addr != NULL) {
+        msg.msg_name = addr;
+        msg.msg_namelen = *addr_len;
+    }
+
+    if(!udpsock->rcv.used &&
        ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
         irq_inside_int())) {
         mutex_unlock(&udp_mutex);
@@ -341,80 +579,182 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
+    while(!udpsock->rcv.used) {
         mutex_unlock(&udp_mutex);
         genwait_wait(udpsock, "net_udp_recvfrom", 0, NULL);
         mutex_lock(&udp_mutex);
     }
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+    rv = udp_dequeue(udpsock, &msg, flags);
+
+    if(addr != NULL)
+        *addr_len = msg.msg_namelen;
 
-    if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
+    mutex_unlock(&udp_mutex);
+
+    return rv;
+}
+
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags,
+                            struct timespec *timeout) {
+    struct udp_sock *udpsock;
+    unsigned int cnt = 0;
+    uint64_t now, deadline = 0;
+    int nonblock, wait = 0;
+    ssize_t rv;
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
     }
-    else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
+
+    if(udpsock->flags & (SHUT_RD << 24)) {
+        mutex_unlock(&udp_mutex);
+        return 0;
     }
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
+    nonblock = (udpsock->flags & FS_SOCKET_NONBLOCK) ||
+               (flags & MSG_DONTWAIT) || irq_inside_int();
 
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+    if(timeout)
+        deadline = timer_ms_gettime64() + timeout->tv_sec * 1000 +
+                   timeout->tv_nsec / 1000000;
 
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
+    /* Pull as many datagrams as we can off of the queue while we've got the
+       lock, only giving it up if we have to wait for more to come in. */
+    while(cnt < vlen) {
+        if(!udpsock->rcv.used) {
+            if(nonblock || (cnt && (flags & MSG_WAITFORONE)))
+                break;
+
+            if(timeout) {
+                if((now = timer_ms_gettime64()) >= deadline)
+                    break;
+
+                wait = (int)(deadline - now);
             }
+
+            mutex_unlock(&udp_mutex);
+            genwait_wait(udpsock, "net_udp_recvmmsg", wait, NULL);
+            mutex_lock(&udp_mutex);
+            continue;
         }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
 
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+        if((rv = udp_dequeue(udpsock, &msgvec[cnt].msg_hdr, flags)) < 0)
+            continue;
 
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
-            }
+        msgvec[cnt++].msg_len = rv;
+
+        /* Peeking would just give us the same datagram over again. */
+        if(flags & MSG_PEEK)
+            break;
+    }
+
+    mutex_unlock(&udp_mutex);
+
+    if(!cnt) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    return cnt;
+}
+
+/* Work out where a datagram is going, given the socket's domain and the
+   address it is connected to (if any). */
+static int udp_get_dst(int domain, const struct sockaddr_in6 *remote,
+                       const struct sockaddr *addr, socklen_t addr_len,
+                       struct sockaddr_in6 *dst) {
+    const struct sockaddr_in *realaddr;
+
+    if(!IN6_IS_ADDR_UNSPECIFIED(&remote->sin6_addr) &&
+       remote->sin6_port != 0) {
+        if(addr) {
+            errno = EISCONN;
+            return -1;
         }
+
+        *dst = *remote;
+    }
+    else if(addr == NULL) {
+        errno = EDESTADDRREQ;
+        return -1;
     }
+    else if(addr->sa_family != domain) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    else if(domain == AF_INET6) {
+        if(addr_len != sizeof(struct sockaddr_in6)) {
+            errno = EINVAL;
+            return -1;
+        }
 
-    /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+        *dst = *((const struct sockaddr_in6 *)addr);
     }
+    else if(domain == AF_INET) {
+        if(addr_len != sizeof(struct sockaddr_in)) {
+            errno = EINVAL;
+            return -1;
+        }
 
-    mutex_unlock(&udp_mutex);
+        realaddr = (const struct sockaddr_in *)addr;
+        memset(dst, 0, sizeof(struct sockaddr_in6));
+        dst->sin6_family = AF_INET6;
+        dst->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        dst->sin6_addr.__s6_addr.__s6_addr32[3] = realaddr->sin_addr.s_addr;
+        dst->sin6_port = realaddr->sin_port;
+    }
+    else {
+        /* Shouldn't be able to get here... */
+        errno = EBADF;
+        return -1;
+    }
 
-    return length;
+    return 0;
+}
+
+/* Bind the socket to an ephemeral port if it hasn't been bound yet. This must
+   be called with the udp_mutex held. */
+static void udp_bind_ephemeral(struct udp_sock *udpsock) {
+    uint16_t port = 1024, tmp = 0;
+    struct udp_sock *iter;
+
+    if(udpsock->local_addr.sin6_port != 0)
+        return;
+
+    /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
+    while(tmp != port) {
+        tmp = port;
+
+        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
+            if(iter->local_addr.sin6_port == port) {
+                ++port;
+                break;
+            }
+        }
+    }
+
+    udpsock->local_addr.sin6_port = htons(port);
 }
 
 static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
                               size_t length, int flags,
                               const struct sockaddr *addr, socklen_t addr_len) {
     struct udp_sock *udpsock;
-    struct sockaddr_in *realaddr;
     struct sockaddr_in6 realaddr6;
     uint32_t sflags, iflags;
     int hops, proto;
     uint16_t cscov;
     struct sockaddr_in6 local_addr;
+    struct iovec iov = { (void *)message, length };
 
     (void)flags;
 
@@ -433,76 +773,69 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
         goto err;
     }
 
-    if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr) &&
-       udpsock->remote_addr.sin6_port != 0) {
-        if(addr) {
-            errno = EISCONN;
-            goto err;
-        }
-
-        realaddr6 = udpsock->remote_addr;
-    }
-    else if(addr == NULL) {
-        errno = EDESTADDRREQ;
-        goto err;
-    }
-    else if(addr->sa_family != udpsock->domain) {
-        errno = EAFNOSUPPORT;
-        goto err;
-    }
-    else if(udpsock->domain == AF_INET6) {
-        if(addr_len != sizeof(struct sockaddr_in6)) {
-            errno = EINVAL;
-            goto err;
-        }
-
-        realaddr6 = *((struct sockaddr_in6 *)addr);
-    }
-    else if(udpsock->domain == AF_INET) {
-        if(addr_len != sizeof(struct sockaddr_in)) {
-            errno = EINVAL;
-            goto err;
-        }
-
-        realaddr = (struct sockaddr_in *)addr;
-        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-        realaddr6.sin6_family = AF_INET6;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr32[3] =
-            realaddr->sin_addr.s_addr;
-        realaddr6.sin6_port = realaddr->sin_port;
-    }
-    else {
-        /* Shouldn't be able to get here... */
-        errno = EBADF;
+    if(udp_get_dst(udpsock->domain, &udpsock->remote_addr, addr, addr_len,
+                   &realaddr6))
         goto err;
-    }
 
     if(message == NULL) {
         errno = EFAULT;
         goto err;
     }
 
-    if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
+    udp_bind_ephemeral(udpsock);
 
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
+    local_addr = udpsock->local_addr;
+    sflags = udpsock->flags;
+    iflags = udpsock->int_flags;
+    hops = udpsock->hop_limit;
+    proto = udpsock->proto;
+    cscov = udpsock->udp_lite.send_cscov;
+    mutex_unlock(&udp_mutex);
 
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
+    return net_udp_send_raw(NULL, &local_addr, &realaddr6, &iov, 1, length,
+                            sflags, hops, iflags, proto, cscov);
+err:
+    mutex_unlock(&udp_mutex);
+    return -1;
+}
 
-        udpsock->local_addr.sin6_port = htons(port);
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
+    struct udp_sock *udpsock;
+    struct sockaddr_in6 realaddr6, local_addr, remote_addr;
+    uint32_t sflags, iflags;
+    int domain, hops, proto, i;
+    uint16_t cscov;
+    unsigned int cnt;
+    struct msghdr *msg;
+    size_t size;
+    ssize_t rv;
+
+    (void)flags;
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
     }
 
+    if(udpsock->flags & (SHUT_WR << 24)) {
+        mutex_unlock(&udp_mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    /* Grab everything we need from the socket once for the whole batch. */
+    udp_bind_ephemeral(udpsock);
+
     local_addr = udpsock->local_addr;
+    remote_addr = udpsock->remote_addr;
+    domain = udpsock->domain;
     sflags = udpsock->flags;
     iflags = udpsock->int_flags;
     hops = udpsock->hop_limit;
@@ -510,12 +843,28 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     cscov = udpsock->udp_lite.send_cscov;
     mutex_unlock(&udp_mutex);
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8_t *)message, length, sflags, hops,
-                            iflags, proto, cscov);
-err:
-    mutex_unlock(&udp_mutex);
-    return -1;
+    for(cnt = 0; cnt < vlen; ++cnt) {
+        msg = &msgvec[cnt].msg_hdr;
+
+        if(udp_get_dst(domain, &remote_addr,
+                       (const struct sockaddr *)msg->msg_name,
+                       msg->msg_namelen, &realaddr6))
+            break;
+
+        for(i = 0, size = 0; i < msg->msg_iovlen; ++i)
+            size += msg->msg_iov[i].iov_len;
+
+        rv = net_udp_send_raw(NULL, &local_addr, &realaddr6, msg->msg_iov,
+                              msg->msg_iovlen, size, sflags, hops, iflags,
+                              proto, cscov);
+
+        if(rv < 0)
+            break;
+
+        msgvec[cnt].msg_len = rv;
+    }
+
+    return cnt ? (int)cnt : -1;
 }
 
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
@@ -547,13 +896,17 @@ static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
 
 static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     struct udp_sock *udpsock;
+    uint8_t *rbuf;
 
     (void)type;
     (void)proto;
 
     udpsock = (struct udp_sock *)malloc(sizeof(struct udp_sock));
+    rbuf = (uint8_t *)malloc(UDP_DEFAULT_RCVBUF);
 
-    if(udpsock == NULL) {
+    if(udpsock == NULL || rbuf == NULL) {
+        free(udpsock);
+        free(rbuf);
         errno = ENOMEM;
         return -1;
     }
@@ -563,18 +916,21 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     }
     else if(proto != IPPROTO_UDP && proto != IPPROTO_UDPLITE) {
         free(udpsock);
+        free(rbuf);
         errno = EPROTONOSUPPORT;
         return -1;
     }
 
     memset(udpsock, 0, sizeof(struct udp_sock));
-    TAILQ_INIT(&udpsock->packets);
+    udpsock->rcv.buf = rbuf;
+    udpsock->rcv.size = UDP_DEFAULT_RCVBUF;
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
 
     if(mutex_lock_irqsafe(&udp_mutex)) {
         free(udpsock);
+        free(rbuf);
         return -1;
     }
 
@@ -587,8 +943,6 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-    struct udp_pkt *it;
 
     if(mutex_lock_irqsafe(&udp_mutex))
         return;
@@ -601,18 +955,9 @@ static void net_udp_close(net_socket_t *hnd) {
         return;
     }
 
-    it = udpsock->packets.tqh_first;
-    while(it) {
-        pkt = it;
-        it = it->pkt_queue.tqe_next;
-
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
-    }
-
     LIST_REMOVE(udpsock, sock_list);
 
+    free(udpsock->rcv.buf);
     free(udpsock);
     mutex_unlock(&udp_mutex);
 }
@@ -641,6 +986,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
+
+                case SO_RCVBUF:
+                    tmp = sock->rcv.size;
+                    goto copy_int;
             }
 
             break;
@@ -734,6 +1083,7 @@ copy_int:
 static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                               const void *option_value, socklen_t option_len) {
     struct udp_sock *sock;
+    uint8_t *rbuf;
     int tmp;
 
     if(mutex_lock_irqsafe(&udp_mutex))
@@ -752,6 +1102,29 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    /* Keep the records in the ring aligned. */
+                    tmp = (tmp + 3) & ~3;
+
+                    if(!(rbuf = (uint8_t *)malloc(tmp))) {
+                        mutex_unlock(&udp_mutex);
+                        errno = ENOMEM;
+                        return -1;
+                    }
+
+                    udp_ring_resize(&sock->rcv, rbuf, tmp);
+                    goto ret_success;
             }
 
             break;
@@ -1091,7 +1464,7 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
         return POLLNVAL;
     }
 
-    if(!TAILQ_EMPTY(&sock->packets))
+    if(sock->rcv.used)
         rv |= POLLRDNORM;
 
     mutex_unlock(&udp_mutex);
@@ -1102,14 +1475,15 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
 extern void __poll_event_trigger(int fd, short event);
 
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
-                          size_t size) {
+                          size_t size, net_pbuf_t *pb) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, defer = 0;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct in6_addr from;
 
     (void)src;
+    (void)pb;
 
     if(size <= sizeof(udp_hdr_t)) {
         /* Discard the packet, since it is too short to be of any interest. */
@@ -1125,13 +1499,10 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         if(hdr->checksum != 0) {
             cs = net_ipv4_checksum_pseudo(ip->src, ip->dest, IPPROTO_UDP, size);
 
-            /* If the checksum is right, we'll get zero back from the checksum
-               function */
-            if(net_ipv4_checksum(data, size, cs)) {
-                /* The checksum was wrong, bail out */
-                ++udp_stats.pkt_recv_bad_chksum;
-                return -1;
-            }
+            /* Only sum up the header for now. The data gets checked when it is
+               copied into the socket's ring. */
+            cs = ~net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+            defer = 1;
         }
     }
     else {
@@ -1202,33 +1573,26 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
+        memset(&from, 0, sizeof(struct in6_addr));
+        from.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        from.__s6_addr.__s6_addr32[3] = ip->src;
 
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
+        /* Copy the datagram into the socket's ring, checking the checksum
+           while we're at it so that the data only gets read once. */
+        if(udp_ring_put(&sock->rcv, &from, hdr->src_port,
+                        data + sizeof(udp_hdr_t), size - sizeof(udp_hdr_t),
+                        defer, cs)) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
+
+        if(sock->thd_cbid)
+            net_thd_schedule(sock->thd_cbid, 0);
+
         mutex_unlock(&udp_mutex);
 
         return 0;
@@ -1241,14 +1605,14 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
 }
 
 static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *data,
-                          size_t size) {
+                          size_t size, net_pbuf_t *pb) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
-    uint16_t cs, cscov = 0;
-    int partial = 1;
+    uint16_t cs = 0, cscov = 0;
+    int partial = 1, defer = 0;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
 
     (void)src;
+    (void)pb;
 
     if(size <= sizeof(udp_hdr_t)) {
         /* Discard the packet, since it is too short to be of any interest. */
@@ -1262,13 +1626,10 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         cs = net_ipv6_checksum_pseudo(&ip->src_addr, &ip->dst_addr, size,
                                       IPPROTO_UDP);
 
-        /* If the checksum is right, we'll get zero back from the checksum
-           function. */
-        if(net_ipv4_checksum(data, size, cs)) {
-            /* The checksum was wrong, bail out */
-            ++udp_stats.pkt_recv_bad_chksum;
-            return -1;
-        }
+        /* Only sum up the header for now. The data gets checked when it is
+           copied into the socket's ring. */
+        cs = ~net_ipv4_checksum(data, sizeof(udp_hdr_t), cs);
+        defer = 1;
     }
     else {
         cscov = ntohs(hdr->length);
@@ -1339,32 +1700,22 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
+        /* Copy the datagram into the socket's ring, checking the checksum
+           while we're at it so that the data only gets read once. */
+        if(udp_ring_put(&sock->rcv, &ip->src_addr, hdr->src_port,
+                        data + sizeof(udp_hdr_t), size - sizeof(udp_hdr_t),
+                        defer, cs)) {
             mutex_unlock(&udp_mutex);
             return -1;
         }
 
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr = ip->src_addr;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
         ++udp_stats.pkt_recv;
         __poll_event_trigger(sock->sock, POLLRDNORM);
         genwait_wake_one(sock);
+
+        if(sock->thd_cbid)
+            net_thd_schedule(sock->thd_cbid, 0);
+
         mutex_unlock(&udp_mutex);
 
         return 0;
@@ -1376,40 +1727,49 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
     return -1;
 }
 
-static int net_udp_input(netif_t *src, int domain, const void *hdr,
-                         const uint8_t *data, size_t size) {
+static int net_udp_input_pbuf(netif_t *src, int domain, const void *hdr,
+                              const uint8_t *data, size_t size,
+                              net_pbuf_t *pb) {
     switch(domain) {
         case AF_INET:
-            return net_udp_input4(src, (const ip_hdr_t *)hdr, data, size);
+            return net_udp_input4(src, (const ip_hdr_t *)hdr, data, size, pb);
 
         case AF_INET6:
-            return net_udp_input6(src, (const ipv6_hdr_t *)hdr, data, size);
+            return net_udp_input6(src, (const ipv6_hdr_t *)hdr, data, size, pb);
     }
 
     return -1;
 }
 
+static int net_udp_input(netif_t *src, int domain, const void *hdr,
+                         const uint8_t *data, size_t size) {
+    return net_udp_input_pbuf(src, domain, hdr, data, size, NULL);
+}
+
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8_t *data,
-                            size_t size, uint32_t flags, int hops,
-                            uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+                            const struct sockaddr_in6 *dst,
+                            const struct iovec *iov, int iovcnt, size_t size,
+                            uint32_t flags, int hops, uint32_t iflags,
+                            int proto, uint16_t cscov) {
+    net_pbuf_t *pkt;
+    udp_hdr_t *hdr;
     uint16_t cs;
-    int err;
+    int err, i;
+    size_t off, n;
+    uint8_t *buf;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
 
-    if(!net) {
-        net = net_default_dev;
+    /* Loopback destinations go out on the loopback device, which also makes
+       sure that we pick a loopback source address for them below. */
+    net = net_lo_route6(net, &dst->sin6_addr);
 
-        if(!net) {
-            errno = ENETDOWN;
-            ++udp_stats.pkt_send_failed;
-            return -1;
-        }
+    if(!net) {
+        errno = ENETDOWN;
+        ++udp_stats.pkt_send_failed;
+        return -1;
     }
 
     if(IN6_IS_ADDR_UNSPECIFIED(&src->sin6_addr)) {
@@ -1438,39 +1798,69 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
-    size += sizeof(udp_hdr_t);
+    /* Build the datagram in a packet buffer with room in front of it for the
+       lower-level headers, so this is the only copy made of the data. */
+    if(!(pkt = net_pbuf_alloc(NET_PBUF_HEADROOM, size + sizeof(udp_hdr_t)))) {
+        errno = ENOMEM;
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
 
+    hdr = (udp_hdr_t *)pkt->data;
     hdr->src_port = src->sin6_port;
     hdr->dst_port = dst->sin6_port;
     hdr->checksum = 0;
 
     /* Is this UDP or UDP-Lite? */
     if(proto == IPPROTO_UDP) {
-        hdr->length = htons(size);
-
-        if(!(iflags & UDPSOCK_NO_CHECKSUM)) {
-            cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size,
-                                          proto);
-            hdr->checksum = net_ipv4_checksum(buf, size, cs);
-        }
+        hdr->length = htons(size + sizeof(udp_hdr_t));
     }
     else {
-        if(cscov <= size) {
+        if(cscov <= size + sizeof(udp_hdr_t)) {
             hdr->length = htons(cscov);
         }
         else {
             hdr->length = 0;
-            cscov = size;
+            cscov = size + sizeof(udp_hdr_t);
+        }
+    }
+
+    /* Gather the data in, checksumming it on the way if we need to. */
+    buf = pkt->data + sizeof(udp_hdr_t);
+
+    if(proto == IPPROTO_UDP && (iflags & UDPSOCK_NO_CHECKSUM)) {
+        for(i = 0, off = 0; i < iovcnt; ++i) {
+            memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+    }
+    else {
+        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr,
+                                      size + sizeof(udp_hdr_t), proto);
+        cs = ~net_ipv4_checksum(pkt->data, sizeof(udp_hdr_t), cs);
+
+        for(i = 0, off = 0; i < iovcnt; ++i) {
+            n = iov[i].iov_len;
+
+            if(!(off & 1))
+                cs = ~net_ipv4_checksum_copy(buf + off, iov[i].iov_base, n,
+                                             cs);
+            else
+                cs = udp_cksum_add(cs, ~net_ipv4_checksum_copy(buf + off,
+                                                               iov[i].iov_base,
+                                                               n, 0), off);
+
+            off += n;
         }
 
-        cs = net_ipv6_checksum_pseudo(&srcaddr, &dst->sin6_addr, size, proto);
-        hdr->checksum = net_ipv4_checksum(buf, size, cs);
+        hdr->checksum = ~cs;
     }
 
+    size += sizeof(udp_hdr_t);
+
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, proto, &srcaddr,
-                        &dst->sin6_addr);
+    err = net_ipv6_send_pbuf(net, pkt, hops, proto, &srcaddr, &dst->sin6_addr);
+    net_pbuf_free(pkt);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
@@ -1507,7 +1897,10 @@ static fs_socket_proto_t proto = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_input_pbuf,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1530,9 +1923,36 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockname,
     net_udp_getpeername,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_input_pbuf,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
+int net_udp_set_thd_cb(int sock, int cbid) {
+    net_socket_t *hnd = (net_socket_t *)fs_get_handle(sock);
+    struct udp_sock *udpsock;
+
+    if(!hnd || (hnd->protocol != &proto && hnd->protocol != &proto_lite)) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(mutex_lock_irqsafe(&udp_mutex))
+        return -1;
+
+    if(!(udpsock = (struct udp_sock *)hnd->data)) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    udpsock->thd_cbid = cbid;
+    mutex_unlock(&udp_mutex);
+
+    return 0;
+}
+
 int net_udp_init(void) {
     return fs_socket_proto_add(&proto) | fs_socket_proto_add(&proto_lite);
 }
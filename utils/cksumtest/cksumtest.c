@@ -0,0 +1,210 @@
+/* KallistiOS ##version##
+
+   cksumtest.c
+
+   Test the network stack's Internet checksum and CRC routines. This builds
+   the real net_checksum.c and net_crc.c on a PC and checks them against plain
+   byte at a time versions: net_ipv4_checksum(), net_crc32le() and
+   net_crc16ccitt() at every offset into a word and every length up to past a
+   full ethernet frame, and net_ipv4_checksum_copy() with the source and the
+   destination at every offset. The slicing-by-4 tables are checked against
+   the polynomials they're built from.
+
+   The SH-4 assembly in net_checksum.c isn't built here; the network/checksum
+   example does the same checks on a Dreamcast.
+
+   Run it from this directory with "make run". It prints anything that doesn't
+   match, and exits with a non-zero status if there was any.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip <kos/net.h>, which the code only needs for these. */
+#define __KOS_NET_H
+#define __pure      __attribute__((pure))
+
+uint16_t __pure net_ipv4_checksum(const uint8_t *data, size_t bytes,
+                                  uint16_t start);
+uint16_t net_ipv4_checksum_copy(uint8_t *dst, const uint8_t *src, size_t bytes,
+                                uint16_t start);
+uint32_t __pure net_crc32le(const uint8_t *data, int size);
+uint32_t __pure net_crc32be(const uint8_t *data, int size);
+uint16_t __pure net_crc16ccitt(const uint8_t *data, int size, uint16_t start);
+
+#include "../../kernel/net/net_checksum.c"
+#include "../../kernel/net/net_crc.c"
+
+/****************************** REFERENCES *********************************/
+
+static uint16_t ref_checksum(const uint8_t *data, size_t bytes,
+                             uint16_t start) {
+    uint32_t sum = start;
+    size_t i;
+
+    /* In the byte order of the data, which is little endian here. */
+    for(i = 0; i + 1 < bytes; i += 2)
+        sum += data[i] | (data[i + 1] << 8);
+
+    if(bytes & 1)
+        sum += data[bytes - 1];
+
+    while(sum >> 16)
+        sum = (sum >> 16) + (sum & 0xFFFF);
+
+    return sum ^ 0xFFFF;
+}
+
+/* One byte of CRC-32, a bit at a time, without the inversions. */
+static uint32_t ref_crc32_byte(uint32_t rv, uint8_t b) {
+    int j;
+
+    rv ^= b;
+
+    for(j = 0; j < 8; ++j)
+        rv = (rv >> 1) ^ ((rv & 1) ? 0xEDB88320 : 0);
+
+    return rv;
+}
+
+static uint32_t ref_crc32le(const uint8_t *data, int size) {
+    uint32_t rv = 0xFFFFFFFF;
+
+    while(size-- > 0)
+        rv = ref_crc32_byte(rv, *data++);
+
+    return ~rv;
+}
+
+/* Likewise for CRC16-CCITT, most significant bit first. */
+static uint16_t ref_crc16_byte(uint16_t rv, uint8_t b) {
+    int j;
+
+    rv ^= b << 8;
+
+    for(j = 0; j < 8; ++j)
+        rv = (rv << 1) ^ ((rv & 0x8000) ? 0x1021 : 0);
+
+    return rv;
+}
+
+static uint16_t ref_crc16ccitt(const uint8_t *data, int size, uint16_t start) {
+    while(size-- > 0)
+        start = ref_crc16_byte(start, *data++);
+
+    return start;
+}
+
+/****************************** TESTS **************************************/
+
+#define MAX_LEN     1600
+#define MAX_OFF     8
+
+static uint8_t buf[MAX_LEN + MAX_OFF] __attribute__((aligned(32)));
+static uint8_t dst[MAX_LEN + MAX_OFF] __attribute__((aligned(32)));
+static uint8_t dst2[MAX_LEN + MAX_OFF] __attribute__((aligned(32)));
+static int fails, checks;
+
+static void check(int ok, const char *what, int off, int doff, int len) {
+    ++checks;
+
+    if(!ok) {
+        printf("FAIL %s: offset %d/%d, length %d\n", what, off, doff, len);
+        ++fails;
+    }
+}
+
+/* Entry n of each table is the CRC of its index followed by n zero bytes. */
+static void test_tables(void) {
+    uint32_t c32;
+    uint16_t c16;
+    int n, i, z;
+
+    for(n = 0; n < 4; ++n) {
+        for(i = 0; i < 256; ++i) {
+            c32 = ref_crc32_byte(0, i);
+            c16 = ref_crc16_byte(0, i);
+
+            for(z = 0; z < n; ++z) {
+                c32 = ref_crc32_byte(c32, 0);
+                c16 = ref_crc16_byte(c16, 0);
+            }
+
+            check(crc32le_tab[n][i] == c32, "crc32le table", n, i, 1);
+            check(crc16ccitt_tab[n][i] == c16, "crc16ccitt table", n, i, 1);
+        }
+    }
+}
+
+static void test_sums(void) {
+    int off, len;
+    uint16_t start;
+
+    for(off = 0; off < MAX_OFF; ++off) {
+        for(len = 0; len <= MAX_LEN; ++len) {
+            start = rand();
+
+            check(net_ipv4_checksum(buf + off, len, start) ==
+                  ref_checksum(buf + off, len, start), "checksum", off, 0,
+                  len);
+            check(net_crc32le(buf + off, len) == ref_crc32le(buf + off, len),
+                  "crc32le", off, 0, len);
+            check(net_crc16ccitt(buf + off, len, start) ==
+                  ref_crc16ccitt(buf + off, len, start), "crc16ccitt", off, 0,
+                  len);
+        }
+    }
+}
+
+/* The copy has to give the same bytes and the same sum as a memcpy() and a
+   checksum, and leave everything around the destination alone. */
+static void test_copy(void) {
+    int off, doff, len;
+    uint16_t start, sum;
+
+    for(off = 0; off < 4; ++off) {
+        for(doff = 0; doff < 4; ++doff) {
+            for(len = 0; len <= MAX_LEN; ++len) {
+                start = rand();
+                memset(dst, 0xa5, sizeof(dst));
+                memset(dst2, 0xa5, sizeof(dst2));
+                memcpy(dst2 + doff, buf + off, len);
+
+                sum = net_ipv4_checksum_copy(dst + doff, buf + off, len, start);
+                check(sum == ref_checksum(buf + off, len, start) &&
+                      !memcmp(dst, dst2, sizeof(dst)), "checksum_copy", off,
+                      doff, len);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t i;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1);
+
+    for(i = 0; i < sizeof(buf); ++i)
+        buf[i] = rand();
+
+    test_tables();
+    test_sums();
+    test_copy();
+
+    /* All ones, so that the sums carry as much as they can. */
+    memset(buf, 0xff, sizeof(buf));
+    test_sums();
+    test_copy();
+
+    printf("%d of %d checks failed\n", fails, checks);
+
+    return fails ? 1 : 0;
+}
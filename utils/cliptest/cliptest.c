@@ -0,0 +1,483 @@
+/* KallistiOS ##version##
+
+   cliptest.c
+
+   Test near plane clipping. This builds the real pvr_clip.c on a PC, with
+   ftrv done in plain C and Direct Rendering going to a buffer, and checks
+   what it puts out against a plain reference clipper: single triangles with
+   none, one, two and all three of their vertices behind the near plane, in
+   both windings and starting from each vertex; strips with every pattern of
+   vertices behind it, so that they get cut and started again on odd and even
+   triangles; and random strips through a camera that sees some of them from
+   behind. It also checks that pvr_clip_strips_dr() sends the same vertices as
+   pvr_clip_strips() writes, and that pvr_clip_strips() doesn't write past the
+   end of a buffer that's too small.
+
+   The comparison is of sums over all of the triangles that come out, of
+   their signed area on the screen times the average of 1/w, u/w and v/w at
+   their corners. Those are all flat across each clipped triangle, so the
+   sums don't depend on how the clipped pieces were split up into triangles,
+   only on what was drawn where, and which way around it was wound.
+
+   Run it from this directory with "make run". It prints anything that doesn't
+   match, and exits with a non-zero status if there was any.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/types.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip the real headers that pvr_clip.c includes, and define what it needs
+   from them here. */
+#define __DC_PVR_H
+#define __DC_MATRIX_H
+#define __PVR_INTERNAL_H
+
+typedef float matrix_t[4][4];
+
+typedef struct {
+    uint32_t flags;
+    float x, y, z;
+    float u, v;
+    uint32_t argb, oargb;
+} pvr_vertex_t;
+
+#define PVR_CMD_VERTEX      0xe0000000
+#define PVR_CMD_VERTEX_EOL  0xf0000000
+
+#define MAX_VERTS   64
+#define MAX_OUT     ((MAX_VERTS - 2) * 4)
+
+/* Direct Rendering goes to a buffer here, a vertex at a time. */
+typedef uint32_t pvr_dr_state_t;
+
+static pvr_vertex_t dr_buf[MAX_OUT];
+
+#define pvr_dr_target(dr)   (&dr_buf[(dr)++])
+#define pvr_dr_commit(addr) ((void)(addr))
+
+static struct {
+    int w, h;
+} pvr_state = { 640, 480 };
+
+/* The SH-4's internal matrix. */
+static matrix_t xmtrx;
+
+static void mat_load(const matrix_t *m) {
+    memcpy(xmtrx, m, sizeof(xmtrx));
+}
+
+/* ftrv, with the matrix stored a column at a time, as on the SH-4. */
+#define mat_trans_nodiv(x, y, z, w) \
+    do { \
+        float a = (x), b = (y), c = (z), d = (w); \
+        (x) = xmtrx[0][0] * a + xmtrx[1][0] * b + xmtrx[2][0] * c + \
+              xmtrx[3][0] * d; \
+        (y) = xmtrx[0][1] * a + xmtrx[1][1] * b + xmtrx[2][1] * c + \
+              xmtrx[3][1] * d; \
+        (z) = xmtrx[0][2] * a + xmtrx[1][2] * b + xmtrx[2][2] * c + \
+              xmtrx[3][2] * d; \
+        (w) = xmtrx[0][3] * a + xmtrx[1][3] * b + xmtrx[2][3] * c + \
+              xmtrx[3][3] * d; \
+    } while(0)
+
+void pvr_clip_set_near(float near_w);
+size_t pvr_clip_strips_dr(pvr_dr_state_t *dr, const pvr_vertex_t *src,
+                          size_t count);
+ssize_t pvr_clip_strips(pvr_vertex_t *dst, size_t max,
+                        const pvr_vertex_t *src, size_t count);
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_clip.c"
+
+/****************************** REFERENCES *********************************/
+
+typedef struct {
+    float x, y, w, z, u, v;
+} ref_vtx_t;
+
+static double sums[4];
+static float near_w;
+
+/* Add a screen space triangle to the sums. */
+static void add_tri(double sign, const ref_vtx_t *a, const ref_vtx_t *b,
+                    const ref_vtx_t *c) {
+    double area = ((b->x - a->x) * (c->y - a->y) -
+                   (c->x - a->x) * (b->y - a->y)) * 0.5 * sign;
+
+    sums[0] += area * (a->z + b->z + c->z) / 3.0;
+    sums[1] += area * (a->u * a->z + b->u * b->z + c->u * c->z) / 3.0;
+    sums[2] += area * (a->v * a->z + b->v * b->z + c->v * c->z) / 3.0;
+    sums[3] += fabs(area) * (a->z + b->z + c->z) / 3.0;
+}
+
+static void ref_xform(ref_vtx_t *r, const pvr_vertex_t *v) {
+    r->x = xmtrx[0][0] * v->x + xmtrx[1][0] * v->y + xmtrx[2][0] * v->z +
+           xmtrx[3][0];
+    r->y = xmtrx[0][1] * v->x + xmtrx[1][1] * v->y + xmtrx[2][1] * v->z +
+           xmtrx[3][1];
+    r->w = xmtrx[0][3] * v->x + xmtrx[1][3] * v->y + xmtrx[2][3] * v->z +
+           xmtrx[3][3];
+    r->u = v->u;
+    r->v = v->v;
+}
+
+static int ref_off(const ref_vtx_t *p, int edge) {
+    switch(edge) {
+        case 0: return p->w < near_w;
+        case 1: return p->x < 0.0f;
+        case 2: return p->x > 640.0f * p->w;
+        case 3: return p->y < 0.0f;
+        default: return p->y > 480.0f * p->w;
+    }
+}
+
+/* Clip one triangle, one edge at a time, and add what's left to the sums. */
+static void ref_tri(ref_vtx_t p[3]) {
+    ref_vtx_t poly[4], *a, *b;
+    float t;
+    int i, n = 0, edge, off;
+
+    /* Dropped if it's entirely off one side. Vertices behind the camera
+       don't count as being off the sides of the screen. */
+    for(edge = 0; edge < 5; ++edge) {
+        for(i = 0, off = 1; i < 3; ++i)
+            off &= ref_off(&p[i], edge) && (!edge || !ref_off(&p[i], 0));
+
+        if(off)
+            return;
+    }
+
+    for(i = 0; i < 3; ++i) {
+        a = &p[i];
+        b = &p[(i + 1) % 3];
+
+        if(a->w >= near_w)
+            poly[n++] = *a;
+
+        if((a->w >= near_w) != (b->w >= near_w)) {
+            if(b->w >= near_w) {
+                a = b;
+                b = &p[i];
+            }
+
+            t = (near_w - a->w) / (b->w - a->w);
+            poly[n].x = a->x + (b->x - a->x) * t;
+            poly[n].y = a->y + (b->y - a->y) * t;
+            poly[n].w = near_w;
+            poly[n].u = a->u + (b->u - a->u) * t;
+            poly[n].v = a->v + (b->v - a->v) * t;
+            ++n;
+        }
+    }
+
+    for(i = 0; i < n; ++i) {
+        poly[i].z = 1.0f / poly[i].w;
+        poly[i].x *= poly[i].z;
+        poly[i].y *= poly[i].z;
+    }
+
+    for(i = 2; i < n; ++i)
+        add_tri(1.0, &poly[0], &poly[i - 1], &poly[i]);
+}
+
+static void ref_strips(const pvr_vertex_t *v, int count) {
+    ref_vtx_t p[3], t;
+    int i, start = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(i - start >= 2) {
+            ref_xform(&p[0], &v[i - 2]);
+            ref_xform(&p[1], &v[i - 1]);
+            ref_xform(&p[2], &v[i]);
+
+            if((i - start) & 1) {
+                t = p[0];
+                p[0] = p[1];
+                p[1] = t;
+            }
+
+            ref_tri(p);
+        }
+
+        if(v[i].flags == PVR_CMD_VERTEX_EOL)
+            start = i + 1;
+    }
+}
+
+/* Take away what the clipper put out from the sums. */
+static int out_strips(const pvr_vertex_t *v, int count) {
+    ref_vtx_t p[3], t;
+    int i, j, start = 0, bad = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(v[i].z <= 0.0f || v[i].z > 1.0f / near_w)
+            ++bad;
+
+        if(v[i].flags != PVR_CMD_VERTEX && v[i].flags != PVR_CMD_VERTEX_EOL)
+            ++bad;
+
+        if(i - start >= 2) {
+            for(j = 0; j < 3; ++j) {
+                p[j].x = v[i - 2 + j].x;
+                p[j].y = v[i - 2 + j].y;
+                p[j].z = v[i - 2 + j].z;
+                p[j].u = v[i - 2 + j].u;
+                p[j].v = v[i - 2 + j].v;
+            }
+
+            if((i - start) & 1) {
+                t = p[0];
+                p[0] = p[1];
+                p[1] = t;
+            }
+
+            add_tri(-1.0, &p[0], &p[1], &p[2]);
+        }
+
+        if(v[i].flags == PVR_CMD_VERTEX_EOL)
+            start = i + 1;
+    }
+
+    if(count && v[count - 1].flags != PVR_CMD_VERTEX_EOL)
+        ++bad;
+
+    return bad;
+}
+
+/****************************** TESTS **************************************/
+
+#define RUNS    2000
+
+static pvr_vertex_t src[MAX_VERTS], dst[MAX_OUT + 1], guard;
+static int fails, checks;
+static uint32_t rand_state = 1;
+
+static float rnd(float lo, float hi) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return lo + (hi - lo) * (rand_state >> 16) / 65535.0f;
+}
+
+static void check(int ok, const char *what, int run) {
+    ++checks;
+
+    if(!ok) {
+        printf("FAIL %s: near %g, run %d\n", what, near_w, run);
+        ++fails;
+    }
+}
+
+static void set_near(float w) {
+    near_w = w;
+    pvr_clip_set_near(w);
+}
+
+/* Clip the strips both ways, check that they agree and that they match the
+   reference, and return how many vertices came out. */
+static int compare(const char *what, int n, int run) {
+    pvr_dr_state_t dr = 0;
+    ssize_t out;
+    size_t sent;
+    double scale;
+
+    memset(sums, 0, sizeof(sums));
+    ref_strips(src, n);
+
+    /* How much was drawn, to know how close is close enough. As u and v
+       are below 1, this is at least as big as any of the sums. */
+    scale = sums[3] + 1.0;
+
+    out = pvr_clip_strips(dst, MAX_OUT, src, n);
+    check(out >= 0, what, run);
+
+    if(out < 0)
+        return -1;
+
+    check(!out_strips(dst, out), what, run);
+    check(fabs(sums[0]) + fabs(sums[1]) + fabs(sums[2]) <= scale * 1e-3,
+          what, run);
+
+    sent = pvr_clip_strips_dr(&dr, src, n);
+    check(sent == (size_t)out && dr == sent &&
+          !memcmp(dr_buf, dst, out * sizeof(pvr_vertex_t)), "dr", run);
+
+    /* One short, which has to fail without going past the end. */
+    if(out > 0) {
+        dst[out - 1] = guard;
+        errno = 0;
+        check(pvr_clip_strips(dst, out - 1, src, n) == -1 &&
+              errno == ENOSPC &&
+              !memcmp(&dst[out - 1], &guard, sizeof(guard)), "short", run);
+    }
+
+    return out;
+}
+
+/* A matrix that leaves w as z, and puts the screen 100 pixels to a unit
+   away from the middle of it. */
+static void flat(void) {
+    matrix_t m = {
+        { 100.0f,   0.0f, 0.0f, 0.0f },
+        {   0.0f, 100.0f, 0.0f, 0.0f },
+        { 320.0f, 240.0f, 0.0f, 1.0f },
+        {   0.0f,   0.0f, 0.0f, 0.0f }
+    };
+
+    mat_load(&m);
+}
+
+static void vertex(int i, float x, float y, float z, uint32_t flags) {
+    src[i].flags = flags;
+    src[i].x = x;
+    src[i].y = y;
+    src[i].z = z;
+    src[i].u = rnd(0.0f, 1.0f);
+    src[i].v = rnd(0.0f, 1.0f);
+    src[i].argb = 0xff000000 | (rand_state & 0xffffff);
+    src[i].oargb = rand_state >> 8;
+}
+
+/* Every way for a triangle to be behind the near plane, in both windings,
+   starting from each vertex. In front, the same triangle comes out; with one
+   vertex behind, a quad; with two, a smaller triangle; with all three,
+   nothing. */
+static void test_tris(void) {
+    static const float corner[3][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f },
+                                        { 0.0f, 1.0f } };
+    static const int expect[4] = { 3, 4, 3, 0 };
+    float behind[2] = { -1.0f, near_w * 0.5f }, z;
+    int mask, wind, first, b, i, j, run = 0;
+
+    flat();
+
+    for(b = 0; b < 2; ++b) {
+        for(mask = 0; mask < 8; ++mask) {
+            for(wind = 0; wind < 2; ++wind) {
+                for(first = 0; first < 3; ++first, ++run) {
+                    for(i = 0; i < 3; ++i) {
+                        j = (first + (wind ? 3 - i : i)) % 3;
+                        z = (mask & (1 << j)) ? behind[b] : near_w * 2.0f;
+                        vertex(i, corner[j][0] * z, corner[j][1] * z, z,
+                               i == 2 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX);
+                    }
+
+                    check(compare("triangle", 3, run) ==
+                          expect[__builtin_popcount(mask)], "triangle count",
+                          run);
+                }
+            }
+        }
+    }
+}
+
+/* A zigzag strip with every pattern of vertices behind the near plane. Every
+   triangle faces the same way on the screen, so one wound the wrong way when
+   a strip is started again on an odd triangle shows up in the sums. */
+#define STRIP   8
+
+static void test_strips(void) {
+    float z;
+    int mask, i;
+
+    flat();
+
+    for(mask = 0; mask < (1 << STRIP); ++mask) {
+        for(i = 0; i < STRIP; ++i) {
+            z = (mask & (1 << i)) ? -0.5f : near_w * 1.5f;
+            vertex(i, (i * 0.5f - 2.0f) * z, ((i & 1) ? 1.0f : -1.0f) * z, z,
+                   i == STRIP - 1 ? PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX);
+        }
+
+        compare("strip", STRIP, mask);
+    }
+}
+
+static void mat_mul(matrix_t r, const matrix_t a, const matrix_t b) {
+    int i, j, k;
+
+    for(i = 0; i < 4; ++i) {
+        for(j = 0; j < 4; ++j) {
+            for(k = 0, r[i][j] = 0.0f; k < 4; ++k)
+                r[i][j] += a[k][j] * b[i][k];
+        }
+    }
+}
+
+/* The same camera as mat_perspective(320, 240, 1, 0.1, 100) gives, turned
+   around by yaw and pitch. */
+static void camera(float yaw, float pitch) {
+    matrix_t sv = {
+        { 240.0f,   0.0f, 0.0f, 0.0f },
+        {   0.0f, 240.0f, 0.0f, 0.0f },
+        {   0.0f,   0.0f, 1.0f, 0.0f },
+        { 320.0f, 240.0f, 0.0f, 1.0f }
+    };
+    matrix_t fr = {
+        { 1.0f, 0.0f, 0.0f, 0.0f },
+        { 0.0f, 1.0f, 0.0f, 0.0f },
+        { 0.0f, 0.0f, 100.1f / -99.9f, -1.0f },
+        { 0.0f, 0.0f, 20.0f / -99.9f, 1.0f }
+    };
+    matrix_t rx = {
+        { 1.0f, 0.0f, 0.0f, 0.0f },
+        { 0.0f, cosf(pitch), sinf(pitch), 0.0f },
+        { 0.0f, -sinf(pitch), cosf(pitch), 0.0f },
+        { 0.0f, 0.0f, 0.0f, 1.0f }
+    };
+    matrix_t ry = {
+        { cosf(yaw), 0.0f, -sinf(yaw), 0.0f },
+        { 0.0f, 1.0f, 0.0f, 0.0f },
+        { sinf(yaw), 0.0f, cosf(yaw), 0.0f },
+        { 0.0f, 0.0f, 0.0f, 1.0f }
+    };
+    matrix_t a, b;
+
+    mat_mul(a, sv, fr);
+    mat_mul(b, a, rx);
+    mat_mul(a, b, ry);
+    mat_load(&a);
+}
+
+/* Random strips all around the camera, some of them ended early. */
+static void test_random(void) {
+    int run, i, n;
+
+    for(run = 0; run < RUNS; ++run) {
+        camera(rnd(0.0f, 6.28f), rnd(-0.5f, 0.5f));
+
+        n = 3 + (int)rnd(0.0f, MAX_VERTS - 3);
+
+        for(i = 0; i < n; ++i)
+            vertex(i, rnd(-8.0f, 8.0f), rnd(-8.0f, 8.0f), rnd(-8.0f, 8.0f),
+                   (i == n - 1 || rnd(0.0f, 1.0f) < 0.1f) ?
+                   PVR_CMD_VERTEX_EOL : PVR_CMD_VERTEX);
+
+        compare("random", n, run);
+    }
+}
+
+int main(int argc, char **argv) {
+    static const float nears[] = { 1.0f, 0.25f, 3.0f };
+    size_t i;
+
+    (void)argc;
+    (void)argv;
+
+    memset(&guard, 0xa5, sizeof(guard));
+
+    for(i = 0; i < sizeof(nears) / sizeof(nears[0]); ++i) {
+        set_near(nears[i]);
+        test_tris();
+        test_strips();
+        test_random();
+    }
+
+    printf("%d of %d checks failed\n", fails, checks);
+
+    return fails ? 1 : 0;
+}
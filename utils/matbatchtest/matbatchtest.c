@@ -0,0 +1,336 @@
+/* KallistiOS ##version##
+
+   matbatchtest.c
+
+   Test the batch kernels in the matrix library. This builds the real
+   matrix_batch.c on a PC, with ftrv and fipr done in plain C, and checks
+   each kernel against a portable C reference over a lot of random input:
+   culling against from one to eight planes, lighting with from none to
+   eight lights, and skinning with from one to three bones a vertex. It also
+   checks that each kernel puts back the matrix that was loaded.
+
+   This only tests the logic of the kernels, not the SH-4 itself. The
+   matbatch example does the same checks on a Dreamcast, and times them.
+
+   Run it from this directory with "make run". It prints anything that doesn't
+   match, and exits with a non-zero status if there was any.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip the real headers that matrix_batch.c includes, and define what it
+   needs from them here. */
+#define __DC_MATRIX_H
+#define __DC_FMATH_H
+
+typedef float matrix_t[4][4];
+typedef struct { float x, y, z, w; } vector_t;
+
+#define MAT_CULL_MAX_PLANES     8
+#define MAT_LIGHT_MAX           8
+
+/* The SH-4's internal matrix. */
+static matrix_t xmtrx;
+
+static void mat_load(const matrix_t *m) {
+    memcpy(xmtrx, m, sizeof(xmtrx));
+}
+
+static void mat_store(matrix_t *m) {
+    memcpy(m, xmtrx, sizeof(xmtrx));
+}
+
+/* ftrv, with the matrix stored a column at a time, as on the SH-4. */
+#define mat_trans_nodiv(x, y, z, w) \
+    do { \
+        float a = (x), b = (y), c = (z), d = (w); \
+        (x) = xmtrx[0][0] * a + xmtrx[1][0] * b + xmtrx[2][0] * c + \
+              xmtrx[3][0] * d; \
+        (y) = xmtrx[0][1] * a + xmtrx[1][1] * b + xmtrx[2][1] * c + \
+              xmtrx[3][1] * d; \
+        (z) = xmtrx[0][2] * a + xmtrx[1][2] * b + xmtrx[2][2] * c + \
+              xmtrx[3][2] * d; \
+        (w) = xmtrx[0][3] * a + xmtrx[1][3] * b + xmtrx[2][3] * c + \
+              xmtrx[3][3] * d; \
+    } while(0)
+
+static inline float fipr(float x, float y, float z, float w,
+                         float a, float b, float c, float d) {
+    return x * a + y * b + z * c + w * d;
+}
+
+int mat_cull_spheres(const vector_t *planes, int plane_count,
+                     const vector_t *spheres, int count, uint8_t *visible);
+int mat_cull_boxes(const vector_t *planes, int plane_count,
+                   const vector_t *centers, const vector_t *extents,
+                   int count, uint8_t *visible);
+void mat_light_diffuse(const vector_t *normals, uint32_t *argb, int count,
+                       int stride, const vector_t *dirs,
+                       const vector_t *colors, int light_count,
+                       const vector_t *ambient);
+void mat_skin(const vector_t *in, vector_t *out, int count,
+              const matrix_t *palette, const uint8_t *bones,
+              const float *weights, int bones_per_vertex);
+
+#include "../../kernel/arch/dreamcast/math/matrix_batch.c"
+
+/****************************** TESTS **************************************/
+
+#define RUNS    2000
+#define COUNT   64
+#define BONES   6
+#define MAX_BPV 3
+
+/* How close to a plane something can be and be counted either way. */
+#define EDGE    1e-4f
+
+static int fails, checks;
+static matrix_t loaded;
+
+static float rnd(float lo, float hi) {
+    return lo + (hi - lo) * rand() / (float)RAND_MAX;
+}
+
+static vector_t rnd_dir(float w) {
+    vector_t v = { rnd(-1.0f, 1.0f), rnd(-1.0f, 1.0f), rnd(-1.0f, 1.0f), w };
+    float l = 1.0f / sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+
+    v.x *= l;
+    v.y *= l;
+    v.z *= l;
+    return v;
+}
+
+static void fail(const char *what, int run, int i) {
+    printf("FAIL %s run %d vertex %d\n", what, run, i);
+    ++fails;
+}
+
+static void check_matrix(const char *what, int run) {
+    ++checks;
+
+    if(memcmp(xmtrx, loaded, sizeof(loaded)))
+        fail(what, run, -1);
+}
+
+static float plane_dist(const vector_t *p, float x, float y, float z) {
+    return p->x * x + p->y * y + p->z * z + p->w;
+}
+
+static void test_cull(int run) {
+    vector_t planes[MAT_CULL_MAX_PLANES], spheres[COUNT], extents[COUNT];
+    uint8_t visible[COUNT];
+    int np = 1 + rand() % MAT_CULL_MAX_PLANES, i, j, c, in, total, want;
+    float d, far;
+
+    for(j = 0; j < np; ++j)
+        planes[j] = rnd_dir(rnd(-3.0f, 3.0f));
+
+    for(i = 0; i < COUNT; ++i) {
+        spheres[i] = (vector_t){ rnd(-5.0f, 5.0f), rnd(-5.0f, 5.0f),
+                                 rnd(-5.0f, 5.0f), rnd(0.0f, 2.0f) };
+        extents[i] = (vector_t){ rnd(0.0f, 2.0f), rnd(0.0f, 2.0f),
+                                 rnd(0.0f, 2.0f), 0.0f };
+    }
+
+    /* A sphere is out if it's all behind any one plane. */
+    total = mat_cull_spheres(planes, np, spheres, COUNT, visible);
+    check_matrix("cull_spheres matrix", run);
+
+    for(i = 0, want = 0; i < COUNT; ++i) {
+        for(j = 0, in = 1; j < np; ++j) {
+            d = plane_dist(&planes[j], spheres[i].x, spheres[i].y,
+                           spheres[i].z) + spheres[i].w;
+
+            if(d < -EDGE)
+                in = 0;
+            else if(d < EDGE && !visible[i])
+                in = 0;
+        }
+
+        ++checks;
+
+        if(in != visible[i])
+            fail("cull_spheres", run, i);
+
+        want += visible[i];
+    }
+
+    ++checks;
+
+    if(total != want)
+        fail("cull_spheres count", run, -1);
+
+    /* A box is out if all eight of its corners are behind any one plane. */
+    total = mat_cull_boxes(planes, np, spheres, extents, COUNT, visible);
+    check_matrix("cull_boxes matrix", run);
+
+    for(i = 0, want = 0; i < COUNT; ++i) {
+        for(j = 0, in = 1; j < np; ++j) {
+            for(c = 0, far = -INFINITY; c < 8; ++c) {
+                d = plane_dist(&planes[j],
+                    spheres[i].x + ((c & 1) ? extents[i].x : -extents[i].x),
+                    spheres[i].y + ((c & 2) ? extents[i].y : -extents[i].y),
+                    spheres[i].z + ((c & 4) ? extents[i].z : -extents[i].z));
+                far = d > far ? d : far;
+            }
+
+            if(far < -EDGE)
+                in = 0;
+            else if(far < EDGE && !visible[i])
+                in = 0;
+        }
+
+        ++checks;
+
+        if(in != visible[i])
+            fail("cull_boxes", run, i);
+
+        want += visible[i];
+    }
+
+    ++checks;
+
+    if(total != want)
+        fail("cull_boxes count", run, -1);
+}
+
+static void test_light(int run) {
+    vector_t normals[COUNT], dirs[MAT_LIGHT_MAX], colors[MAT_LIGHT_MAX];
+    vector_t ambient = { 0.1f, 0.2f, 0.05f, 0.5f };
+    uint32_t argb[COUNT * 2], got;
+    float n[3], c[3], d, want;
+    int nl = rand() % (MAT_LIGHT_MAX + 1), i, j, k;
+
+    for(j = 0; j < nl; ++j) {
+        dirs[j] = rnd_dir(0.0f);
+        colors[j] = (vector_t){ rnd(0.0f, 0.5f), rnd(0.0f, 0.5f),
+                                rnd(0.0f, 0.5f), 0.0f };
+    }
+
+    for(i = 0; i < COUNT; ++i)
+        normals[i] = (vector_t){ rnd(-1.0f, 1.0f), rnd(-1.0f, 1.0f),
+                                 rnd(-1.0f, 1.0f), 0.0f };
+
+    /* Every other word, to check the stride. */
+    memset(argb, 0, sizeof(argb));
+    mat_light_diffuse(normals, argb, COUNT, 2 * sizeof(uint32_t), dirs, colors,
+                      nl, &ambient);
+    check_matrix("light_diffuse matrix", run);
+
+    /* The normals are put through the loaded matrix before lighting, and the
+       lights that face away are left out. The channels can be off by one,
+       as the sums aren't done in the same order. */
+    for(i = 0; i < COUNT; ++i) {
+        for(k = 0; k < 3; ++k)
+            n[k] = loaded[0][k] * normals[i].x + loaded[1][k] * normals[i].y +
+                   loaded[2][k] * normals[i].z;
+
+        c[0] = ambient.x;
+        c[1] = ambient.y;
+        c[2] = ambient.z;
+
+        for(j = 0; j < nl; ++j) {
+            d = n[0] * dirs[j].x + n[1] * dirs[j].y + n[2] * dirs[j].z;
+
+            if(d > 0.0f) {
+                c[0] += d * colors[j].x;
+                c[1] += d * colors[j].y;
+                c[2] += d * colors[j].z;
+            }
+        }
+
+        got = argb[i * 2];
+        ++checks;
+
+        if(got >> 24 != 127 || argb[i * 2 + 1]) {
+            fail("light_diffuse", run, i);
+            continue;
+        }
+
+        for(k = 0; k < 3; ++k) {
+            want = c[k] > 1.0f ? 255.0f : c[k] * 255.0f;
+
+            if(fabsf(want - ((got >> (16 - k * 8)) & 0xff)) > 1.01f) {
+                fail("light_diffuse", run, i);
+                break;
+            }
+        }
+    }
+}
+
+static void test_skin(int run) {
+    static matrix_t palette[BONES];
+    vector_t in[COUNT], out[COUNT];
+    uint8_t bones[COUNT * MAX_BPV];
+    float weights[COUNT * MAX_BPV], v[4];
+    const float (*m)[4];
+    int bpv = 1 + rand() % MAX_BPV, i, j, k;
+
+    for(i = 0; i < BONES * 16; ++i)
+        ((float *)palette)[i] = rnd(-2.0f, 2.0f);
+
+    /* Positions and normals, with some bones not counting. */
+    for(i = 0; i < COUNT; ++i) {
+        in[i] = (vector_t){ rnd(-3.0f, 3.0f), rnd(-3.0f, 3.0f),
+                            rnd(-3.0f, 3.0f), (float)(rand() & 1) };
+
+        for(j = 0; j < bpv; ++j) {
+            bones[i * bpv + j] = rand() % BONES;
+            weights[i * bpv + j] = (rand() & 3) ? rnd(0.0f, 1.0f) : 0.0f;
+        }
+    }
+
+    mat_skin(in, out, COUNT, palette, bones, weights, bpv);
+    check_matrix("skin matrix", run);
+
+    /* Each vertex is the weighted sum of what its bones make of it. */
+    for(i = 0; i < COUNT; ++i) {
+        v[0] = v[1] = v[2] = v[3] = 0.0f;
+
+        for(j = 0; j < bpv; ++j) {
+            m = palette[bones[i * bpv + j]];
+
+            for(k = 0; k < 4; ++k)
+                v[k] += weights[i * bpv + j] *
+                        (m[0][k] * in[i].x + m[1][k] * in[i].y +
+                         m[2][k] * in[i].z + m[3][k] * in[i].w);
+        }
+
+        ++checks;
+
+        if(fabsf(v[0] - out[i].x) > 1e-3f || fabsf(v[1] - out[i].y) > 1e-3f ||
+           fabsf(v[2] - out[i].z) > 1e-3f || fabsf(v[3] - out[i].w) > 1e-3f)
+            fail("skin", run, i);
+    }
+}
+
+int main(int argc, char **argv) {
+    int run, i;
+
+    (void)argc;
+    (void)argv;
+
+    srand(1);
+
+    for(run = 0; run < RUNS; ++run) {
+        for(i = 0; i < 16; ++i)
+            ((float *)loaded)[i] = rnd(-2.0f, 2.0f);
+
+        mat_load(&loaded);
+
+        test_cull(run);
+        test_light(run);
+        test_skin(run);
+    }
+
+    printf("%d of %d checks failed\n", fails, checks);
+
+    return fails ? 1 : 0;
+}
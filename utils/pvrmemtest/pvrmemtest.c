@@ -0,0 +1,420 @@
+/* KallistiOS ##version##
+
+   pvrmemtest.c
+
+   Test the slab/buddy PVR memory allocator. This builds the real
+   pvr_mem_buddy.c on a PC, over a pretend 8MB of VRAM (nothing is ever
+   written to the addresses it hands out), and replays allocation traces that
+   fragment the pool: a game going through levels like the pvr/memfrag example
+   does, and random churn of everything from 1 byte to a few hundred KB.
+
+   Every block handed out has to be in the pool, aligned for a texture (and to
+   a unit, if it's at least that big) and clear of every other block that's
+   still allocated. Once everything is freed, the pool has to be back the way
+   it started: nothing used, and the free space merged back into the same
+   blocks.
+
+   Run it from this directory with "make run". It prints anything that goes
+   wrong, and exits with a non-zero status if anything did.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip the KOS headers that pvr_mem_buddy.c includes, and define what it
+   needs from them here. */
+#define __DC_PVR_H
+#define __KOS_DBGLOG_H
+#define __PVR_INTERNAL_H
+
+/* From dc/pvr/pvr_regs.h */
+#define PVR_RAM_INT_BASE    0xa4000000
+#define PVR_RAM_SIZE        (8 * 1024 * 1024)
+
+/* From dc/pvr/pvr_mem.h */
+typedef struct pvr_mem_stats {
+    size_t  total;
+    size_t  used;
+    size_t  free;
+    size_t  largest_free;
+    size_t  free_blocks;
+} pvr_mem_stats_t;
+
+void pvr_buddy_reset(uint32_t base, uint32_t top);
+void *pvr_buddy_malloc(size_t size);
+void pvr_buddy_free(void *ptr);
+void pvr_buddy_get_stats(pvr_mem_stats_t *stats);
+void pvr_buddy_print_stats(void);
+
+/* Complaints from the allocator are failures here. */
+static int complaints;
+
+#define DBG_ERROR               3
+#define dbglog(l, ...) \
+    ((void)(l), ++complaints, fprintf(stdout, __VA_ARGS__))
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_mem_buddy.c"
+
+/****************************** TRACKING ***********************************/
+
+#define GRAIN       32
+#define GRAINS      (PVR_RAM_SIZE / GRAIN)
+#define MAX_LIVE    8192
+
+typedef struct {
+    uint32_t addr;
+    size_t size;
+} block_t;
+
+/* Which block (plus one) each 32 bytes of VRAM belongs to. */
+static uint16_t owner[GRAINS];
+static block_t live[MAX_LIVE];
+static int nlive;
+
+static uint32_t pool_base, pool_top;
+static int fails, checks;
+
+static uint32_t rand_state;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+static void fail(const char *what, uint32_t addr, size_t size) {
+    printf("FAIL %s: %08lx, %lu bytes\n", what, (unsigned long)addr,
+           (unsigned long)size);
+    ++fails;
+}
+
+/* Allocate a block and check it, returning its slot in live[], or -1 if it
+   didn't fit. */
+static int do_alloc(size_t size) {
+    uint32_t addr, g, first, last;
+    void *p;
+
+    if(nlive == MAX_LIVE)
+        return -1;
+
+    if(!(p = pvr_buddy_malloc(size)))
+        return -1;
+
+    addr = (uint32_t)(uintptr_t)p;
+    ++checks;
+
+    if(addr < pool_base || addr + size > pool_top || addr + size < addr) {
+        fail("outside the pool", addr, size);
+        return -1;
+    }
+
+    if((addr & (GRAIN - 1)) ||
+       (size > PVR_SLAB_MAX && (addr & (PVR_BUDDY_UNIT - 1)))) {
+        fail("misaligned", addr, size);
+        return -1;
+    }
+
+    first = (addr - PVR_RAM_INT_BASE) / GRAIN;
+    last = (addr - PVR_RAM_INT_BASE + (size ? size : 1) - 1) / GRAIN;
+
+    for(g = first; g <= last; ++g) {
+        if(owner[g]) {
+            fail("overlaps another block", addr, size);
+            printf("     the other is %08lx, %lu bytes\n",
+                   (unsigned long)live[owner[g] - 1].addr,
+                   (unsigned long)live[owner[g] - 1].size);
+            return -1;
+        }
+    }
+
+    live[nlive].addr = addr;
+    live[nlive].size = size;
+    ++nlive;
+
+    for(g = first; g <= last; ++g)
+        owner[g] = nlive;
+
+    return nlive - 1;
+}
+
+static void do_free(int i) {
+    block_t *b = &live[i];
+    uint32_t g, first, last;
+
+    pvr_buddy_free((void *)(uintptr_t)b->addr);
+
+    first = (b->addr - PVR_RAM_INT_BASE) / GRAIN;
+    last = (b->addr - PVR_RAM_INT_BASE + (b->size ? b->size : 1) - 1) / GRAIN;
+
+    for(g = first; g <= last; ++g)
+        owner[g] = 0;
+
+    /* Move the last block into the hole. */
+    if(i != --nlive) {
+        live[i] = live[nlive];
+        first = (live[i].addr - PVR_RAM_INT_BASE) / GRAIN;
+        last = (live[i].addr - PVR_RAM_INT_BASE +
+                (live[i].size ? live[i].size : 1) - 1) / GRAIN;
+
+        for(g = first; g <= last; ++g)
+            owner[g] = i + 1;
+    }
+}
+
+static void free_all(void) {
+    while(nlive)
+        do_free(rnd() % nlive);
+}
+
+static void check_stats(const char *what) {
+    pvr_mem_stats_t st;
+
+    pvr_buddy_get_stats(&st);
+    ++checks;
+
+    if(st.used + st.free != st.total || st.largest_free > st.free ||
+       (st.free && !st.free_blocks)) {
+        printf("FAIL %s: stats don't add up: %lu total, %lu used, %lu free, "
+               "%lu largest in %lu blocks\n", what, (unsigned long)st.total,
+               (unsigned long)st.used, (unsigned long)st.free,
+               (unsigned long)st.largest_free, (unsigned long)st.free_blocks);
+        ++fails;
+    }
+}
+
+/* Free everything, and check that the pool went back to how it was. */
+static void check_reclaimed(const char *what, const pvr_mem_stats_t *fresh) {
+    pvr_mem_stats_t st;
+    int i;
+
+    free_all();
+    pvr_buddy_get_stats(&st);
+    ++checks;
+
+    if(memcmp(&st, fresh, sizeof(st))) {
+        printf("FAIL %s: not all reclaimed: %lu used, %lu free, %lu largest "
+               "in %lu blocks (should be %lu free, %lu largest in %lu "
+               "blocks)\n", what, (unsigned long)st.used,
+               (unsigned long)st.free, (unsigned long)st.largest_free,
+               (unsigned long)st.free_blocks, (unsigned long)fresh->free,
+               (unsigned long)fresh->largest_free,
+               (unsigned long)fresh->free_blocks);
+        ++fails;
+    }
+
+    for(i = 0; i < GRAINS; ++i) {
+        if(owner[i]) {
+            fail("still owned after freeing everything",
+                 PVR_RAM_INT_BASE + i * GRAIN, GRAIN);
+            break;
+        }
+    }
+
+    /* The biggest block should be there for the taking. */
+    ++checks;
+
+    if((i = do_alloc(fresh->largest_free)) < 0)
+        fail("can't allocate the largest free block", 0, fresh->largest_free);
+    else
+        do_free(i);
+}
+
+/****************************** TRACES *************************************/
+
+#define LEVELS      8
+#define LEVEL_TXRS  160
+#define KEEP_TXRS   600
+#define CHURN       2000
+
+/* Size of a random texture, as a game might have. */
+static size_t txr_size(void) {
+    size_t w = 8 << (rnd() % 6), h = w, bpp = 16, size = 0;
+
+    switch(rnd() % 8) {
+        case 0:
+            bpp = 4;
+            break;
+        case 1:
+            bpp = 8;
+            break;
+        case 2:
+            h = w >> (rnd() % 3);
+            break;
+        case 3:
+            /* A screen sized buffer, or a movie frame. */
+            return 320 * 240 * 2;
+        default:
+            break;
+    }
+
+    /* Mipmaps, with the padding pvr_txr_load_ex() puts in front. */
+    if(w == h && !(rnd() % 3)) {
+        for(size = 4; w > 1; w >>= 1)
+            size += w * w;
+
+        return size * bpp / 8;
+    }
+
+    return w * h * bpp / 8;
+}
+
+/* Free the block that ids[k] is the slot of, and keep the rest of ids
+   pointing at the right slots after do_free() moves one around. */
+static void free_id(int *ids, int n, int k) {
+    int i;
+
+    do_free(ids[k]);
+
+    for(i = 0; i < n; ++i) {
+        if(ids[i] == nlive)
+            ids[i] = ids[k];
+    }
+
+    ids[k] = -1;
+}
+
+/* Levels of textures, some of which stick around for good, with smaller
+   textures coming and going while each level is played. This is the
+   pvr/memfrag example's trace. */
+static void trace_levels(void) {
+    int level[LEVEL_TXRS];
+    int l, i, j, kept = 0;
+
+    for(l = 0; l < LEVELS; ++l) {
+        for(i = 0; i < LEVEL_TXRS; ++i) {
+            level[i] = do_alloc(txr_size());
+
+            /* Every so often, something comes along that sticks around
+               until the end. */
+            if(!(rnd() % 4) && kept < KEEP_TXRS) {
+                do_alloc(32 << (rnd() % 8));
+                ++kept;
+            }
+        }
+
+        check_stats("levels");
+
+        for(i = 0; i < CHURN; ++i) {
+            j = rnd() % LEVEL_TXRS;
+
+            if(level[j] >= 0)
+                free_id(level, LEVEL_TXRS, j);
+
+            level[j] = do_alloc(32 << (rnd() % 6));
+        }
+
+        for(i = 0; i < LEVEL_TXRS; ++i) {
+            if(level[i] >= 0)
+                free_id(level, LEVEL_TXRS, i);
+        }
+    }
+}
+
+/* Anything from a byte to a few hundred KB, allocated and freed at random,
+   freeing more when the pool fills up. */
+static void trace_random(int ops) {
+    size_t size;
+    int i;
+
+    for(i = 0; i < ops; ++i) {
+        if(nlive && (rnd() % 5) < 2) {
+            do_free(rnd() % nlive);
+            continue;
+        }
+
+        switch(rnd() % 4) {
+            case 0:
+                size = 1 + rnd() % PVR_SLAB_MAX;
+                break;
+            case 1:
+                size = 32 << (rnd() % 6);
+                break;
+            case 2:
+                size = PVR_SLAB_MAX + 1 + rnd() % (64 * 1024);
+                break;
+            default:
+                size = (rnd() % 384 + 1) * 1024 + (rnd() & 1) * 32;
+                break;
+        }
+
+        if(do_alloc(size) < 0 && nlive) {
+            /* Make some room. */
+            for(size = nlive / 4 + 1; size--; )
+                do_free(rnd() % nlive);
+        }
+
+        if(!(i % 1000))
+            check_stats("random");
+    }
+}
+
+/* As much as will fit of a single size, then freed in a random order, so
+   that everything has to merge back together from the smallest pieces. */
+static void trace_fill(size_t size) {
+    while(do_alloc(size) >= 0)
+        ;
+
+    check_stats("fill");
+}
+
+static void run(uint32_t base, uint32_t top, uint32_t seed) {
+    static const size_t fills[] = { 1, 32, 100, 1024, 1025, 2048, 6000,
+                                    65536, 174776 };
+    pvr_mem_stats_t fresh;
+    char what[64];
+    unsigned i;
+
+    pool_base = base;
+    pool_top = top;
+    rand_state = seed;
+    pvr_buddy_reset(base, top);
+    pvr_buddy_get_stats(&fresh);
+
+    /* The pool starts at the first unit from base. */
+    ++checks;
+
+    if(fresh.total != top - ((base + PVR_BUDDY_UNIT - 1) &
+                             ~(PVR_BUDDY_UNIT - 1)) || fresh.used)
+        fail("wrong pool size", base, fresh.total);
+
+    trace_levels();
+    snprintf(what, sizeof(what), "levels, seed %lu", (unsigned long)seed);
+    check_reclaimed(what, &fresh);
+
+    trace_random(100000);
+    snprintf(what, sizeof(what), "random, seed %lu", (unsigned long)seed);
+    check_reclaimed(what, &fresh);
+
+    for(i = 0; i < sizeof(fills) / sizeof(fills[0]); ++i) {
+        trace_fill(fills[i]);
+        snprintf(what, sizeof(what), "fill %lu", (unsigned long)fills[i]);
+        check_reclaimed(what, &fresh);
+    }
+
+    /* All of it again, on top of whatever the last run left behind. */
+    trace_levels();
+    trace_random(20000);
+    check_reclaimed("second round", &fresh);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    /* The texture area starts after the frame buffers and the TA's buffers,
+       which needn't be a whole unit. */
+    run(PVR_RAM_INT_BASE + 0x1c2000, PVR_RAM_INT_BASE + PVR_RAM_SIZE, 1);
+    run(PVR_RAM_INT_BASE + 0x25a020, PVR_RAM_INT_BASE + PVR_RAM_SIZE, 2);
+    run(PVR_RAM_INT_BASE + 0x000800, PVR_RAM_INT_BASE + PVR_RAM_SIZE, 3);
+
+    pvr_buddy_reset(0, 0);
+
+    fails += complaints;
+    printf("%d of %d checks failed\n", fails, checks);
+
+    return fails ? 1 : 0;
+}
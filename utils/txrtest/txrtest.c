@@ -0,0 +1,493 @@
+/* KallistiOS ##version##
+
+   txrtest.c
+
+   Test the twiddled texture loader. This builds the real pvr_texture.c on a
+   PC, with just enough of KOS around it to load textures into main RAM, and
+   checks what pvr_txr_load_ex() puts out against a plain texel at a time
+   twiddler, for every format and for sizes from 8x8 up to 1024x1024. That
+   covers non-square textures, inverted loads and mipmap chains.
+
+   It also keeps a copy of the loader pvr_txr_load_ex() replaced, to show what
+   changed: the output is the same, except for inverted 4bpp and 8bpp loads.
+   The old loader swapped each pair of rows on those, rather than just
+   flipping the texture.
+
+   Run it from this directory with "make run". It prints anything that doesn't
+   match, and exits with a non-zero status if there was any.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip the real headers that pvr_texture.c includes. Everything it needs from
+   them is defined below, the way it is on the Dreamcast. */
+#define __ASSERT_H
+#define __DC_PVR_H
+#define __DC_SQ_H
+#define __KOS_DBGLOG_H
+#define __KOS_MUTEX_H
+#define __KOS_REGFIELD_H
+#define __KOS_THREAD_H
+#define __PVR_INTERNAL_H
+
+typedef void *pvr_ptr_t;
+
+/* From dc/pvr/pvr_txr.h */
+#define PVR_TXRLOAD_4BPP            0x01
+#define PVR_TXRLOAD_8BPP            0x02
+#define PVR_TXRLOAD_16BPP           0x03
+#define PVR_TXRLOAD_32BPP           0x04
+#define PVR_TXRLOAD_FMT_MASK        0x0f
+#define PVR_TXRLOAD_CONV_ARGB1555   0x100
+#define PVR_TXRLOAD_CONV_RGB565     0x200
+#define PVR_TXRLOAD_CONV_ARGB4444   0x300
+#define PVR_TXRLOAD_CONV_MASK       0x300
+#define PVR_TXRLOAD_VQ_LOAD         0x10
+#define PVR_TXRLOAD_INVERT_Y        0x20
+#define PVR_TXRLOAD_FMT_VQ          0x40
+#define PVR_TXRLOAD_FMT_TWIDDLED    0x80
+#define PVR_TXRLOAD_DMA             0x8000
+#define PVR_TXRLOAD_NONBLOCK        0x4000
+#define PVR_TXRLOAD_SQ              0x2000
+#define PVR_TXRLOAD_MIPMAP          0x1000
+
+/* From kos/img.h */
+typedef struct {
+    void *data;
+    uint32_t w, h;
+    uint32_t fmt;
+    uint32_t byte_count;
+} kos_img_t;
+
+#define KOS_IMG_FMT_RGB565      1
+#define KOS_IMG_FMT_ARGB4444    2
+#define KOS_IMG_FMT_ARGB1555    3
+#define KOS_IMG_FMT_PAL4BPP     4
+#define KOS_IMG_FMT_PAL8BPP     5
+#define KOS_IMG_FMT_MASK        0xff
+#define KOS_IMG_FMT_I(x)        ((x) & 0xffff)
+#define KOS_IMG_FMT_D(x)        (((x) >> 16) & 0xffff)
+
+/* Registers, which only pvr_txr_set_stride() touches. */
+static uint32_t txr_modulo;
+#define PVR_TEXTURE_MODULO      0
+#define PVR_TXR_STRIDE_MULT     0x1f
+#define PVR_GET(r)              ((void)(r), txr_modulo)
+#define PVR_SET(r, v)           ((void)(r), txr_modulo = (v))
+#define FIELD_PREP(m, v)        ((v) & (m))
+#define FIELD_GET(v, m)         ((v) & (m))
+#define PVR_DMA_VRAM64          0
+
+#define __is_aligned(x, a)      (!((uintptr_t)(x) & ((a) - 1)))
+#define __align_up(x, a)        (((x) + (a) - 1) & ~((a) - 1))
+
+#define assert(x)               assert_msg((x), #x)
+#define assert_msg(x, m) \
+    do { \
+        if(!(x)) { \
+            fprintf(stderr, "assertion failed: %s\n", (m)); \
+            abort(); \
+        } \
+    } while(0)
+
+#define DBG_ERROR               3
+#define dbglog(l, ...)          ((void)(l), fprintf(stderr, __VA_ARGS__))
+
+typedef int mutex_t;
+#define MUTEX_INITIALIZER       0
+#define mutex_lock(m)           ((void)(m))
+#define mutex_unlock(m)         ((void)(m))
+#define thd_pass()
+
+static struct {
+    mutex_t dma_lock;
+} pvr_state;
+
+typedef void (*pvr_dma_callback_t)(void *data);
+
+/* Nothing in here is ever in VRAM, so none of the ways of getting it there
+   should be used. */
+static void pvr_sq_load(void *dst, const void *src, size_t n, int type) {
+    (void)dst; (void)src; (void)n; (void)type;
+    assert_msg(0, "pvr_sq_load() called");
+}
+
+static int pvr_txr_load_dma(const void *src, pvr_ptr_t dst, size_t n,
+                            int block, pvr_dma_callback_t cb, void *d) {
+    (void)src; (void)dst; (void)n; (void)block; (void)cb; (void)d;
+    assert_msg(0, "pvr_txr_load_dma() called");
+    return -1;
+}
+
+static int pvr_dma_ready(void) {
+    return 1;
+}
+
+static size_t pvr_txr_vq_size(uint32_t w, uint32_t h, uint32_t flags) {
+    (void)w; (void)h; (void)flags;
+    return 0;
+}
+
+static int pvr_txr_vq_encode(const void *src, void *dst, uint32_t w,
+                             uint32_t h, uint32_t flags, const void *params) {
+    (void)src; (void)dst; (void)w; (void)h; (void)flags; (void)params;
+    return -1;
+}
+
+/* From pvr_internal.h */
+static inline uint32_t pvr_txr_untwid(uint32_t i) {
+    i &= 0x55555555;
+    i = (i | (i >> 1)) & 0x33333333;
+    i = (i | (i >> 2)) & 0x0f0f0f0f;
+    i = (i | (i >> 4)) & 0x00ff00ff;
+    return (i | (i >> 8)) & 0x0000ffff;
+}
+
+static inline uint16_t pvr_txr_conv32(uint32_t p, uint32_t flags) {
+    switch(flags & PVR_TXRLOAD_CONV_MASK) {
+        case PVR_TXRLOAD_CONV_RGB565:
+            return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) |
+                   ((p >> 3) & 0x001f);
+        case PVR_TXRLOAD_CONV_ARGB4444:
+            return ((p >> 16) & 0xf000) | ((p >> 12) & 0x0f00) |
+                   ((p >> 8) & 0x00f0) | ((p >> 4) & 0x000f);
+        default:
+            return ((p >> 16) & 0x8000) | ((p >> 9) & 0x7c00) |
+                   ((p >> 6) & 0x03e0) | ((p >> 3) & 0x001f);
+    }
+}
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_texture.c"
+
+/****************************** REFERENCES *********************************/
+
+/* The loader pvr_txr_load_ex() replaced, texel by texel, minus the
+   assertions. */
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+static void old_load(const void *src, void *dst, uint32_t w, uint32_t h,
+                     uint32_t bpp, int invert) {
+    uint32_t x, y, yout, min = MIN(w, h), mask = min - 1;
+    uint16_t *vtex = (uint16_t *)dst;
+
+    switch(bpp) {
+        case 4: {
+            const uint8_t *pixels = (const uint8_t *)src;
+
+            for(y = 0; y < h; y += 2) {
+                yout = invert ? (h - 1) - y : y;
+
+                for(x = 0; x < w; x += 2) {
+                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
+                         (x / min + yout / min) * min * min / 4] =
+                        (pixels[(x + y * w) >> 1] & 15) |
+                        ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                        ((pixels[(x + y * w) >> 1] >> 4) << 8) |
+                        ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                }
+            }
+        }
+        break;
+
+        case 8: {
+            const uint8_t *pixels = (const uint8_t *)src;
+
+            for(y = 0; y < h; y += 2) {
+                yout = invert ? (h - 1) - y : y;
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
+                         (x / min + yout / min) * min * min / 2] =
+                        pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+                }
+            }
+        }
+        break;
+
+        case 16: {
+            const uint16_t *pixels = (const uint16_t *)src;
+
+            for(y = 0; y < h; y++) {
+                yout = invert ? (h - 1) - y : y;
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT(x & mask, yout & mask) +
+                         (x / min + yout / min) * min * min] =
+                        pixels[y * w + x];
+                }
+            }
+        }
+        break;
+    }
+}
+
+/* Read texel (x, y) of a source image. */
+static uint32_t ref_texel(const uint8_t *src, uint32_t w, uint32_t x,
+                          uint32_t y, uint32_t bpp, uint32_t flags) {
+    size_t i = (size_t)y * w + x;
+
+    switch(bpp) {
+        case 4:
+            return (src[i >> 1] >> ((i & 1) << 2)) & 15;
+        case 8:
+            return src[i];
+        case 16:
+            return ((const uint16_t *)src)[i];
+        default:
+            return pvr_txr_conv32(((const uint32_t *)src)[i], flags);
+    }
+}
+
+/* Write texel number i of a twiddled texture. */
+static void ref_put(uint8_t *dst, size_t i, uint32_t v, uint32_t bpp) {
+    switch(bpp) {
+        case 4:
+            dst[i >> 1] = (dst[i >> 1] & ~(15 << ((i & 1) << 2))) |
+                          (v << ((i & 1) << 2));
+            break;
+        case 8:
+            dst[i] = v;
+            break;
+        default:
+            ((uint16_t *)dst)[i] = v;
+            break;
+    }
+}
+
+/* Twiddle a texture one texel at a time, straight from the definition: the
+   texture is split into squares of the smaller side, one after the other,
+   and each texel's place in its square has the bits of x and y interleaved
+   (y in the low bit). Returns the number of texels written. */
+static size_t ref_twiddle(const uint8_t *src, uint8_t *dst, uint32_t w,
+                          uint32_t h, uint32_t bpp, uint32_t flags) {
+    uint32_t x, y, sy, min = MIN(w, h), mask = min - 1, sq;
+    size_t i;
+
+    for(y = 0; y < h; ++y) {
+        sy = (flags & PVR_TXRLOAD_INVERT_Y) ? h - 1 - y : y;
+
+        for(x = 0; x < w; ++x) {
+            sq = w > h ? x / min : y / min;
+            i = (size_t)sq * min * min + (TWIDTAB(y & mask) |
+                                          (TWIDTAB(x & mask) << 1));
+            ref_put(dst, i, ref_texel(src, w, x, sy, bpp, flags), bpp);
+        }
+    }
+
+    return (size_t)w * h;
+}
+
+/* A mipmap chain: some padding, then the levels from 1x1 up, each one
+   twiddled. The padding is the 1x1 texel repeated. */
+static void ref_mipmap(const uint8_t *src, uint8_t *dst, uint32_t w,
+                       uint32_t bpp, uint32_t flags) {
+    const uint8_t *level[11];
+    uint32_t n, top = 0, lvl;
+    size_t at = 0, i;
+
+    for(n = w; n; n >>= 1, ++top) {
+        level[top] = src;
+        src += MAX((n * n * bpp) >> 3, 1);
+    }
+
+    --top;
+
+    for(i = 0; i <= MIP_PAD; ++i)
+        ref_put(dst, at++, ref_texel(level[top], 1, 0, 0, bpp, flags), bpp);
+
+    for(lvl = 1; lvl <= top; ++lvl) {
+        ref_twiddle(level[top - lvl], dst + ((at * MIN(bpp, 16)) >> 3),
+                    1 << lvl, 1 << lvl, bpp, flags);
+        at += (size_t)1 << (2 * lvl);
+    }
+}
+
+/****************************** TESTS **************************************/
+
+#define MAX_SIDE    1024
+#define MAX_BYTES   ((size_t)MAX_SIDE * MAX_SIDE * 4 * 2)
+
+static uint8_t *src, *out, *ref;
+static int fails, checks;
+
+/* Get a buffer that pvr_texture.c won't mistake for VRAM. */
+static uint8_t *host_buf(size_t size) {
+    uint8_t *rv;
+    uintptr_t a;
+
+    for(;;) {
+        if(!(rv = (uint8_t *)aligned_alloc(32, size))) {
+            perror("aligned_alloc");
+            exit(1);
+        }
+
+        for(a = (uintptr_t)rv; a < (uintptr_t)rv + size; a += 32) {
+            if(TXR_IN_VRAM(a))
+                break;
+        }
+
+        if(a >= (uintptr_t)rv + size)
+            return rv;
+    }
+}
+
+static void fill_src(size_t n) {
+    size_t i;
+
+    for(i = 0; i < n; ++i)
+        src[i] = rand();
+}
+
+static void check(const char *what, uint32_t w, uint32_t h, uint32_t flags,
+                  size_t bytes) {
+    size_t i;
+
+    ++checks;
+
+    for(i = 0; i < bytes; ++i) {
+        if(out[i] != ref[i]) {
+            printf("FAIL %s %lux%lu flags 0x%04lx: byte %lu is 0x%02x, "
+                   "should be 0x%02x\n", what, (unsigned long)w,
+                   (unsigned long)h, (unsigned long)flags, (unsigned long)i,
+                   out[i], ref[i]);
+            ++fails;
+            break;
+        }
+    }
+}
+
+static const uint32_t fmts[][2] = {
+    { PVR_TXRLOAD_4BPP, 4 },
+    { PVR_TXRLOAD_8BPP, 8 },
+    { PVR_TXRLOAD_16BPP, 16 },
+    { PVR_TXRLOAD_32BPP | PVR_TXRLOAD_CONV_ARGB1555, 32 },
+    { PVR_TXRLOAD_32BPP | PVR_TXRLOAD_CONV_RGB565, 32 },
+    { PVR_TXRLOAD_32BPP | PVR_TXRLOAD_CONV_ARGB4444, 32 }
+};
+
+static void test_plain(void) {
+    uint32_t w, h, f, flags, bpp;
+    int inv;
+    size_t bytes;
+
+    for(f = 0; f < sizeof(fmts) / sizeof(fmts[0]); ++f) {
+        bpp = fmts[f][1];
+
+        for(w = 8; w <= MAX_SIDE; w <<= 1) {
+            for(h = 8; h <= MAX_SIDE; h <<= 1) {
+                fill_src(((size_t)w * h * bpp) >> 3);
+                bytes = ((size_t)w * h * MIN(bpp, 16)) >> 3;
+
+                for(inv = 0; inv < 2; ++inv) {
+                    flags = fmts[f][0] | (inv ? PVR_TXRLOAD_INVERT_Y : 0);
+
+                    memset(out, 0xa5, bytes);
+                    memset(ref, 0x5a, bytes);
+                    pvr_txr_load_ex(src, out, w, h, flags);
+                    ref_twiddle(src, ref, w, h, bpp, flags);
+                    check("twiddle", w, h, flags, bytes);
+                }
+            }
+        }
+    }
+}
+
+static void test_mipmap(void) {
+    uint32_t w, n, f, flags, bpp;
+    int inv;
+    size_t srcsize, bytes;
+
+    for(f = 0; f < sizeof(fmts) / sizeof(fmts[0]); ++f) {
+        bpp = fmts[f][1];
+
+        for(w = 8; w <= MAX_SIDE; w <<= 1) {
+            for(n = w, srcsize = 0, bytes = MIP_PAD; n; n >>= 1) {
+                srcsize += MAX((n * n * bpp) >> 3, 1);
+                bytes += (size_t)n * n;
+            }
+
+            bytes = (bytes * MIN(bpp, 16)) >> 3;
+            fill_src(srcsize);
+
+            for(inv = 0; inv < 2; ++inv) {
+                flags = fmts[f][0] | PVR_TXRLOAD_MIPMAP |
+                        (inv ? PVR_TXRLOAD_INVERT_Y : 0);
+
+                memset(out, 0xa5, bytes);
+                memset(ref, 0x5a, bytes);
+                pvr_txr_load_ex(src, out, w, w, flags);
+                ref_mipmap(src, ref, w, bpp, flags);
+                check("mipmap", w, w, flags, bytes);
+            }
+        }
+    }
+}
+
+/* The old loader should give the same output, except for inverted 4bpp and
+   8bpp loads. Those come out the same as a proper flip of the texture with
+   each pair of rows swapped first. */
+static void test_old(void) {
+    uint32_t w, h, f, flags, bpp, y, stride;
+    int inv;
+    size_t bytes;
+
+    for(f = 0; f < 3; ++f) {
+        bpp = fmts[f][1];
+
+        for(w = 8; w <= MAX_SIDE; w <<= 1) {
+            for(h = 8; h <= MAX_SIDE; h <<= 1) {
+                stride = (w * bpp) >> 3;
+                bytes = (size_t)stride * h;
+                fill_src(bytes);
+
+                for(inv = 0; inv < 2; ++inv) {
+                    flags = fmts[f][0] | (inv ? PVR_TXRLOAD_INVERT_Y : 0);
+
+                    memset(out, 0xa5, bytes);
+                    memset(ref, 0x5a, bytes);
+                    old_load(src, ref, w, h, bpp, inv);
+
+                    if(inv && bpp < 16) {
+                        for(y = 0; y < h; y += 2) {
+                            memcpy(out, src + y * stride, stride);
+                            memcpy(src + y * stride, src + (y + 1) * stride,
+                                   stride);
+                            memcpy(src + (y + 1) * stride, out, stride);
+                        }
+                    }
+
+                    pvr_txr_load_ex(src, out, w, h, flags);
+                    check("old loader", w, h, flags, bytes);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+
+    src = host_buf(MAX_BYTES);
+    out = host_buf(MAX_BYTES);
+    ref = host_buf(MAX_BYTES);
+    srand(1);
+
+    test_plain();
+    test_mipmap();
+    test_old();
+
+    printf("%d of %d checks failed\n", fails, checks);
+
+    free(src);
+    free(out);
+    free(ref);
+
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,452 @@
+/* KallistiOS ##version##
+
+   vqbench.c
+
+   Benchmark and test the runtime VQ texture compression. This builds the
+   real pvr_vq.c on a PC and does what the pvr/vqbench example does on a
+   Dreamcast: it makes up a few 256x256 textures that look quite different
+   from each other (smooth, noisy and full of hard edges), compresses each of
+   them with a varying number of refinement passes, and also with the
+   codebook of the first one (a fixed codebook). For each, it prints how long
+   the compression took (the best of a few runs) and how close the result is
+   to the original, as the PSNR over all components, in the form
+
+   RESULT <test> <metric> <value> <unit>
+
+   Then it checks the layout of what pvr_txr_vq_encode() puts out, with a
+   decoder of its own, on textures made of few enough different 2x2 blocks
+   that they should come out exactly: square and not, 2x2, inverted and
+   mipmapped, from 16bpp and 32bpp sources.
+
+   Run it from this directory with "make run". The last line is either "DONE"
+   or "FAILED", and the exit status says the same.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+/****************************** KOS STAND-INS ******************************/
+
+/* Skip the KOS headers that pvr_vq.c includes, and define what it needs from
+   them here. */
+#define __DC_PVR_H
+#define __PVR_INTERNAL_H
+
+/* From dc/pvr/pvr_txr.h */
+#define PVR_TXRLOAD_16BPP           0x03
+#define PVR_TXRLOAD_32BPP           0x04
+#define PVR_TXRLOAD_FMT_MASK        0x0f
+#define PVR_TXRLOAD_CONV_ARGB1555   0x100
+#define PVR_TXRLOAD_CONV_RGB565     0x200
+#define PVR_TXRLOAD_CONV_ARGB4444   0x300
+#define PVR_TXRLOAD_CONV_MASK       0x300
+#define PVR_TXRLOAD_INVERT_Y        0x20
+#define PVR_TXRLOAD_MIPMAP          0x1000
+
+#define PVR_TXR_VQ_PASSES_DEFAULT   1
+
+typedef struct pvr_txr_vq_params {
+    int passes;
+    const uint16_t *codebook;
+} pvr_txr_vq_params_t;
+
+void pvr_txr_set_vq_params(const pvr_txr_vq_params_t *params);
+size_t pvr_txr_vq_size(uint32_t w, uint32_t h, uint32_t flags);
+int pvr_txr_vq_encode(const void *src, void *out, uint32_t w, uint32_t h,
+                      uint32_t flags, const pvr_txr_vq_params_t *params);
+
+/* From pvr_internal.h */
+static inline uint32_t pvr_txr_untwid(uint32_t i) {
+    i &= 0x55555555;
+    i = (i | (i >> 1)) & 0x33333333;
+    i = (i | (i >> 2)) & 0x0f0f0f0f;
+    i = (i | (i >> 4)) & 0x00ff00ff;
+    return (i | (i >> 8)) & 0x0000ffff;
+}
+
+static inline uint16_t pvr_txr_conv32(uint32_t p, uint32_t flags) {
+    switch(flags & PVR_TXRLOAD_CONV_MASK) {
+        case PVR_TXRLOAD_CONV_RGB565:
+            return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) |
+                   ((p >> 3) & 0x001f);
+        case PVR_TXRLOAD_CONV_ARGB4444:
+            return ((p >> 16) & 0xf000) | ((p >> 12) & 0x0f00) |
+                   ((p >> 8) & 0x00f0) | ((p >> 4) & 0x000f);
+        default:
+            return ((p >> 16) & 0x8000) | ((p >> 9) & 0x7c00) |
+                   ((p >> 6) & 0x03e0) | ((p >> 3) & 0x001f);
+    }
+}
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_vq.c"
+
+/****************************** BENCHMARK **********************************/
+
+#define SIZE        256
+#define TEXELS      (SIZE * SIZE)
+#define CODEBOOK    2048
+#define RUNS        5
+
+typedef struct {
+    const char *name;
+    uint32_t flags;
+    uint32_t (*gen)(int x, int y);
+} tex_t;
+
+static uint32_t rand_state = 1;
+
+static uint32_t rnd(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+static uint32_t clamp8(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Smooth plasma, like the plasma example. */
+static uint32_t gen_plasma(int x, int y) {
+    float r = sinf(x * 0.05f) + sinf(y * 0.07f);
+    float g = sinf((x + y) * 0.04f) + cosf(y * 0.03f);
+    float b = sinf(sqrtf((x - 128.0f) * (x - 128.0f) +
+                         (y - 128.0f) * (y - 128.0f)) * 0.08f);
+
+    return 0xff000000 | (clamp8(r * 63 + 128) << 16) |
+           (clamp8(g * 63 + 128) << 8) | clamp8(b * 127 + 128);
+}
+
+/* The same plasma, with lots of noise on top. */
+static uint32_t gen_noise(int x, int y) {
+    uint32_t p = gen_plasma(x, y);
+    int n = (int)(rnd() & 63) - 32;
+
+    return 0xff000000 | (clamp8(((p >> 16) & 255) + n) << 16) |
+           (clamp8(((p >> 8) & 255) + n) << 8) | clamp8((p & 255) + n);
+}
+
+/* Hard edges and a bit of alpha: bricks with see-through mortar. */
+static uint32_t gen_bricks(int x, int y) {
+    int row = y / 16, bx = (x + (row & 1) * 16) % 32, by = y % 16;
+    uint32_t shade = 64 + ((x / 32 + row * 7) % 5) * 24 + bx * 2 + by;
+
+    if(bx < 2 || by < 2)
+        return 0x40808080;
+
+    return 0xff000000 | (shade << 16) | ((shade / 2) << 8) | (shade / 3);
+}
+
+static const tex_t texs[] = {
+    { "plasma", PVR_TXRLOAD_CONV_RGB565, gen_plasma },
+    { "noise", PVR_TXRLOAD_CONV_RGB565, gen_noise },
+    { "bricks", PVR_TXRLOAD_CONV_ARGB4444, gen_bricks }
+};
+
+#define TEX_COUNT   (sizeof(texs) / sizeof(texs[0]))
+
+static const int passes[] = { 0, 1, 2, 4 };
+
+#define PASS_COUNT  (sizeof(passes) / sizeof(passes[0]))
+
+static uint32_t src[TEXELS];
+static uint16_t src16[TEXELS];
+static uint8_t vq[CODEBOOK + TEXELS];
+static uint8_t codebook[CODEBOOK];
+
+/* Expand a 16-bit texel to ARGB8888, the same way the encoder does. */
+static void unpack(uint16_t p, uint32_t fmt, int *out) {
+    if(fmt == PVR_TXRLOAD_CONV_RGB565) {
+        out[0] = 255;
+        out[1] = ((p >> 11) << 3) | (p >> 13);
+        out[2] = (((p >> 5) & 63) << 2) | ((p >> 9) & 3);
+        out[3] = ((p & 31) << 3) | ((p >> 2) & 7);
+    }
+    else {
+        out[0] = (p >> 12) * 17;
+        out[1] = ((p >> 8) & 15) * 17;
+        out[2] = ((p >> 4) & 15) * 17;
+        out[3] = (p & 15) * 17;
+    }
+}
+
+/* Every other bit of i, starting from the lowest. */
+static uint32_t untwid(uint32_t i) {
+    uint32_t r = 0, b;
+
+    for(b = 0; b < 16; ++b)
+        r |= ((i >> (b * 2)) & 1) << b;
+
+    return r;
+}
+
+/* Decode the VQ texture and compare it with the source, as rounded to the
+   16-bit format (since that's the best that could be done). */
+static double psnr(uint32_t fmt) {
+    const uint16_t *cb = (const uint16_t *)vq;
+    const uint8_t *idx = vq + CODEBOOK;
+    int a[4], b[4], i, t, c, x, y;
+    double err = 0.0;
+
+    for(i = 0; i < TEXELS / 4; ++i) {
+        x = untwid(i >> 1) * 2;
+        y = untwid(i) * 2;
+
+        for(t = 0; t < 4; ++t) {
+            unpack(cb[idx[i] * 4 + t], fmt, a);
+            unpack(src16[(y + (t & 1)) * SIZE + x + (t >> 1)], fmt, b);
+
+            for(c = 0; c < 4; ++c)
+                err += (a[c] - b[c]) * (a[c] - b[c]);
+        }
+    }
+
+    err /= TEXELS * 4.0;
+    return err ? 10.0 * log10(255.0 * 255.0 / err) : 99.0;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int encode(const char *test, uint32_t fmt, pvr_txr_vq_params_t *p) {
+    double start, t, best = INFINITY;
+    int run;
+
+    for(run = 0; run < RUNS; ++run) {
+        start = now_ms();
+
+        if(pvr_txr_vq_encode(src, vq, SIZE, SIZE, PVR_TXRLOAD_32BPP | fmt,
+                             p)) {
+            perror("pvr_txr_vq_encode");
+            return -1;
+        }
+
+        t = now_ms() - start;
+        best = t < best ? t : best;
+    }
+
+    printf("RESULT %s encode_time %.1f ms\n", test, best);
+    printf("RESULT %s psnr %.2f dB\n", test, psnr(fmt));
+    return 0;
+}
+
+static int bench(void) {
+    pvr_txr_vq_params_t p = { 0, NULL };
+    char test[64];
+    unsigned t, i;
+    int x, y, fails = 0;
+    uint32_t c;
+
+    for(t = 0; t < TEX_COUNT; ++t) {
+        for(y = 0; y < SIZE; ++y) {
+            for(x = 0; x < SIZE; ++x) {
+                c = texs[t].gen(x, y);
+                src[y * SIZE + x] = c;
+                src16[y * SIZE + x] = pvr_txr_conv32(c, texs[t].flags);
+            }
+        }
+
+        p.codebook = NULL;
+
+        for(i = 0; i < PASS_COUNT; ++i) {
+            p.passes = passes[i];
+            snprintf(test, sizeof(test), "%s_p%d", texs[t].name, passes[i]);
+            fails |= encode(test, texs[t].flags, &p);
+
+            /* Hang on to the best codebook of the first texture. */
+            if(!t && i == PASS_COUNT - 1)
+                memcpy(codebook, vq, CODEBOOK);
+        }
+
+        /* A fixed codebook only makes sense in the same format. */
+        if(t && texs[t].flags == texs[0].flags) {
+            p.codebook = (const uint16_t *)codebook;
+            snprintf(test, sizeof(test), "%s_fixed", texs[t].name);
+            fails |= encode(test, texs[t].flags, &p);
+        }
+    }
+
+    return fails;
+}
+
+/****************************** LAYOUT TESTS *******************************/
+
+/* Few enough different blocks that each gets a codebook entry of its own,
+   with one left over for the 1x1 level of a mipmap. */
+#define PATTERNS    200
+
+static uint16_t patterns[PATTERNS][4];
+
+/* Make a texture of w by h texels out of the patterns, as seen after
+   flipping it if asked to. Returns the next level of a mipmap chain. */
+static void *make_level(void *dst, uint16_t *want, uint32_t w, uint32_t h,
+                        uint32_t flags) {
+    uint32_t x, y, row, t;
+    uint16_t p;
+
+    for(y = 0; y < h; y += 2) {
+        for(x = 0; x < w; x += 2) {
+            t = rnd() % PATTERNS;
+
+            /* A 1x1 level is a block of its own. */
+            if(w == 1)
+                t = 0;
+
+            for(row = y; row < y + 2 && row < h; ++row) {
+                p = patterns[t][(row - y) * 2];
+                want[row * w + x] = p;
+
+                if(x + 1 < w)
+                    want[row * w + x + 1] = patterns[t][(row - y) * 2 + 1];
+            }
+        }
+    }
+
+    /* The source is upside down from what should come out. */
+    for(y = 0; y < h; ++y) {
+        row = (flags & PVR_TXRLOAD_INVERT_Y) ? h - 1 - y : y;
+
+        for(x = 0; x < w; ++x) {
+            p = want[row * w + x];
+
+            if((flags & PVR_TXRLOAD_FMT_MASK) == PVR_TXRLOAD_16BPP) {
+                *(uint16_t *)dst = p;
+                dst = (uint16_t *)dst + 1;
+            }
+            else {
+                /* Something that converts back to p exactly. */
+                *(uint32_t *)dst = 0xff000000 | ((p >> 11) << 19) |
+                                   (((p >> 5) & 63) << 10) | ((p & 31) << 3);
+                dst = (uint32_t *)dst + 1;
+            }
+        }
+    }
+
+    return dst;
+}
+
+/* Decode one level, starting at index i, and compare it with want. */
+static int check_level(const uint8_t *out, size_t i, const uint16_t *want,
+                       uint32_t w, uint32_t h) {
+    const uint16_t *cb = (const uint16_t *)out;
+    const uint8_t *idx = out + CODEBOOK;
+    uint32_t bw = w / 2, bh = h / 2, side = bw < bh ? bw : bh, n, sq, x, y, t;
+
+    /* The 1x1 level is the first texel of its entry. */
+    if(w == 1)
+        return cb[idx[i] * 4] != want[0];
+
+    for(n = 0; n < bw * bh; ++n) {
+        sq = n / (side * side);
+        x = untwid((n % (side * side)) >> 1) * 2 + (bw > bh ? sq * side * 2 : 0);
+        y = untwid(n % (side * side)) * 2 + (bw > bh ? 0 : sq * side * 2);
+
+        for(t = 0; t < 4; ++t) {
+            if(cb[idx[i + n] * 4 + t] !=
+               want[(y + (t & 1)) * w + x + (t >> 1)])
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int check_layout(uint32_t w, uint32_t h, uint32_t flags) {
+    static uint8_t in[1024 * 1024 * 4 * 2];
+    static uint16_t want[1024 * 1024 * 2];
+    size_t size = pvr_txr_vq_size(w, h, flags), i;
+    uint16_t *lv[12];
+    uint32_t n, levels = 0;
+    uint8_t *out;
+    void *s = in;
+    int rv = 0;
+
+    if(!(out = malloc(size)))
+        return -1;
+
+    /* Largest first in the source. */
+    lv[0] = want;
+
+    for(n = (flags & PVR_TXRLOAD_MIPMAP) ? w : 0; n; n >>= 1, ++levels) {
+        s = make_level(s, lv[levels], n, n, flags);
+        lv[levels + 1] = lv[levels] + n * n;
+    }
+
+    if(!levels)
+        make_level(s, want, w, h, flags);
+
+    if(pvr_txr_vq_encode(in, out, w, h, flags | PVR_TXRLOAD_CONV_RGB565,
+                         NULL)) {
+        perror("pvr_txr_vq_encode");
+        free(out);
+        return -1;
+    }
+
+    /* Smallest first in the texture. */
+    if(!levels) {
+        rv = check_level(out, 0, want, w, h);
+    }
+    else {
+        for(i = 0, n = 1; n <= w && !rv; n <<= 1) {
+            rv = check_level(out, i, lv[--levels], n, n);
+            i += n == 1 ? 1 : (n / 2) * (n / 2);
+        }
+
+        rv |= i != size - CODEBOOK;
+    }
+
+    if(rv)
+        printf("FAIL layout %lux%lu flags 0x%04lx\n", (unsigned long)w,
+               (unsigned long)h, (unsigned long)flags);
+
+    free(out);
+    return rv;
+}
+
+static int layout(void) {
+    static const uint32_t fmts[] = { PVR_TXRLOAD_16BPP, PVR_TXRLOAD_32BPP };
+    uint32_t w, h, f, inv;
+    int fails = 0, checks = 0;
+
+    /* The 1x1 level of each mipmap is pattern 0, which is all one texel. */
+    for(f = 0; f < PATTERNS; ++f) {
+        for(w = 0; w < 4; ++w)
+            patterns[f][w] = f ? (uint16_t)rnd() : patterns[0][0];
+    }
+
+    for(f = 0; f < 2; ++f) {
+        for(inv = 0; inv < 2; ++inv) {
+            uint32_t flags = fmts[f] | (inv ? PVR_TXRLOAD_INVERT_Y : 0);
+
+            for(w = 2; w <= 1024; w <<= 1) {
+                for(h = 2; h <= 1024; h <<= 1, ++checks)
+                    fails += !!check_layout(w, h, flags);
+
+                fails += !!check_layout(w, w, flags | PVR_TXRLOAD_MIPMAP);
+                ++checks;
+            }
+        }
+    }
+
+    printf("RESULT layout failed %d of %d\n", fails, checks);
+    return fails;
+}
+
+int main(int argc, char **argv) {
+    int fails;
+
+    (void)argc;
+    (void)argv;
+
+    fails = bench();
+    fails |= layout();
+
+    printf("%s\n", fails ? "FAILED" : "DONE");
+    return fails ? 1 : 0;
+}